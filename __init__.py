@@ -5,7 +5,24 @@ Pangfish - A hybrid cryptosystem library implementing Twofish and Multi-Power RS
 from .pangfish import (
     Twofish, 
     derive_key, 
-    new
+    hkdf,
+    derive_keys,
+    new,
+    Keyring,
+    KeyManager,
+    CMAC,
+    SIV,
+    FPE,
+    HCTR2,
+    MappedFile,
+    Ring,
+    encrypt_file,
+    mmap_decrypt,
+    numa_nodes,
+    key_cache_configure,
+    key_cache_clear,
+    key_cache_stats,
+    bulk_config
 )
 
 from .c_multipowerrsa import MultiPowerRSA
@@ -27,7 +44,24 @@ __version__ = '0.2.0'
 __all__ = [
     'Twofish', 
     'derive_key', 
+    'hkdf',
+    'derive_keys',
     'new', 
+    'Keyring',
+    'KeyManager',
+    'CMAC',
+    'SIV',
+    'FPE',
+    'HCTR2',
+    'MappedFile',
+    'Ring',
+    'encrypt_file',
+    'mmap_decrypt',
+    'numa_nodes',
+    'key_cache_configure',
+    'key_cache_clear',
+    'key_cache_stats',
+    'bulk_config',
     'new_hybrid_cryptosystem',
     'RSA',
     'MultiPowerRSA',
@@ -0,0 +1,61 @@
+"""
+Asyncio support for Pangfish.
+
+Jobs run on the native worker pool of each extension module. Completed jobs
+are collected in C and signalled through one descriptor per module, which is
+watched by the event loop, so a burst of completions costs a single wakeup
+and all of its futures are resolved in one callback.
+"""
+
+import asyncio
+import weakref
+
+# event loop -> extension modules whose completion descriptor it watches
+_watched = weakref.WeakKeyDictionary()
+
+def _resolve(future, ok, value):
+    if future.done():
+        return  # cancelled while the job was running
+    if ok:
+        future.set_result(value)
+    else:
+        future.set_exception(value)
+
+def _drain(module):
+    """Resolve every completed job of an extension module"""
+    try:
+        loop = asyncio.get_running_loop()
+    except RuntimeError:
+        loop = None
+    for future, ok, value in module.reap():
+        # the descriptor may be watched by several loops; hand foreign futures back
+        owner = future.get_loop()
+        if owner is loop:
+            _resolve(future, ok, value)
+        elif not owner.is_closed():
+            owner.call_soon_threadsafe(_resolve, future, ok, value)
+
+def _watch(module):
+    loop = asyncio.get_running_loop()
+    modules = _watched.setdefault(loop, set())
+    if module not in modules:
+        loop.add_reader(module.completion_fd(), _drain, module)
+        modules.add(module)
+    return loop
+
+def submit(module, submit_job, *args):
+    """
+    Queue a job on a module's worker pool and return a future for its result.
+
+    Args:
+        module: Extension module that owns the pool (_twofish or _multipowerrsa)
+        submit_job: Native submit method; the future is passed as its last argument
+        *args: Job arguments
+
+    Returns:
+        asyncio.Future: Resolved on the event loop when the job completes
+    """
+    loop = _watch(module)
+    future = loop.create_future()
+    submit_job(*args, future)
+    return future
@@ -0,0 +1,269 @@
+#include <string.h>
+#include "base64.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+static const char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* character -> 6-bit value, 0xff if not in the alphabet */
+static unsigned char values[256];
+static int values_ready;
+
+static void init_values(void)
+{
+    int i;
+
+    if (__atomic_load_n(&values_ready, __ATOMIC_ACQUIRE))
+        return;
+    memset(values, 0xff, sizeof(values));
+    for (i = 0; i < 64; i++)
+        values[(unsigned char)alphabet[i]] = (unsigned char)i;
+    __atomic_store_n(&values_ready, 1, __ATOMIC_RELEASE);
+}
+
+static void encode_scalar(const unsigned char *in, size_t len, char *out)
+{
+    size_t i;
+
+    for (i = 0; i + 3 <= len; i += 3)
+    {
+        unsigned int v = (unsigned int)in[i] << 16 | (unsigned int)in[i + 1] << 8 | in[i + 2];
+        *out++ = alphabet[v >> 18];
+        *out++ = alphabet[(v >> 12) & 63];
+        *out++ = alphabet[(v >> 6) & 63];
+        *out++ = alphabet[v & 63];
+    }
+    if (len - i == 1)
+    {
+        *out++ = alphabet[in[i] >> 2];
+        *out++ = alphabet[(in[i] & 3) << 4];
+        *out++ = '=';
+        *out++ = '=';
+    }
+    else if (len - i == 2)
+    {
+        *out++ = alphabet[in[i] >> 2];
+        *out++ = alphabet[((in[i] & 3) << 4) | (in[i + 1] >> 4)];
+        *out++ = alphabet[(in[i + 1] & 15) << 2];
+        *out++ = '=';
+    }
+}
+
+/* whole quanta without padding; returns -1 on a character outside the alphabet */
+static int decode_scalar(const unsigned char *in, size_t quanta, unsigned char *out)
+{
+    size_t i;
+
+    for (i = 0; i < quanta; i++, in += 4, out += 3)
+    {
+        unsigned int a = values[in[0]], b = values[in[1]], c = values[in[2]], d = values[in[3]];
+
+        if ((a | b | c | d) & 0x80)
+            return -1;
+        out[0] = (unsigned char)(a << 2 | b >> 4);
+        out[1] = (unsigned char)(b << 4 | c >> 2);
+        out[2] = (unsigned char)(c << 6 | d);
+    }
+    return 0;
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+   24 bytes to 32 characters per step: spread each 3-byte group over four
+   bytes, isolate the 6-bit fields with multiplies, then map the indices to
+   ASCII with a 16-entry offset table. Reads 28 bytes, two 16-byte lanes.
+*/
+__attribute__((target("avx2")))
+static size_t encode_avx2(const unsigned char *in, size_t len, char *out)
+{
+    const __m256i spread = _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i offsets = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t done = 0;
+
+    while (len - done >= 28)
+    {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + done))),
+            _mm_loadu_si128((const __m128i *)(in + done + 12)), 1);
+        __m256i hi, lo, idx, shift;
+
+        v = _mm256_shuffle_epi8(v, spread);
+        hi = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+                                _mm256_set1_epi32(0x04000040));
+        lo = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+                                _mm256_set1_epi32(0x01000010));
+        idx = _mm256_or_si256(hi, lo);
+
+        /* 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12 */
+        shift = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        shift = _mm256_or_si256(shift, _mm256_and_si256(
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+        v = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, shift), idx);
+
+        _mm256_storeu_si256((__m256i *)out, v);
+        out += 32;
+        done += 24;
+    }
+    return done;
+}
+
+/*
+   32 characters to 24 bytes per step: validate and translate with nibble
+   lookups, pack the 6-bit values with multiply-adds, then compact. Writes
+   32 bytes, so the caller leaves 8 bytes of slack.
+*/
+__attribute__((target("avx2")))
+static size_t decode_avx2(const unsigned char *in, size_t quanta, unsigned char *out, int *bad)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    size_t done = 0;
+
+    /* 8 quanta per step, keeping 3 spare quanta so the 32-byte store stays inside out */
+    while (quanta - done >= 11)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(in + 4 * done));
+        __m256i hi_n = _mm256_and_si256(_mm256_srli_epi32(s, 4), mask_2f);
+        __m256i lo_n = _mm256_and_si256(s, mask_2f);
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_n);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_n);
+        __m256i roll;
+
+        if (!_mm256_testz_si256(lo, hi))
+        {
+            *bad = 1;
+            return done;
+        }
+        roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(s, mask_2f), hi_n));
+        s = _mm256_add_epi8(s, roll);
+
+        s = _mm256_maddubs_epi16(s, _mm256_set1_epi32(0x01400140));
+        s = _mm256_madd_epi16(s, _mm256_set1_epi32(0x00011000));
+        s = _mm256_shuffle_epi8(s, pack);
+        s = _mm256_permutevar8x32_epi32(s, compact);
+
+        _mm256_storeu_si256((__m256i *)(out + 3 * done), s);
+        done += 8;
+    }
+    return done;
+}
+#endif /* HAVE_X86_SIMD */
+
+/* backend selection, resolved on first use */
+enum { BACKEND_UNKNOWN, BACKEND_SCALAR, BACKEND_AVX2 };
+static int backend = BACKEND_UNKNOWN;
+
+static int get_backend(void)
+{
+    int b = __atomic_load_n(&backend, __ATOMIC_RELAXED);
+
+    if (b != BACKEND_UNKNOWN)
+        return b;
+
+    init_values();
+    b = BACKEND_SCALAR;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        b = BACKEND_AVX2;
+#endif
+    __atomic_store_n(&backend, b, __ATOMIC_RELAXED);
+    return b;
+}
+
+const char *base64_backend(void)
+{
+    return get_backend() == BACKEND_AVX2 ? "avx2" : "scalar";
+}
+
+void base64_encode(const unsigned char *in, size_t len, char *out)
+{
+    size_t done = 0;
+
+#ifdef HAVE_X86_SIMD
+    if (get_backend() == BACKEND_AVX2)
+        done = encode_avx2(in, len, out);
+#endif
+    encode_scalar(in + done, len - done, out + done / 3 * 4);
+}
+
+size_t base64_decoded_len(const char *in, size_t len)
+{
+    size_t n;
+
+    if (len < 4 || len % 4)
+        return len / 4 * 3;
+    n = len / 4 * 3;
+    if (in[len - 1] == '=')
+        n--;
+    if (in[len - 2] == '=')
+        n--;
+    return n;
+}
+
+int base64_decode(const char *in, size_t len, unsigned char *out)
+{
+    const unsigned char *s = (const unsigned char *)in;
+    size_t quanta, done = 0;
+    unsigned char last[4];
+    int bad = 0;
+
+    if (len % 4)
+        return -1;
+    if (len == 0)
+        return 0;
+    get_backend();
+
+    /* everything but the final quantum, which may carry padding */
+    quanta = len / 4 - 1;
+#ifdef HAVE_X86_SIMD
+    if (get_backend() == BACKEND_AVX2)
+    {
+        done = decode_avx2(s, quanta, out, &bad);
+        if (bad)
+            return -1;
+    }
+#endif
+    if (decode_scalar(s + 4 * done, quanta - done, out + 3 * done) != 0)
+        return -1;
+
+    s += 4 * quanta;
+    out += 3 * quanta;
+    memcpy(last, s, 4);
+    if (last[3] == '=')
+    {
+        /* padding: decode with zero bits in its place, keep the leading bytes */
+        size_t keep = last[2] == '=' ? 1 : 2;
+
+        last[3] = 'A';
+        if (keep == 1)
+            last[2] = 'A';
+        if (decode_scalar(last, 1, last) != 0)
+            return -1;
+        memcpy(out, last, keep);
+        return 0;
+    }
+    return decode_scalar(last, 1, out);
+}
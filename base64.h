@@ -0,0 +1,25 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <stddef.h>
+
+/* Characters in the padded encoding of len bytes */
+#define BASE64_ENCODED_LEN(len) (((len) + 2) / 3 * 4)
+
+/* Name of the backend in use: "avx2" or "scalar" */
+const char *base64_backend(void);
+
+/* Standard padded base64 of len bytes; writes BASE64_ENCODED_LEN(len) characters */
+void base64_encode(const unsigned char *in, size_t len, char *out);
+
+/* Bytes that len characters of padded base64 decode to (in is needed for the padding) */
+size_t base64_decoded_len(const char *in, size_t len);
+
+/*
+   Decode standard padded base64 (no whitespace) into base64_decoded_len
+   bytes of out. Returns 0, or -1 if in is not valid, in which case the
+   contents of out are unspecified.
+*/
+int base64_decode(const char *in, size_t len, unsigned char *out);
+
+#endif /* BASE64_H */
@@ -1,333 +1,841 @@
 """
-Benchmark script for Pangfish library
+Benchmark suite for Pangfish library
+
+Every benchmark runs under pyperf: each value comes from a fresh worker
+process, the loop count is calibrated so a value spans at least pyperf's
+minimum time, and warmup values are dropped. The layers are timed
+separately so the cost of a call can be split up:
+
+    raw         _twofish.Twofish methods: the C binding with nothing on top
+    pangfish    pangfish.Twofish, the Python class over the binding
+    mprsa       MultiPowerRSA, next to its _multipowerrsa.MPRSA binding
+    hybrid      HybridCryptosystem: KEM, CBC and the envelope together
+
+Usage:
+    python benchmark.py                              # default sweep
+    python benchmark.py --fast --layers raw,pangfish --payloads 16,4096
+    python benchmark.py --rigorous -o before.json    # pyperf options apply
+    python -m pyperf compare_to before.json after.json
+
+Results go to the --results directory: pyperf.json holds the whole suite
+in pyperf's format, comparable between runs with compare_to, and
+breakdown.json the split of each call into binding overhead, wrapper
+overhead and crypto.
+
+With --memory nothing is timed. Every public operation is called instead,
+at each payload size where it takes one, and memory.json gets per call:
+malloc calls and bytes (through the memcount.c shim, which the script
+preloads itself once built with make memcount.so), GMP allocations and
+peak through the library's allocator hooks, the tracemalloc peak of
+Python objects, and the rise in peak RSS. Bytes allocated per payload
+byte is the number of copies made of the payload:
+
+    make memcount.so && python benchmark.py --memory --payloads 4096,1048576
 """
 
-import time
+import argparse
+import atexit
+import ctypes
+import gc
+import itertools
+import json
 import os
+import random
+import shutil
 import sys
-import argparse
-import pandas as pd
-import numpy as np
-import matplotlib.pyplot as plt
-from pangfish import Twofish, MultiPowerRSA, HybridCryptosystem
-
-def benchmark_twofish(rounds=1000, key_size=256, data_size=1024):
-    """Benchmark Twofish performance"""
-    print(f"Benchmarking Twofish with {rounds} rounds...")
-    
-    # Generate key and data
-    key = os.urandom(key_size // 8)
-    data = os.urandom(data_size)
-    
-    # Create cipher
-    cipher = Twofish(key)
-    
-    # Time encryption (ECB mode)
-    start_time = time.time()
-    for _ in range(rounds):
-        encrypted = cipher.encrypt(data, mode='ecb')
-    encryption_time = (time.time() - start_time) * 1000 / rounds  # ms per operation
-    
-    # Time decryption (ECB mode)
-    start_time = time.time()
-    for _ in range(rounds):
-        decrypted = cipher.decrypt(encrypted, mode='ecb')
-    decryption_time = (time.time() - start_time) * 1000 / rounds  # ms per operation
-    
-    # Time encryption (CBC mode)
-    iv = os.urandom(16)
-    start_time = time.time()
-    for _ in range(rounds):
-        encrypted_cbc = cipher.encrypt(data, mode='cbc', iv=iv)
-    encryption_time_cbc = (time.time() - start_time) * 1000 / rounds  # ms per operation
-    
-    # Time decryption (CBC mode)
-    start_time = time.time()
-    for _ in range(rounds):
-        decrypted_cbc = cipher.decrypt(encrypted_cbc, mode='cbc', iv=iv)
-    decryption_time_cbc = (time.time() - start_time) * 1000 / rounds  # ms per operation
-    
-    return {
-        'algorithm': 'Twofish',
-        'mode_ecb_encryption_ms': encryption_time,
-        'mode_ecb_decryption_ms': decryption_time,
-        'mode_cbc_encryption_ms': encryption_time_cbc,
-        'mode_cbc_decryption_ms': decryption_time_cbc,
-        'data_size_bytes': data_size,
-        'key_size_bits': key_size
-    }
-
-def benchmark_multipowerrsa(rounds=10, key_sizes=[1024, 2048], b_values=[2, 3]):
-    """Benchmark Multi-Power RSA performance"""
-    print(f"Benchmarking Multi-Power RSA with {rounds} rounds...")
-    
-    results = []
-    
-    for key_size in key_sizes:
-        for b in b_values:
-            print(f"  Testing key size {key_size} bits, b={b}...")
-            
-            # Generate test data
-            test_data = 12345678  # Small integer
-            
-            # Key generation time
-            start_time = time.time()
-            rsa = MultiPowerRSA(key_size=key_size, b=b)
-            public_key, private_key = rsa.generate_keys()
-            key_gen_time = (time.time() - start_time) * 1000  # ms
-            
-            # Encrypt and decrypt small data multiple times
-            encrypt_times = []
-            decrypt_times = []
-            
-            for _ in range(rounds):
-                # Encryption time
-                start_time = time.time()
-                ciphertext = rsa.encrypt(test_data, public_key)
-                encrypt_times.append((time.time() - start_time) * 1000)  # ms
-                
-                # Decryption time
-                start_time = time.time()
-                plaintext = rsa.decrypt(ciphertext, private_key)
-                decrypt_times.append((time.time() - start_time) * 1000)  # ms
-            
-            results.append({
-                'algorithm': f'Multi-Power RSA (b={b})',
-                'key_size_bits': key_size,
-                'b_value': b,
-                'key_generation_ms': key_gen_time,
-                'encryption_ms': np.mean(encrypt_times),
-                'decryption_ms': np.mean(decrypt_times),
-                'encryption_std': np.std(encrypt_times),
-                'decryption_std': np.std(decrypt_times)
-            })
-    
-    return results
+import tempfile
+import time
+import tracemalloc
 
-def benchmark_hybrid(rounds=10, rsa_key_size=2048, b=3, data_sizes=[1024, 10240, 102400]):
+import _twofish
+import _multipowerrsa
+from pangfish import Twofish, MultiPowerRSA, HybridCryptosystem, Keyring, numa_nodes, bulk_config
+from pangfish import KeyManager, CMAC, SIV, HCTR2, FPE, encrypt_file, mmap_decrypt, hkdf, derive_keys
+
+LAYERS = ('raw', 'pangfish', 'mprsa', 'hybrid')
+TWOFISH_OPS = ('ecb_encrypt', 'ecb_decrypt', 'cbc_encrypt', 'cbc_decrypt')
+RSA_OPS = ('encrypt', 'decrypt', 'kem_encapsulate', 'kem_decapsulate')
+RSA_MESSAGE = 12345678
+KEM_INFO = b'pangfish benchmark'
+API_KEY = bytes(range(32))
+MAC_KEY = bytes(range(32, 64))
+TWEAK = bytes(16)
+
+# What each worker builds for its benchmark, kept for all its values
+_prepared = {}
+
+
+class Case:
     """
-    Benchmark Hybrid Cryptosystem performance
-    
-    Args:
-        rounds (int): Number of encryption/decryption rounds
-        rsa_key_size (int): RSA key size in bits
-        b (int): Multi-Power RSA parameter
-        data_sizes (list): List of data sizes to test
-    
-    Returns:
-        list: Performance benchmarking results
+    One benchmark: its pyperf name, the layer and operation it times, and
+    the setup that builds the call. setup() returns (func, args) and runs
+    once per worker process, outside the timed loop.
     """
-    print(f"Benchmarking Hybrid Cryptosystem with {rounds} rounds...")
-    
-    results = []
-    
-    for data_size in data_sizes:
-        print(f"  Testing with data size {data_size} bytes...")
-        
-        # Generate test data
-        test_data = os.urandom(data_size)
-        
-        # Initialize cryptosystem
+
+    def __init__(self, name, layer, op, setup, timer=None, **params):
+        self.name = name
+        self.layer = layer
+        self.op = op
+        self.setup = setup
+        self.timer = timer or time_calls
+        self.params = params
+
+    def prepare(self):
+        if self.name not in _prepared:
+            _prepared[self.name] = self.setup()
+        return _prepared[self.name]
+
+
+def _cached(key, make):
+    """Objects shared by several cases within one worker, such as RSA keys"""
+    if key not in _prepared:
+        _prepared[key] = make()
+    return _prepared[key]
+
+
+def time_calls(loops, case):
+    """pyperf time function: loops calls of the case's func"""
+    func, args = case.prepare()
+    it = range(loops)
+    start = time.perf_counter()
+    for _ in it:
+        func(*args)
+    return time.perf_counter() - start
+
+
+def time_indexed(loops, case):
+    """pyperf time function: func(index, *args) over a fixed random sequence of indices"""
+    func, (indices, *args) = case.prepare()
+    it = itertools.islice(itertools.cycle(indices), loops)
+    start = time.perf_counter()
+    for i in it:
+        func(i, *args)
+    return time.perf_counter() - start
+
+
+def time_bulk_config(loops, case):
+    """pyperf time function: calls made under the case's bulk_config, restored afterwards"""
+    default = bulk_config()
+    bulk_config(**dict(default, **case.params['config']))
+    try:
+        return time_calls(loops, case)
+    finally:
+        bulk_config(**default)
+
+
+def _name(*parts):
+    return '/'.join(str(p) for p in parts)
+
+
+# Twofish: the raw binding and pangfish.Twofish over the same calls
+
+def _twofish_setup(layer, op, bits, size):
+    def setup():
+        key = bytes(range(bits // 8))
+        data = os.urandom(size)
+        iv = os.urandom(16)
+        if layer == 'raw':
+            cipher = _twofish.Twofish(key)
+            if op.startswith('cbc'):
+                return getattr(cipher, op), (data, iv, False)
+            return getattr(cipher, op), (data, False)
+        cipher = Twofish(key)
+        if op == 'ecb_encrypt':
+            return cipher.encrypt, (data, 'ecb', None, False)
+        if op == 'ecb_decrypt':
+            return cipher.decrypt, (data, 'ecb', None, False)
+        if op == 'cbc_encrypt':
+            return cipher.encrypt, (data, 'cbc', iv, False)
+        return cipher.decrypt, (iv + data, 'cbc', None, False)
+    return setup
+
+
+def twofish_cases(args):
+    cases = []
+    for bits in args.key_sizes:
+        for op in TWOFISH_OPS:
+            if 'raw' in args.layers:
+                # the empty call is the binding's own cost: argument parsing, result, GIL release
+                for size in [0] + args.payloads:
+                    cases.append(Case(_name('raw', op, 'k%d' % bits, size), 'raw', op,
+                                      _twofish_setup('raw', op, bits, size), key_bits=bits, payload=size))
+            if 'pangfish' in args.layers:
+                for size in args.payloads:
+                    cases.append(Case(_name('pangfish', op, 'k%d' % bits, size), 'pangfish', op,
+                                      _twofish_setup('pangfish', op, bits, size), key_bits=bits, payload=size))
+    return cases
+
+
+# Multi-Power RSA: the wrapper class next to the MPRSA object it holds
+
+def _rsa(bits, b):
+    def make():
+        rsa = MultiPowerRSA(key_size=bits, b=b)
+        rsa.generate_keys()
+        return rsa
+    return _cached(('rsa', bits, b), make)
+
+
+def _rsa_setup(layer, op, bits, b):
+    def setup():
+        rsa = _rsa(bits, b)
+        raw = rsa._rsa
+        if op == 'generate_keys':
+            return raw.generate_keys, ()
+        if op == 'encrypt':
+            func, args = (raw.encrypt, (RSA_MESSAGE, rsa.public_key))
+            wrapped = (rsa.encrypt, (RSA_MESSAGE,))
+        elif op == 'decrypt':
+            c = rsa.encrypt(RSA_MESSAGE)
+            func, args = (raw.decrypt, (c, rsa.private_key))
+            wrapped = (rsa.decrypt, (c,))
+        elif op == 'kem_encapsulate':
+            func, args = (raw.kem_encapsulate, (rsa.public_key, 32, KEM_INFO))
+            wrapped = (rsa.encapsulate, (None, 32, KEM_INFO))
+        else:
+            enc, _ = rsa.encapsulate(size=32, info=KEM_INFO)
+            func, args = (raw.kem_decapsulate, (enc, rsa.private_key, 32, KEM_INFO))
+            wrapped = (rsa.decapsulate, (enc, None, 32, KEM_INFO))
+        return (func, args) if layer == 'mprsa-raw' else wrapped
+    return setup
+
+
+def rsa_cases(args):
+    cases = []
+    for bits in args.rsa_sizes:
+        for b in args.rsa_b:
+            params = dict(rsa_bits=bits, b=b)
+            tag = '%db%d' % (bits, b)
+            cases.append(Case(_name('mprsa-raw', 'generate_keys', tag), 'mprsa-raw', 'generate_keys',
+                              _rsa_setup('mprsa-raw', 'generate_keys', bits, b), **params))
+            for op in RSA_OPS:
+                for layer in ('mprsa-raw', 'mprsa'):
+                    cases.append(Case(_name(layer, op, tag), layer, op, _rsa_setup(layer, op, bits, b),
+                                      **params))
+    return cases
+
+
+# Hybrid: whole-message encryption, to set against its KEM and CBC parts
+
+def _hybrid_setup(op, bits, b, size):
+    def setup():
+        crypto = HybridCryptosystem()
+        crypto.generate_keys(rsa_key_size=bits, b=b)
+        data = os.urandom(size)
+        # the KEM envelope, so that the call splits into the KEM and CBC parts
+        if op == 'encrypt':
+            return crypto.encrypt, (data, None, None, False, True)
+        envelope = crypto.encrypt(data, kem=True)
+        return crypto.decrypt, (envelope,)
+    return setup
+
+
+def hybrid_cases(args):
+    cases = []
+    for op in ('encrypt', 'decrypt'):
+        for size in args.payloads:
+            cases.append(Case(_name('hybrid', op, '%db%d' % (args.hybrid_rsa, args.hybrid_b), size),
+                              'hybrid', op, _hybrid_setup(op, args.hybrid_rsa, args.hybrid_b, size),
+                              rsa_bits=args.hybrid_rsa, b=args.hybrid_b, payload=size))
+    return cases
+
+
+# Context placement and large buffers, as before but under pyperf
+
+def _keyring_setup(huge_pages, keys):
+    def setup():
+        ring = Keyring(keys, huge_pages=huge_pages)
+        for i in range(keys):
+            ring.set_key(i, os.urandom(32))
+        rng = random.Random(0)
+        indices = [rng.randrange(keys) for _ in range(1 << 16)]
+        return ring.encrypt, (indices, os.urandom(16))
+    return setup
+
+
+def _context_setup(replicate):
+    def setup():
+        cipher = Twofish(os.urandom(32), numa_replicate=replicate)
+        return cipher.encrypt_block, (os.urandom(16),)
+    return setup
+
+
+def alloc_cases(args):
+    cases = []
+    for huge_pages in (False, True):
+        cases.append(Case(_name('keyring', 'random_key', 'huge' if huge_pages else 'regular'),
+                          'keyring', 'random_key', _keyring_setup(huge_pages, args.keyring_size),
+                          timer=time_indexed, keys=args.keyring_size))
+    for replicate in (False, True):
+        cases.append(Case(_name('context', 'encrypt_block', 'replicas' if replicate else 'single'),
+                          'context', 'encrypt_block', _context_setup(replicate)))
+    return cases
+
+
+def _large_setup(size_mb):
+    def setup():
+        cipher = _twofish.Twofish(os.urandom(32))
+        return cipher.ctr, (bytes(size_mb << 20), bytes(16))
+    return setup
+
+
+def large_cases(args):
+    configs = [
+        ('plain', dict(threshold=0)),
+        ('tiled', dict(threshold=1, nt_stores=False, warm_tables=False)),
+        ('tiled-warm', dict(threshold=1, nt_stores=False, warm_tables=True)),
+        ('tiled-warm-nt', dict(threshold=1, nt_stores=True, warm_tables=True)),
+    ]
+    return [Case(_name('large', 'ctr', name, '%dMiB' % args.large_mb), 'large', 'ctr',
+                 _large_setup(args.large_mb), timer=time_bulk_config, config=config, size_mb=args.large_mb)
+            for name, config in configs]
+
+
+# Every public operation, for --memory: one call each, at each payload size
+# where the call takes a payload
+
+def _api_hybrid(bits, b):
+    def make():
         crypto = HybridCryptosystem()
-        public_key, private_key = crypto.generate_keys(rsa_key_size=rsa_key_size, b=b)
-        
-        # Encrypt and decrypt data multiple times
-        encrypt_times = []
-        decrypt_times = []
-        
-        for _ in range(rounds):
-            # Encryption time
-            start_time = time.time()
-            encrypted_data = crypto.encrypt(test_data, public_key=public_key)
-            encrypt_time = (time.time() - start_time) * 1000  # ms
-            encrypt_times.append(encrypt_time)
-            
-            # Serialization (part of real-world usage)
-            serialized = HybridCryptosystem.serialize_encrypted_data(encrypted_data)
-            deserialized = HybridCryptosystem.deserialize_encrypted_data(serialized)
-            
-            # Decryption time
-            start_time = time.time()
-            decrypted = crypto.decrypt(deserialized, private_key=private_key)
-            decrypt_time = (time.time() - start_time) * 1000  # ms
-            decrypt_times.append(decrypt_time)
-            
-            # Verify correctness
-            if len(decrypted) != len(test_data):
-                print(f"Length mismatch: original {len(test_data)}, decrypted {len(decrypted)}")
-                print(f"Decrypted data first 10 bytes: {decrypted[:10]}")
-                print(f"Original data first 10 bytes: {test_data[:10]}")
-            
-            assert decrypted == test_data, "Decryption failed!"
-        
-        results.append({
-            'algorithm': 'Hybrid (Twofish+MPRSA)',
-            'data_size_bytes': data_size,
-            'rsa_key_size_bits': rsa_key_size,
-            'b_value': b,
-            'encryption_ms': np.mean(encrypt_times),
-            'decryption_ms': np.mean(decrypt_times),
-            'encryption_std': np.std(encrypt_times),
-            'decryption_std': np.std(decrypt_times)
-        })
-    
-    return results
-
-def plot_results(twofish_results, rsa_results, hybrid_results, output_dir='.'):
-    """Plot benchmark results"""
-    # Create output directory if it doesn't exist
-    os.makedirs(output_dir, exist_ok=True)
-    
-    # Prepare DataFrame for Twofish results
-    twofish_df = pd.DataFrame([twofish_results])
-    
-    # Plot Twofish ECB vs CBC
-    plt.figure(figsize=(10, 6))
-    
-    # Create bar data
-    labels = ['ECB Encryption', 'ECB Decryption', 'CBC Encryption', 'CBC Decryption']
-    values = [
-        twofish_df['mode_ecb_encryption_ms'].values[0],
-        twofish_df['mode_ecb_decryption_ms'].values[0],
-        twofish_df['mode_cbc_encryption_ms'].values[0],
-        twofish_df['mode_cbc_decryption_ms'].values[0]
+        crypto.generate_keys(rsa_key_size=bits, b=b)
+        return crypto
+    return _cached(('hybrid', bits, b), make)
+
+
+def _api_dir():
+    def make():
+        path = tempfile.mkdtemp(prefix='pangfish-bench-')
+        atexit.register(shutil.rmtree, path, True)
+        return path
+    return _cached('tmpdir', make)
+
+
+def _api_file(data):
+    path = os.path.join(_api_dir(), 'payload-%d' % len(data))
+    if not os.path.exists(path):
+        encrypt_file(path, data, API_KEY)
+    return path
+
+
+def _read_mapped(path):
+    with mmap_decrypt(path, API_KEY) as mapped:
+        view = memoryview(mapped)
+        out = bytes(view)
+        view.release()
+    return out
+
+
+def _api_payload_ops(args):
+    """(op, setup taking the payload) for the calls whose cost grows with the payload"""
+    def cipher():
+        return Twofish(API_KEY)
+
+    def cbc_padded(data):
+        c = cipher()
+        return c.decrypt, (c.encrypt(data, 'cbc'), 'cbc')
+
+    def ecb_padded(data):
+        c = cipher()
+        return c.decrypt, (c.encrypt(data, 'ecb'), 'ecb')
+
+    def stream(mode, encrypt):
+        def setup(data):
+            c = cipher()
+            if encrypt:
+                return c.encrypt, (data, mode)
+            return c.decrypt, (c.encrypt(data, mode), mode)
+        return setup
+
+    def etm_decrypt(data):
+        c = cipher()
+        ciphertext, tag = c.encrypt_then_mac(data, MAC_KEY)
+        return c.decrypt_and_verify, (ciphertext, tag, MAC_KEY)
+
+    def open_batched(data):
+        c = cipher()
+        return c.open_batched, (c.seal_batched(data),)
+
+    def siv_open(data):
+        siv = SIV(API_KEY * 2)
+        return siv.open, (siv.seal(data),)
+
+    def hctr2_decrypt(data):
+        hctr2 = HCTR2(API_KEY)
+        return hctr2.decrypt, (hctr2.encrypt(data, TWEAK), TWEAK)
+
+    def keymgr(data):
+        mgr = KeyManager()
+        return mgr.encrypt, (mgr.add(API_KEY), data)
+
+    def hybrid(op):
+        def setup(data):
+            crypto = _api_hybrid(args.hybrid_rsa, args.hybrid_b)
+            if op in ('encrypt', 'encrypt_serialized'):
+                return getattr(crypto, op), (data,)
+            envelope = getattr(crypto, op.replace('decrypt', 'encrypt'))(data)
+            return getattr(crypto, op), (envelope,)
+        return setup
+
+    return [
+        ('twofish.encrypt/ecb', lambda data: (cipher().encrypt, (data, 'ecb'))),
+        ('twofish.decrypt/ecb', ecb_padded),
+        ('twofish.encrypt/cbc', lambda data: (cipher().encrypt, (data, 'cbc'))),
+        ('twofish.decrypt/cbc', cbc_padded),
+        ('twofish.encrypt/cfb', stream('cfb', True)),
+        ('twofish.decrypt/cfb', stream('cfb', False)),
+        ('twofish.encrypt/ofb', stream('ofb', True)),
+        ('twofish.encrypt_then_mac', lambda data: (cipher().encrypt_then_mac, (data, MAC_KEY))),
+        ('twofish.decrypt_and_verify', etm_decrypt),
+        ('twofish.seal_batched', lambda data: (cipher().seal_batched, (data,))),
+        ('twofish.open_batched', open_batched),
+        ('cmac.tag', lambda data: (CMAC(API_KEY).tag, (data,))),
+        ('siv.seal', lambda data: (SIV(API_KEY * 2).seal, (data,))),
+        ('siv.open', siv_open),
+        ('hctr2.encrypt', lambda data: (HCTR2(API_KEY).encrypt, (data, TWEAK))),
+        ('hctr2.decrypt', hctr2_decrypt),
+        ('keymanager.encrypt', keymgr),
+        ('encrypt_file', lambda data: (encrypt_file, (os.path.join(_api_dir(), 'out'), data, API_KEY))),
+        ('mmap_decrypt', lambda data: (_read_mapped, (_api_file(data),))),
+        ('hybrid.encrypt', hybrid('encrypt')),
+        ('hybrid.decrypt', hybrid('decrypt')),
+        ('hybrid.encrypt_serialized', hybrid('encrypt_serialized')),
+        ('hybrid.decrypt_serialized', hybrid('decrypt_serialized')),
+    ]
+
+
+def _api_fixed_ops(args):
+    """(op, setup) for the calls of a fixed size"""
+    bits, b = args.hybrid_rsa, args.hybrid_b
+
+    def keyring():
+        ring = Keyring(16)
+        ring.set_key(0, API_KEY)
+        return ring.encrypt, (0, bytes(16))
+
+    def rsa(op):
+        def setup():
+            return _rsa_setup('mprsa', op, bits, b)()
+        return setup
+
+    def fpe():
+        return FPE(API_KEY)
+    return [
+        ('twofish.new', lambda: (Twofish, (API_KEY,))),
+        ('twofish.encrypt_block', lambda: (Twofish(API_KEY).encrypt_block, (bytes(16),))),
+        ('twofish.decrypt_block', lambda: (Twofish(API_KEY).decrypt_block, (bytes(16),))),
+        ('keyring.encrypt', keyring),
+        ('hkdf', lambda: (hkdf, (API_KEY, KEM_INFO))),
+        ('derive_keys/16', lambda: (derive_keys, (API_KEY, [b'%d' % i for i in range(16)]))),
+        ('fpe.encrypt', lambda: (fpe().encrypt, ('4111111111111111',))),
+        ('fpe.encrypt_batch/256', lambda: (fpe().encrypt_batch, (['%016d' % i for i in range(256)],))),
+        ('mprsa.generate_keys', lambda: (MultiPowerRSA(key_size=bits, b=b).generate_keys, ())),
+        ('mprsa.encrypt', rsa('encrypt')),
+        ('mprsa.decrypt', rsa('decrypt')),
+        ('mprsa.encapsulate', rsa('kem_encapsulate')),
+        ('mprsa.decapsulate', rsa('kem_decapsulate')),
     ]
-    
-    plt.bar(labels, values, color=['blue', 'lightblue', 'green', 'lightgreen'])
-    plt.ylabel('Time (ms)')
-    plt.title(f'Twofish Performance: ECB vs CBC Mode ({twofish_df["data_size_bytes"].values[0]} bytes)')
-    plt.grid(axis='y', linestyle='--', alpha=0.7)
-    
-    for i, v in enumerate(values):
-        plt.text(i, v + 0.1, f'{v:.2f}', ha='center')
-    
-    plt.tight_layout()
-    plt.savefig(os.path.join(output_dir, 'twofish_ecb_vs_cbc.png'))
-    
-    # Prepare DataFrame for Multi-Power RSA results
-    rsa_df = pd.DataFrame(rsa_results)
-    
-    # Plot RSA key generation time by key size and b value
-    plt.figure(figsize=(10, 6))
-    
-    key_sizes = sorted(rsa_df['key_size_bits'].unique())
-    b_values = sorted(rsa_df['b_value'].unique())
-    
-    bar_width = 0.35
-    index = np.arange(len(key_sizes))
-    
-    for i, b in enumerate(b_values):
-        b_data = rsa_df[rsa_df['b_value'] == b]
-        values = [b_data[b_data['key_size_bits'] == ks]['key_generation_ms'].values[0] for ks in key_sizes]
-        plt.bar(index + i*bar_width, values, bar_width, label=f'b={b}')
-    
-    plt.xlabel('Key Size (bits)')
-    plt.ylabel('Time (ms)')
-    plt.title('Multi-Power RSA Key Generation Time')
-    plt.xticks(index + bar_width/2, key_sizes)
-    plt.legend()
-    plt.grid(axis='y', linestyle='--', alpha=0.7)
-    plt.tight_layout()
-    plt.savefig(os.path.join(output_dir, 'mprsa_key_generation.png'))
-    
-    # Plot RSA encryption/decryption time by key size and b value
-    plt.figure(figsize=(12, 8))
-    
-    for i, key_size in enumerate(key_sizes):
-        plt.subplot(1, len(key_sizes), i+1)
-        
-        ks_data = rsa_df[rsa_df['key_size_bits'] == key_size]
-        x = np.arange(len(b_values))
-        width = 0.35
-        
-        enc_values = [ks_data[ks_data['b_value'] == b]['encryption_ms'].values[0] for b in b_values]
-        dec_values = [ks_data[ks_data['b_value'] == b]['decryption_ms'].values[0] for b in b_values]
-        
-        plt.bar(x - width/2, enc_values, width, label='Encryption')
-        plt.bar(x + width/2, dec_values, width, label='Decryption')
-        
-        plt.xlabel('b value')
-        plt.ylabel('Time (ms)')
-        plt.title(f'Key Size: {key_size} bits')
-        plt.xticks(x, b_values)
-        plt.legend()
-        plt.grid(axis='y', linestyle='--', alpha=0.7)
-    
-    plt.tight_layout()
-    plt.savefig(os.path.join(output_dir, 'mprsa_encryption_decryption.png'))
-    
-    # Prepare DataFrame for Hybrid Cryptosystem results
-    hybrid_df = pd.DataFrame(hybrid_results)
-    
-    # Plot Hybrid encryption/decryption time by data size
-    plt.figure(figsize=(10, 6))
-    
-    data_sizes = sorted(hybrid_df['data_size_bytes'].unique())
-    x = np.arange(len(data_sizes))
-    width = 0.35
-    
-    enc_values = [hybrid_df[hybrid_df['data_size_bytes'] == ds]['encryption_ms'].values[0] for ds in data_sizes]
-    dec_values = [hybrid_df[hybrid_df['data_size_bytes'] == ds]['decryption_ms'].values[0] for ds in data_sizes]
-    
-    plt.bar(x - width/2, enc_values, width, label='Encryption')
-    plt.bar(x + width/2, dec_values, width, label='Decryption')
-    
-    plt.xlabel('Data Size (bytes)')
-    plt.ylabel('Time (ms)')
-    plt.title(f'Hybrid Cryptosystem Performance (RSA {hybrid_df["rsa_key_size_bits"].values[0]} bits, b={hybrid_df["b_value"].values[0]})')
-    plt.xticks(x, data_sizes)
-    plt.legend()
-    plt.grid(axis='y', linestyle='--', alpha=0.7)
-    
-    plt.tight_layout()
-    plt.savefig(os.path.join(output_dir, 'hybrid_performance.png'))
-    
-    # Create performance report
-    report = pd.concat([
-        twofish_df,
-        rsa_df,
-        hybrid_df
-    ])
-    
-    report.to_csv(os.path.join(output_dir, 'performance_report.csv'), index=False)
-    
-    print(f"Results saved to {output_dir}")
+
+
+def _with_payload(setup, size):
+    return lambda: setup(os.urandom(size))
+
+
+def api_cases(args):
+    cases = []
+    for op, setup in _api_fixed_ops(args):
+        cases.append(Case(_name('api', op), 'api', op, setup, payload=None))
+    for op, setup in _api_payload_ops(args):
+        for size in args.payloads:
+            cases.append(Case(_name('api', op, size), 'api', op,
+                              _with_payload(setup, size), payload=size))
+    return cases
+
+
+# Breakdown of the measured times
+
+def _share(part, total):
+    return part / total if part is not None and total else None
+
+
+def _diff(a, b):
+    return a - b if a is not None and b is not None else None
+
+
+def breakdown(args, results):
+    """
+    Split each call from the medians: binding is the raw call on an empty
+    payload, crypto the raw call less that, and wrapper what the Python
+    layer adds over the raw call. For the hybrid, glue is what is left
+    after its KEM and CBC parts, measured on their own. A difference
+    within the noise can come out negative; pyperf.json has the spread.
+    """
+    med = {name: bench.median() for name, bench in results.items()}
+    out = {'twofish': [], 'mprsa': [], 'hybrid': []}
+
+    for bits in args.key_sizes:
+        for op in TWOFISH_OPS:
+            binding = med.get(_name('raw', op, 'k%d' % bits, 0))
+            for size in args.payloads:
+                raw = med.get(_name('raw', op, 'k%d' % bits, size))
+                layer = med.get(_name('pangfish', op, 'k%d' % bits, size))
+                crypto = _diff(raw, binding)
+                crypto = max(crypto, 0.0) if crypto is not None else None
+                wrapper = _diff(layer, raw)
+                total = layer if layer is not None else raw
+                out['twofish'].append({
+                    'op': op, 'key_bits': bits, 'payload': size,
+                    'raw_s': raw, 'pangfish_s': layer,
+                    'binding_s': binding, 'crypto_s': crypto, 'wrapper_s': wrapper,
+                    'crypto_mb_s': size / crypto / 1e6 if crypto else None,
+                    'overhead_share': _share(_diff(total, crypto), total),
+                })
+
+    for bits in args.rsa_sizes:
+        for b in args.rsa_b:
+            tag = '%db%d' % (bits, b)
+            for op in RSA_OPS:
+                raw = med.get(_name('mprsa-raw', op, tag))
+                layer = med.get(_name('mprsa', op, tag))
+                out['mprsa'].append({
+                    'op': op, 'rsa_bits': bits, 'b': b,
+                    'raw_s': raw, 'mprsa_s': layer, 'wrapper_s': _diff(layer, raw),
+                    'overhead_share': _share(_diff(layer, raw), layer),
+                })
+
+    tag = '%db%d' % (args.hybrid_rsa, args.hybrid_b)
+    for op in ('encrypt', 'decrypt'):
+        for size in args.payloads:
+            total = med.get(_name('hybrid', op, tag, size))
+            kem = med.get(_name('mprsa-raw', 'kem_encapsulate' if op == 'encrypt' else 'kem_decapsulate', tag))
+            cipher = med.get(_name('pangfish', 'cbc_' + op, 'k256', size))
+            glue = _diff(_diff(total, kem), cipher)
+            out['hybrid'].append({
+                'op': op, 'rsa_bits': args.hybrid_rsa, 'b': args.hybrid_b, 'payload': size,
+                'hybrid_s': total, 'kem_s': kem, 'cbc_s': cipher, 'glue_s': glue,
+                'glue_share': _share(glue, total),
+            })
+
+    out = {k: [row for row in v if any(row[f] is not None for f in row if f.endswith('_s'))]
+           for k, v in out.items()}
+    return out
+
+
+def _fmt(seconds):
+    if seconds is None:
+        return '-'
+    if abs(seconds) >= 1e-3:
+        return '%.2f ms' % (seconds * 1e3)
+    return '%.2f us' % (seconds * 1e6)
+
+
+def print_breakdown(split):
+    if split['twofish']:
+        print()
+        print('%-12s %4s %8s %11s %11s %11s %10s %9s' % (
+            'twofish', 'key', 'payload', 'binding', 'crypto', 'wrapper', 'MB/s', 'overhead'))
+        for row in split['twofish']:
+            print('%-12s %4d %8d %11s %11s %11s %10s %9s' % (
+                row['op'], row['key_bits'], row['payload'], _fmt(row['binding_s']), _fmt(row['crypto_s']),
+                _fmt(row['wrapper_s']), '%.1f' % row['crypto_mb_s'] if row['crypto_mb_s'] else '-',
+                '%.0f%%' % (100 * row['overhead_share']) if row['overhead_share'] is not None else '-'))
+    if split['mprsa']:
+        print()
+        print('%-16s %5s %2s %11s %11s %11s' % ('mprsa', 'bits', 'b', 'raw', 'wrapper', 'overhead'))
+        for row in split['mprsa']:
+            print('%-16s %5d %2d %11s %11s %11s' % (
+                row['op'], row['rsa_bits'], row['b'], _fmt(row['raw_s']), _fmt(row['wrapper_s']),
+                '%.1f%%' % (100 * row['overhead_share']) if row['overhead_share'] is not None else '-'))
+    if split['hybrid']:
+        print()
+        print('%-8s %8s %11s %11s %11s %11s' % ('hybrid', 'payload', 'total', 'kem', 'cbc', 'glue'))
+        for row in split['hybrid']:
+            print('%-8s %8d %11s %11s %11s %11s' % (
+                row['op'], row['payload'], _fmt(row['hybrid_s']), _fmt(row['kem_s']), _fmt(row['cbc_s']),
+                _fmt(row['glue_s'])))
+
+
+# Memory: allocations and peaks per call, for --memory
+
+class MemCount:
+    """
+    Counters of the memcount.c shim, when the process runs with it in
+    LD_PRELOAD. read() gives allocations, frees, bytes requested, bytes
+    live and peak bytes live since the last reset().
+    """
+
+    FIELDS = 5
+
+    def __init__(self):
+        lib = ctypes.CDLL(None)
+        self._read = lib.memcount_read      # AttributeError without the shim
+        self._read.restype = None
+        self._reset = lib.memcount_reset
+        self._reset.restype = None
+        self._stats = (ctypes.c_ulonglong * self.FIELDS)()   # made once, so reads allocate nothing
+
+    def read(self):
+        self._read(self._stats)
+        return list(self._stats)
+
+    def reset(self):
+        self._reset()
+
+
+def _memcount():
+    try:
+        return MemCount()
+    except AttributeError:
+        return None
+
+
+def _preload(shim):
+    """Run this command again with the shim in LD_PRELOAD, once"""
+    if os.environ.get('PANGFISH_MEMCOUNT') or not os.path.exists(shim):
+        return
+    env = dict(os.environ, PANGFISH_MEMCOUNT='1')
+    env['LD_PRELOAD'] = ' '.join(p for p in (os.path.abspath(shim), env.get('LD_PRELOAD')) if p)
+    sys.stdout.flush()
+    os.execve(sys.executable, [sys.executable] + sys.argv, env)
+
+
+def _vm_status():
+    """VmRSS and VmHWM of this process, in bytes"""
+    out = {}
+    with open('/proc/self/status') as f:
+        for line in f:
+            if line.startswith(('VmRSS:', 'VmHWM:')):
+                key, value = line.split(':')
+                out[key] = int(value.split()[0]) * 1024
+    return out
+
+
+def _reset_hwm():
+    """Lower VmHWM to the current RSS; False where the kernel does not allow it"""
+    try:
+        with open('/proc/self/clear_refs', 'w') as f:
+            f.write('5')
+        return True
+    except OSError:
+        return False
+
+
+def _per_byte(value, size):
+    return value / size if value is not None and size else None
+
+
+def measure_memory(case, reps, shim):
+    """
+    One row for a case. Two warmup calls first, so that key schedules,
+    caches and pools reached on every call are not counted. Then reps
+    calls under the malloc and GMP counters and the RSS high-water mark,
+    and a last call under tracemalloc for the peak of Python objects,
+    the result included. Peaks are above what was live before the calls.
+    """
+    func, args = case.prepare()
+    row = {'op': case.op, 'payload': case.params.get('payload'), 'reps': reps}
+    func(*args)
+    func(*args)
+    gc.collect()
+
+    rss = _vm_status()['VmRSS']
+    hwm = _reset_hwm()
+    _multipowerrsa.gmp_alloc_stats_reset()
+    gmp_live = _multipowerrsa.gmp_alloc_stats()['live']
+    if shim is not None:
+        shim.reset()
+        heap_live = shim.read()[3]
+    for _ in range(reps):
+        func(*args)
+    if shim is not None:
+        calls, _, nbytes, _, peak = shim.read()
+        row.update(malloc_calls=calls / reps, malloc_bytes=nbytes / reps,
+                   heap_peak_bytes=max(peak - heap_live, 0))
+    else:
+        row.update(malloc_calls=None, malloc_bytes=None, heap_peak_bytes=None)
+    gmp = _multipowerrsa.gmp_alloc_stats()
+    row.update(gmp_allocs=(gmp['allocs'] + gmp['reallocs']) / reps, gmp_bytes=gmp['bytes'] / reps,
+               gmp_peak_bytes=max(gmp['peak'] - gmp_live, 0))
+    row['rss_peak_bytes'] = max(_vm_status()['VmHWM'] - rss, 0) if hwm else None
+
+    tracemalloc.start()
+    func(*args)
+    tracemalloc.reset_peak()
+    base = tracemalloc.get_traced_memory()[0]
+    func(*args)
+    row['py_peak_bytes'] = tracemalloc.get_traced_memory()[1] - base
+    tracemalloc.stop()
+
+    size = row['payload']
+    row['alloc_copies'] = _per_byte(row['malloc_bytes'], size)
+    row['peak_copies'] = _per_byte(max(row['py_peak_bytes'], row['heap_peak_bytes'] or 0), size)
+    return row
+
+
+def _kib(value):
+    if value is None:
+        return '-'
+    return '%.1f' % (value / 1024)
+
+
+def _copies(value):
+    return '%.2f' % value if value is not None else '-'
+
+
+def print_memory(rows):
+    print()
+    print('%-28s %8s %9s %11s %11s %8s %11s %11s %11s %8s %8s' % (
+        'operation', 'payload', 'mallocs', 'malloc KiB', 'heap pk KiB', 'gmp', 'gmp pk KiB',
+        'py pk KiB', 'rss pk KiB', 'copies', 'peak'))
+    for row in rows:
+        print('%-28s %8s %9s %11s %11s %8.1f %11s %11s %11s %8s %8s' % (
+            row['op'], row['payload'] if row['payload'] is not None else '-',
+            '%.1f' % row['malloc_calls'] if row['malloc_calls'] is not None else '-',
+            _kib(row['malloc_bytes']), _kib(row['heap_peak_bytes']), row['gmp_allocs'],
+            _kib(row['gmp_peak_bytes']), _kib(row['py_peak_bytes']), _kib(row['rss_peak_bytes']),
+            _copies(row['alloc_copies']), _copies(row['peak_copies'])))
+
+
+def run_memory(args):
+    """
+    The --memory mode: every public operation in this process, no pyperf
+    workers. Allocation counts need the memcount.c shim (make memcount.so);
+    without it they are left out and only the GMP, tracemalloc and RSS
+    figures are reported.
+    """
+    shim = _memcount()
+    if shim is None:
+        print("memcount shim not loaded (build it with make memcount.so); malloc counts are left out")
+    rows = []
+    for case in api_cases(args):
+        reps = args.memory_reps if case.op != 'mprsa.generate_keys' else 1
+        row = measure_memory(case, reps, shim)
+        row['name'] = case.name
+        rows.append(row)
+        _prepared.pop(case.name, None)
+
+    os.makedirs(args.results, exist_ok=True)
+    with open(os.path.join(args.results, 'memory.json'), 'w') as f:
+        json.dump({'memcount': shim is not None, 'hybrid_rsa': args.hybrid_rsa, 'hybrid_b': args.hybrid_b,
+                   'rows': rows}, f, indent=2)
+    print_memory(rows)
+    print("\nResults saved to %s" % args.results)
+
+
+def _sizes(text):
+    return [int(v) for v in text.split(',') if v]
+
+
+def _payloads(text):
+    sizes = _sizes(text)
+    if any(n <= 0 or n % 16 for n in sizes):
+        raise ValueError("payload sizes must be positive multiples of 16")
+    return sizes
+
+
+def _layers(text):
+    layers = [v for v in text.split(',') if v]
+    for layer in layers:
+        if layer not in LAYERS:
+            raise ValueError("unknown layer %r" % layer)
+    return layers
+
+
+def add_cmdline_args(cmd, args):
+    """Pass the suite's own options on to the worker processes"""
+    cmd.extend(('--layers', ','.join(args.layers)))
+    cmd.extend(('--payloads', ','.join(map(str, args.payloads))))
+    cmd.extend(('--key-sizes', ','.join(map(str, args.key_sizes))))
+    cmd.extend(('--rsa-sizes', ','.join(map(str, args.rsa_sizes))))
+    cmd.extend(('--rsa-b', ','.join(map(str, args.rsa_b))))
+    cmd.extend(('--hybrid-rsa', str(args.hybrid_rsa), '--hybrid-b', str(args.hybrid_b)))
+    cmd.extend(('--keyring-size', str(args.keyring_size), '--large-mb', str(args.large_mb)))
+    if args.alloc:
+        cmd.append('--alloc')
+    if args.large:
+        cmd.append('--large')
+
+
+def add_arguments(parser):
+    """The suite's own options, on pyperf's parser or, for --memory, a plain one"""
+    parser.add_argument('--layers', type=_layers, default=list(LAYERS),
+                        help='Comma-separated layers to run, of %s (default: all)' % ', '.join(LAYERS))
+    parser.add_argument('--payloads', type=_payloads, default=[16, 256, 4096, 65536, 1048576],
+                        help='Comma-separated payload sizes in bytes, multiples of 16')
+    parser.add_argument('--key-sizes', type=_sizes, default=[128, 192, 256],
+                        help='Comma-separated Twofish key sizes in bits')
+    parser.add_argument('--rsa-sizes', type=_sizes, default=[1024, 2048],
+                        help='Comma-separated Multi-Power RSA modulus sizes in bits')
+    parser.add_argument('--rsa-b', type=_sizes, default=[2, 3],
+                        help='Comma-separated Multi-Power RSA b values')
+    parser.add_argument('--hybrid-rsa', type=int, default=2048, help='RSA size for the hybrid layer')
+    parser.add_argument('--hybrid-b', type=int, default=3, help='RSA b value for the hybrid layer')
+    parser.add_argument('--alloc', action='store_true',
+                        help='Also run the context allocation (NUMA/huge page) benchmarks')
+    parser.add_argument('--keyring-size', type=int, default=4096, help='Keys in the keyring for --alloc')
+    parser.add_argument('--large', action='store_true',
+                        help='Also run the large-buffer (cache-aware bulk path) benchmarks')
+    parser.add_argument('--large-mb', type=int, default=2048, help='Buffer size in MiB for --large')
+    parser.add_argument('--memory', action='store_true',
+                        help='Measure allocations and peak memory of every public operation instead of time')
+    parser.add_argument('--memory-reps', type=int, default=20, help='Calls counted per operation for --memory')
+    parser.add_argument('--memcount', default=os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                                           'memcount.so'),
+                        help='Allocation counting shim preloaded for --memory')
+    parser.add_argument('--results', default='benchmark_results',
+                        help='Directory for pyperf.json, breakdown.json and memory.json')
+
 
 def main():
-    parser = argparse.ArgumentParser(description='Benchmark Pangfish library')
-    parser.add_argument('--twofish', action='store_true', help='Run Twofish benchmark')
-    parser.add_argument('--mprsa', action='store_true', help='Run Multi-Power RSA benchmark')
-    parser.add_argument('--hybrid', action='store_true', help='Run Hybrid Cryptosystem benchmark')
-    parser.add_argument('--all', action='store_true', help='Run all benchmarks')
-    parser.add_argument('--output', default='benchmark_results', help='Output directory for results')
-    
-    args = parser.parse_args()
-    
-    if not (args.twofish or args.mprsa or args.hybrid or args.all):
-        parser.print_help()
+    # nothing is timed with --memory, so that mode runs without pyperf installed
+    if '--memory' in sys.argv[1:]:
+        parser = argparse.ArgumentParser(description='Pangfish memory benchmark')
+        add_arguments(parser)
+        args = parser.parse_args()
+        if _memcount() is None:
+            _preload(args.memcount)
+        run_memory(args)
+        return
+
+    import pyperf
+    runner = pyperf.Runner(add_cmdline_args=add_cmdline_args)
+    add_arguments(runner.argparser)
+    args = runner.parse_args()
+
+    runner.metadata['pangfish_simd_backend'] = _twofish.simd_backend()
+    runner.metadata['pangfish_shuffle_backend'] = _twofish.shuffle_backend()
+    runner.metadata['pangfish_sha256_backend'] = _twofish.sha256_backend()
+    runner.metadata['pangfish_numa_nodes'] = numa_nodes()
+
+    cases = []
+    if 'raw' in args.layers or 'pangfish' in args.layers:
+        cases += twofish_cases(args)
+    if 'mprsa' in args.layers:
+        cases += rsa_cases(args)
+    if 'hybrid' in args.layers:
+        cases += hybrid_cases(args)
+    if args.alloc:
+        cases += alloc_cases(args)
+    if args.large:
+        cases += large_cases(args)
+
+    results = {}
+    for case in cases:
+        bench = runner.bench_time_func(case.name, case.timer, case)
+        if bench is not None:
+            results[case.name] = bench
+
+    # workers return None; only the parent process has the results
+    if not results:
         return
-    
-    twofish_results = None
-    rsa_results = None
-    hybrid_results = None
-    
-    if args.twofish or args.all:
-        twofish_results = benchmark_twofish()
-    
-    if args.mprsa or args.all:
-        rsa_results = benchmark_multipowerrsa()
-    
-    if args.hybrid or args.all:
-        hybrid_results = benchmark_hybrid()
-    
-    # Plot results if we have data
-    if twofish_results or rsa_results or hybrid_results:
-        plot_results(
-            twofish_results if twofish_results else None,
-            rsa_results if rsa_results else [],
-            hybrid_results if hybrid_results else [],
-            args.output
-        )
+
+    os.makedirs(args.results, exist_ok=True)
+    pyperf.BenchmarkSuite(list(results.values())).dump(os.path.join(args.results, 'pyperf.json'),
+                                                      replace=True)
+    split = breakdown(args, results)
+    with open(os.path.join(args.results, 'breakdown.json'), 'w') as f:
+        json.dump(split, f, indent=2)
+    print_breakdown(split)
+    print("\nResults saved to %s" % args.results)
 
 if __name__ == "__main__":
-    main()
\ No newline at end of file
+    main()
@@ -2,7 +2,9 @@
 Python wrapper for the C implementation of Multi-Power RSA.
 """
 
+import _multipowerrsa
 from _multipowerrsa import MPRSA as _MPRSA
+from . import aio
 
 class MultiPowerRSA:
     """
@@ -60,6 +62,37 @@ class MultiPowerRSA:
         """
         return self._rsa.decrypt(ciphertext, private_key or self.private_key)
         
+    async def decrypt_async(self, ciphertext, private_key=None):
+        """
+        Decrypt a message on the native worker pool without blocking the event loop.
+        
+        Args:
+            ciphertext: The encrypted message (string or int)
+            private_key (bytes, optional): The private key to use for decryption
+            
+        Returns:
+            int: The decrypted message as an integer
+        """
+        return await aio.submit(_multipowerrsa, self._rsa.submit_decrypt,
+                                ciphertext, private_key or self.private_key)
+        
+    def decrypt_batched(self, ciphertext, private_key=None):
+        """
+        Decrypt like decrypt(), but batch with concurrent callers from other threads.
+        
+        Calls arriving within a few microseconds of each other run as one batch
+        with the GIL released; see _multipowerrsa.configure_dispatcher and
+        _multipowerrsa.dispatcher_stats.
+        
+        Args:
+            ciphertext: The encrypted message (string or int)
+            private_key (bytes, optional): The private key to use for decryption
+            
+        Returns:
+            int: The decrypted message as an integer
+        """
+        return self._rsa.decrypt_batched(ciphertext, private_key or self.private_key)
+        
     def decrypt_to_bytes(self, ciphertext, private_key=None):
         """
         Decrypt a message and return it as bytes.
@@ -73,6 +106,39 @@ class MultiPowerRSA:
         """
         return self._rsa.decrypt_to_bytes(ciphertext, private_key or self.private_key)
     
+    def encapsulate(self, public_key=None, size=32, info=b''):
+        """
+        Create a fresh shared key with RSA-KEM.
+        
+        A random integer mod n is encrypted and the key is derived from it
+        with HKDF-SHA256, all in native code. Only the holder of the private
+        key can recover the same key from the returned encapsulation.
+        
+        Args:
+            public_key (bytes, optional): The public key to use
+            size (int): Length of the derived key in bytes
+            info (bytes): Context bound into the derived key
+            
+        Returns:
+            tuple: (encapsulation as fixed-width bytes, derived key)
+        """
+        return self._rsa.kem_encapsulate(public_key or self.public_key, size, info)
+        
+    def decapsulate(self, enc, private_key=None, size=32, info=b''):
+        """
+        Recover the key created by encapsulate.
+        
+        Args:
+            enc (bytes): Encapsulation returned by encapsulate
+            private_key (bytes, optional): The private key to use
+            size (int): Length of the derived key in bytes
+            info (bytes): Context given to encapsulate
+            
+        Returns:
+            bytes: The derived key
+        """
+        return self._rsa.kem_decapsulate(enc, private_key or self.private_key, size, info)
+    
     @staticmethod
     def bytes_to_int(data):
         """
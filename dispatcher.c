@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "dispatcher.h"
+
+struct dispatcher {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;          /* the leader waits here for lanes or the deadline */
+    pthread_cond_t done;            /* waiters sleep here until their job is done */
+    workpool_job *head;             /* pending jobs, in arrival order */
+    workpool_job *tail;
+    size_t count;
+    int leading;                    /* a thread is collecting the current batch */
+    unsigned long long first_ns;    /* arrival of the oldest pending job */
+    dispatcher_stats_t stats;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static int hist_bucket(size_t n)
+{
+    int b = 0;
+    while (b < DISPATCHER_HIST - 1 && n >= ((size_t)2 << b))
+        b++;
+    return b;
+}
+
+dispatcher *dispatcher_create(unsigned long max_window_ns, size_t lanes)
+{
+    dispatcher *d = calloc(1, sizeof(*d));
+    pthread_condattr_t attr;
+
+    if (d == NULL)
+        return NULL;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&d->filled, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&d->done, NULL);
+    dispatcher_configure(d, max_window_ns, lanes);
+    return d;
+}
+
+void dispatcher_destroy(dispatcher *d)
+{
+    if (d == NULL)
+        return;
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->filled);
+    pthread_cond_destroy(&d->done);
+    free(d);
+}
+
+void dispatcher_configure(dispatcher *d, unsigned long max_window_ns, size_t lanes)
+{
+    if (lanes < 1)
+        lanes = 1;
+    if (lanes > DISPATCHER_MAX_LANES)
+        lanes = DISPATCHER_MAX_LANES;
+    pthread_mutex_lock(&d->lock);
+    d->stats.max_window_ns = max_window_ns;
+    d->stats.window_ns = max_window_ns;
+    d->stats.lanes = lanes;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* called with the lock held once a batch has closed */
+static void adapt(dispatcher *d, size_t n, int full)
+{
+    unsigned long w = d->stats.window_ns, max = d->stats.max_window_ns;
+
+    if (n == 1 && !full)
+        w /= 2;                             /* nobody joined: stop waiting for company */
+    else if (n > 1 && w < max)
+        w = w ? (w * 2 < max ? w * 2 : max) : (max / 8 ? max / 8 : max);
+    d->stats.window_ns = w;
+}
+
+static void lead(dispatcher *d)
+{
+    workpool_job *jobs[DISPATCHER_MAX_LANES], *group[DISPATCHER_MAX_LANES], *job;
+    unsigned long long start, deadline, waited;
+    struct timespec ts;
+    size_t n, m, j;
+    int full;
+
+    /* collect until the lanes fill or the window closes; the lock drops while waiting */
+    deadline = d->first_ns + d->stats.window_ns;
+    while (d->count < d->stats.lanes && d->stats.window_ns)
+    {
+        start = now_ns();
+        if (start >= deadline)
+            break;
+        ts.tv_sec = (time_t)(deadline / 1000000000ULL);
+        ts.tv_nsec = (long)(deadline % 1000000000ULL);
+        pthread_cond_timedwait(&d->filled, &d->lock, &ts);
+    }
+
+    full = d->count >= d->stats.lanes;
+    for (n = 0; n < d->stats.lanes && d->head; n++)
+    {
+        /* marked under the lock, so its waiter does not try to lead again */
+        jobs[n] = d->head;
+        __atomic_store_n(&jobs[n]->state, WORKPOOL_RUNNING, __ATOMIC_RELAXED);
+        d->head = d->head->next;
+    }
+    if (d->head == NULL)
+        d->tail = NULL;
+    d->count -= n;
+
+    start = now_ns();
+    waited = start - d->first_ns;
+    d->first_ns = start;                    /* leftovers have waited since at most now */
+    d->leading = 0;
+    d->stats.jobs += n;
+    d->stats.batches++;
+    d->stats.full_batches += full;
+    d->stats.size_hist[hist_bucket(n)]++;
+    d->stats.wait_ns_total += waited;
+    if (waited > d->stats.wait_ns_max)
+        d->stats.wait_ns_max = waited;
+    adapt(d, n, full);
+    if (d->count)
+        pthread_cond_broadcast(&d->done);   /* a leftover job's thread takes the lead */
+    pthread_mutex_unlock(&d->lock);
+
+    while ((m = workpool_next_group(jobs, n, group)) != 0)
+    {
+        workpool_run_group(group, m);
+        for (j = 0; j < m; j++)
+        {
+            job = group[j];
+            __atomic_store_n(&job->state, WORKPOOL_DONE, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_lock(&d->lock);
+    pthread_cond_broadcast(&d->done);
+}
+
+void dispatcher_run(dispatcher *d, workpool_job *job)
+{
+    job->next = NULL;
+    job->state = WORKPOOL_QUEUED;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail)
+        d->tail->next = job;
+    else
+        d->head = job;
+    d->tail = job;
+    if (d->count++ == 0)
+        d->first_ns = now_ns();
+    if (d->leading && d->count >= d->stats.lanes)
+        pthread_cond_signal(&d->filled);
+
+    while (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != WORKPOOL_DONE)
+    {
+        /* queued jobs and no collector: this thread leads the next batch */
+        if (!d->leading && __atomic_load_n(&job->state, __ATOMIC_RELAXED) == WORKPOOL_QUEUED)
+        {
+            d->leading = 1;
+            lead(d);
+            continue;
+        }
+        pthread_cond_wait(&d->done, &d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+void dispatcher_stats(dispatcher *d, dispatcher_stats_t *stats)
+{
+    pthread_mutex_lock(&d->lock);
+    *stats = d->stats;
+    pthread_mutex_unlock(&d->lock);
+}
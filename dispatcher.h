@@ -0,0 +1,52 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <stddef.h>
+#include "workpool.h"
+
+/*
+   Micro-batching front end for synchronous callers. Threads hand in one
+   job each and block; the first thread to arrive collects the jobs of
+   others until the batch holds lanes jobs or the window closes, then runs
+   them grouped (as the workpool does) and wakes every waiter. Jobs that
+   arrive while a batch runs form the next one.
+
+   The window adapts: it shrinks while batches close with a single job, so
+   a lone caller stops paying for it, and grows back once callers overlap.
+*/
+
+typedef struct dispatcher dispatcher;
+
+#define DISPATCHER_MAX_LANES 64
+#define DISPATCHER_HIST 7
+
+typedef struct {
+    size_t jobs;
+    size_t batches;
+    size_t full_batches;        /* closed because lanes filled up */
+    size_t size_hist[DISPATCHER_HIST];   /* batch sizes 1, 2-3, 4-7, 8-15, 16-31, 32-63, 64 */
+    unsigned long long wait_ns_total;    /* time the oldest job of each batch waited */
+    unsigned long long wait_ns_max;
+    unsigned long window_ns;    /* current window */
+    unsigned long max_window_ns;
+    size_t lanes;
+} dispatcher_stats_t;
+
+/* Create a dispatcher with a window of at most max_window_ns and a batch of at most lanes */
+dispatcher *dispatcher_create(unsigned long max_window_ns, size_t lanes);
+
+void dispatcher_destroy(dispatcher *d);
+
+/* Change the window limit and lane count */
+void dispatcher_configure(dispatcher *d, unsigned long max_window_ns, size_t lanes);
+
+/*
+   Run a job as part of a batch and return once it is done. The job's
+   completion fields are ignored.
+*/
+void dispatcher_run(dispatcher *d, workpool_job *job);
+
+/* Snapshot of the counters */
+void dispatcher_stats(dispatcher *d, dispatcher_stats_t *stats);
+
+#endif /* DISPATCHER_H */
@@ -0,0 +1,256 @@
+#include <string.h>
+#include "envelope.h"
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+    return p;
+}
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* non-zero if any byte of w is '"', '\\', a control character or non-ASCII */
+static uint64_t special_bytes(uint64_t w)
+{
+    uint64_t quote = w ^ (ONES * '"'), slash = w ^ (ONES * '\\');
+
+    return ((quote - ONES) & ~quote) | ((slash - ONES) & ~slash) | ((w - ONES * 0x20) & ~w) | w;
+}
+
+/* p is just past the opening quote; returns the closing quote or NULL */
+static const char *scan_string(const char *p, const char *end, int *escaped)
+{
+    uint64_t w;
+    unsigned char c;
+
+    *escaped = 0;
+    for (;;)
+    {
+        /* skip plain characters a word at a time */
+        while (end - p >= 8)
+        {
+            memcpy(&w, p, 8);
+            if (special_bytes(w) & HIGHS)
+                break;
+            p += 8;
+        }
+        if (p == end)
+            return NULL;
+
+        c = (unsigned char)*p;
+        if (c == '"')
+            return p;
+        if (c < 0x20 || c >= 0x80)
+            return NULL;
+        if (c == '\\')
+        {
+            *escaped = 1;
+            if (++p == end)
+                return NULL;
+        }
+        p++;
+    }
+}
+
+long envelope_parse(const char *text, size_t len, envelope_member *members, size_t max)
+{
+    const char *p = text, *end = text + len, *q;
+    size_t n = 0;
+    int escaped;
+
+    p = skip_space(p, end);
+    if (p == end || *p++ != '{')
+        return -1;
+    p = skip_space(p, end);
+    if (p < end && *p == '}')
+        return skip_space(p + 1, end) == end ? 0 : -1;
+
+    for (;;)
+    {
+        envelope_member *m;
+
+        if (n == max || p == end || *p++ != '"')
+            return -1;
+        m = &members[n++];
+        q = scan_string(p, end, &escaped);
+        if (q == NULL)
+            return -1;
+        m->name = p;
+        m->name_len = (size_t)(q - p);
+        m->name_escaped = escaped;
+
+        p = skip_space(q + 1, end);
+        if (p == end || *p++ != ':')
+            return -1;
+        p = skip_space(p, end);
+        if (p == end)
+            return -1;
+
+        if (*p == '"')
+        {
+            p++;
+            q = scan_string(p, end, &escaped);
+            if (q == NULL)
+                return -1;
+            m->kind = escaped ? ENVELOPE_ESCAPED : ENVELOPE_STRING;
+            m->value = p;
+            m->value_len = (size_t)(q - p);
+            p = q + 1;
+        }
+        else
+        {
+            /* -?(0|[1-9][0-9]*) */
+            q = p;
+            if (q < end && *q == '-')
+                q++;
+            if (q == end || *q < '0' || *q > '9')
+                return -1;
+            if (*q == '0')
+                q++;
+            else
+                while (q < end && *q >= '0' && *q <= '9')
+                    q++;
+            if (q < end && (*q == '.' || *q == 'e' || *q == 'E' || (*q >= '0' && *q <= '9')))
+                return -1;
+            m->kind = ENVELOPE_INTEGER;
+            m->value = p;
+            m->value_len = (size_t)(q - p);
+            p = q;
+        }
+
+        p = skip_space(p, end);
+        if (p == end)
+            return -1;
+        if (*p == '}')
+            break;
+        if (*p++ != ',')
+            return -1;
+        p = skip_space(p, end);
+    }
+    return skip_space(p + 1, end) == end ? (long)n : -1;
+}
+
+static int hex4(const char *s, uint32_t *v)
+{
+    int i;
+
+    *v = 0;
+    for (i = 0; i < 4; i++)
+    {
+        char c = s[i];
+
+        *v <<= 4;
+        if (c >= '0' && c <= '9')
+            *v |= (uint32_t)(c - '0');
+        else if (c >= 'a' && c <= 'f')
+            *v |= (uint32_t)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            *v |= (uint32_t)(c - 'A' + 10);
+        else
+            return -1;
+    }
+    return 0;
+}
+
+long envelope_unescape(const char *s, size_t len, uint32_t *out)
+{
+    const char *end = s + len;
+    long n = 0;
+
+    while (s < end)
+    {
+        uint32_t c = (unsigned char)*s++, lo;
+
+        if (c == '\\')
+        {
+            if (s == end)
+                return -1;
+            switch (*s++)
+            {
+            case '"': c = '"'; break;
+            case '\\': c = '\\'; break;
+            case '/': c = '/'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u':
+                if (end - s < 4 || hex4(s, &c) < 0)
+                    return -1;
+                s += 4;
+                if (c >= 0xdc00 && c <= 0xdfff)
+                    return -1;
+                if (c >= 0xd800 && c <= 0xdbff)
+                {
+                    if (end - s < 6 || s[0] != '\\' || s[1] != 'u' || hex4(s + 2, &lo) < 0 ||
+                        lo < 0xdc00 || lo > 0xdfff)
+                        return -1;
+                    s += 6;
+                    c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                }
+                break;
+            default:
+                return -1;
+            }
+        }
+        out[n++] = c;
+    }
+    return n;
+}
+
+size_t envelope_string_len(const char *s, size_t len)
+{
+    size_t n = len + 2, i;
+
+    for (i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)s[i];
+
+        if (c == '"' || c == '\\' || c == '\b' || c == '\f' || c == '\n' || c == '\r' || c == '\t')
+            n += 1;
+        else if (c < 0x20 || c == 0x7f)
+            n += 5;
+    }
+    return n;
+}
+
+char *envelope_write_string(char *out, const char *s, size_t len)
+{
+    size_t i;
+
+    *out++ = '"';
+    for (i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)s[i];
+
+        if (c >= 0x20 && c != 0x7f && c != '"' && c != '\\')
+        {
+            *out++ = (char)c;
+            continue;
+        }
+        *out++ = '\\';
+        switch (c)
+        {
+        case '"': *out++ = '"'; break;
+        case '\\': *out++ = '\\'; break;
+        case '\b': *out++ = 'b'; break;
+        case '\f': *out++ = 'f'; break;
+        case '\n': *out++ = 'n'; break;
+        case '\r': *out++ = 'r'; break;
+        case '\t': *out++ = 't'; break;
+        default:
+            *out++ = 'u';
+            *out++ = '0';
+            *out++ = '0';
+            *out++ = hex_digits[c >> 4];
+            *out++ = hex_digits[c & 15];
+        }
+    }
+    *out++ = '"';
+    return out;
+}
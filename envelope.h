@@ -0,0 +1,46 @@
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+   Codec for the flat JSON objects used as encryption envelopes: one level
+   of "name": value members whose values are strings or integers. Parsing
+   does not copy; members point into the source text.
+*/
+
+/* Member value kinds */
+#define ENVELOPE_STRING  0      /* string without escapes, value is its contents */
+#define ENVELOPE_ESCAPED 1      /* string with escapes, see envelope_unescape */
+#define ENVELOPE_INTEGER 2      /* integer literal */
+
+typedef struct {
+    const char *name;           /* between the quotes */
+    size_t name_len;
+    int name_escaped;           /* name has escapes, see envelope_unescape */
+    const char *value;          /* between the quotes for strings */
+    size_t value_len;
+    int kind;
+} envelope_member;
+
+/*
+   Split an ASCII text holding one flat object into at most max members.
+   Returns the member count, or -1 if the text is anything else (nesting,
+   floats, literals, non-ASCII bytes, syntax errors).
+*/
+long envelope_parse(const char *text, size_t len, envelope_member *members, size_t max);
+
+/*
+   Decode an ENVELOPE_ESCAPED value into at most len code points of out.
+   Returns the count, or -1 on a malformed escape or lone surrogate.
+*/
+long envelope_unescape(const char *s, size_t len, uint32_t *out);
+
+/* Characters of ASCII s as a JSON string, quotes included */
+size_t envelope_string_len(const char *s, size_t len);
+
+/* Write ASCII s as a JSON string escaped like json.dumps (ensure_ascii); returns the end */
+char *envelope_write_string(char *out, const char *s, size_t len);
+
+#endif /* ENVELOPE_H */
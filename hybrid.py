@@ -6,8 +6,31 @@ import os
 import secrets
 import base64
 import json
+import _twofish
 from .c_multipowerrsa import MultiPowerRSA
 
+# Envelope algorithms: legacy RSA key wrapping and RSA-KEM
+LEGACY_ALGORITHM = "Twofish-MultiPowerRSA"
+KEM_ALGORITHM = "Twofish-MultiPowerRSA-KEM"
+KEM_INFO = b"pangfish hybrid twofish key"
+
+# Tag added by encrypt(..., authenticate=True)
+MAC_ALGORITHM = "HMAC-SHA256"
+MAC_KEY_INFO = b"pangfish hybrid cbc-hmac-sha256 key"
+
+# Envelope fields that hold base64-encoded bytes
+BINARY_FIELDS = ("ciphertext", "iv", "encapsulated_key", "mac")
+
+def _b64decode(value):
+    """Strict native decoding, falling back to base64's lenient rules"""
+    try:
+        return _twofish.b64decode(value)
+    except ValueError:
+        return base64.b64decode(value)
+
+def _raw(value):
+    return value
+
 class HybridCryptosystem:
     def __init__(self):
         """Initialize the hybrid cryptosystem"""
@@ -28,7 +51,7 @@ class HybridCryptosystem:
         self.rsa = MultiPowerRSA(key_size=rsa_key_size, b=b)
         return self.rsa.generate_keys()
     
-    def encrypt(self, plaintext, twofish_key=None, public_key=None):
+    def encrypt(self, plaintext, twofish_key=None, public_key=None, authenticate=False, kem=False):
         """
         Encrypt a message using the hybrid cryptosystem
         
@@ -36,24 +59,46 @@ class HybridCryptosystem:
             plaintext (bytes): Message to encrypt
             twofish_key (bytes, optional): Symmetric key for Twofish (generated if None)
             public_key (bytes, optional): RSA public key
+            authenticate (bool): Add an HMAC-SHA256 tag over the IV and ciphertext
+                ("mac" field) to a legacy envelope. The other fields are
+                unchanged, so readers that do not know the tag can still
+                decrypt. KEM envelopes are always authenticated.
+            kem (bool): Establish the Twofish key with RSA-KEM
+                ("Twofish-MultiPowerRSA-KEM" envelope with an "encapsulated_key"
+                field) instead of encrypting it as an integer. Off by default,
+                since only readers from this version on accept KEM envelopes;
+                it cannot be combined with twofish_key.
             
         Returns:
             dict: Dictionary containing the encrypted data and metadata
         """
-        # Import pangfish here to avoid circular imports
-        from pangfish import Twofish
-        
-        if twofish_key is None:
-            twofish_key = secrets.token_bytes(32)  # 256-bit key
+        return self._encrypt_fields(plaintext, _twofish.b64encode, twofish_key, public_key,
+                                    authenticate, kem)
+    
+    def encrypt_serialized(self, plaintext, twofish_key=None, public_key=None, authenticate=False,
+                           kem=False):
+        """
+        Encrypt a message straight to its JSON envelope
         
-        # Print debug information
-        print(f"Original plaintext length: {len(plaintext)}")
+        Same as serialize_encrypted_data(encrypt(...)), character for
+        character, but the binary fields are base64-encoded directly into
+        the output string.
         
-        # Create Twofish cipher and encrypt the plaintext
-        cipher = Twofish(twofish_key)
-        ciphertext = cipher.encrypt(plaintext, mode='cbc', iv=os.urandom(16))
+        Returns:
+            str: JSON envelope
+        """
+        fields = self._encrypt_fields(plaintext, _raw, twofish_key, public_key, authenticate, kem)
+        return _twofish.envelope_dumps(fields)
+    
+    def _encrypt_fields(self, plaintext, encode, twofish_key, public_key, authenticate, kem):
+        """Envelope dict of encrypt(), with the binary fields passed through encode"""
+        # Import pangfish here to avoid circular imports
+        from pangfish import Twofish
         
-        print(f"Encrypted ciphertext length: {len(ciphertext)}")
+        if kem and twofish_key is not None:
+            raise ValueError("twofish_key cannot be used with kem=True; the KEM generates the key")
+        # KEM envelopes have no unauthenticated readers to stay compatible with
+        authenticate = authenticate or kem
         
         # If public key is not provided, use the one from the object
         if public_key is None:
@@ -65,54 +110,105 @@ class HybridCryptosystem:
         if self.rsa is None:
             self.rsa = MultiPowerRSA()
         
-        # Encrypt the Twofish key with RSA
-        key_int = MultiPowerRSA.bytes_to_int(twofish_key)
-        encrypted_key = self.rsa.encrypt(key_int, public_key)
+        if kem:
+            encapsulated_key, twofish_key = self.rsa.encapsulate(public_key, 32, KEM_INFO)
+        elif twofish_key is None:
+            twofish_key = secrets.token_bytes(32)  # 256-bit key
+        
+        # Create Twofish cipher and encrypt the plaintext
+        cipher = Twofish(twofish_key)
+        tag = None
+        if authenticate:
+            ciphertext, tag = cipher.encrypt_then_mac(plaintext, self._mac_key(twofish_key))
+        else:
+            ciphertext = cipher.encrypt(plaintext, mode='cbc', iv=os.urandom(16))
         
         # Prepare the output format
         # Extract iv from the beginning of ciphertext (first 16 bytes for CBC mode)
         iv = ciphertext[:16]
-        actual_ciphertext = ciphertext[16:]
+        actual_ciphertext = memoryview(ciphertext)[16:]
         
-        result = {
-            "algorithm": "Twofish-MultiPowerRSA",
-            "ciphertext": base64.b64encode(actual_ciphertext).decode('utf-8'),
-            "iv": base64.b64encode(iv).decode('utf-8'),
-            "encrypted_key": encrypted_key
-        }
+        if kem:
+            result = {
+                "algorithm": KEM_ALGORITHM,
+                "ciphertext": encode(actual_ciphertext),
+                "iv": encode(iv),
+                "encapsulated_key": encode(encapsulated_key)
+            }
+        else:
+            # Encrypt the Twofish key with RSA
+            key_int = MultiPowerRSA.bytes_to_int(twofish_key)
+            encrypted_key = self.rsa.encrypt(key_int, public_key)
+            
+            result = {
+                "algorithm": LEGACY_ALGORITHM,
+                "ciphertext": encode(actual_ciphertext),
+                "iv": encode(iv),
+                "encrypted_key": encrypted_key
+            }
+        if tag is not None:
+            result["mac"] = encode(tag)
+            result["mac_algorithm"] = MAC_ALGORITHM
         
         return result
     
-    def decrypt(self, encrypted_data, private_key=None):
+    def decrypt(self, encrypted_data, private_key=None, require_mac=False):
         """
         Decrypt a message using the hybrid cryptosystem
         
         Args:
             encrypted_data (dict): Dictionary containing the encrypted data and metadata
             private_key (bytes, optional): RSA private key
+            require_mac (bool): Reject legacy envelopes without a "mac" field.
+                KEM envelopes always need one, and a tag that is present is
+                always checked.
             
         Returns:
             bytes: Decrypted plaintext
         """
+        return self._decrypt_fields(encrypted_data, _b64decode, private_key, require_mac)
+    
+    def decrypt_serialized(self, json_data, private_key=None, require_mac=False):
+        """
+        Decrypt a JSON envelope
+        
+        Same as decrypt(deserialize_encrypted_data(json_data)), but the
+        binary fields are base64-decoded directly from the JSON text.
+        
+        Returns:
+            bytes: Decrypted plaintext
+        """
+        try:
+            fields = _twofish.envelope_loads(json_data, BINARY_FIELDS)
+        except ValueError:
+            return self.decrypt(json.loads(json_data), private_key, require_mac)
+        return self._decrypt_fields(fields, _raw, private_key, require_mac)
+    
+    def _decrypt_fields(self, encrypted_data, decode, private_key, require_mac):
+        """decrypt() of an envelope whose binary fields are passed through decode"""
         # Import pangfish here to avoid circular imports
         from pangfish import Twofish
         
+        # Check algorithm
+        algorithm = encrypted_data.get("algorithm")
+        if algorithm not in (LEGACY_ALGORITHM, KEM_ALGORITHM):
+            raise ValueError(f"Unsupported algorithm: {algorithm}")
+        
         # Validate input format
-        required_fields = ["algorithm", "ciphertext", "iv", "encrypted_key"]
+        key_field = "encapsulated_key" if algorithm == KEM_ALGORITHM else "encrypted_key"
+        required_fields = ["ciphertext", "iv", key_field]
         if not all(field in encrypted_data for field in required_fields):
             raise ValueError("Invalid encrypted data format")
         
-        # Check algorithm
-        if encrypted_data["algorithm"] != "Twofish-MultiPowerRSA":
-            raise ValueError(f"Unsupported algorithm: {encrypted_data['algorithm']}")
+        if "mac" in encrypted_data:
+            if encrypted_data.get("mac_algorithm", MAC_ALGORITHM) != MAC_ALGORITHM:
+                raise ValueError(f"Unsupported MAC algorithm: {encrypted_data['mac_algorithm']}")
+        elif require_mac or algorithm == KEM_ALGORITHM:
+            raise ValueError("Encrypted data is not authenticated")
         
         # Extract components
-        ciphertext = base64.b64decode(encrypted_data["ciphertext"])
-        iv = base64.b64decode(encrypted_data["iv"])
-        encrypted_key = encrypted_data["encrypted_key"]
-        
-        print(f"Encrypted ciphertext length: {len(ciphertext)}")
-        print(f"IV length: {len(iv)}")
+        ciphertext = decode(encrypted_data["ciphertext"])
+        iv = decode(encrypted_data["iv"])
         
         # If private key is not provided, use the one from the object
         if private_key is None:
@@ -124,9 +220,13 @@ class HybridCryptosystem:
         if self.rsa is None:
             self.rsa = MultiPowerRSA()
         
-        # Decrypt the Twofish key
-        key_int = self.rsa.decrypt(encrypted_key, private_key)
-        twofish_key = MultiPowerRSA.int_to_bytes(key_int)
+        # Recover the Twofish key
+        if algorithm == KEM_ALGORITHM:
+            encapsulated_key = decode(encrypted_data["encapsulated_key"])
+            twofish_key = self.rsa.decapsulate(encapsulated_key, private_key, 32, KEM_INFO)
+        else:
+            key_int = self.rsa.decrypt(encrypted_data["encrypted_key"], private_key)
+            twofish_key = MultiPowerRSA.int_to_bytes(key_int, self._wrapped_key_length(key_int))
         
         # Create Twofish cipher and decrypt the ciphertext
         cipher = Twofish(twofish_key)
@@ -134,17 +234,49 @@ class HybridCryptosystem:
         # Reconstruct the full ciphertext with IV
         full_ciphertext = iv + ciphertext
         
-        # Decrypt the message
-        plaintext = cipher.decrypt(full_ciphertext, mode='cbc', iv=iv)
+        # Decrypt the message, checking the tag first if there is one
+        if "mac" in encrypted_data:
+            tag = decode(encrypted_data["mac"])
+            plaintext = cipher.decrypt_and_verify(full_ciphertext, tag, self._mac_key(twofish_key))
+        else:
+            plaintext = cipher.decrypt(full_ciphertext, mode='cbc', iv=iv)
         
         return plaintext
     
+    @staticmethod
+    def _wrapped_key_length(key_int):
+        """
+        Byte length of a key unwrapped from the legacy format. The integer
+        loses the key's leading zero bytes, so take the smallest Twofish key
+        size it fits in.
+        """
+        length = (key_int.bit_length() + 7) // 8
+        for size in (16, 24, 32):
+            if length <= size:
+                return size
+        return length
+    
+    @staticmethod
+    def _mac_key(twofish_key):
+        """HMAC key for the authenticated format, derived from the Twofish key"""
+        from pangfish import hkdf
+        return hkdf(twofish_key, info=MAC_KEY_INFO, size=32)
+    
     @staticmethod
     def serialize_encrypted_data(encrypted_data):
         """Convert encrypted data dictionary to JSON string"""
+        # the native codec writes what json.dumps would for a flat dict of str/int
+        if type(encrypted_data) is dict:
+            try:
+                return _twofish.envelope_dumps(encrypted_data)
+            except (TypeError, ValueError):
+                pass
         return json.dumps(encrypted_data)
     
     @staticmethod
     def deserialize_encrypted_data(json_data):
         """Convert JSON string to encrypted data dictionary"""
-        return json.loads(json_data)
\ No newline at end of file
+        try:
+            return _twofish.envelope_loads(json_data)
+        except ValueError:
+            return json.loads(json_data)
\ No newline at end of file
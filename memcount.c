@@ -0,0 +1,136 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stddef.h>
+#include <errno.h>
+#include <malloc.h>
+
+/*
+   Allocation counter for the memory benchmark (benchmark.py --memory).
+   Built as a shared library and loaded with LD_PRELOAD, it stands in for
+   the malloc family, passes every call on to glibc, and counts calls and
+   bytes. Live bytes are the usable sizes of the blocks held, so the peak
+   includes allocator rounding. glibc only.
+
+   memcount_read fills stats with: allocations, frees, bytes requested,
+   bytes live, peak bytes live. memcount_reset zeroes the first three and
+   starts a new peak from the current live bytes.
+*/
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+enum { MC_ALLOCS, MC_FREES, MC_BYTES, MC_LIVE, MC_PEAK, MC_FIELDS };
+static unsigned long long counters[MC_FIELDS];
+
+void memcount_read(unsigned long long stats[MC_FIELDS])
+{
+    int i;
+
+    for (i = 0; i < MC_FIELDS; i++)
+        stats[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+}
+
+void memcount_reset(void)
+{
+    __atomic_store_n(&counters[MC_ALLOCS], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&counters[MC_FREES], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&counters[MC_BYTES], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&counters[MC_PEAK], __atomic_load_n(&counters[MC_LIVE], __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+static void count_alloc(void *ptr, size_t size)
+{
+    unsigned long long live, peak;
+
+    if (ptr == NULL)
+        return;
+    __atomic_add_fetch(&counters[MC_ALLOCS], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counters[MC_BYTES], size, __ATOMIC_RELAXED);
+    live = __atomic_add_fetch(&counters[MC_LIVE], malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&counters[MC_PEAK], __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&counters[MC_PEAK], &peak, live, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void count_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    __atomic_add_fetch(&counters[MC_FREES], 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&counters[MC_LIVE], malloc_usable_size(ptr), __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+
+    count_alloc(ptr, size);
+    return ptr;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *ptr = __libc_calloc(n, size);
+
+    count_alloc(ptr, n * size);
+    return ptr;
+}
+
+/*
+   A resize counts as freeing the old block and allocating the new one.
+   realloc(ptr, 0) frees ptr and may return NULL, so that still counts
+   as the free; any other NULL leaves ptr alone.
+*/
+void *realloc(void *ptr, size_t size)
+{
+    size_t old = ptr != NULL ? malloc_usable_size(ptr) : 0;
+    void *fresh = __libc_realloc(ptr, size);
+
+    if (fresh == NULL && size != 0)
+        return NULL;
+    if (ptr != NULL)
+    {
+        __atomic_add_fetch(&counters[MC_FREES], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&counters[MC_LIVE], old, __ATOMIC_RELAXED);
+    }
+    count_alloc(fresh, size);
+    return fresh;
+}
+
+void free(void *ptr)
+{
+    count_free(ptr);
+    __libc_free(ptr);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    void *ptr = __libc_memalign(align, size);
+
+    count_alloc(ptr, size);
+    return ptr;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+int posix_memalign(void **out, size_t align, size_t size)
+{
+    void *ptr;
+
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+        return EINVAL;
+    ptr = memalign(align, size);
+    if (ptr == NULL && size != 0)
+        return ENOMEM;
+    *out = ptr;
+    return 0;
+}
@@ -3,10 +3,143 @@
 #include <string.h>
 #include <time.h>
 #include <gmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <sys/random.h>   /* getentropy */
+#endif
 #include "multipowerrsa.h"
+#include "secure_pool.h"
+#include "sha256.h"
+
+/*
+   While a secure scope is open, GMP allocations on that thread come from the
+   locked secure pool, so private-key limbs never reach swap or core dumps.
+   The hooks route frees and reallocs by ownership, so limbs from either side
+   can be released from anywhere. A pool block never moves back to the heap.
+*/
+static __thread int secure_depth;
+static pthread_once_t gmp_hooks_once = PTHREAD_ONCE_INIT;
+
+/*
+   Allocation counters for mp_rsa_alloc_stats, in the sizes GMP reports.
+   They stay off, at the cost of one relaxed load per hook, until the first
+   mp_rsa_alloc_stats_reset, so the RSA workers do not share their line.
+*/
+static mp_rsa_alloc_stats_t gmp_counts;
+static int gmp_counting;
+
+static int counting_gmp(void) {
+    return __atomic_load_n(&gmp_counting, __ATOMIC_RELAXED);
+}
+
+static void count_gmp(size_t *field, size_t add, size_t freed) {
+    ptrdiff_t live, peak;
+    
+    __atomic_add_fetch(field, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&gmp_counts.bytes, add, __ATOMIC_RELAXED);
+    live = __atomic_add_fetch(&gmp_counts.live, (ptrdiff_t)add - (ptrdiff_t)freed, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&gmp_counts.peak, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&gmp_counts.peak, &peak, live, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void mp_rsa_alloc_stats(mp_rsa_alloc_stats_t *stats) {
+    stats->allocs = __atomic_load_n(&gmp_counts.allocs, __ATOMIC_RELAXED);
+    stats->reallocs = __atomic_load_n(&gmp_counts.reallocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&gmp_counts.frees, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&gmp_counts.bytes, __ATOMIC_RELAXED);
+    stats->live = __atomic_load_n(&gmp_counts.live, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&gmp_counts.peak, __ATOMIC_RELAXED);
+}
+
+void mp_rsa_alloc_stats_reset(void) {
+    __atomic_store_n(&gmp_counts.allocs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&gmp_counts.reallocs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&gmp_counts.frees, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&gmp_counts.bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&gmp_counts.peak, __atomic_load_n(&gmp_counts.live, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&gmp_counting, 1, __ATOMIC_RELAXED);
+}
+
+static void *gmp_secure_alloc(size_t size) {
+    void *ptr = secure_depth ? secure_alloc(size) : malloc(size);
+    
+    if (ptr == NULL) {
+        fprintf(stderr, "multipowerrsa: out of memory allocating %zu bytes\n", size);
+        abort(); /* GMP has no way to report allocation failure */
+    }
+    if (counting_gmp())
+        count_gmp(&gmp_counts.allocs, size, 0);
+    return ptr;
+}
+
+static void *gmp_secure_realloc(void *ptr, size_t old_size, size_t new_size) {
+    void *fresh;
+    
+    if (secure_owns(ptr)) {
+        fresh = secure_realloc(ptr, new_size);
+    } else if (secure_depth) {
+        /* heap limbs growing inside a secure scope move into the pool */
+        fresh = secure_alloc(new_size);
+        if (fresh != NULL) {
+            memcpy(fresh, ptr, old_size < new_size ? old_size : new_size);
+            secure_zero(ptr, old_size);
+            free(ptr);
+        }
+    } else {
+        fresh = realloc(ptr, new_size);
+    }
+    
+    if (fresh == NULL) {
+        fprintf(stderr, "multipowerrsa: out of memory allocating %zu bytes\n", new_size);
+        abort();
+    }
+    if (counting_gmp())
+        count_gmp(&gmp_counts.reallocs, new_size, old_size);
+    return fresh;
+}
+
+static void gmp_secure_free(void *ptr, size_t size) {
+    if (counting_gmp()) {
+        __atomic_add_fetch(&gmp_counts.frees, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&gmp_counts.live, (ptrdiff_t)size, __ATOMIC_RELAXED);
+    }
+    if (secure_owns(ptr))
+        secure_free(ptr);
+    else
+        free(ptr);
+}
+
+static void install_gmp_hooks(void) {
+    mp_set_memory_functions(gmp_secure_alloc, gmp_secure_realloc, gmp_secure_free);
+}
+
+void mp_rsa_secure_begin(void) {
+    pthread_once(&gmp_hooks_once, install_gmp_hooks);
+    secure_depth++;
+}
+
+void mp_rsa_secure_end(void) {
+    secure_depth--;
+}
+
+void mp_rsa_free_str(char *str) {
+    void (*free_func)(void *, size_t);
+    
+    if (str == NULL)
+        return;
+    mp_get_memory_functions(NULL, NULL, &free_func);
+    free_func(str, strlen(str) + 1);
+}
 
 /* Initialize a Multi-Power RSA context */
 void mp_rsa_init(mp_rsa_ctx *ctx, unsigned int key_size, unsigned int b) {
+    /* install the pool-aware hooks before the context owns any limbs */
+    pthread_once(&gmp_hooks_once, install_gmp_hooks);
+    
     ctx->key_size = key_size;
     ctx->b = b;
     
@@ -59,6 +192,8 @@ int mp_rsa_generate_keys(mp_rsa_ctx *ctx) {
     gmp_randstate_t state;
     mpz_t p_minus_1, q_minus_1, gcd_value, temp;
     
+    mp_rsa_secure_begin();
+    
     /* Initialize random state */
     gmp_randinit_default(state);
     gmp_randseed_ui(state, time(NULL));
@@ -113,6 +248,7 @@ int mp_rsa_generate_keys(mp_rsa_ctx *ctx) {
     mpz_clear(temp);
     gmp_randclear(state);
     
+    mp_rsa_secure_end();
     return 0;
 }
 
@@ -134,6 +270,8 @@ int mp_rsa_decrypt(mp_rsa_ctx *ctx, const mpz_t cipher, mpz_t message) {
     mpz_t m1, m2, m_prime1, error, correction, inverse, p_power_i, temp;
     int result = 0;
     
+    mp_rsa_secure_begin();
+    
     mpz_init(m1);
     mpz_init(m2);
     mpz_init(m_prime1);
@@ -180,10 +318,11 @@ int mp_rsa_decrypt(mp_rsa_ctx *ctx, const mpz_t cipher, mpz_t message) {
             mpz_mod(temp, temp, ctx->p);
             mpz_invert(inverse, temp, ctx->p);
             
-            /* Adjust m_prime1 */
+            /* Adjust m_prime1 by (correction / f'(m)) * p^i */
             mpz_mul(temp, correction, inverse);
             mpz_mod(temp, temp, ctx->p);
-            mpz_mul(temp, temp, p_power_i);
+            mpz_pow_ui(correction, ctx->p, i);
+            mpz_mul(temp, temp, correction);
             mpz_sub(m_prime1, m_prime1, temp);
             mpz_mod(m_prime1, m_prime1, p_power_i);
         }
@@ -229,6 +368,7 @@ cleanup:
     mpz_clear(p_power_i);
     mpz_clear(temp);
     
+    mp_rsa_secure_end();
     return result;
 }
 
@@ -253,8 +393,8 @@ int mp_rsa_export_public_key(mp_rsa_ctx *ctx, unsigned char **key, size_t *key_l
     snprintf((char*)*key, *key_len, "%s:%s", n_str, e_str);
     
     // Free temporary strings
-    free(n_str);
-    free(e_str);
+    mp_rsa_free_str(n_str);
+    mp_rsa_free_str(e_str);
     
     return 0;
 }
@@ -275,6 +415,8 @@ int mp_rsa_export_private_key(mp_rsa_ctx *ctx, unsigned char **key, size_t *key_
         return -1;
     }
     
+    mp_rsa_secure_begin();
+    
     // Format key as "p:q:r1:r2:b"
     char *p_str = mpz_get_str(NULL, 16, ctx->p);
     char *q_str = mpz_get_str(NULL, 16, ctx->q);
@@ -284,12 +426,13 @@ int mp_rsa_export_private_key(mp_rsa_ctx *ctx, unsigned char **key, size_t *key_
     snprintf((char*)*key, *key_len, "%s:%s:%s:%s:%u", 
              p_str, q_str, r1_str, r2_str, ctx->b);
     
-    // Free temporary strings
-    free(p_str);
-    free(q_str);
-    free(r1_str);
-    free(r2_str);
+    // Free temporary strings (zeroized by the pool)
+    mp_rsa_free_str(p_str);
+    mp_rsa_free_str(q_str);
+    mp_rsa_free_str(r1_str);
+    mp_rsa_free_str(r2_str);
     
+    mp_rsa_secure_end();
     return 0;
 }
 
@@ -327,6 +470,7 @@ int mp_rsa_import_private_key(mp_rsa_ctx *ctx, const unsigned char *key, size_t
     if (key_copy == NULL) {
         return -1;
     }
+    size_t copy_len = strlen(key_copy);
     
     // Parse "p:q:r1:r2:b" format
     char *q_str = strchr(key_copy, ':');
@@ -366,10 +510,13 @@ int mp_rsa_import_private_key(mp_rsa_ctx *ctx, const unsigned char *key, size_t
     b_str++;
     
     // Import the values
+    mp_rsa_secure_begin();
     if (mpz_set_str(ctx->p, key_copy, 16) != 0 ||
         mpz_set_str(ctx->q, q_str, 16) != 0 ||
         mpz_set_str(ctx->r1, r1_str, 16) != 0 ||
         mpz_set_str(ctx->r2, r2_str, 16) != 0) {
+        mp_rsa_secure_end();
+        secure_zero(key_copy, copy_len);
         free(key_copy);
         return -3;
     }
@@ -381,7 +528,146 @@ int mp_rsa_import_private_key(mp_rsa_ctx *ctx, const unsigned char *key, size_t
     
     // Calculate n = p^(b-1) * q
     mpz_mul(ctx->n, ctx->p_power, ctx->q);
+    mp_rsa_secure_end();
     
+    secure_zero(key_copy, copy_len);
     free(key_copy);
     return 0;
+}
+
+/* Fill buf from the kernel's CSPRNG; getentropy takes at most 256 bytes a call */
+static int random_bytes(unsigned char *buf, size_t len) {
+    size_t n;
+    
+    while (len) {
+        n = len < 256 ? len : 256;
+        if (getentropy(buf, n) != 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Bytes in the fixed-width encoding of integers mod n */
+size_t mp_rsa_modulus_bytes(const mp_rsa_ctx *ctx) {
+    return (mpz_sizeinbase(ctx->n, 2) + 7) / 8;
+}
+
+/* Big-endian encoding of x in exactly len bytes (x < 256^len) */
+static void encode_fixed(const mpz_t x, unsigned char *out, size_t len) {
+    size_t count = (mpz_sizeinbase(x, 2) + 7) / 8;
+    
+    memset(out, 0, len);
+    if (mpz_sgn(x) != 0)
+        mpz_export(out + len - count, NULL, 1, 1, 1, 0, x);
+}
+
+/* KEM key from the encoded secret: HKDF-SHA256 with the ciphertext as salt */
+static int kem_kdf(const unsigned char *z, const unsigned char *enc, size_t len,
+                   const unsigned char *info, size_t info_len, unsigned char *key, size_t key_len) {
+    unsigned char prk[SHA256_DIGEST_SIZE];
+    int rc;
+    
+    hkdf_sha256_extract(enc, len, z, len, prk);
+    rc = hkdf_sha256_expand(prk, info, info_len, key, key_len);
+    secure_zero(prk, sizeof(prk));
+    return rc;
+}
+
+/* RSA-KEM encapsulation */
+int mp_rsa_kem_encapsulate(mp_rsa_ctx *ctx, const unsigned char *info, size_t info_len,
+                           unsigned char *enc, unsigned char *key, size_t key_len) {
+    size_t len = mp_rsa_modulus_bytes(ctx);
+    unsigned char *z;
+    mpz_t r, c;
+    int rc = -1;
+    
+    if (len == 0 || key_len > 255 * SHA256_DIGEST_SIZE)
+        return -1;
+    
+    mp_rsa_secure_begin();
+    z = secure_alloc(len);
+    mpz_init(r);
+    mpz_init(c);
+    if (z == NULL)
+        goto done;
+    
+    /* rejection sampling gives r uniform in [2, n) */
+    do {
+        if (random_bytes(z, len) != 0)
+            goto done;
+        z[0] &= (unsigned char)(0xff >> (8 * len - mpz_sizeinbase(ctx->n, 2)));
+        mpz_import(r, len, 1, 1, 1, 0, z);
+    } while (mpz_cmp_ui(r, 2) < 0 || mpz_cmp(r, ctx->n) >= 0);
+    
+    mpz_powm(c, r, ctx->e, ctx->n);
+    encode_fixed(c, enc, len);
+    rc = kem_kdf(z, enc, len, info, info_len, key, key_len);
+    
+done:
+    mpz_clear(r);
+    mpz_clear(c);
+    secure_free(z);
+    mp_rsa_secure_end();
+    return rc;
+}
+
+/* RSA-KEM decapsulation */
+int mp_rsa_kem_decapsulate(mp_rsa_ctx *ctx, const unsigned char *enc, size_t enc_len,
+                           const unsigned char *info, size_t info_len,
+                           unsigned char *key, size_t key_len) {
+    size_t len = mp_rsa_modulus_bytes(ctx);
+    unsigned char *z;
+    mpz_t r, c;
+    int rc = -1;
+    
+    if (len == 0 || enc_len != len || key_len > 255 * SHA256_DIGEST_SIZE)
+        return -1;
+    
+    mp_rsa_secure_begin();
+    z = secure_alloc(len);
+    mpz_init(r);
+    mpz_init(c);
+    mpz_import(c, len, 1, 1, 1, 0, enc);
+    if (z != NULL && mp_rsa_decrypt(ctx, c, r) == 0) {
+        encode_fixed(r, z, len);
+        rc = kem_kdf(z, enc, len, info, info_len, key, key_len);
+    }
+    mpz_clear(r);
+    mpz_clear(c);
+    secure_free(z);
+    mp_rsa_secure_end();
+    return rc;
+}
+
+static void run_decrypt_batch(workpool_job **jobs, size_t n) {
+    size_t i;
+
+    mp_rsa_secure_begin();
+    for (i = 0; i < n; i++) {
+        mp_rsa_job *job = (mp_rsa_job *)jobs[i];
+        job->status = mp_rsa_decrypt(job->ctx, job->cipher, job->message);
+    }
+    mp_rsa_secure_end();
+}
+
+static void run_decrypt(workpool_job *job) {
+    run_decrypt_batch(&job, 1);
+}
+
+void mp_rsa_job_init(mp_rsa_job *job, mp_rsa_ctx *ctx) {
+    memset(&job->base, 0, sizeof(job->base));
+    job->base.run = run_decrypt;
+    job->base.run_batch = run_decrypt_batch;
+    job->base.group = ctx;
+    job->ctx = ctx;
+    job->status = 0;
+    mpz_init(job->cipher);
+    mpz_init(job->message);
+}
+
+void mp_rsa_job_clear(mp_rsa_job *job) {
+    mpz_clear(job->cipher);
+    mpz_clear(job->message);
 }
\ No newline at end of file
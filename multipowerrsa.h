@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <gmp.h>
+#include "workpool.h"
 
 /* Multi-Power RSA context */
 typedef struct {
@@ -46,4 +47,69 @@ int mp_rsa_import_public_key(mp_rsa_ctx *ctx, const unsigned char *key, size_t k
 /* Import private key from memory */
 int mp_rsa_import_private_key(mp_rsa_ctx *ctx, const unsigned char *key, size_t key_len);
 
+/* Bytes in the fixed-width big-endian encoding of integers mod n */
+size_t mp_rsa_modulus_bytes(const mp_rsa_ctx *ctx);
+
+/*
+   RSA-KEM. Encapsulation draws a uniformly random r in [2, n) and writes
+   r^e mod n to enc, mp_rsa_modulus_bytes(ctx) bytes. The key is
+   HKDF-SHA256 of r's fixed-width encoding, salted with enc and expanded
+   with info to key_len bytes. The secret r only exists in the secure pool.
+   Both return 0, or -1 on a bad length or a failed decryption.
+*/
+int mp_rsa_kem_encapsulate(mp_rsa_ctx *ctx, const unsigned char *info, size_t info_len,
+                           unsigned char *enc, unsigned char *key, size_t key_len);
+int mp_rsa_kem_decapsulate(mp_rsa_ctx *ctx, const unsigned char *enc, size_t enc_len,
+                           const unsigned char *info, size_t info_len,
+                           unsigned char *key, size_t key_len);
+
+/* Open a scope in which GMP allocations on this thread come from the secure pool */
+void mp_rsa_secure_begin(void);
+
+/* Close the innermost secure scope */
+void mp_rsa_secure_end(void);
+
+/* Release a string returned by mpz_get_str(NULL, ...) */
+void mp_rsa_free_str(char *str);
+
+/*
+   GMP allocation counters, kept by the memory hooks from the first
+   mp_rsa_alloc_stats_reset on; until then they cost nothing. bytes totals
+   the sizes requested by allocs and reallocs; live and peak are in the
+   sizes GMP reports, pool and heap together, counted from that first
+   reset, so they go negative as blocks allocated before it are freed.
+*/
+typedef struct {
+    size_t allocs;
+    size_t reallocs;
+    size_t frees;
+    size_t bytes;
+    ptrdiff_t live;
+    ptrdiff_t peak;
+} mp_rsa_alloc_stats_t;
+
+/* Read the counters */
+void mp_rsa_alloc_stats(mp_rsa_alloc_stats_t *stats);
+
+/* Zero the counts and start a new peak from the bytes now live */
+void mp_rsa_alloc_stats_reset(void);
+
+/*
+   Decryption (key unwrap) job for the workpool engine. Jobs under the same
+   context run as one batch inside a single secure scope.
+*/
+typedef struct {
+    workpool_job base;      /* first, so a delivered workpool_job * converts back */
+    mp_rsa_ctx *ctx;
+    mpz_t cipher;           /* set by the caller before submitting */
+    mpz_t message;
+    int status;             /* result of mp_rsa_decrypt */
+} mp_rsa_job;
+
+/* Prepare a job for ctx, initialising cipher and message */
+void mp_rsa_job_init(mp_rsa_job *job, mp_rsa_ctx *ctx);
+
+/* Release the job's integers */
+void mp_rsa_job_clear(mp_rsa_job *job);
+
 #endif /* MULTIPOWERRSA_H */
\ No newline at end of file
@@ -3,17 +3,70 @@ Python wrapper for Pangfish encryption algorithms.
 This module includes Twofish encryption and a hybrid cryptosystem with Multi-Power RSA.
 """
 
+import os
+import hmac
+import struct
 import hashlib
+import _twofish
 from _twofish import Twofish as _Twofish
+from _twofish import Keyring, KeyManager, CMAC, SIV, HCTR2, MappedFile, Ring, numa_nodes
+from _twofish import key_cache_configure, key_cache_clear, key_cache_stats, bulk_config
+from _twofish import hkdf_sha256, hkdf_sha256_batch, sha256_backend, simd_backend, polyval_backend
+from _twofish import shuffle_backend
 from .hybrid import HybridCryptosystem
 from .c_multipowerrsa import MultiPowerRSA
+from . import aio
 
 def derive_key(key_material, size=16):
-    """Convert any input to a valid key of specified size (16, 24, or 32 bytes)"""
+    """
+    Convert any input to a valid key of specified size (16, 24, or 32 bytes).
+
+    Legacy: a truncated SHA-256, kept so existing auto_derive keys still match.
+    New code should use hkdf() or derive_keys().
+    """
     if isinstance(key_material, str):
         key_material = key_material.encode('utf-8')
     return hashlib.sha256(key_material).digest()[:size]
 
+def _as_bytes(value):
+    return value.encode('utf-8') if isinstance(value, str) else value
+
+def hkdf(key_material, info=b'', size=32, salt=None):
+    """
+    Derive a key with HKDF-SHA256 (RFC 5869).
+
+    Args:
+        key_material (bytes or str): Input key material
+        info (bytes or str): Context the key is bound to
+        size (int): Output length in bytes (up to 8160)
+        salt (bytes, optional): Extract salt; defaults to 32 zero bytes
+
+    Returns:
+        bytes: The derived key
+    """
+    return hkdf_sha256(_as_bytes(key_material), _as_bytes(info), size, salt)
+
+def derive_keys(master, infos, size=16, salt=None):
+    """
+    Derive one HKDF-SHA256 subkey of a master key per context, in native code.
+
+    To key Twofish contexts without creating the subkeys as Python objects,
+    use Keyring.derive(master, infos, salt, size) instead.
+
+    Args:
+        master (bytes or str): Master key
+        infos (sequence): Per-subkey contexts (bytes or str)
+        size (int): Subkey length in bytes
+        salt (bytes, optional): Extract salt
+
+    Returns:
+        list: The subkeys, in the order of infos
+    """
+    return hkdf_sha256_batch(_as_bytes(master), infos, size, salt)
+
+# Modes without padding, handled natively: name -> CFB segment size in bits
+_STREAM_MODES = {'cfb': 128, 'cfb8': 8, 'ofb': 128}
+
 class Twofish:
     """
     Pangfish block cipher implementation.
@@ -22,13 +75,18 @@ class Twofish:
     and key sizes up to 256 bits.
     """
     
-    def __init__(self, key, auto_derive=False):
+    def __init__(self, key, auto_derive=False, numa_replicate=False, promote_after=8):
         """
         Initialize Pangfish cipher with the given key.
         
         Args:
             key (bytes or str): Key for Pangfish (16, 24, or 32 bytes for 128, 192, or 256 bits)
             auto_derive (bool): Automatically derive a valid key from any input using SHA-256
+            numa_replicate (bool): Keep a copy of the key schedule on every NUMA node and
+                use the one local to the calling thread
+            promote_after (int): Encrypt up to this many single blocks from the cheaper
+                partially keyed schedule before building the full one; any multi-block
+                operation builds it at once. 0 builds it when the key is set
         """
         if isinstance(key, str):
             key = key.encode('utf-8')
@@ -50,7 +108,7 @@ class Twofish:
             raise ValueError("Key size must be 16, 24, or 32 bytes (128, 192, or 256 bits). "
                             "Use auto_derive=True to automatically create a valid key.")
             
-        self._cipher = _Twofish(key)
+        self._cipher = _Twofish(key, numa_replicate=numa_replicate, promote_after=promote_after)
     
     def encrypt_block(self, data):
         """
@@ -92,22 +150,16 @@ class Twofish:
         if not isinstance(data, bytes):
             raise TypeError("Data must be bytes")
         
-        original_length = len(data)
-        
-        # Always pad to full 16-byte blocks
-        if padding:
-            pad_length = 16 - (original_length % 16)
-            if pad_length == 0:
-                pad_length = 16
-            data = data + bytes([pad_length]) * pad_length
-        
-        result = bytearray()
+        # Stream modes: no padding, IV prepended to the ciphertext
+        if mode.lower() in _STREAM_MODES:
+            if iv is None:
+                iv = os.urandom(16)
+            if len(iv) != 16:
+                raise ValueError("IV must be 16 bytes for %s mode" % mode.upper())
+            return iv + self._stream(mode.lower(), True, data, iv)
         
         if mode.lower() == 'ecb':
-            for i in range(0, len(data), 16):
-                block = data[i:i+16]
-                encrypted_block = self.encrypt_block(block)
-                result.extend(encrypted_block)
+            return self._cipher.ecb_encrypt(data, padding)
         
         elif mode.lower() == 'cbc':
             if iv is None:
@@ -116,57 +168,195 @@ class Twofish:
             if len(iv) != 16:
                 raise ValueError("IV must be 16 bytes for CBC mode")
             
-            result.extend(iv)
-            prev_block = iv
-            
-            for i in range(0, len(data), 16):
-                block = data[i:i+16]
-                xored = bytes(a ^ b for a, b in zip(block, prev_block))
-                encrypted_block = self.encrypt_block(xored)
-                result.extend(encrypted_block)
-                prev_block = encrypted_block
+            return iv + self._cipher.cbc_encrypt(data, iv, padding)
         
-        return bytes(result)
+        return b''
 
     def decrypt(self, data, mode='ecb', iv=None, padding=True):
         if not isinstance(data, bytes):
             raise TypeError("Data must be bytes")
         
+        # Stream modes: any length; the IV leads the data unless given separately
+        if mode.lower() in _STREAM_MODES:
+            if iv is None:
+                if len(data) < 16:
+                    raise ValueError("%s mode requires at least 16 bytes for IV" % mode.upper())
+                iv, data = data[:16], data[16:]
+            if len(iv) != 16:
+                raise ValueError("IV must be 16 bytes for %s mode" % mode.upper())
+            return self._stream(mode.lower(), False, data, iv)
+        
         if len(data) == 0 or len(data) % 16 != 0:
             raise ValueError("Encrypted data length must be a non-zero multiple of 16 bytes")
         
-        result = bytearray()
-        
         if mode.lower() == 'ecb':
-            for i in range(0, len(data), 16):
-                block = data[i:i+16]
-                decrypted_block = self.decrypt_block(block)
-                result.extend(decrypted_block)
+            return self._cipher.ecb_decrypt(data, padding)
         
         elif mode.lower() == 'cbc':
             if len(data) < 16:
                 raise ValueError("CBC mode requires at least 16 bytes for IV")
             
-            iv = data[:16]
-            data = data[16:]
-            
-            prev_block = iv
-            
-            for i in range(0, len(data), 16):
-                block = data[i:i+16]
-                decrypted_block = self.decrypt_block(block)
-                xored = bytes(a ^ b for a, b in zip(decrypted_block, prev_block))
-                result.extend(xored)
-                prev_block = block
+            return self._cipher.cbc_decrypt(data[16:], data[:16], padding)
         
-        # Remove padding if requested
-        if padding and result:
-            pad_length = result[-1]
-            if 0 < pad_length <= 16:
-                if all(x == pad_length for x in result[-pad_length:]):
-                    result = result[:-pad_length]
+        return b''
+
+    def encrypt_then_mac(self, data, mac_key, iv=None):
+        """
+        Encrypt data in CBC mode with padding and authenticate it with HMAC-SHA256.
+
+        The ciphertext is the same as encrypt(data, mode='cbc', iv=iv), so it
+        can still be read by code that ignores the tag. Encryption and MAC run
+        as one pass in native code.
+
+        Args:
+            data (bytes): Data to encrypt
+            mac_key (bytes): HMAC key, independent of the cipher key
+            iv (bytes, optional): 16-byte IV; random if not given
+
+        Returns:
+            tuple: (IV followed by the ciphertext, 32-byte tag over both)
+        """
+        if not isinstance(data, bytes):
+            raise TypeError("Data must be bytes")
+        if iv is None:
+            iv = os.urandom(16)
+        if len(iv) != 16:
+            raise ValueError("IV must be 16 bytes for CBC mode")
+        ciphertext, tag = self._cipher.cbc_hmac_encrypt(data, iv, _as_bytes(mac_key))
+        return iv + ciphertext, tag
+
+    def decrypt_and_verify(self, data, tag, mac_key):
+        """
+        Check the tag of encrypt_then_mac output and decrypt it.
+
+        The MAC is checked while the data is decrypted; nothing is returned
+        unless it matches.
+
+        Args:
+            data (bytes): IV followed by the ciphertext
+            tag (bytes): 32-byte tag
+            mac_key (bytes): HMAC key
+
+        Returns:
+            bytes: Decrypted data with the padding removed
+
+        Raises:
+            ValueError: If the tag does not match
+        """
+        if not isinstance(data, bytes):
+            raise TypeError("Data must be bytes")
+        if len(data) < 16:
+            raise ValueError("CBC mode requires at least 16 bytes for IV")
+        return self._cipher.cbc_hmac_decrypt(data[16:], data[:16], tag, _as_bytes(mac_key))
+
+    def _stream(self, mode, encrypt, data, iv):
+        if mode == 'ofb':
+            return self._cipher.ofb(data, iv)
+        segment_bits = _STREAM_MODES[mode]
+        if encrypt:
+            return self._cipher.cfb_encrypt(data, iv, segment_bits)
+        return self._cipher.cfb_decrypt(data, iv, segment_bits)
+
+    async def seal_async(self, data, iv=None):
+        """
+        Encrypt data in CBC mode with padding on the native worker pool.
+
+        The result is the same as encrypt(data, mode='cbc', iv=iv), but the
+        event loop is never blocked and no executor thread is involved.
+
+        Args:
+            data (bytes): Data to encrypt
+            iv (bytes, optional): 16-byte IV; random if not given
+
+        Returns:
+            bytes: IV followed by the ciphertext
+        """
+        if not isinstance(data, bytes):
+            raise TypeError("Data must be bytes")
+        if iv is None:
+            iv = os.urandom(16)
+        return await aio.submit(_twofish, self._cipher.submit_seal, data, iv)
+
+    async def open_async(self, data):
+        """
+        Decrypt the output of seal_async (or encrypt in CBC mode) on the native worker pool.
+
+        Args:
+            data (bytes): IV followed by the ciphertext
+
+        Returns:
+            bytes: Decrypted data with the padding removed
+        """
+        if not isinstance(data, bytes):
+            raise TypeError("Data must be bytes")
+        return await aio.submit(_twofish, self._cipher.submit_open, data)
+
+    def seal_batched(self, data, iv=None):
+        """
+        Same result as seal_async, for threaded callers.
+
+        Concurrent calls from many threads are collected for a few microseconds
+        and run as one batch with the GIL released; see
+        _twofish.configure_dispatcher and _twofish.dispatcher_stats.
+        """
+        if not isinstance(data, bytes):
+            raise TypeError("Data must be bytes")
+        if iv is None:
+            iv = os.urandom(16)
+        return self._cipher.seal_batched(data, iv)
+
+    def open_batched(self, data):
+        """Same result as open_async, batched with concurrent callers like seal_batched."""
+        if not isinstance(data, bytes):
+            raise TypeError("Data must be bytes")
+        return self._cipher.open_batched(data)
+
+class FPE(_twofish.FPE):
+    """
+    Format-preserving encryption (FF1 or FF3-1 of NIST SP 800-38G) over Twofish.
+    
+    FPE(key, mode='ff1', radix=10, alphabet=None) encrypts strings over the
+    alphabet (by default the first radix characters of 0-9a-z) to strings of
+    the same length. FF1 takes a tweak of any length, FF3-1 one of 7 bytes.
+    Besides encrypt/decrypt and their _batch forms for lists of str, whole
+    numpy columns go through encrypt_array and decrypt_array, which need the
+    numpy extra (pip install pangfish[numpy]).
+    """
+    
+    def encrypt_array(self, values, tweak=b''):
+        """
+        Encrypt a numpy array (or anything numpy.asarray accepts, such as a
+        pandas column) of str or bytes values under one tweak.
         
-        return bytes(result)
+        Returns:
+            numpy.ndarray: The ciphertexts, with the shape and kind of dtype of values
+        """
+        return _fpe_array(values, tweak, self.encrypt_column)
+    
+    def decrypt_array(self, values, tweak=b''):
+        """Decrypt the output of encrypt_array."""
+        return _fpe_array(values, tweak, self.decrypt_column)
+
+def _fpe_array(values, tweak, crypt):
+    # the values cross into C as one buffer of fixed-width, NUL-padded slots
+    import numpy
+    array = numpy.ascontiguousarray(values)
+    kind = array.dtype.kind
+    if kind == 'S':
+        raw = array
+    elif kind == 'U':
+        raw = array.astype('S%d' % max(array.dtype.itemsize // 4, 1))
+    elif kind == 'O':
+        raw = array.astype('S')
+    else:
+        raise TypeError("FPE arrays must hold str or bytes values")
+    width = raw.dtype.itemsize
+    out = numpy.frombuffer(crypt(raw, width, tweak), dtype=raw.dtype).reshape(array.shape)
+    if kind == 'U':
+        return out.astype(array.dtype)
+    if kind == 'O':
+        return out.astype('U').astype(object)
+    return out
 
 # Utility functions
 def new(key, auto_derive=False):
@@ -182,6 +372,72 @@ def new(key, auto_derive=False):
     """
     return Twofish(key, auto_derive)
 
+# Encrypted file read by mmap_decrypt: header, then the data in CTR mode.
+# The header carries an HMAC so that a wrong key is reported; the data is
+# not authenticated, since pages are decrypted independently.
+_FILE_MAGIC = b'PFCTR\x00\x00\x01'
+_FILE_HEADER = struct.Struct('>8sQ16s16s')     # magic, length, counter, check
+_FILE_CHECK_INFO = b'pangfish encrypted file header'
+_FILE_CHUNK = 1 << 20
+
+def _file_check(key, length, counter):
+    mac_key = hkdf(key, info=_FILE_CHECK_INFO, size=32)
+    message = _FILE_MAGIC + length.to_bytes(8, 'big') + counter
+    return hmac.new(mac_key, message, hashlib.sha256).digest()[:16]
+
+def encrypt_file(path, data, key):
+    """
+    Write data to path encrypted for mmap_decrypt.
+    
+    Args:
+        path (str): File to create or overwrite
+        data (bytes-like): Plaintext
+        key (bytes or str): Twofish key (16, 24, or 32 bytes)
+    """
+    key = _as_bytes(key)
+    cipher = Twofish(key)
+    data = memoryview(data).cast('B')
+    counter = os.urandom(16)
+    start = int.from_bytes(counter, 'big')
+    
+    with open(path, 'wb') as f:
+        f.write(_FILE_HEADER.pack(_FILE_MAGIC, len(data), counter,
+                                  _file_check(key, len(data), counter)))
+        for pos in range(0, len(data), _FILE_CHUNK):
+            block_counter = ((start + pos // 16) % (1 << 128)).to_bytes(16, 'big')
+            f.write(cipher._cipher.ctr(data[pos:pos + _FILE_CHUNK], block_counter))
+
+def mmap_decrypt(path, key, readahead=65536):
+    """
+    Map a file written by encrypt_file as a read-only buffer of its plaintext.
+    
+    Pages are decrypted when first touched, with up to readahead following
+    bytes, so only the parts of the file that are read cost anything. The
+    kernel may drop decrypted pages under memory pressure; they are decrypted
+    again when touched. Where userfaultfd is not available (see the "lazy"
+    entry of stats()) the whole file is decrypted up front instead.
+    
+    Args:
+        path (str): Encrypted file
+        key (bytes or str): Key given to encrypt_file
+        readahead (int): Bytes decrypted ahead of a faulting page
+    
+    Returns:
+        MappedFile: Buffer-protocol object; use memoryview() on it, and
+        close() it (or use it as a context manager) once no views remain
+    """
+    key = _as_bytes(key)
+    cipher = Twofish(key)
+    
+    with open(path, 'rb') as f:
+        header = f.read(_FILE_HEADER.size)
+        if len(header) != _FILE_HEADER.size or header[:8] != _FILE_MAGIC:
+            raise ValueError("Not a pangfish encrypted file")
+        _, length, counter, check = _FILE_HEADER.unpack(header)
+        if not hmac.compare_digest(check, _file_check(key, length, counter)):
+            raise ValueError("Wrong key or corrupted file header")
+        return MappedFile(cipher._cipher, f.fileno(), _FILE_HEADER.size, length, counter, readahead)
+
 def new_hybrid_cryptosystem():
     """
     Create a new hybrid cryptosystem using Twofish and Multi-Power RSA.
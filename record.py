@@ -0,0 +1,352 @@
+"""
+Encrypted record layer for asyncio streams.
+
+RecordProtocol sits between a transport (usually TCP) and an application
+protocol. What the application writes during one event loop iteration is
+coalesced and sealed into records with Twofish-SIV; records received are
+opened in place in a reusable buffer and passed on as plaintext. The
+application sees an ordinary transport and the usual protocol callbacks.
+
+A record is a 5-byte header (type, ciphertext length), the ciphertext and
+a 16-byte tag. The header and a per-direction sequence number are the
+associated data, so records cannot be altered, replayed, reordered or
+dropped unnoticed, and a stream that ends without a close record is
+reported as truncated.
+"""
+
+import os
+import struct
+import asyncio
+from _twofish import SIV, hkdf_sha256
+
+RECORD_DATA = 0
+RECORD_CLOSE = 1
+
+# Largest plaintext in one record; both ends must agree on it
+MAX_RECORD = 16384
+
+_HEADER = struct.Struct('>BI')
+_SEQ = struct.Struct('>Q')
+_TAG = 16
+
+# one key per direction, so a record cannot be reflected back to its sender
+_KEY_INFO = {True: b'pangfish record initiator to responder',
+             False: b'pangfish record responder to initiator'}
+
+try:
+    _IOV_MAX = os.sysconf('SC_IOV_MAX')
+except (AttributeError, ValueError, OSError):
+    _IOV_MAX = 16
+_IOV_MAX -= _IOV_MAX % 3    # whole records per writev
+
+class RecordError(ConnectionError):
+    """A record failed to authenticate, or the stream was cut short"""
+
+class _RecordTransport(asyncio.Transport):
+    """Transport handed to the application protocol"""
+
+    def __init__(self, layer):
+        super().__init__()
+        self._layer = layer
+
+    def write(self, data):
+        self._layer._write(data)
+
+    def writelines(self, list_of_data):
+        for data in list_of_data:
+            self._layer._write(data)
+
+    def write_eof(self):
+        self._layer._write_eof()
+
+    def can_write_eof(self):
+        return True
+
+    def close(self):
+        self._layer._close()
+
+    def abort(self):
+        self._layer._abort()
+
+    def is_closing(self):
+        return self._layer._closing
+
+    def get_extra_info(self, name, default=None):
+        return self._layer._transport.get_extra_info(name, default)
+
+    def pause_reading(self):
+        self._layer._transport.pause_reading()
+
+    def resume_reading(self):
+        self._layer._transport.resume_reading()
+
+    def is_reading(self):
+        return self._layer._transport.is_reading()
+
+    def set_write_buffer_limits(self, high=None, low=None):
+        self._layer._transport.set_write_buffer_limits(high, low)
+
+    def get_write_buffer_size(self):
+        return self._layer._pending_size + self._layer._transport.get_write_buffer_size()
+
+    def get_write_buffer_limits(self):
+        return self._layer._transport.get_write_buffer_limits()
+
+    def set_protocol(self, protocol):
+        self._layer._set_app(protocol)
+
+    def get_protocol(self):
+        return self._layer._app
+
+class RecordProtocol(asyncio.BufferedProtocol):
+    """
+    Protocol that encrypts the stream of an application protocol.
+
+    Args:
+        app_protocol (asyncio.Protocol): Protocol receiving the plaintext; a
+            BufferedProtocol gets it copied straight into its own buffers
+        key (bytes): Shared secret, at least 16 bytes; the per-direction SIV
+            keys are derived from it with HKDF
+        initiator (bool): True on the connecting side, False on the other
+        max_record (int): Largest plaintext per record
+    """
+
+    def __init__(self, app_protocol, key, initiator, max_record=MAX_RECORD):
+        if len(key) < 16:
+            raise ValueError("Record layer key must be at least 16 bytes")
+        if not 0 < max_record < 1 << 32:
+            raise ValueError("max_record must be between 1 and 2**32 - 1")
+        self._set_app(app_protocol)
+        self._sealer = SIV(hkdf_sha256(key, _KEY_INFO[bool(initiator)], 64))
+        self._opener = SIV(hkdf_sha256(key, _KEY_INFO[not initiator], 64))
+        self._max_record = max_record
+        self._send_seq = 0
+        self._recv_seq = 0
+
+        # plaintext written since the last flush
+        self._pending = []
+        self._pending_size = 0
+        self._flush_handle = None
+        self._send_buf = bytearray()
+
+        # records are received and opened in place here
+        self._recv_buf = bytearray(_HEADER.size + max_record + _TAG)
+        self._recv_start = 0
+        self._recv_end = 0
+
+        self._transport = None
+        self._fd = None
+        self._closing = False
+        self._eof_sent = False
+        self._peer_closed = False
+        self._error = None
+
+    def _set_app(self, protocol):
+        self._app = protocol
+        self._app_buffered = isinstance(protocol, asyncio.BufferedProtocol)
+
+    # Underlying transport
+
+    def connection_made(self, transport):
+        self._transport = transport
+        sock = transport.get_extra_info('socket')
+        # records go out with one writev when nothing is queued ahead of them
+        if (hasattr(os, 'writev') and sock is not None and
+                transport.get_extra_info('sslcontext') is None):
+            self._fd = sock.fileno()
+        self._app.connection_made(_RecordTransport(self))
+
+    def connection_lost(self, exc):
+        if self._flush_handle is not None:
+            self._flush_handle.cancel()
+            self._flush_handle = None
+        self._closing = True
+        self._fd = None
+        self._app.connection_lost(self._error or exc)
+
+    def pause_writing(self):
+        self._app.pause_writing()
+
+    def resume_writing(self):
+        self._app.resume_writing()
+
+    def get_buffer(self, sizehint):
+        buf = self._recv_buf
+        start, end = self._recv_start, self._recv_end
+        needed = _HEADER.size
+        if end - start >= _HEADER.size:
+            needed += _HEADER.unpack_from(buf, start)[1] + _TAG
+
+        # move a partial record to the front only when the rest would not fit
+        if start == end:
+            self._recv_start = self._recv_end = 0
+        elif start and len(buf) - start < needed:
+            buf[:end - start] = buf[start:end]
+            self._recv_start, self._recv_end = 0, end - start
+        return memoryview(buf)[self._recv_end:]
+
+    def buffer_updated(self, nbytes):
+        self._recv_end += nbytes
+        buf = self._recv_buf
+        with memoryview(buf) as view:
+            while self._error is None and not self._peer_closed:
+                start = self._recv_start
+                if self._recv_end - start < _HEADER.size:
+                    break
+                rtype, length = _HEADER.unpack_from(buf, start)
+                if rtype not in (RECORD_DATA, RECORD_CLOSE) or length > self._max_record:
+                    self._fatal(RecordError("malformed record header"))
+                    break
+                body = start + _HEADER.size
+                end = body + length + _TAG
+                if self._recv_end < end:
+                    break
+
+                data = view[body:body + length]
+                ad = (view[start:body], _SEQ.pack(self._recv_seq))
+                try:
+                    self._opener.open_into(data, view[body + length:end], data, ad)
+                except ValueError:
+                    self._fatal(RecordError("record authentication failed"))
+                    break
+                self._recv_seq += 1
+                self._recv_start = end
+
+                if rtype == RECORD_CLOSE:
+                    self._peer_closed = True
+                    if not self._app.eof_received():
+                        self._close()
+                elif length:
+                    self._deliver(data)
+
+        if self._peer_closed or self._error is not None:
+            # nothing may follow a close record; drop it so the buffer never fills
+            self._recv_start = self._recv_end = 0
+
+    def _deliver(self, data):
+        if not self._app_buffered:
+            self._app.data_received(bytes(data))
+            return
+        while data:
+            buf = self._app.get_buffer(len(data))
+            n = min(len(buf), len(data))
+            buf[:n] = data[:n]
+            self._app.buffer_updated(n)
+            data = data[n:]
+
+    def eof_received(self):
+        if not self._peer_closed and self._error is None:
+            self._fatal(RecordError("connection closed without a close record"))
+        return False
+
+    def _fatal(self, exc):
+        self._error = exc
+        self._abort()
+
+    # Application transport
+
+    def _write(self, data):
+        if self._eof_sent:
+            raise RuntimeError("Cannot call write() after write_eof()")
+        if not data:
+            return
+        if not isinstance(data, bytes):
+            data = bytes(data)
+        self._pending.append(data)
+        self._pending_size += len(data)
+        if self._pending_size >= self._max_record:
+            self._flush()
+        elif self._flush_handle is None:
+            self._flush_handle = asyncio.get_running_loop().call_soon(self._flush)
+
+    def _flush(self):
+        if self._flush_handle is not None:
+            self._flush_handle.cancel()
+            self._flush_handle = None
+        if not self._pending or self._transport is None:
+            return
+        data = self._pending[0] if len(self._pending) == 1 else b''.join(self._pending)
+        self._pending = []
+        self._pending_size = 0
+
+        # ciphertexts back to back in the send buffer, headers and tags apart
+        if len(self._send_buf) < len(data):
+            self._send_buf = bytearray(len(data))
+        iov = []
+        with memoryview(data) as plain, memoryview(self._send_buf) as out:
+            for pos in range(0, len(data), self._max_record):
+                n = min(self._max_record, len(data) - pos)
+                iov += self._seal(RECORD_DATA, plain[pos:pos + n], out[pos:pos + n])
+            self._send(iov)
+            del iov
+
+    def _seal(self, rtype, plain, out):
+        header = _HEADER.pack(rtype, len(plain))
+        tag = self._sealer.seal_into(plain, out, (header, _SEQ.pack(self._send_seq)))
+        self._send_seq += 1
+        return [header, out, tag]
+
+    def _send(self, iov):
+        transport = self._transport
+        if self._fd is not None and not transport.get_write_buffer_size():
+            done = 0    # parts written in full
+            while done < len(iov):
+                try:
+                    sent = os.writev(self._fd, iov[done:done + _IOV_MAX])
+                except (BlockingIOError, InterruptedError):
+                    break
+                except OSError:
+                    break   # the transport runs into it again and reports it
+                for part in iov[done:done + _IOV_MAX]:
+                    if sent < len(part):
+                        break
+                    sent -= len(part)
+                    done += 1
+                else:
+                    continue
+                iov[done] = iov[done][sent:]
+                break
+            iov = iov[done:]
+        if iov:
+            # the socket is backed up: queue a copy of whatever it did not take
+            transport.write(b''.join(iov))
+
+    def _write_eof(self):
+        if self._eof_sent:
+            return
+        self._flush()
+        self._eof_sent = True
+        if self._transport is not None and not self._transport.is_closing():
+            self._send(self._seal(RECORD_CLOSE, b'', bytearray()))
+            if self._transport.can_write_eof():
+                self._transport.write_eof()
+
+    def _close(self):
+        if self._closing:
+            return
+        self._write_eof()
+        self._closing = True
+        if self._transport is not None:
+            self._transport.close()
+
+    def _abort(self):
+        self._closing = True
+        self._pending = []
+        self._pending_size = 0
+        if self._transport is not None:
+            self._transport.abort()
+
+def protocol_factory(app_factory, key, initiator, max_record=MAX_RECORD):
+    """
+    Wrap a protocol factory for loop.create_connection or loop.create_server.
+
+    Args:
+        app_factory (callable): Returns the application protocol
+        key (bytes): Shared secret, as for RecordProtocol
+        initiator (bool): True for the connecting side
+        max_record (int): Largest plaintext per record
+
+    Returns:
+        callable: Factory of RecordProtocol instances
+    """
+    return lambda: RecordProtocol(app_factory(), key, initiator, max_record)
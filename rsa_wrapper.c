@@ -1,6 +1,9 @@
 #include <Python.h>
 #include <time.h>
 #include "multipowerrsa.h"
+#include "secure_pool.h"
+#include "workpool.h"
+#include "dispatcher.h"
 
 /* Python module for Multi-Power RSA */
 
@@ -95,7 +98,10 @@ MPRSA_generate_keys(MPRSAObject *self, PyObject *Py_UNUSED(ignored))
     
 cleanup:
     if (pub_key_bytes) free(pub_key_bytes);
-    if (priv_key_bytes) free(priv_key_bytes);
+    if (priv_key_bytes) {
+        secure_zero(priv_key_bytes, priv_key_len);
+        free(priv_key_bytes);
+    }
     Py_XDECREF(public_key);
     Py_XDECREF(private_key);
     
@@ -190,7 +196,7 @@ MPRSA_encrypt(MPRSAObject *self, PyObject *args, PyObject *kwds)
     PyObject *result = PyUnicode_FromString(cipher_str);
     
     // Clean up
-    free(cipher_str);
+    mp_rsa_free_str(cipher_str);
     mpz_clear(message);
     mpz_clear(cipher);
     if (public_key_obj && public_key_obj != Py_None) {
@@ -281,7 +287,7 @@ MPRSA_decrypt(MPRSAObject *self, PyObject *args, PyObject *kwds)
     result = PyLong_FromString(message_str, NULL, 10);
     
     // Clean up
-    free(message_str);
+    mp_rsa_free_str(message_str);
     mpz_clear(cipher);
     mpz_clear(message);
     if (private_key_obj && private_key_obj != Py_None) {
@@ -291,9 +297,318 @@ MPRSA_decrypt(MPRSAObject *self, PyObject *args, PyObject *kwds)
     return result;
 }
 
+/* RSA-KEM */
+
+/* context for an optional key argument: self's own, or the key imported into temp */
+static mp_rsa_ctx *
+MPRSA_key_ctx(MPRSAObject *self, PyObject *key_obj, int private_key, mp_rsa_ctx *temp)
+{
+    int result;
+    
+    if (key_obj == NULL || key_obj == Py_None)
+        return &self->ctx;
+    if (!PyBytes_Check(key_obj)) {
+        PyErr_SetString(PyExc_TypeError, private_key ? "Private key must be bytes" : "Public key must be bytes");
+        return NULL;
+    }
+    
+    mp_rsa_init(temp, self->ctx.key_size, self->ctx.b);
+    if (private_key)
+        result = mp_rsa_import_private_key(temp, (unsigned char *)PyBytes_AS_STRING(key_obj),
+                                           PyBytes_GET_SIZE(key_obj));
+    else
+        result = mp_rsa_import_public_key(temp, (unsigned char *)PyBytes_AS_STRING(key_obj),
+                                          PyBytes_GET_SIZE(key_obj));
+    if (result != 0) {
+        PyErr_SetString(PyExc_ValueError, private_key ? "Invalid private key format" : "Invalid public key format");
+        mp_rsa_clear(temp);
+        return NULL;
+    }
+    return temp;
+}
+
+static PyObject *
+MPRSA_kem_encapsulate(MPRSAObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *public_key_obj = NULL, *enc, *key;
+    Py_buffer info = {NULL};
+    Py_ssize_t key_len = 32;
+    mp_rsa_ctx temp_ctx, *ctx;
+    int result;
+    static char *kwlist[] = {"public_key", "key_len", "info", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Ony*", kwlist, &public_key_obj, &key_len, &info))
+        return NULL;
+    
+    if (key_len < 1 || key_len > 255 * 32) {
+        PyErr_SetString(PyExc_ValueError, "key_len must be between 1 and 8160");
+        PyBuffer_Release(&info);
+        return NULL;
+    }
+    
+    ctx = MPRSA_key_ctx(self, public_key_obj, 0, &temp_ctx);
+    if (ctx == NULL) {
+        PyBuffer_Release(&info);
+        return NULL;
+    }
+    
+    enc = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)mp_rsa_modulus_bytes(ctx));
+    key = PyBytes_FromStringAndSize(NULL, key_len);
+    if (enc == NULL || key == NULL) {
+        result = -2;
+    }
+    else {
+        Py_BEGIN_ALLOW_THREADS
+        result = mp_rsa_kem_encapsulate(ctx, info.buf, info.buf ? (size_t)info.len : 0,
+                                        (unsigned char *)PyBytes_AS_STRING(enc),
+                                        (unsigned char *)PyBytes_AS_STRING(key), (size_t)key_len);
+        Py_END_ALLOW_THREADS
+    }
+    
+    if (ctx == &temp_ctx)
+        mp_rsa_clear(&temp_ctx);
+    PyBuffer_Release(&info);
+    if (result != 0) {
+        if (result == -1)
+            PyErr_SetString(PyExc_ValueError, "Encapsulation failed: no public key");
+        Py_XDECREF(enc);
+        Py_XDECREF(key);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", enc, key);
+}
+
+static PyObject *
+MPRSA_kem_decapsulate(MPRSAObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *private_key_obj = NULL, *key;
+    Py_buffer enc, info = {NULL};
+    Py_ssize_t key_len = 32;
+    mp_rsa_ctx temp_ctx, *ctx;
+    int result;
+    static char *kwlist[] = {"enc", "private_key", "key_len", "info", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|Ony*", kwlist, &enc, &private_key_obj,
+                                     &key_len, &info))
+        return NULL;
+    
+    if (key_len < 1 || key_len > 255 * 32) {
+        PyErr_SetString(PyExc_ValueError, "key_len must be between 1 and 8160");
+        PyBuffer_Release(&enc);
+        PyBuffer_Release(&info);
+        return NULL;
+    }
+    
+    ctx = MPRSA_key_ctx(self, private_key_obj, 1, &temp_ctx);
+    key = ctx ? PyBytes_FromStringAndSize(NULL, key_len) : NULL;
+    if (key == NULL) {
+        if (ctx == &temp_ctx)
+            mp_rsa_clear(&temp_ctx);
+        PyBuffer_Release(&enc);
+        PyBuffer_Release(&info);
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    result = mp_rsa_kem_decapsulate(ctx, enc.buf, (size_t)enc.len,
+                                    info.buf, info.buf ? (size_t)info.len : 0,
+                                    (unsigned char *)PyBytes_AS_STRING(key), (size_t)key_len);
+    Py_END_ALLOW_THREADS
+    
+    if (ctx == &temp_ctx)
+        mp_rsa_clear(&temp_ctx);
+    PyBuffer_Release(&enc);
+    PyBuffer_Release(&info);
+    if (result != 0) {
+        PyErr_SetString(PyExc_ValueError, "Decapsulation failed: wrong ciphertext length for this key");
+        Py_DECREF(key);
+        return NULL;
+    }
+    return key;
+}
+
 /* Forward declaration for the method table */
 static PyObject *MPRSA_decrypt_to_bytes(MPRSAObject *self, PyObject *args, PyObject *kwds);
 
+/* Asynchronous decryption on the worker pool */
+
+typedef struct {
+    mp_rsa_job job;         /* first, so a reaped workpool_job * converts back */
+    PyObject *owner;        /* MPRSA object, kept alive until reaped */
+    PyObject *future;       /* handed back by reap() */
+    mp_rsa_ctx *key;        /* imported private key, or NULL for the owner's */
+} DecryptJob;
+
+static workpool *pool = NULL;
+
+/* start the pool on first use; the GIL serialises this */
+static workpool *
+get_pool(void)
+{
+    if (pool == NULL) {
+        pool = workpool_create(0);
+        if (pool == NULL)
+            PyErr_SetString(PyExc_RuntimeError, "Could not start the worker pool");
+    }
+    return pool;
+}
+
+static void
+DecryptJob_free(DecryptJob *job)
+{
+    if (job->key) {
+        mp_rsa_clear(job->key);
+        PyMem_Free(job->key);
+    }
+    mp_rsa_job_clear(&job->job);
+    Py_XDECREF(job->future);
+    Py_XDECREF(job->owner);
+    PyMem_Free(job);
+}
+
+/*
+   Fill a job from (cipher, private_key or None); the job must have been set
+   up with mp_rsa_job_init on the object's own context.
+*/
+static int
+DecryptJob_parse(DecryptJob *job, MPRSAObject *self, PyObject *cipher_obj, PyObject *private_key_obj)
+{
+    PyObject *str_obj;
+    
+    if (!PyUnicode_Check(cipher_obj) && !PyLong_Check(cipher_obj)) {
+        PyErr_SetString(PyExc_TypeError, "Cipher must be a string or integer");
+        return -1;
+    }
+    if (private_key_obj != Py_None && !PyBytes_Check(private_key_obj)) {
+        PyErr_SetString(PyExc_TypeError, "Private key must be bytes");
+        return -1;
+    }
+    
+    str_obj = PyObject_Str(cipher_obj);
+    if (str_obj == NULL)
+        return -1;
+    mpz_set_str(job->job.cipher, PyUnicode_AsUTF8(str_obj), 10);
+    Py_DECREF(str_obj);
+    
+    if (private_key_obj != Py_None) {
+        job->key = PyMem_Malloc(sizeof(mp_rsa_ctx));
+        if (job->key == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        mp_rsa_init(job->key, self->ctx.key_size, self->ctx.b);
+        if (mp_rsa_import_private_key(job->key, (unsigned char *)PyBytes_AS_STRING(private_key_obj),
+                                      PyBytes_GET_SIZE(private_key_obj)) != 0) {
+            PyErr_SetString(PyExc_ValueError, "Invalid private key format");
+            return -1;
+        }
+        /* run and batch the job under the imported key instead */
+        job->job.ctx = job->key;
+        job->job.base.group = job->key;
+    }
+    return 0;
+}
+
+/* the decrypted message of a finished job, or a ValueError */
+static PyObject *
+DecryptJob_result(DecryptJob *job, int raise)
+{
+    char *message_str;
+    PyObject *value;
+    
+    if (job->job.status != 0) {
+        if (raise) {
+            PyErr_SetString(PyExc_ValueError, "Decryption failed");
+            return NULL;
+        }
+        return PyObject_CallFunction(PyExc_ValueError, "s", "Decryption failed");
+    }
+    message_str = mpz_get_str(NULL, 10, job->job.message);
+    value = PyLong_FromString(message_str, NULL, 10);
+    mp_rsa_free_str(message_str);
+    return value;
+}
+
+static PyObject *
+MPRSA_submit_decrypt(MPRSAObject *self, PyObject *args)
+{
+    PyObject *cipher_obj, *private_key_obj, *future;
+    DecryptJob *job;
+    workpool *wp;
+    
+    if (!PyArg_ParseTuple(args, "OOO", &cipher_obj, &private_key_obj, &future))
+        return NULL;
+    if ((wp = get_pool()) == NULL)
+        return NULL;
+    
+    job = PyMem_Calloc(1, sizeof(DecryptJob));
+    if (job == NULL)
+        return PyErr_NoMemory();
+    mp_rsa_job_init(&job->job, &self->ctx);
+    if (DecryptJob_parse(job, self, cipher_obj, private_key_obj) < 0) {
+        DecryptJob_free(job);
+        return NULL;
+    }
+    
+    Py_INCREF(self);
+    job->owner = (PyObject *)self;
+    Py_INCREF(future);
+    job->future = future;
+    
+    if (workpool_submit(wp, &job->job.base) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Worker pool is shut down");
+        DecryptJob_free(job);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* Micro-batched synchronous decryption through the dispatcher */
+
+static dispatcher *batcher = NULL;
+
+static dispatcher *
+get_batcher(void)
+{
+    if (batcher == NULL) {
+        batcher = dispatcher_create(20000, 4);
+        if (batcher == NULL)
+            PyErr_NoMemory();
+    }
+    return batcher;
+}
+
+static PyObject *
+MPRSA_decrypt_batched(MPRSAObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *cipher_obj, *private_key_obj = Py_None, *result;
+    DecryptJob *job;
+    dispatcher *d;
+    static char *kwlist[] = {"cipher", "private_key", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &cipher_obj, &private_key_obj))
+        return NULL;
+    if ((d = get_batcher()) == NULL)
+        return NULL;
+    
+    job = PyMem_Calloc(1, sizeof(DecryptJob));
+    if (job == NULL)
+        return PyErr_NoMemory();
+    mp_rsa_job_init(&job->job, &self->ctx);
+    if (DecryptJob_parse(job, self, cipher_obj, private_key_obj) < 0) {
+        DecryptJob_free(job);
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    dispatcher_run(d, &job->job.base);
+    Py_END_ALLOW_THREADS
+    
+    result = DecryptJob_result(job, 1);
+    DecryptJob_free(job);
+    return result;
+}
+
 static PyMethodDef MPRSA_methods[] = {
     {"generate_keys", (PyCFunction)MPRSA_generate_keys, METH_NOARGS,
      "Generate a new Multi-Power RSA key pair"},
@@ -303,6 +618,14 @@ static PyMethodDef MPRSA_methods[] = {
      "Decrypt a message using the private key and return as integer"},
     {"decrypt_to_bytes", (PyCFunction)MPRSA_decrypt_to_bytes, METH_VARARGS | METH_KEYWORDS,
      "Decrypt a message using the private key and return as bytes"},
+    {"kem_encapsulate", (PyCFunction)MPRSA_kem_encapsulate, METH_VARARGS | METH_KEYWORDS,
+     "RSA-KEM: (public_key=None, key_len=32, info=b'') -> (encapsulated key, derived key)"},
+    {"kem_decapsulate", (PyCFunction)MPRSA_kem_decapsulate, METH_VARARGS | METH_KEYWORDS,
+     "RSA-KEM: (enc, private_key=None, key_len=32, info=b'') -> derived key"},
+    {"submit_decrypt", (PyCFunction)MPRSA_submit_decrypt, METH_VARARGS,
+     "Queue a decryption (cipher, private_key or None, future) on the worker pool"},
+    {"decrypt_batched", (PyCFunction)MPRSA_decrypt_batched, METH_VARARGS | METH_KEYWORDS,
+     "Decrypt to an integer, batched with concurrent callers under the same key"},
     {NULL}  /* Sentinel */
 };
 
@@ -319,11 +642,137 @@ static PyTypeObject MPRSAType = {
     .tp_methods = MPRSA_methods,
 };
 
+static PyObject *
+module_completion_fd(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    workpool *wp = get_pool();
+    
+    if (wp == NULL)
+        return NULL;
+    return PyLong_FromLong(workpool_fd(wp));
+}
+
+static PyObject *
+module_reap(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    workpool_job *base, *next;
+    PyObject *list, *item, *value;
+    
+    list = PyList_New(0);
+    if (list == NULL || pool == NULL)
+        return list;
+    
+    /* every reaped job is released, even if building the list fails */
+    for (base = workpool_reap(pool); base != NULL; base = next) {
+        DecryptJob *job = (DecryptJob *)base;
+        
+        next = base->next;
+        if (list != NULL) {
+            value = DecryptJob_result(job, 0);
+            item = value ? Py_BuildValue("(OOO)", job->future, job->job.status == 0 ? Py_True : Py_False, value) : NULL;
+            if (item == NULL || PyList_Append(list, item) < 0)
+                Py_CLEAR(list);
+            Py_XDECREF(item);
+            Py_XDECREF(value);
+        }
+        DecryptJob_free(job);
+    }
+    return list;
+}
+
+static PyObject *
+module_dispatcher_stats(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    dispatcher_stats_t stats;
+    PyObject *hist;
+    dispatcher *d = get_batcher();
+    int i;
+    
+    if (d == NULL)
+        return NULL;
+    dispatcher_stats(d, &stats);
+    hist = PyList_New(DISPATCHER_HIST);
+    if (hist == NULL)
+        return NULL;
+    for (i = 0; i < DISPATCHER_HIST; i++)
+        PyList_SET_ITEM(hist, i, PyLong_FromSize_t(stats.size_hist[i]));
+    return Py_BuildValue("{s:n,s:n,s:n,s:N,s:d,s:d,s:d,s:d,s:n}",
+                         "jobs", (Py_ssize_t)stats.jobs,
+                         "batches", (Py_ssize_t)stats.batches,
+                         "full_batches", (Py_ssize_t)stats.full_batches,
+                         "batch_size_hist", hist,
+                         "mean_batch", stats.batches ? (double)stats.jobs / stats.batches : 0.0,
+                         "mean_wait_us", stats.batches ? stats.wait_ns_total / 1e3 / stats.batches : 0.0,
+                         "max_wait_us", stats.wait_ns_max / 1e3,
+                         "window_us", stats.window_ns / 1e3,
+                         "lanes", (Py_ssize_t)stats.lanes);
+}
+
+static PyObject *
+module_gmp_alloc_stats(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    mp_rsa_alloc_stats_t stats;
+    
+    mp_rsa_alloc_stats(&stats);
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n}",
+                         "allocs", (Py_ssize_t)stats.allocs,
+                         "reallocs", (Py_ssize_t)stats.reallocs,
+                         "frees", (Py_ssize_t)stats.frees,
+                         "bytes", (Py_ssize_t)stats.bytes,
+                         "live", (Py_ssize_t)stats.live,
+                         "peak", (Py_ssize_t)stats.peak);
+}
+
+static PyObject *
+module_gmp_alloc_stats_reset(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    mp_rsa_alloc_stats_reset();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+module_configure_dispatcher(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    double window_us = 20.0;
+    Py_ssize_t lanes = 4;
+    dispatcher *d = get_batcher();
+    
+    static char *kwlist[] = {"window_us", "lanes", NULL};
+
+    if (d == NULL)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dn", kwlist, &window_us, &lanes))
+        return NULL;
+    if (window_us < 0 || lanes < 1 || lanes > DISPATCHER_MAX_LANES) {
+        PyErr_SetString(PyExc_ValueError, "window_us must be >= 0 and lanes between 1 and 64");
+        return NULL;
+    }
+    dispatcher_configure(d, (unsigned long)(window_us * 1000), (size_t)lanes);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+    {"completion_fd", (PyCFunction)module_completion_fd, METH_NOARGS,
+     "Descriptor that becomes readable when queued jobs have completed"},
+    {"reap", (PyCFunction)module_reap, METH_NOARGS,
+     "List of (future, ok, result) for every completed job"},
+    {"dispatcher_stats", (PyCFunction)module_dispatcher_stats, METH_NOARGS,
+     "Batch-size and wait-time metrics of the micro-batching dispatcher"},
+    {"configure_dispatcher", (PyCFunction)module_configure_dispatcher, METH_VARARGS | METH_KEYWORDS,
+     "Set the dispatcher's maximum window (microseconds) and lanes per batch"},
+    {"gmp_alloc_stats", (PyCFunction)module_gmp_alloc_stats, METH_NOARGS,
+     "GMP allocation counts, bytes requested, and live and peak bytes, kept from the first gmp_alloc_stats_reset"},
+    {"gmp_alloc_stats_reset", (PyCFunction)module_gmp_alloc_stats_reset, METH_NOARGS,
+     "Zero the GMP allocation counts and restart the peak"},
+    {NULL}  /* Sentinel */
+};
+
 static PyModuleDef multipowerrsamodule = {
     PyModuleDef_HEAD_INIT,
     .m_name = "_multipowerrsa",
     .m_doc = "Multi-Power RSA encryption module implemented in C",
     .m_size = -1,
+    .m_methods = module_methods,
 };
 
 PyMODINIT_FUNC
@@ -0,0 +1,498 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "secure_pool.h"
+#include "simd_util.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
+
+#define SLAB_SIZE   (64 * 1024)
+#define ARENA_SLABS 16
+#define ARENA_SIZE  (SLAB_SIZE * ARENA_SLABS)
+#define ARENA_BLOCK 256     /* arena descriptors per table block */
+#define MAX_BLOCKS  4096    /* table blocks, 1 TiB of arenas in all */
+#define LARGE_MAGIC 0x5345435552454C47ULL  /* "SECURELG" */
+
+#define ROUND_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/*
+   chunk sizes; 4352 fits a cache-line header plus a TWOFISH_CTX, as
+   twofish_ctx_alloc lays it out, and 8192 a TWOFISH_ADAPTIVE
+*/
+static const size_t class_size[] = { 16, 32, 64, 128, 256, 512, 1024, 2048, 4352, 8192 };
+#define NUM_CLASSES (sizeof(class_size) / sizeof(class_size[0]))
+
+void secure_zero(void *ptr, size_t len)
+{
+    simd_zero(ptr, len);
+}
+
+#ifdef HAVE_MMAP
+
+/* a freed chunk links to the next free chunk of its class */
+typedef struct free_chunk {
+    struct free_chunk *next;
+} free_chunk;
+
+typedef struct {
+    unsigned char *base;                 /* first slab, after the guard page */
+    signed char slab_class[ARENA_SLABS]; /* -1 while unassigned */
+    int slabs_used;
+} arena_t;
+
+/* header at the start of a dedicated mapping for large blocks */
+typedef struct large_block {
+    uint64_t magic;
+    size_t map_len;
+    size_t size;
+    unsigned char *map;
+    struct large_block *next;
+} large_block;
+
+#define LARGE_HDR 64
+
+/*
+   Arena descriptors live in blocks that are allocated as the pool grows
+   and never move, so lookups can walk them without the lock.
+*/
+static arena_t *arena_table[MAX_BLOCKS];
+static int num_arenas;   /* only grows; read without the lock */
+#define ARENA(i) (&arena_table[(i) / ARENA_BLOCK][(i) % ARENA_BLOCK])
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static free_chunk *free_list[NUM_CLASSES];
+static pthread_mutex_t class_lock[NUM_CLASSES] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER
+};
+
+/*
+   Per-thread cache of free chunks so the common alloc/free pair takes no
+   lock; it is handed back to the shared lists when the thread exits.
+*/
+#define TCACHE_MAX 32
+
+typedef struct {
+    free_chunk *head[NUM_CLASSES];
+    int count[NUM_CLASSES];
+} thread_cache;
+
+static __thread thread_cache tcache;
+static __thread int tcache_registered;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+static large_block *large_list;
+static uintptr_t large_lo = UINTPTR_MAX, large_hi;
+
+static secure_pool_stats_t stats;
+
+static size_t page_size(void)
+{
+    long ps = sysconf(_SC_PAGESIZE);
+    return ps > 0 ? (size_t)ps : 4096;
+}
+
+/*
+   Map len usable bytes between two PROT_NONE guard pages, lock them and
+   keep them out of core dumps. Called with pool_lock held.
+*/
+static unsigned char *map_secure(size_t len, size_t *map_len)
+{
+    size_t ps = page_size();
+    unsigned char *map;
+
+    len = ROUND_UP(len, ps);
+    *map_len = len + 2 * ps;
+    map = mmap(NULL, *map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    mprotect(map, ps, PROT_NONE);
+    mprotect(map + ps + len, ps, PROT_NONE);
+#ifdef MADV_DONTDUMP
+    madvise(map + ps, len, MADV_DONTDUMP);
+#endif
+    if (mlock(map + ps, len) == 0)
+        stats.locked += len;
+    else
+        stats.lock_failures++;
+    stats.reserved += len;
+    return map + ps;
+}
+
+static void unmap_secure(unsigned char *data, size_t map_len)
+{
+    size_t ps = page_size();
+    size_t len = map_len - 2 * ps;
+
+    munlock(data, len);
+    munmap(data - ps, map_len);
+}
+
+static int size_class(size_t size)
+{
+    unsigned int c;
+
+    for (c = 0; c < NUM_CLASSES; c++)
+        if (size <= class_size[c])
+            return (int)c;
+    return -1;
+}
+
+static arena_t *find_arena(const void *ptr)
+{
+    const unsigned char *p = ptr;
+    int i, n = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < n; i++)
+        if (p >= ARENA(i)->base && p < ARENA(i)->base + ARENA_SIZE)
+            return ARENA(i);
+    return NULL;
+}
+
+/* hand a fresh slab to class c, returning its chunks as a list */
+static free_chunk *new_slab(int c)
+{
+    free_chunk *head = NULL;
+    unsigned char *slab = NULL;
+    size_t n, i, map_len;
+    int a, s;
+
+    pthread_mutex_lock(&pool_lock);
+    for (a = 0; a < num_arenas && slab == NULL; a++)
+    {
+        arena_t *arena = ARENA(a);
+
+        if (arena->slabs_used == ARENA_SLABS)
+            continue;
+        for (s = 0; s < ARENA_SLABS; s++)
+        {
+            if (arena->slab_class[s] < 0)
+            {
+                arena->slab_class[s] = (signed char)c;
+                arena->slabs_used++;
+                slab = arena->base + (size_t)s * SLAB_SIZE;
+                break;
+            }
+        }
+    }
+    if (slab == NULL && num_arenas < MAX_BLOCKS * ARENA_BLOCK)
+    {
+        arena_t *arena;
+
+        /* descriptors hold no key material, so plain memory will do */
+        if (arena_table[num_arenas / ARENA_BLOCK] == NULL)
+            arena_table[num_arenas / ARENA_BLOCK] = calloc(ARENA_BLOCK, sizeof(arena_t));
+        if (arena_table[num_arenas / ARENA_BLOCK] == NULL)
+        {
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        arena = ARENA(num_arenas);
+        arena->base = map_secure(ARENA_SIZE, &map_len);
+        if (arena->base != NULL)
+        {
+            memset(arena->slab_class, -1, sizeof(arena->slab_class));
+            arena->slab_class[0] = (signed char)c;
+            arena->slabs_used = 1;
+            slab = arena->base;
+            stats.arenas++;
+            __atomic_store_n(&num_arenas, num_arenas + 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (slab == NULL)
+        return NULL;
+
+    /* thread the chunks back to front so they are handed out in address order */
+    n = SLAB_SIZE / class_size[c];
+    for (i = n; i-- > 0; )
+    {
+        free_chunk *chunk = (free_chunk *)(slab + i * class_size[c]);
+        chunk->next = head;
+        head = chunk;
+    }
+    return head;
+}
+
+static void *alloc_large(size_t size)
+{
+    large_block *blk;
+    unsigned char *data;
+    size_t map_len;
+
+    if (size > SIZE_MAX - LARGE_HDR - 2 * page_size())
+        return NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    data = map_secure(size + LARGE_HDR, &map_len);
+    if (data == NULL)
+    {
+        pthread_mutex_unlock(&pool_lock);
+        return NULL;
+    }
+    blk = (large_block *)data;
+    blk->magic = LARGE_MAGIC;
+    blk->map_len = map_len;
+    blk->size = size;
+    blk->map = data;
+    blk->next = large_list;
+    large_list = blk;
+    if ((uintptr_t)data < large_lo)
+        large_lo = (uintptr_t)data;
+    if ((uintptr_t)data + map_len > large_hi)
+        large_hi = (uintptr_t)data + map_len;
+    __atomic_add_fetch(&stats.in_use, size, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool_lock);
+
+    return data + LARGE_HDR;
+}
+
+/* find (and optionally unlink) the large block holding ptr */
+static large_block *find_large(const void *ptr, int unlink)
+{
+    large_block **link, *blk = NULL;
+
+    if ((uintptr_t)ptr < large_lo || (uintptr_t)ptr >= large_hi)
+        return NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    for (link = &large_list; *link != NULL; link = &(*link)->next)
+    {
+        if ((const unsigned char *)ptr == (*link)->map + LARGE_HDR)
+        {
+            blk = *link;
+            if (unlink)
+                *link = blk->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return blk;
+}
+
+/* return every chunk in the calling thread's cache to the shared lists */
+static void tcache_flush(void *unused)
+{
+    unsigned int c;
+    free_chunk *chunk;
+
+    (void)unused;
+    for (c = 0; c < NUM_CLASSES; c++)
+    {
+        pthread_mutex_lock(&class_lock[c]);
+        while ((chunk = tcache.head[c]) != NULL)
+        {
+            tcache.head[c] = chunk->next;
+            chunk->next = free_list[c];
+            free_list[c] = chunk;
+            __atomic_sub_fetch(&stats.in_use, class_size[c], __ATOMIC_RELAXED);
+        }
+        tcache.count[c] = 0;
+        pthread_mutex_unlock(&class_lock[c]);
+    }
+}
+
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+void *secure_alloc(size_t size)
+{
+    free_chunk *chunk;
+    int c = size_class(size ? size : 1);
+
+    if (c < 0)
+        return alloc_large(size);
+
+    chunk = tcache.head[c];
+    if (chunk != NULL)
+    {
+        tcache.head[c] = chunk->next;
+        tcache.count[c]--;
+        chunk->next = NULL;
+        return chunk;
+    }
+
+    pthread_mutex_lock(&class_lock[c]);
+    if (free_list[c] == NULL)
+        free_list[c] = new_slab(c);
+    chunk = free_list[c];
+    if (chunk != NULL)
+    {
+        free_list[c] = chunk->next;
+        chunk->next = NULL;   /* the rest of the chunk was zeroized on free */
+        __atomic_add_fetch(&stats.in_use, class_size[c], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&class_lock[c]);
+
+    /* no arena could be mapped: a dedicated mapping is still locked */
+    if (chunk == NULL && (chunk = alloc_large(size)) != NULL)
+        __atomic_add_fetch(&stats.large_fallbacks, 1, __ATOMIC_RELAXED);
+    return chunk;
+}
+
+void secure_free(void *ptr)
+{
+    arena_t *arena;
+    large_block *blk;
+
+    if (ptr == NULL)
+        return;
+
+    arena = find_arena(ptr);
+    if (arena != NULL)
+    {
+        int c = arena->slab_class[((unsigned char *)ptr - arena->base) / SLAB_SIZE];
+        free_chunk *chunk = ptr;
+
+        secure_zero(chunk, class_size[c]);
+
+        if (!tcache_registered)
+        {
+            /* the destructor only runs for threads with a non-NULL value */
+            pthread_once(&tcache_once, tcache_key_create);
+            pthread_setspecific(tcache_key, &tcache);
+            tcache_registered = 1;
+        }
+        if (tcache.count[c] < TCACHE_MAX)
+        {
+            chunk->next = tcache.head[c];
+            tcache.head[c] = chunk;
+            tcache.count[c]++;
+            return;
+        }
+
+        pthread_mutex_lock(&class_lock[c]);
+        chunk->next = free_list[c];
+        free_list[c] = chunk;
+        __atomic_sub_fetch(&stats.in_use, class_size[c], __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&class_lock[c]);
+        return;
+    }
+
+    blk = find_large(ptr, 1);
+    if (blk != NULL)
+    {
+        size_t map_len = blk->map_len;
+        size_t ps = page_size();
+
+        pthread_mutex_lock(&pool_lock);
+        __atomic_sub_fetch(&stats.in_use, blk->size, __ATOMIC_RELAXED);
+        stats.reserved -= map_len - 2 * ps;
+        pthread_mutex_unlock(&pool_lock);
+        secure_zero(blk->map, map_len - 2 * ps);
+        unmap_secure((unsigned char *)blk, map_len);
+    }
+}
+
+int secure_owns(const void *ptr)
+{
+    return find_arena(ptr) != NULL || find_large(ptr, 0) != NULL;
+}
+
+void *secure_realloc(void *ptr, size_t size)
+{
+    arena_t *arena;
+    large_block *blk;
+    size_t old_size = 0;
+    void *fresh;
+
+    if (ptr == NULL)
+        return secure_alloc(size);
+
+    arena = find_arena(ptr);
+    if (arena != NULL)
+    {
+        old_size = class_size[arena->slab_class[((unsigned char *)ptr - arena->base) / SLAB_SIZE]];
+        if (size <= old_size)
+            return ptr;
+    }
+    else if ((blk = find_large(ptr, 0)) != NULL)
+        old_size = blk->size;
+    else
+        return NULL;
+
+    fresh = secure_alloc(size);
+    if (fresh == NULL)
+        return NULL;
+    memcpy(fresh, ptr, old_size < size ? old_size : size);
+    secure_free(ptr);
+    return fresh;
+}
+
+void secure_pool_stats(secure_pool_stats_t *out)
+{
+    pthread_mutex_lock(&pool_lock);
+    *out = stats;
+    out->in_use = __atomic_load_n(&stats.in_use, __ATOMIC_RELAXED);
+    out->large_fallbacks = __atomic_load_n(&stats.large_fallbacks, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+#else /* !HAVE_MMAP */
+
+/* no page control here: plain heap memory that is still zeroized on free */
+typedef struct {
+    size_t size;
+    size_t pad;
+} heap_hdr;
+
+void *secure_alloc(size_t size)
+{
+    heap_hdr *h = calloc(1, sizeof(heap_hdr) + size);
+    if (h == NULL)
+        return NULL;
+    h->size = size;
+    return h + 1;
+}
+
+void secure_free(void *ptr)
+{
+    heap_hdr *h;
+
+    if (ptr == NULL)
+        return;
+    h = (heap_hdr *)ptr - 1;
+    secure_zero(h, sizeof(heap_hdr) + h->size);
+    free(h);
+}
+
+void *secure_realloc(void *ptr, size_t size)
+{
+    void *fresh;
+    size_t old_size;
+
+    if (ptr == NULL)
+        return secure_alloc(size);
+    old_size = ((heap_hdr *)ptr - 1)->size;
+    fresh = secure_alloc(size);
+    if (fresh == NULL)
+        return NULL;
+    memcpy(fresh, ptr, old_size < size ? old_size : size);
+    secure_free(ptr);
+    return fresh;
+}
+
+int secure_owns(const void *ptr)
+{
+    (void)ptr;
+    return 0;
+}
+
+void secure_pool_stats(secure_pool_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+}
+
+#endif /* HAVE_MMAP */
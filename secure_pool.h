@@ -0,0 +1,40 @@
+#ifndef SECURE_POOL_H
+#define SECURE_POOL_H
+
+#include <stddef.h>
+
+/*
+   Allocator for key material. Memory comes from mlock'ed arenas that are
+   excluded from core dumps and surrounded by guard pages. Small requests are
+   served from per-size-class slabs; everything is zeroized when freed.
+*/
+
+/* Pool statistics */
+typedef struct {
+    size_t arenas;          /* slab arenas mapped */
+    size_t reserved;        /* bytes mapped for slabs and large blocks */
+    size_t locked;          /* bytes successfully mlock'ed */
+    size_t in_use;          /* bytes handed out or parked in thread caches */
+    size_t lock_failures;   /* mappings that could not be locked */
+    size_t large_fallbacks; /* small requests given their own mapping, no arena being available */
+} secure_pool_stats_t;
+
+/* Allocate size bytes of zeroed secure memory, 16-byte aligned (64 for size >= 64) */
+void *secure_alloc(size_t size);
+
+/* Zeroize and release memory from secure_alloc */
+void secure_free(void *ptr);
+
+/* Resize a secure block, keeping it in the pool; the old block is zeroized */
+void *secure_realloc(void *ptr, size_t size);
+
+/* Non-zero if ptr was returned by secure_alloc */
+int secure_owns(const void *ptr);
+
+/* Clear memory in a way the compiler cannot elide */
+void secure_zero(void *ptr, size_t len);
+
+/* Snapshot of the pool statistics */
+void secure_pool_stats(secure_pool_stats_t *stats);
+
+#endif /* SECURE_POOL_H */
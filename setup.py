@@ -30,11 +30,16 @@ if not os.path.exists('tables.h'):
    subprocess.run(['python3', 'makeCtables.py'], stdout=open('tables.h', 'w'))
 
 twofish_module = Extension('_twofish',
-                         sources=['twofish_wrap.c', 'twofish.c'],
+                         sources=['twofish_wrap.c', 'twofish.c', 'twofish_alloc.c', 'secure_pool.c', 'sha256.c',
+                                  'twofish_modes.c', 'twofish_jobs.c', 'workpool.c', 'dispatcher.c',
+                                  'twofish_cmac.c', 'twofish_siv.c', 'twofish_fpe.c', 'twofish_hctr2.c',
+                                  'twofish_etm.c', 'base64.c', 'envelope.c', 'twofish_mmap.c', 'twofish_ring.c',
+                                  'twofish_cache.c', 'twofish_keymgr.c', 'simd_util.c', 'twofish_shuffle.c'],
                          extra_compile_args=extra_compile_args)
 
 multipowerrsa_module = Extension('_multipowerrsa',
-                               sources=['rsa_wrapper.c', 'multipowerrsa.c'],
+                               sources=['rsa_wrapper.c', 'multipowerrsa.c', 'secure_pool.c', 'workpool.c',
+                                        'dispatcher.c', 'sha256.c', 'simd_util.c'],
                                libraries=gmp_lib,
                                include_dirs=gmp_include_dirs + ['.'],  
                                library_dirs=gmp_library_dirs,
@@ -49,6 +54,9 @@ setup(name='pangfish',
      package_dir={'pangfish': '.'},
      py_modules=[],
      ext_modules=[twofish_module, multipowerrsa_module],
+     extras_require={
+         'numpy': ['numpy'],  # encrypt_array / decrypt_array
+     },
      cmdclass={
          'bdist_wheel': BdistWheelCommand,
      },
@@ -0,0 +1,517 @@
+#include <string.h>
+#include <stdlib.h>
+#include "sha256.h"
+#include "secure_pool.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define LOAD_BE32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+                      ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+
+#define STORE_BE32(p, v) do { \
+    (p)[0] = (unsigned char)((v) >> 24); (p)[1] = (unsigned char)((v) >> 16); \
+    (p)[2] = (unsigned char)((v) >> 8);  (p)[3] = (unsigned char)(v); } while (0)
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t H256[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* portable compression function */
+static void compress_scalar(uint32_t state[8], const unsigned char *data, size_t nblocks)
+{
+    uint32_t W[64];
+    uint32_t a, b, c, d, e, f, g, h, T1, T2;
+    int t;
+
+    while (nblocks--)
+    {
+        for (t = 0; t < 16; t++)
+            W[t] = LOAD_BE32(data + 4 * t);
+        for (t = 16; t < 64; t++)
+        {
+            uint32_t s0 = ROTR32(W[t-15], 7) ^ ROTR32(W[t-15], 18) ^ (W[t-15] >> 3);
+            uint32_t s1 = ROTR32(W[t-2], 17) ^ ROTR32(W[t-2], 19) ^ (W[t-2] >> 10);
+            W[t] = W[t-16] + s0 + W[t-7] + s1;
+        }
+
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+        for (t = 0; t < 64; t++)
+        {
+            T1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + K256[t] + W[t];
+            T2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + T1;
+            d = c; c = b; b = a; a = T1 + T2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        data += SHA256_BLOCK_SIZE;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* SHA extensions: four rounds per pair of sha256rnds2 */
+__attribute__((target("sha,sse4.1")))
+static void compress_shani(uint32_t state[8], const unsigned char *data, size_t nblocks)
+{
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i STATE0, STATE1, TMP, ABEF_SAVE, CDGH_SAVE, MSG;
+    __m128i W[4];
+    int i;
+
+    TMP = _mm_loadu_si128((const __m128i *)&state[0]);
+    STATE1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    TMP = _mm_shuffle_epi32(TMP, 0xB1);            /* CDAB */
+    STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);      /* EFGH */
+    STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);      /* ABEF */
+    STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);   /* CDGH */
+
+    while (nblocks--)
+    {
+        ABEF_SAVE = STATE0;
+        CDGH_SAVE = STATE1;
+
+        for (i = 0; i < 16; i++)
+        {
+            if (i < 4)
+            {
+                W[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), MASK);
+            }
+            else
+            {
+                /* W[i-4], W[i-3], W[i-2], W[i-1] live at (i+0..3) & 3 */
+                TMP = _mm_sha256msg1_epu32(W[i & 3], W[(i + 1) & 3]);
+                TMP = _mm_add_epi32(TMP, _mm_alignr_epi8(W[(i + 3) & 3], W[(i + 2) & 3], 4));
+                W[i & 3] = _mm_sha256msg2_epu32(TMP, W[(i + 3) & 3]);
+            }
+            MSG = _mm_add_epi32(W[i & 3], _mm_loadu_si128((const __m128i *)&K256[4 * i]));
+            STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+            STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, _mm_shuffle_epi32(MSG, 0x0E));
+        }
+
+        STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+        STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+        data += SHA256_BLOCK_SIZE;
+    }
+
+    TMP = _mm_shuffle_epi32(STATE0, 0x1B);         /* FEBA */
+    STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);      /* DCHG */
+    STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0);   /* DCBA */
+    STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);      /* HGFE */
+    _mm_storeu_si128((__m128i *)&state[0], STATE0);
+    _mm_storeu_si128((__m128i *)&state[4], STATE1);
+}
+
+/* eight messages, one per 32-bit lane */
+#define V_ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define V_ADD(a, b) _mm256_add_epi32(a, b)
+#define V_XOR(a, b) _mm256_xor_si256(a, b)
+#define V_AND(a, b) _mm256_and_si256(a, b)
+
+__attribute__((target("avx2")))
+static void compress_avx2_x8(uint32_t state[8][8], const unsigned char *blocks[8], size_t nblocks)
+{
+    const __m256i BSWAP = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i S[8], W[16];
+    __m256i a, b, c, d, e, f, g, h, T1, T2;
+    size_t blk;
+    int t, j;
+
+    for (j = 0; j < 8; j++)
+        S[j] = _mm256_setr_epi32((int)state[0][j], (int)state[1][j], (int)state[2][j], (int)state[3][j],
+                                 (int)state[4][j], (int)state[5][j], (int)state[6][j], (int)state[7][j]);
+
+    for (blk = 0; blk < nblocks; blk++)
+    {
+        size_t off = blk * SHA256_BLOCK_SIZE;
+
+        a = S[0]; b = S[1]; c = S[2]; d = S[3];
+        e = S[4]; f = S[5]; g = S[6]; h = S[7];
+
+        for (t = 0; t < 64; t++)
+        {
+            __m256i w;
+
+            if (t < 16)
+            {
+                uint32_t lane[8];
+                for (j = 0; j < 8; j++)
+                    memcpy(&lane[j], blocks[j] + off + 4 * t, 4);
+                w = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)lane), BSWAP);
+            }
+            else
+            {
+                __m256i w15 = W[(t - 15) & 15], w2 = W[(t - 2) & 15];
+                __m256i s0 = V_XOR(V_XOR(V_ROTR(w15, 7), V_ROTR(w15, 18)), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = V_XOR(V_XOR(V_ROTR(w2, 17), V_ROTR(w2, 19)), _mm256_srli_epi32(w2, 10));
+                w = V_ADD(V_ADD(W[t & 15], s0), V_ADD(W[(t - 7) & 15], s1));
+            }
+            W[t & 15] = w;
+
+            T1 = V_ADD(h, V_XOR(V_XOR(V_ROTR(e, 6), V_ROTR(e, 11)), V_ROTR(e, 25)));
+            T1 = V_ADD(T1, V_XOR(V_AND(e, f), _mm256_andnot_si256(e, g)));
+            T1 = V_ADD(T1, V_ADD(_mm256_set1_epi32((int)K256[t]), w));
+            T2 = V_XOR(V_XOR(V_ROTR(a, 2), V_ROTR(a, 13)), V_ROTR(a, 22));
+            T2 = V_ADD(T2, V_XOR(V_XOR(V_AND(a, b), V_AND(a, c)), V_AND(b, c)));
+            h = g; g = f; f = e; e = V_ADD(d, T1);
+            d = c; c = b; b = a; a = V_ADD(T1, T2);
+        }
+
+        S[0] = V_ADD(S[0], a); S[1] = V_ADD(S[1], b); S[2] = V_ADD(S[2], c); S[3] = V_ADD(S[3], d);
+        S[4] = V_ADD(S[4], e); S[5] = V_ADD(S[5], f); S[6] = V_ADD(S[6], g); S[7] = V_ADD(S[7], h);
+    }
+
+    for (j = 0; j < 8; j++)
+    {
+        uint32_t lane[8];
+        int l;
+        _mm256_storeu_si256((__m256i *)lane, S[j]);
+        for (l = 0; l < 8; l++)
+            state[l][j] = lane[l];
+    }
+}
+#endif /* HAVE_X86_SIMD */
+
+/* backend selection, resolved on first use */
+enum { BACKEND_UNKNOWN, BACKEND_SCALAR, BACKEND_AVX2, BACKEND_SHANI };
+static int backend = BACKEND_UNKNOWN;
+
+static int get_backend(void)
+{
+    int b = __atomic_load_n(&backend, __ATOMIC_RELAXED);
+
+    if (b != BACKEND_UNKNOWN)
+        return b;
+
+    b = BACKEND_SCALAR;
+#ifdef HAVE_X86_SIMD
+    {
+        unsigned int eax, ebx, ecx, edx;
+
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            b = BACKEND_AVX2;
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29))
+            && __builtin_cpu_supports("sse4.1"))
+            b = BACKEND_SHANI;
+    }
+#endif
+    __atomic_store_n(&backend, b, __ATOMIC_RELAXED);
+    return b;
+}
+
+const char *sha256_backend(void)
+{
+    switch (get_backend())
+    {
+        case BACKEND_SHANI: return "sha-ni";
+        case BACKEND_AVX2:  return "avx2-x8";
+        default:            return "scalar";
+    }
+}
+
+void sha256_compress(uint32_t state[8], const unsigned char *blocks, size_t nblocks)
+{
+#ifdef HAVE_X86_SIMD
+    if (get_backend() == BACKEND_SHANI)
+    {
+        compress_shani(state, blocks, nblocks);
+        return;
+    }
+#endif
+    compress_scalar(state, blocks, nblocks);
+}
+
+void sha256_compress_x8(uint32_t state[8][8], const unsigned char *blocks[8], size_t nblocks)
+{
+    int lane;
+
+#ifdef HAVE_X86_SIMD
+    /* SHA-NI on one lane at a time beats eight-way AVX2 */
+    if (get_backend() == BACKEND_AVX2)
+    {
+        compress_avx2_x8(state, blocks, nblocks);
+        return;
+    }
+#endif
+    for (lane = 0; lane < 8; lane++)
+        sha256_compress(state[lane], blocks[lane], nblocks);
+}
+
+void sha256_init(sha256_ctx *ctx)
+{
+    memcpy(ctx->state, H256, sizeof(H256));
+    ctx->length = 0;
+    ctx->buf_len = 0;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t n;
+
+    ctx->length += len;
+    if (ctx->buf_len)
+    {
+        n = SHA256_BLOCK_SIZE - ctx->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + ctx->buf_len, p, n);
+        ctx->buf_len += n;
+        p += n;
+        len -= n;
+        if (ctx->buf_len < SHA256_BLOCK_SIZE)
+            return;
+        sha256_compress(ctx->state, ctx->buf, 1);
+        ctx->buf_len = 0;
+    }
+    if (len >= SHA256_BLOCK_SIZE)
+    {
+        n = len / SHA256_BLOCK_SIZE;
+        sha256_compress(ctx->state, p, n);
+        p += n * SHA256_BLOCK_SIZE;
+        len -= n * SHA256_BLOCK_SIZE;
+    }
+    memcpy(ctx->buf, p, len);
+    ctx->buf_len = len;
+}
+
+/* append the padding for a message of total_len bytes ending with tail */
+static size_t pad_block(unsigned char *out, const unsigned char *tail, size_t tail_len, uint64_t total_len)
+{
+    size_t n = (tail_len + 9 + SHA256_BLOCK_SIZE - 1) / SHA256_BLOCK_SIZE * SHA256_BLOCK_SIZE;
+    uint64_t bits = total_len * 8;
+    int i;
+
+    memcpy(out, tail, tail_len);
+    out[tail_len] = 0x80;
+    memset(out + tail_len + 1, 0, n - tail_len - 1);
+    for (i = 0; i < 8; i++)
+        out[n - 1 - i] = (unsigned char)(bits >> (8 * i));
+    return n / SHA256_BLOCK_SIZE;
+}
+
+void sha256_final(sha256_ctx *ctx, unsigned char out[SHA256_DIGEST_SIZE])
+{
+    unsigned char last[2 * SHA256_BLOCK_SIZE];
+    size_t n;
+    int i;
+
+    n = pad_block(last, ctx->buf, ctx->buf_len, ctx->length);
+    sha256_compress(ctx->state, last, n);
+    for (i = 0; i < 8; i++)
+        STORE_BE32(out + 4 * i, ctx->state[i]);
+    secure_zero(last, sizeof(last));
+    secure_zero(ctx, sizeof(*ctx));
+}
+
+void sha256(const void *data, size_t len, unsigned char out[SHA256_DIGEST_SIZE])
+{
+    sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, out);
+}
+
+void hmac_sha256_init(hmac_sha256_ctx *ctx, const void *key, size_t key_len)
+{
+    unsigned char pad[SHA256_BLOCK_SIZE];
+    unsigned char hashed[SHA256_DIGEST_SIZE];
+    int i;
+
+    if (key_len > SHA256_BLOCK_SIZE)
+    {
+        sha256(key, key_len, hashed);
+        key = hashed;
+        key_len = SHA256_DIGEST_SIZE;
+    }
+
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, key, key_len);
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++)
+        pad[i] ^= 0x36;
+    sha256_init(&ctx->inner);
+    sha256_update(&ctx->inner, pad, sizeof(pad));
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&ctx->outer);
+    sha256_update(&ctx->outer, pad, sizeof(pad));
+
+    secure_zero(pad, sizeof(pad));
+    secure_zero(hashed, sizeof(hashed));
+}
+
+void hmac_sha256_update(hmac_sha256_ctx *ctx, const void *data, size_t len)
+{
+    sha256_update(&ctx->inner, data, len);
+}
+
+void hmac_sha256_final(hmac_sha256_ctx *ctx, unsigned char out[SHA256_DIGEST_SIZE])
+{
+    unsigned char digest[SHA256_DIGEST_SIZE];
+
+    sha256_final(&ctx->inner, digest);
+    sha256_update(&ctx->outer, digest, sizeof(digest));
+    sha256_final(&ctx->outer, out);
+    secure_zero(digest, sizeof(digest));
+}
+
+void hmac_sha256(const void *key, size_t key_len, const void *data, size_t len,
+                 unsigned char out[SHA256_DIGEST_SIZE])
+{
+    hmac_sha256_ctx ctx;
+
+    hmac_sha256_init(&ctx, key, key_len);
+    hmac_sha256_update(&ctx, data, len);
+    hmac_sha256_final(&ctx, out);
+}
+
+void hkdf_sha256_extract(const void *salt, size_t salt_len, const void *ikm, size_t ikm_len,
+                         unsigned char prk[SHA256_DIGEST_SIZE])
+{
+    static const unsigned char zeros[SHA256_DIGEST_SIZE];
+
+    /* RFC 5869: an absent salt is HashLen zero bytes */
+    if (salt == NULL || salt_len == 0)
+    {
+        salt = zeros;
+        salt_len = sizeof(zeros);
+    }
+    hmac_sha256(salt, salt_len, ikm, ikm_len, prk);
+}
+
+int hkdf_sha256_expand(const unsigned char prk[SHA256_DIGEST_SIZE], const void *info,
+                       size_t info_len, unsigned char *okm, size_t okm_len)
+{
+    const unsigned char *infos[1];
+
+    infos[0] = info;
+    return hkdf_sha256_expand_batch(prk, infos, &info_len, 1, okm, okm_len);
+}
+
+/*
+   T(j) = HMAC(PRK, T(j-1) | info | j). With the keyed inner and outer states
+   computed once, each T(j) of each subkey costs only its own message blocks
+   plus one outer block, and eight subkeys go through the compressor together.
+*/
+int hkdf_sha256_expand_batch(const unsigned char prk[SHA256_DIGEST_SIZE],
+                             const unsigned char *const *infos, const size_t *info_lens,
+                             size_t n, unsigned char *okm, size_t okm_len)
+{
+    hmac_sha256_ctx keyed;
+    size_t nT = (okm_len + SHA256_DIGEST_SIZE - 1) / SHA256_DIGEST_SIZE;
+    size_t max_info = 0, lane_bytes, i, j, base;
+    unsigned char *buf, *msg;
+    int lane, k;
+
+    if (okm_len > 255 * SHA256_DIGEST_SIZE)
+        return -1;
+    if (n == 0 || okm_len == 0)
+        return 0;
+
+    for (i = 0; i < n; i++)
+        if (info_lens[i] > max_info)
+            max_info = info_lens[i];
+
+    /* per lane: room for the padded inner message, plus a scratch message */
+    lane_bytes = (SHA256_DIGEST_SIZE + max_info + 1 + 9 + SHA256_BLOCK_SIZE - 1)
+                 / SHA256_BLOCK_SIZE * SHA256_BLOCK_SIZE;
+    /* T(j) blocks are key material: keep them in the locked pool */
+    buf = secure_alloc(8 * lane_bytes + SHA256_DIGEST_SIZE + max_info + 1);
+    if (buf == NULL)
+        return -1;
+    msg = buf + 8 * lane_bytes;
+
+    hmac_sha256_init(&keyed, prk, SHA256_DIGEST_SIZE);
+
+    for (j = 1; j <= nT; j++)
+    {
+        size_t out_off = (j - 1) * SHA256_DIGEST_SIZE;
+        size_t take = okm_len - out_off < SHA256_DIGEST_SIZE ? okm_len - out_off : SHA256_DIGEST_SIZE;
+
+        for (base = 0; base < n; base += 8)
+        {
+            uint32_t inner[8][8], outer[8][8];
+            const unsigned char *blocks[8];
+            unsigned char digest[8][SHA256_BLOCK_SIZE];
+            size_t nblocks[8];
+            int uniform = 1;
+
+            /* build each lane's padded inner message: T(j-1) | info | j */
+            for (lane = 0; lane < 8; lane++)
+            {
+                size_t idx = base + lane < n ? base + lane : n - 1;   /* idle lanes repeat */
+                size_t len = 0, nb;
+
+                if (j > 1)
+                {
+                    memcpy(msg, okm + idx * okm_len + out_off - SHA256_DIGEST_SIZE, SHA256_DIGEST_SIZE);
+                    len = SHA256_DIGEST_SIZE;
+                }
+                memcpy(msg + len, infos[idx], info_lens[idx]);
+                len += info_lens[idx];
+                msg[len++] = (unsigned char)j;
+
+                nb = pad_block(buf + lane * lane_bytes, msg, len, SHA256_BLOCK_SIZE + len);
+                blocks[lane] = buf + lane * lane_bytes;
+                nblocks[lane] = nb;
+                if (nb != nblocks[0])
+                    uniform = 0;
+                memcpy(inner[lane], keyed.inner.state, sizeof(inner[lane]));
+                memcpy(outer[lane], keyed.outer.state, sizeof(outer[lane]));
+            }
+
+            /* lanes of differing length go through the single-message path */
+            if (uniform)
+                sha256_compress_x8(inner, blocks, nblocks[0]);
+            else
+                for (lane = 0; lane < 8; lane++)
+                    sha256_compress(inner[lane], blocks[lane], nblocks[lane]);
+
+            /* outer hash: one block holding the 32-byte inner digest */
+            for (lane = 0; lane < 8; lane++)
+            {
+                unsigned char d[SHA256_DIGEST_SIZE];
+                for (k = 0; k < 8; k++)
+                    STORE_BE32(d + 4 * k, inner[lane][k]);
+                pad_block(digest[lane], d, SHA256_DIGEST_SIZE, SHA256_BLOCK_SIZE + SHA256_DIGEST_SIZE);
+                blocks[lane] = digest[lane];
+            }
+            sha256_compress_x8(outer, blocks, 1);
+
+            for (lane = 0; lane < 8 && base + lane < n; lane++)
+            {
+                unsigned char d[SHA256_DIGEST_SIZE];
+                for (k = 0; k < 8; k++)
+                    STORE_BE32(d + 4 * k, outer[lane][k]);
+                memcpy(okm + (base + lane) * okm_len + out_off, d, take);
+            }
+            secure_zero(inner, sizeof(inner));
+            secure_zero(digest, sizeof(digest));
+        }
+    }
+
+    secure_free(buf);
+    secure_zero(&keyed, sizeof(keyed));
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BLOCK_SIZE  64
+#define SHA256_DIGEST_SIZE 32
+
+/* Streaming SHA-256 context */
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;                   /* bytes hashed so far */
+    unsigned char buf[SHA256_BLOCK_SIZE];
+    size_t buf_len;
+} sha256_ctx;
+
+/* HMAC-SHA256 with the padded key already absorbed */
+typedef struct {
+    sha256_ctx inner;
+    sha256_ctx outer;
+} hmac_sha256_ctx;
+
+/* Name of the compression backend in use: "sha-ni", "avx2-x8" or "scalar" */
+const char *sha256_backend(void);
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx *ctx, unsigned char out[SHA256_DIGEST_SIZE]);
+void sha256(const void *data, size_t len, unsigned char out[SHA256_DIGEST_SIZE]);
+
+/* Compress nblocks 64-byte blocks into state */
+void sha256_compress(uint32_t state[8], const unsigned char *blocks, size_t nblocks);
+
+/*
+   Compress nblocks blocks of eight independent messages at once, one
+   message per lane. Uses AVX2 when available, otherwise loops.
+*/
+void sha256_compress_x8(uint32_t state[8][8], const unsigned char *blocks[8], size_t nblocks);
+
+void hmac_sha256_init(hmac_sha256_ctx *ctx, const void *key, size_t key_len);
+void hmac_sha256_update(hmac_sha256_ctx *ctx, const void *data, size_t len);
+void hmac_sha256_final(hmac_sha256_ctx *ctx, unsigned char out[SHA256_DIGEST_SIZE]);
+void hmac_sha256(const void *key, size_t key_len, const void *data, size_t len,
+                 unsigned char out[SHA256_DIGEST_SIZE]);
+
+/* HKDF-SHA256 (RFC 5869) extract step */
+void hkdf_sha256_extract(const void *salt, size_t salt_len, const void *ikm, size_t ikm_len,
+                         unsigned char prk[SHA256_DIGEST_SIZE]);
+
+/* HKDF-SHA256 expand step; returns 0 on success, -1 if okm_len > 255*32 */
+int hkdf_sha256_expand(const unsigned char prk[SHA256_DIGEST_SIZE], const void *info,
+                       size_t info_len, unsigned char *okm, size_t okm_len);
+
+/*
+   Expand one PRK into n subkeys of okm_len bytes each, written back to back
+   into okm. Subkey i uses infos[i] (info_lens[i] bytes) as its context.
+   Returns 0 on success, -1 if okm_len > 255*32.
+*/
+int hkdf_sha256_expand_batch(const unsigned char prk[SHA256_DIGEST_SIZE],
+                             const unsigned char *const *infos, const size_t *info_lens,
+                             size_t n, unsigned char *okm, size_t okm_len);
+
+#endif /* SHA256_H */
@@ -0,0 +1,456 @@
+#include <stdint.h>
+#include <string.h>
+#include "simd_util.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/* backend selection, resolved on first use */
+enum { BACKEND_UNKNOWN, BACKEND_SCALAR, BACKEND_SSE2, BACKEND_AVX2, BACKEND_AVX512 };
+static int backend = BACKEND_UNKNOWN;
+
+static int get_backend(void)
+{
+    int b = __atomic_load_n(&backend, __ATOMIC_RELAXED);
+
+    if (b != BACKEND_UNKNOWN)
+        return b;
+
+    b = BACKEND_SCALAR;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        b = BACKEND_AVX512;
+    else if (__builtin_cpu_supports("avx2"))
+        b = BACKEND_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        b = BACKEND_SSE2;
+#endif
+    __atomic_store_n(&backend, b, __ATOMIC_RELAXED);
+    return b;
+}
+
+const char *simd_backend(void)
+{
+    switch (get_backend())
+    {
+    case BACKEND_AVX512:
+        return "avx512";
+    case BACKEND_AVX2:
+        return "avx2";
+    case BACKEND_SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+static uint64_t load64_be(const unsigned char *p)
+{
+    uint64_t x;
+
+    memcpy(&x, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+static void store64_be(unsigned char *p, uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(p, &x, 8);
+}
+
+/* Portable kernels; they also finish whatever tail the vector code leaves */
+
+static void xor_scalar(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t n)
+{
+    uint64_t x, y;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        x ^= y;
+        memcpy(dst + i, &x, 8);
+    }
+    for (; i < n; i++)
+        dst[i] = a[i] ^ b[i];
+}
+
+static void xor3_scalar(unsigned char *dst, const unsigned char *a, const unsigned char *b,
+                        const unsigned char *c, size_t n)
+{
+    uint64_t x, y, z;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        memcpy(&z, c + i, 8);
+        x ^= y ^ z;
+        memcpy(dst + i, &x, 8);
+    }
+    for (; i < n; i++)
+        dst[i] = a[i] ^ b[i] ^ c[i];
+}
+
+static void ctr_scalar(unsigned char *out, uint64_t *hi, uint64_t *lo, size_t nblocks)
+{
+    size_t i;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        store64_be(out + 16 * i, *hi);
+        store64_be(out + 16 * i + 8, *lo);
+        if (++*lo == 0)
+            ++*hi;
+    }
+}
+
+static uint64_t diff_scalar(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    uint64_t x, y, diff = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        diff |= x ^ y;
+    }
+    for (; i < n; i++)
+        diff |= (uint64_t)(a[i] ^ b[i]);
+    return diff;
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+   Each vector kernel returns how many bytes (or blocks) it handled and
+   leaves the rest to the portable code.
+*/
+
+__attribute__((target("sse2")))
+static size_t xor_sse2(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                                       _mm_loadu_si128((const __m128i *)(b + i))));
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t xor_avx2(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32)
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                             _mm256_loadu_si256((const __m256i *)(b + i))));
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static size_t xor_avx512(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 64 <= n; i += 64)
+        _mm512_storeu_si512((void *)(dst + i),
+                            _mm512_xor_si512(_mm512_loadu_si512((const void *)(a + i)),
+                                             _mm512_loadu_si512((const void *)(b + i))));
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t xor3_sse2(unsigned char *dst, const unsigned char *a, const unsigned char *b,
+                        const unsigned char *c, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                                       _mm_xor_si128(_mm_loadu_si128((const __m128i *)(b + i)),
+                                                     _mm_loadu_si128((const __m128i *)(c + i)))));
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t xor3_avx2(unsigned char *dst, const unsigned char *a, const unsigned char *b,
+                        const unsigned char *c, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32)
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                             _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(b + i)),
+                                                              _mm256_loadu_si256((const __m256i *)(c + i)))));
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static size_t xor3_avx512(unsigned char *dst, const unsigned char *a, const unsigned char *b,
+                          const unsigned char *c, size_t n)
+{
+    size_t i = 0;
+
+    /* 0x96 is the truth table of a ^ b ^ c */
+    for (; i + 64 <= n; i += 64)
+        _mm512_storeu_si512((void *)(dst + i),
+                            _mm512_ternarylogic_epi64(_mm512_loadu_si512((const void *)(a + i)),
+                                                      _mm512_loadu_si512((const void *)(b + i)),
+                                                      _mm512_loadu_si512((const void *)(c + i)), 0x96));
+    return i;
+}
+
+/*
+   Counter blocks: the counter is kept as (low, high) 64-bit lanes, one
+   block per 128-bit lane, and each lane is byte-reversed on the way out.
+   The caller makes sure the low half does not wrap within the run.
+*/
+
+__attribute__((target("avx2")))
+static size_t ctr_avx2(unsigned char *out, uint64_t hi, uint64_t lo, size_t nblocks)
+{
+    const __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                         15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256i step = _mm256_set_epi64x(0, 4, 0, 4);
+    __m256i c0 = _mm256_set_epi64x((long long)hi, (long long)(lo + 1), (long long)hi, (long long)lo);
+    __m256i c1 = _mm256_add_epi64(c0, _mm256_set_epi64x(0, 2, 0, 2));
+    size_t i = 0;
+
+    for (; i + 4 <= nblocks; i += 4)
+    {
+        _mm256_storeu_si256((__m256i *)(out + 16 * i), _mm256_shuffle_epi8(c0, rev));
+        _mm256_storeu_si256((__m256i *)(out + 16 * i + 32), _mm256_shuffle_epi8(c1, rev));
+        c0 = _mm256_add_epi64(c0, step);
+        c1 = _mm256_add_epi64(c1, step);
+    }
+    return i;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t ctr_avx512(unsigned char *out, uint64_t hi, uint64_t lo, size_t nblocks)
+{
+    const __m512i rev = _mm512_broadcast_i32x4(_mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                                             7, 6, 5, 4, 3, 2, 1, 0));
+    const __m512i step = _mm512_set_epi64(0, 4, 0, 4, 0, 4, 0, 4);
+    __m512i c = _mm512_set_epi64((long long)hi, (long long)(lo + 3), (long long)hi, (long long)(lo + 2),
+                                 (long long)hi, (long long)(lo + 1), (long long)hi, (long long)lo);
+    size_t i = 0;
+
+    for (; i + 4 <= nblocks; i += 4)
+    {
+        _mm512_storeu_si512((void *)(out + 16 * i), _mm512_shuffle_epi8(c, rev));
+        c = _mm512_add_epi64(c, step);
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t diff_sse2(const unsigned char *a, const unsigned char *b, size_t n, uint64_t *diff)
+{
+    __m128i acc = _mm_setzero_si128();
+    uint64_t lanes[2];
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+        acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    *diff |= lanes[0] | lanes[1];
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t diff_avx2(const unsigned char *a, const unsigned char *b, size_t n, uint64_t *diff)
+{
+    __m256i acc = _mm256_setzero_si256();
+    uint64_t lanes[4];
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32)
+        acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                    _mm256_loadu_si256((const __m256i *)(b + i))));
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    *diff |= lanes[0] | lanes[1] | lanes[2] | lanes[3];
+    return i;
+}
+
+__attribute__((target("avx512f")))
+static size_t zero_avx512(unsigned char *p, size_t n)
+{
+    const __m512i z = _mm512_setzero_si512();
+    size_t i = 0;
+
+    for (; i + 64 <= n; i += 64)
+        _mm512_storeu_si512((void *)(p + i), z);
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t zero_avx2(unsigned char *p, size_t n)
+{
+    const __m256i z = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32)
+        _mm256_storeu_si256((__m256i *)(p + i), z);
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t zero_sse2(unsigned char *p, size_t n)
+{
+    const __m128i z = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+        _mm_storeu_si128((__m128i *)(p + i), z);
+    return i;
+}
+#endif /* HAVE_X86_SIMD */
+
+void simd_xor(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t n)
+{
+    size_t done = 0;
+
+#ifdef HAVE_X86_SIMD
+    switch (get_backend())
+    {
+    case BACKEND_AVX512:
+        done = xor_avx512(dst, a, b, n);
+        break;
+    case BACKEND_AVX2:
+        done = xor_avx2(dst, a, b, n);
+        break;
+    case BACKEND_SSE2:
+        done = xor_sse2(dst, a, b, n);
+        break;
+    }
+#endif
+    xor_scalar(dst + done, a + done, b + done, n - done);
+}
+
+void simd_xor3(unsigned char *dst, const unsigned char *a, const unsigned char *b,
+               const unsigned char *c, size_t n)
+{
+    size_t done = 0;
+
+#ifdef HAVE_X86_SIMD
+    switch (get_backend())
+    {
+    case BACKEND_AVX512:
+        done = xor3_avx512(dst, a, b, c, n);
+        break;
+    case BACKEND_AVX2:
+        done = xor3_avx2(dst, a, b, c, n);
+        break;
+    case BACKEND_SSE2:
+        done = xor3_sse2(dst, a, b, c, n);
+        break;
+    }
+#endif
+    xor3_scalar(dst + done, a + done, b + done, c + done, n - done);
+}
+
+void simd_ctr_blocks(unsigned char *out, unsigned char ctr[16], size_t nblocks)
+{
+    uint64_t hi = load64_be(ctr), lo = load64_be(ctr + 8);
+    size_t done = 0;
+
+#ifdef HAVE_X86_SIMD
+    /* SSE2 has no byte shuffle, so it stays on the bswap loop */
+    if (lo <= UINT64_MAX - nblocks)
+    {
+        if (get_backend() == BACKEND_AVX512)
+            done = ctr_avx512(out, hi, lo, nblocks);
+        else if (get_backend() == BACKEND_AVX2)
+            done = ctr_avx2(out, hi, lo, nblocks);
+        lo += done;
+    }
+#endif
+    ctr_scalar(out + 16 * done, &hi, &lo, nblocks - done);
+    store64_be(ctr, hi);
+    store64_be(ctr + 8, lo);
+}
+
+int simd_equal(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    uint64_t diff = 0;
+    size_t done = 0;
+
+#ifdef HAVE_X86_SIMD
+    if (get_backend() >= BACKEND_AVX2)
+        done = diff_avx2(a, b, n, &diff);
+    else if (get_backend() == BACKEND_SSE2)
+        done = diff_sse2(a, b, n, &diff);
+#endif
+    diff |= diff_scalar(a + done, b + done, n - done);
+    /* fold to one bit without a data-dependent branch */
+    diff |= diff >> 32;
+    diff |= diff >> 16;
+    diff |= diff >> 8;
+    return (int)(1 & ((diff & 0xff) - 1) >> 8);
+}
+
+size_t simd_pkcs7_pad_len(const unsigned char last[16])
+{
+    unsigned pad = last[15], bad = 0, i;
+
+    /* every byte is looked at; those inside the padding must equal pad */
+    for (i = 0; i < 16; i++)
+    {
+        unsigned inside = (unsigned)((int)(15 - i - pad) >> 8) & 1;     /* 15 - i < pad */
+
+        bad |= inside & (unsigned)((((unsigned)last[i] ^ pad) + 0xff) >> 8);
+    }
+    bad |= ((pad - 1) >> 8) & 1;                    /* pad == 0 */
+    bad |= ((16 - pad) >> 8) & 1;                   /* pad > 16 */
+    return pad & (bad - 1);
+}
+
+void simd_zero(void *ptr, size_t n)
+{
+    unsigned char *p = ptr;
+    size_t done = 0;
+
+#if defined(__GNUC__)
+#ifdef HAVE_X86_SIMD
+    switch (get_backend())
+    {
+    case BACKEND_AVX512:
+        done = zero_avx512(p, n);
+        break;
+    case BACKEND_AVX2:
+        done = zero_avx2(p, n);
+        break;
+    case BACKEND_SSE2:
+        done = zero_sse2(p, n);
+        break;
+    }
+#endif
+    memset(p + done, 0, n - done);
+    /* the barrier makes the stores observable, so they cannot be elided */
+    __asm__ __volatile__("" : : "r"(ptr) : "memory");
+#else
+    volatile unsigned char *v = p;
+
+    (void)done;
+    while (n--)
+        *v++ = 0;
+#endif
+}
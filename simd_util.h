@@ -0,0 +1,64 @@
+#ifndef SIMD_UTIL_H
+#define SIMD_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+   Byte-level kernels shared by the modes and the Python wrapper, each
+   dispatched once to AVX-512, AVX2, SSE2 or portable code. Buffers may be
+   unaligned; a destination may be the same buffer as a source, but must
+   not partially overlap one.
+*/
+
+/* Name of the backend in use: "avx512", "avx2", "sse2" or "scalar" */
+const char *simd_backend(void);
+
+/* dst = a ^ b over n bytes */
+void simd_xor(unsigned char *dst, const unsigned char *a, const unsigned char *b, size_t n);
+
+/* dst = a ^ b over one 16-byte block, inline for the per-block paths */
+static inline void simd_xor_block(unsigned char *dst, const unsigned char *a, const unsigned char *b)
+{
+#if defined(__SSE2__)
+    _mm_storeu_si128((__m128i *)dst, _mm_xor_si128(_mm_loadu_si128((const __m128i *)a),
+                                                   _mm_loadu_si128((const __m128i *)b)));
+#else
+    uint64_t x[2], y[2];
+
+    memcpy(x, a, 16);
+    memcpy(y, b, 16);
+    x[0] ^= y[0];
+    x[1] ^= y[1];
+    memcpy(dst, x, 16);
+#endif
+}
+
+/* dst = a ^ b ^ c over n bytes */
+void simd_xor3(unsigned char *dst, const unsigned char *a, const unsigned char *b,
+               const unsigned char *c, size_t n);
+
+/*
+   Write nblocks successive values of a 128-bit big-endian counter to out,
+   starting at ctr, and advance ctr past them.
+*/
+void simd_ctr_blocks(unsigned char *out, unsigned char ctr[16], size_t nblocks);
+
+/* 1 if the n bytes of a and b are equal; the time taken depends on n only */
+int simd_equal(const unsigned char *a, const unsigned char *b, size_t n);
+
+/*
+   Length of the PKCS#7 padding ending the 16-byte block last, 1 to 16, or
+   0 if the block is not validly padded. Runs in constant time.
+*/
+size_t simd_pkcs7_pad_len(const unsigned char last[16]);
+
+/* Zero n bytes; the stores are never optimised away */
+void simd_zero(void *ptr, size_t n);
+
+#endif /* SIMD_UTIL_H */
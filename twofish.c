@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include "tables.h"
 #include "twofish.h"
+#include "secure_pool.h"
+#include "twofish_shuffle.h"
 
 /* 
    gcc is smart enough to convert these to roll instructions.
@@ -118,11 +120,28 @@ static u32 h(u32 X, u32 L[4], int k)
     return BYTES_TO_U32(z0, z1, z2, z3);
 }
 
-/* given the Sbox keys, create the fully keyed QF */
-static void fullKey(u32 L[4], int k, u32 QF[4][256])
+/* given the Sbox keys, create the keyed 8-bit S-boxes: the Q permutations before the MDS multiply */
+static void keyedSboxes(u32 L[4], int k, BYTE SB[4][256])
 {
     BYTE y0, y1, y2, y3;
+    u32 X[256];
     int i;
+
+    /* all 256 inputs at once as words x*RHO, without the MDS multiply */
+    for (i=0; i<256; i++)
+        X[i] = i * RHO;
+    if (twofish_shuffle_h(L, k, 0, X, X, 256))
+    {
+        for (i=0; i<256; i++)
+        {
+            SB[0][i] = b0(X[i]);
+            SB[1][i] = b1(X[i]);
+            SB[2][i] = b2(X[i]);
+            SB[3][i] = b3(X[i]);
+        }
+        secure_zero(X, sizeof(X));
+        return;
+    }
     
     /* for all input values to the Q permutations */
     for (i=0; i<256; i++)
@@ -147,27 +166,43 @@ static void fullKey(u32 L[4], int k, u32 QF[4][256])
                 y2 = Q1[  Q1 [ Q0[y2] ^ b2(L[1]) ] ^ b2(L[0]) ];
                 y3 = Q0[  Q1 [ Q1[y3] ^ b3(L[1]) ] ^ b3(L[0]) ];
         }
+        SB[0][i] = y0;
+        SB[1][i] = y1;
+        SB[2][i] = y2;
+        SB[3][i] = y3;
+    }
+}
+
+/* columns of the MDS matrix times one S-box output */
+#define MDS0(y) ((multEF[y] << 24) | (multEF[y] << 16) | (mult5B[y] << 8) | (y))
+#define MDS1(y) (((y) << 24) | (mult5B[y] << 16) | (multEF[y] << 8) | multEF[y])
+#define MDS2(y) ((multEF[y] << 24) | ((y) << 16) | (multEF[y] << 8) | mult5B[y])
+#define MDS3(y) ((mult5B[y] << 24) | (multEF[y] << 16) | ((y) << 8) | mult5B[y])
+
+/* given the keyed S-boxes, create the fully keyed QF: the partial MDS matrix multiplies */
+static void sboxTables(const BYTE SB[4][256], u32 QF[4][256])
+{
+    int i;
     
-        /* now do the partial MDS matrix multiplies */
-        QF[0][i] = ((multEF[y0] << 24) 
-                    | (multEF[y0] << 16) 
-                    | (mult5B[y0] << 8)
-                    | y0);
-        QF[1][i] = ((y1 << 24) 
-                    | (mult5B[y1] << 16) 
-                    | (multEF[y1] << 8)
-                    | multEF[y1]);
-        QF[2][i] = ((multEF[y2] << 24) 
-                    | (y2 << 16) 
-                    | (multEF[y2] << 8)
-                    | mult5B[y2]);
-        QF[3][i] = ((mult5B[y3] << 24) 
-                    | (multEF[y3] << 16)
-                    | (y3 << 8) 
-                    | mult5B[y3]);
+    for (i=0; i<256; i++)
+    {
+        QF[0][i] = MDS0((u32)SB[0][i]);
+        QF[1][i] = MDS1((u32)SB[1][i]);
+        QF[2][i] = MDS2((u32)SB[2][i]);
+        QF[3][i] = MDS3((u32)SB[3][i]);
     }
 }
 
+/* given the Sbox keys, create the fully keyed QF */
+static void fullKey(u32 L[4], int k, u32 QF[4][256])
+{
+    BYTE SB[4][256];
+
+    keyedSboxes(L, k, SB);
+    sboxTables((const BYTE (*)[256])SB, QF);
+    secure_zero(SB, sizeof(SB));
+}
+
 /* fully keyed h (aka g) function */
 #define fkh(X) (ctx->QF[0][b0(X)]^ctx->QF[1][b1(X)]^ctx->QF[2][b2(X)]^ctx->QF[3][b3(X)])
 
@@ -255,18 +290,121 @@ void twofish_decrypt(TWOFISH_CTX *ctx, BYTE PT[16])
     ((u32*)PT)[0] = BSWAP(R2 ^ ctx->K[0]);
 }
 
+/*
+   Multi-block kernel: the rounds of TWOFISH_LANES independent blocks are
+   interleaved, so the table lookups of one block overlap the dependency
+   chain of the others.
+*/
+#define TWOFISH_LANES 4
+
+static void load_block(u32 R[4], const BYTE *p, const u32 *K)
+{
+    u32 w[4];
+    memcpy(w, p, 16);
+    R[0] = K[0] ^ BSWAP(w[0]);
+    R[1] = K[1] ^ BSWAP(w[1]);
+    R[2] = K[2] ^ BSWAP(w[2]);
+    R[3] = K[3] ^ BSWAP(w[3]);
+}
+
+static void store_block(BYTE *p, u32 a, u32 b, u32 c, u32 d, const u32 *K)
+{
+    u32 w[4];
+    w[0] = BSWAP(a ^ K[0]);
+    w[1] = BSWAP(b ^ K[1]);
+    w[2] = BSWAP(c ^ K[2]);
+    w[3] = BSWAP(d ^ K[3]);
+    memcpy(p, w, 16);
+}
+
+static void encrypt_lanes(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out)
+{
+    u32 R[TWOFISH_LANES][4];
+    u32 T0, T1;
+    int l, r;
+
+    for (l = 0; l < TWOFISH_LANES; l++)
+        load_block(R[l], in + 16 * l, ctx->K);
+    for (r = 0; r < 16; r += 2)
+    {
+        for (l = 0; l < TWOFISH_LANES; l++)
+        {
+            ENC_ROUND(R[l][0], R[l][1], R[l][2], R[l][3], r);
+        }
+        for (l = 0; l < TWOFISH_LANES; l++)
+        {
+            ENC_ROUND(R[l][2], R[l][3], R[l][0], R[l][1], (r + 1));
+        }
+    }
+    for (l = 0; l < TWOFISH_LANES; l++)
+        store_block(out + 16 * l, R[l][2], R[l][3], R[l][0], R[l][1], ctx->K + 4);
+}
+
+static void decrypt_lanes(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out)
+{
+    u32 R[TWOFISH_LANES][4];
+    u32 T0, T1;
+    int l, r;
+
+    for (l = 0; l < TWOFISH_LANES; l++)
+        load_block(R[l], in + 16 * l, ctx->K + 4);
+    for (r = 15; r > 0; r -= 2)
+    {
+        for (l = 0; l < TWOFISH_LANES; l++)
+        {
+            DEC_ROUND(R[l][0], R[l][1], R[l][2], R[l][3], r);
+        }
+        for (l = 0; l < TWOFISH_LANES; l++)
+        {
+            DEC_ROUND(R[l][2], R[l][3], R[l][0], R[l][1], (r - 1));
+        }
+    }
+    for (l = 0; l < TWOFISH_LANES; l++)
+        store_block(out + 16 * l, R[l][2], R[l][3], R[l][0], R[l][1], ctx->K);
+}
+
+void twofish_encrypt_blocks(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out, size_t nblocks)
+{
+    BYTE tail[16];
+    size_t i;
+
+    for (i = 0; i + TWOFISH_LANES <= nblocks; i += TWOFISH_LANES)
+        encrypt_lanes(ctx, in + 16 * i, out + 16 * i);
+    for (; i < nblocks; i++)
+    {
+        memcpy(tail, in + 16 * i, 16);
+        twofish_encrypt(ctx, tail);
+        memcpy(out + 16 * i, tail, 16);
+    }
+}
+
+void twofish_decrypt_blocks(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out, size_t nblocks)
+{
+    BYTE tail[16];
+    size_t i;
+
+    for (i = 0; i + TWOFISH_LANES <= nblocks; i += TWOFISH_LANES)
+        decrypt_lanes(ctx, in + 16 * i, out + 16 * i);
+    for (; i < nblocks; i++)
+    {
+        memcpy(tail, in + 16 * i, 16);
+        twofish_decrypt(ctx, tail);
+        memcpy(out + 16 * i, tail, 16);
+    }
+}
+
 /* the key schedule routine */
-void twofish_set_key(TWOFISH_CTX *ctx, BYTE M[], int key_size)
+void twofish_compact_key(TWOFISH_COMPACT *ck, BYTE M[], int key_size)
 {
     u32 Mo[4], Me[4];
     int i, j;
     BYTE vector[8];
-    u32 A, B;
+    u32 A[20], B[20];
     int k;
-    u32 *S;
 
     k = (key_size + 63) / 64;
-    S = (u32*)malloc(sizeof(u32) * k);
+    ck->k = k;
+    memset(ck->S, 0, sizeof(ck->S));
 
     for (i = 0; i < k; i++)
     {
@@ -278,21 +416,56 @@ void twofish_set_key(TWOFISH_CTX *ctx, BYTE M[], int key_size)
     {
         for (j = 0; j < 4; j++) vector[j] = _b(Me[i], j);
         for (j = 0; j < 4; j++) vector[j+4] = _b(Mo[i], j);
-        S[k-i-1] = RSMatrixMultiply(vector);
+        ck->S[k-i-1] = RSMatrixMultiply(vector);
     }
     
+    /* the 40 h inputs are fixed, so the round keys go through h as one batch per key half */
     for (i = 0; i < 20; i++)
     {
-        A = h(2*i*RHO, Me, k);
-        B = ROL(h(2*i*RHO + RHO, Mo, k), 8);
-        ctx->K[2*i] = A+B;
-        ctx->K[2*i+1] = ROL(A + 2*B, 9);
+        A[i] = 2*i*RHO;
+        B[i] = 2*i*RHO + RHO;
     }
-    
+    if (!twofish_shuffle_h(Me, k, 1, A, A, 20) || !twofish_shuffle_h(Mo, k, 1, B, B, 20))
+    {
+        for (i = 0; i < 20; i++)
+        {
+            A[i] = h(2*i*RHO, Me, k);
+            B[i] = h(2*i*RHO + RHO, Mo, k);
+        }
+    }
+    for (i = 0; i < 20; i++)
+    {
+        B[i] = ROL(B[i], 8);
+        ck->K[2*i] = A[i]+B[i];
+        ck->K[2*i+1] = ROL(A[i] + 2*B[i], 9);
+    }
+
+    secure_zero(Me, sizeof(Me));
+    secure_zero(Mo, sizeof(Mo));
+    secure_zero(vector, sizeof(vector));
+    secure_zero(A, sizeof(A));
+    secure_zero(B, sizeof(B));
+}
+
+void twofish_expand_key(const TWOFISH_COMPACT *ck, TWOFISH_CTX *ctx)
+{
+    u32 S[4];
+
+    memcpy(ctx->K, ck->K, sizeof(ctx->K));
+    memcpy(S, ck->S, sizeof(S));
+
     /* Build the QF tables */
-    fullKey(S, k, ctx->QF);
-    
-    free(S);
+    fullKey(S, ck->k, ctx->QF);
+    secure_zero(S, sizeof(S));
+}
+
+void twofish_set_key(TWOFISH_CTX *ctx, BYTE M[], int key_size)
+{
+    TWOFISH_COMPACT ck;
+
+    twofish_compact_key(&ck, M, key_size);
+    twofish_expand_key(&ck, ctx);
+    secure_zero(&ck, sizeof(ck));
 }
 
 void twofish_init_ctx(TWOFISH_CTX *ctx)
@@ -302,6 +475,230 @@ void twofish_init_ctx(TWOFISH_CTX *ctx)
 
 void twofish_free_ctx(TWOFISH_CTX *ctx)
 {
-    /* Nothing specific to free yet, but keeping the function for future use */
-    (void)ctx; /* Silence unused parameter warning */
-}
\ No newline at end of file
+    /* Wipe the key schedule; the memory itself belongs to the caller */
+    secure_zero(ctx, sizeof(TWOFISH_CTX));
+}
+
+/*
+   Partially keyed path: g is computed from the S-box key words on every
+   call instead of being looked up in QF. Several times slower per block,
+   but it needs no table and no full key setup.
+*/
+#undef fkh
+#define fkh(X) h((X), (u32 *)ctx->S, ctx->k)
+
+void twofish_encrypt_compact(const TWOFISH_COMPACT *ctx, BYTE PT[16])
+{
+    u32 R0, R1, R2, R3;
+    u32 T0, T1;
+
+    R3 = ctx->K[3] ^ BSWAP(((u32*)PT)[3]);
+    R2 = ctx->K[2] ^ BSWAP(((u32*)PT)[2]);
+    R1 = ctx->K[1] ^ BSWAP(((u32*)PT)[1]);
+    R0 = ctx->K[0] ^ BSWAP(((u32*)PT)[0]);
+
+    ENC_ROUND(R0, R1, R2, R3, 0);
+    ENC_ROUND(R2, R3, R0, R1, 1);
+    ENC_ROUND(R0, R1, R2, R3, 2);
+    ENC_ROUND(R2, R3, R0, R1, 3);
+    ENC_ROUND(R0, R1, R2, R3, 4);
+    ENC_ROUND(R2, R3, R0, R1, 5);
+    ENC_ROUND(R0, R1, R2, R3, 6);
+    ENC_ROUND(R2, R3, R0, R1, 7);
+    ENC_ROUND(R0, R1, R2, R3, 8);
+    ENC_ROUND(R2, R3, R0, R1, 9);
+    ENC_ROUND(R0, R1, R2, R3, 10);
+    ENC_ROUND(R2, R3, R0, R1, 11);
+    ENC_ROUND(R0, R1, R2, R3, 12);
+    ENC_ROUND(R2, R3, R0, R1, 13);
+    ENC_ROUND(R0, R1, R2, R3, 14);
+    ENC_ROUND(R2, R3, R0, R1, 15);
+
+    ((u32*)PT)[3] = BSWAP(R1 ^ ctx->K[7]);
+    ((u32*)PT)[2] = BSWAP(R0 ^ ctx->K[6]);
+    ((u32*)PT)[1] = BSWAP(R3 ^ ctx->K[5]);
+    ((u32*)PT)[0] = BSWAP(R2 ^ ctx->K[4]);
+}
+
+void twofish_decrypt_compact(const TWOFISH_COMPACT *ctx, BYTE PT[16])
+{
+    u32 T0, T1;
+    u32 R0, R1, R2, R3;
+
+    R3 = ctx->K[7] ^ BSWAP(((u32*)PT)[3]);
+    R2 = ctx->K[6] ^ BSWAP(((u32*)PT)[2]);
+    R1 = ctx->K[5] ^ BSWAP(((u32*)PT)[1]);
+    R0 = ctx->K[4] ^ BSWAP(((u32*)PT)[0]);
+
+    DEC_ROUND(R0, R1, R2, R3, 15);
+    DEC_ROUND(R2, R3, R0, R1, 14);
+    DEC_ROUND(R0, R1, R2, R3, 13);
+    DEC_ROUND(R2, R3, R0, R1, 12);
+    DEC_ROUND(R0, R1, R2, R3, 11);
+    DEC_ROUND(R2, R3, R0, R1, 10);
+    DEC_ROUND(R0, R1, R2, R3, 9);
+    DEC_ROUND(R2, R3, R0, R1, 8);
+    DEC_ROUND(R0, R1, R2, R3, 7);
+    DEC_ROUND(R2, R3, R0, R1, 6);
+    DEC_ROUND(R0, R1, R2, R3, 5);
+    DEC_ROUND(R2, R3, R0, R1, 4);
+    DEC_ROUND(R0, R1, R2, R3, 3);
+    DEC_ROUND(R2, R3, R0, R1, 2);
+    DEC_ROUND(R0, R1, R2, R3, 1);
+    DEC_ROUND(R2, R3, R0, R1, 0);
+
+    ((u32*)PT)[3] = BSWAP(R1 ^ ctx->K[3]);
+    ((u32*)PT)[2] = BSWAP(R0 ^ ctx->K[2]);
+    ((u32*)PT)[1] = BSWAP(R3 ^ ctx->K[1]);
+    ((u32*)PT)[0] = BSWAP(R2 ^ ctx->K[0]);
+}
+
+void twofish_encrypt_compact_blocks(const TWOFISH_COMPACT *ck, const BYTE *in, BYTE *out, size_t nblocks)
+{
+    BYTE tail[16];
+    size_t i;
+
+    for (i = twofish_shuffle_encrypt(ck, in, out, nblocks); i < nblocks; i++)
+    {
+        memcpy(tail, in + 16 * i, 16);
+        twofish_encrypt_compact(ck, tail);
+        memcpy(out + 16 * i, tail, 16);
+    }
+}
+
+void twofish_decrypt_compact_blocks(const TWOFISH_COMPACT *ck, const BYTE *in, BYTE *out, size_t nblocks)
+{
+    BYTE tail[16];
+    size_t i;
+
+    for (i = twofish_shuffle_decrypt(ck, in, out, nblocks); i < nblocks; i++)
+    {
+        memcpy(tail, in + 16 * i, 16);
+        twofish_decrypt_compact(ck, tail);
+        memcpy(out + 16 * i, tail, 16);
+    }
+}
+
+/*
+   Adaptive context. Until promotion g is the keyed S-boxes followed by
+   the MDS multiply, three lookups per byte instead of one.
+*/
+#undef fkh
+#define fkh(X) (MDS0((u32)SB[0][b0(X)]) ^ MDS1((u32)SB[1][b1(X)]) ^ \
+                MDS2((u32)SB[2][b2(X)]) ^ MDS3((u32)SB[3][b3(X)]))
+
+static void partial_encrypt(const TWOFISH_ADAPTIVE *ad, BYTE PT[16])
+{
+    const TWOFISH_CTX *ctx = &ad->full;
+    const BYTE (*SB)[256] = ad->SB;
+    u32 R0, R1, R2, R3;
+    u32 T0, T1;
+
+    R3 = ctx->K[3] ^ BSWAP(((u32*)PT)[3]);
+    R2 = ctx->K[2] ^ BSWAP(((u32*)PT)[2]);
+    R1 = ctx->K[1] ^ BSWAP(((u32*)PT)[1]);
+    R0 = ctx->K[0] ^ BSWAP(((u32*)PT)[0]);
+
+    ENC_ROUND(R0, R1, R2, R3, 0);
+    ENC_ROUND(R2, R3, R0, R1, 1);
+    ENC_ROUND(R0, R1, R2, R3, 2);
+    ENC_ROUND(R2, R3, R0, R1, 3);
+    ENC_ROUND(R0, R1, R2, R3, 4);
+    ENC_ROUND(R2, R3, R0, R1, 5);
+    ENC_ROUND(R0, R1, R2, R3, 6);
+    ENC_ROUND(R2, R3, R0, R1, 7);
+    ENC_ROUND(R0, R1, R2, R3, 8);
+    ENC_ROUND(R2, R3, R0, R1, 9);
+    ENC_ROUND(R0, R1, R2, R3, 10);
+    ENC_ROUND(R2, R3, R0, R1, 11);
+    ENC_ROUND(R0, R1, R2, R3, 12);
+    ENC_ROUND(R2, R3, R0, R1, 13);
+    ENC_ROUND(R0, R1, R2, R3, 14);
+    ENC_ROUND(R2, R3, R0, R1, 15);
+
+    ((u32*)PT)[3] = BSWAP(R1 ^ ctx->K[7]);
+    ((u32*)PT)[2] = BSWAP(R0 ^ ctx->K[6]);
+    ((u32*)PT)[1] = BSWAP(R3 ^ ctx->K[5]);
+    ((u32*)PT)[0] = BSWAP(R2 ^ ctx->K[4]);
+}
+
+static void partial_decrypt(const TWOFISH_ADAPTIVE *ad, BYTE PT[16])
+{
+    const TWOFISH_CTX *ctx = &ad->full;
+    const BYTE (*SB)[256] = ad->SB;
+    u32 T0, T1;
+    u32 R0, R1, R2, R3;
+
+    R3 = ctx->K[7] ^ BSWAP(((u32*)PT)[3]);
+    R2 = ctx->K[6] ^ BSWAP(((u32*)PT)[2]);
+    R1 = ctx->K[5] ^ BSWAP(((u32*)PT)[1]);
+    R0 = ctx->K[4] ^ BSWAP(((u32*)PT)[0]);
+
+    DEC_ROUND(R0, R1, R2, R3, 15);
+    DEC_ROUND(R2, R3, R0, R1, 14);
+    DEC_ROUND(R0, R1, R2, R3, 13);
+    DEC_ROUND(R2, R3, R0, R1, 12);
+    DEC_ROUND(R0, R1, R2, R3, 11);
+    DEC_ROUND(R2, R3, R0, R1, 10);
+    DEC_ROUND(R0, R1, R2, R3, 9);
+    DEC_ROUND(R2, R3, R0, R1, 8);
+    DEC_ROUND(R0, R1, R2, R3, 7);
+    DEC_ROUND(R2, R3, R0, R1, 6);
+    DEC_ROUND(R0, R1, R2, R3, 5);
+    DEC_ROUND(R2, R3, R0, R1, 4);
+    DEC_ROUND(R0, R1, R2, R3, 3);
+    DEC_ROUND(R2, R3, R0, R1, 2);
+    DEC_ROUND(R0, R1, R2, R3, 1);
+    DEC_ROUND(R2, R3, R0, R1, 0);
+
+    ((u32*)PT)[3] = BSWAP(R1 ^ ctx->K[3]);
+    ((u32*)PT)[2] = BSWAP(R0 ^ ctx->K[2]);
+    ((u32*)PT)[1] = BSWAP(R3 ^ ctx->K[1]);
+    ((u32*)PT)[0] = BSWAP(R2 ^ ctx->K[0]);
+}
+
+void twofish_adaptive_set_key(TWOFISH_ADAPTIVE *ad, BYTE M[], int key_size, size_t promote_after)
+{
+    TWOFISH_COMPACT ck;
+
+    twofish_compact_key(&ck, M, key_size);
+    memcpy(ad->full.K, ck.K, sizeof(ad->full.K));
+    keyedSboxes(ck.S, ck.k, ad->SB);
+    secure_zero(&ck, sizeof(ck));
+    ad->blocks = 0;
+    ad->promote_after = promote_after;
+    ad->promoted = 0;
+    if (promote_after == 0)
+        twofish_adaptive_full(ad);
+}
+
+TWOFISH_CTX *twofish_adaptive_full(TWOFISH_ADAPTIVE *ad)
+{
+    if (!ad->promoted)
+    {
+        sboxTables((const BYTE (*)[256])ad->SB, ad->full.QF);
+        ad->promoted = 1;
+    }
+    return &ad->full;
+}
+
+void twofish_adaptive_encrypt(TWOFISH_ADAPTIVE *ad, BYTE PT[16])
+{
+    if (!ad->promoted && ++ad->blocks <= ad->promote_after)
+        partial_encrypt(ad, PT);
+    else
+        twofish_encrypt(twofish_adaptive_full(ad), PT);
+}
+
+void twofish_adaptive_decrypt(TWOFISH_ADAPTIVE *ad, BYTE PT[16])
+{
+    if (!ad->promoted && ++ad->blocks <= ad->promote_after)
+        partial_decrypt(ad, PT);
+    else
+        twofish_decrypt(twofish_adaptive_full(ad), PT);
+}
+
+void twofish_adaptive_free(TWOFISH_ADAPTIVE *ad)
+{
+    secure_zero(ad, sizeof(*ad));
+}
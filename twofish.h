@@ -1,6 +1,8 @@
 #ifndef TWOFISH_H
 #define TWOFISH_H
 
+#include <stddef.h>
+
 #define u32 unsigned int
 #define BYTE unsigned char
 #ifndef BIG_ENDIAN
@@ -15,18 +17,79 @@ typedef struct {
     u32 QF[4][256];      /* Fully keyed Q function */
 } TWOFISH_CTX;
 
+/* Compact key: round keys and S-box key words, from which QF is rebuilt */
+typedef struct {
+    u32 K[40];           /* Expanded key */
+    u32 S[4];            /* S-box key words */
+    int k;               /* key length in 64-bit words */
+} TWOFISH_COMPACT;
+
+/*
+   Adaptive context: starts partially keyed, with the round keys and the
+   keyed 8-bit S-boxes, which take about half of a full key setup, and
+   builds the QF tables from the S-boxes once promote_after blocks have
+   been processed or a bulk caller asks for the full context. Promotion
+   is not synchronized; callers sharing one context serialize it.
+*/
+typedef struct {
+    TWOFISH_CTX full;        /* K always set; QF only once promoted */
+    BYTE SB[4][256];         /* keyed S-boxes, before the MDS multiply */
+    size_t blocks;           /* blocks processed while partially keyed */
+    size_t promote_after;
+    int promoted;
+} TWOFISH_ADAPTIVE;
+
 /* Initialize a Twofish context */
 void twofish_init_ctx(TWOFISH_CTX *ctx);
 
 /* Set the key for a Twofish context */
 void twofish_set_key(TWOFISH_CTX *ctx, BYTE M[], int key_size);
 
+/* Run the key schedule up to the S-box keys, without building QF */
+void twofish_compact_key(TWOFISH_COMPACT *ck, BYTE M[], int key_size);
+
+/* Build the full context of a compact key */
+void twofish_expand_key(const TWOFISH_COMPACT *ck, TWOFISH_CTX *ctx);
+
 /* Encrypt a block using Twofish */
 void twofish_encrypt(TWOFISH_CTX *ctx, BYTE PT[16]);
 
 /* Decrypt a block using Twofish */
 void twofish_decrypt(TWOFISH_CTX *ctx, BYTE PT[16]);
 
+/* Encrypt nblocks independent blocks, several at a time; in and out may be the same */
+void twofish_encrypt_blocks(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out, size_t nblocks);
+
+/* Decrypt nblocks independent blocks, several at a time; in and out may be the same */
+void twofish_decrypt_blocks(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out, size_t nblocks);
+
+/* Encrypt or decrypt a block straight from a compact key, computing g on the fly */
+void twofish_encrypt_compact(const TWOFISH_COMPACT *ck, BYTE PT[16]);
+void twofish_decrypt_compact(const TWOFISH_COMPACT *ck, BYTE PT[16]);
+
+/*
+   The same for nblocks independent blocks; in and out may be the same.
+   With AVX2, g runs on eight blocks at a time through byte shuffles
+   (twofish_shuffle.h), short calls included, and costs the same for every
+   key and block. Without it every block goes through the scalar g of
+   twofish_encrypt_compact, whose q-table lookups are not constant time.
+*/
+void twofish_encrypt_compact_blocks(const TWOFISH_COMPACT *ck, const BYTE *in, BYTE *out, size_t nblocks);
+void twofish_decrypt_compact_blocks(const TWOFISH_COMPACT *ck, const BYTE *in, BYTE *out, size_t nblocks);
+
+/* Key an adaptive context; promote_after 0 builds the full tables right away */
+void twofish_adaptive_set_key(TWOFISH_ADAPTIVE *ad, BYTE M[], int key_size, size_t promote_after);
+
+/* The full context of an adaptive one, promoting it first if needed */
+TWOFISH_CTX *twofish_adaptive_full(TWOFISH_ADAPTIVE *ad);
+
+/* Encrypt or decrypt one block, promoting the context when the count is reached */
+void twofish_adaptive_encrypt(TWOFISH_ADAPTIVE *ad, BYTE PT[16]);
+void twofish_adaptive_decrypt(TWOFISH_ADAPTIVE *ad, BYTE PT[16]);
+
+/* Wipe an adaptive context */
+void twofish_adaptive_free(TWOFISH_ADAPTIVE *ad);
+
 /* Free resources in a Twofish context */
 void twofish_free_ctx(TWOFISH_CTX *ctx);
 
@@ -0,0 +1,432 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "twofish_alloc.h"
+#include "secure_pool.h"
+#include "sha256.h"
+
+#if defined(__linux__)
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_MMAP 1
+#elif defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/mman.h>
+#define HAVE_MMAP 1
+#endif
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+#define MAX_CPUS 4096
+
+#define ROUND_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/*
+   Every context handed out by twofish_ctx_alloc is preceded by one cache
+   line holding this header, so release knows how the memory was obtained.
+*/
+typedef struct {
+    void *raw;         /* start of the allocation */
+    size_t map_len;    /* length of the mapping, 0 for heap memory */
+    int secure;        /* 1 if raw came from the secure pool */
+} alloc_hdr;
+
+#define HDR(ctx) ((alloc_hdr *)((unsigned char *)(ctx) - TWOFISH_CACHELINE))
+
+/* NUMA topology, read once from sysfs */
+static int numa_nodes = 1;
+static short cpu_node[MAX_CPUS];
+
+#if defined(__linux__)
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+/* parse a sysfs cpu/node list such as "0-3,8-11", calling fn for each id */
+static void parse_list(const char *path, void (*fn)(int id, int arg), int arg)
+{
+    char buf[4096];
+    char *p, *end;
+    long lo, hi;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL)
+        return;
+    if (fgets(buf, sizeof(buf), f) == NULL)
+        buf[0] = '\0';
+    fclose(f);
+
+    p = buf;
+    while (*p)
+    {
+        lo = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        hi = lo;
+        p = end;
+        if (*p == '-')
+        {
+            hi = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (; lo <= hi; lo++)
+            fn((int)lo, arg);
+        if (*p != ',')
+            break;
+        p++;
+    }
+}
+
+static void note_node(int id, int arg)
+{
+    (void)arg;
+    if (id < TWOFISH_MAX_NODES && id + 1 > numa_nodes)
+        numa_nodes = id + 1;
+}
+
+static void note_cpu(int id, int node)
+{
+    if (id < MAX_CPUS)
+        cpu_node[id] = (short)node;
+}
+
+static void read_topology(void)
+{
+    char path[64];
+    int node;
+
+    parse_list("/sys/devices/system/node/possible", note_node, 0);
+    for (node = 0; node < numa_nodes; node++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        parse_list(path, note_cpu, node);
+    }
+}
+
+/* bind [addr, addr+len) to a node before it is first touched (best effort) */
+static void bind_to_node(void *addr, size_t len, int node)
+{
+#ifdef SYS_mbind
+    unsigned long mask[TWOFISH_MAX_NODES / (8 * sizeof(unsigned long))];
+
+    if (node < 0 || node >= TWOFISH_MAX_NODES)
+        return;
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, addr, len, MPOL_BIND, mask, TWOFISH_MAX_NODES + 1, 0);
+#else
+    (void)addr; (void)len; (void)node;
+#endif
+}
+#endif
+
+int twofish_numa_nodes(void)
+{
+#if defined(__linux__)
+    pthread_once(&topology_once, read_topology);
+#endif
+    return numa_nodes;
+}
+
+int twofish_current_node(void)
+{
+#if defined(__linux__)
+    int cpu;
+
+    pthread_once(&topology_once, read_topology);
+    if (numa_nodes == 1)
+        return 0;
+    cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= MAX_CPUS)
+        return 0;
+    return cpu_node[cpu];
+#else
+    return 0;
+#endif
+}
+
+#ifdef HAVE_MMAP
+static size_t page_size(void)
+{
+    long ps = sysconf(_SC_PAGESIZE);
+    return ps > 0 ? (size_t)ps : 4096;
+}
+
+static size_t lock_failures;
+
+/* map len bytes, optionally on huge pages; *huge and *locked report what we got */
+static void *map_pages(size_t len, int want_huge, int node, int lock, int *huge, int *locked)
+{
+    void *p = MAP_FAILED;
+
+    *huge = 0;
+    *locked = 0;
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    if (want_huge)
+    {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            *huge = 1;
+    }
+#endif
+    if (p == MAP_FAILED)
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+#if defined(__linux__)
+#ifdef MADV_HUGEPAGE
+    /* no reserved huge pages: ask for transparent ones instead */
+    if (want_huge && !*huge)
+        madvise(p, len, MADV_HUGEPAGE);
+#endif
+    if (node >= 0)
+        bind_to_node(p, len, node);
+#ifdef MADV_DONTDUMP
+    if (lock)
+        madvise(p, len, MADV_DONTDUMP);
+#endif
+#else
+    (void)node;
+#endif
+    /* locking also faults the pages in, after the node binding is in place */
+    if (lock)
+    {
+        /* e.g. over RLIMIT_MEMLOCK: still usable, but it may be swapped out */
+        *locked = mlock(p, len) == 0;
+        if (!*locked)
+            __atomic_add_fetch(&lock_failures, 1, __ATOMIC_RELAXED);
+    }
+    return p;
+}
+#endif
+
+TWOFISH_CTX *twofish_ctx_alloc(int flags, int node)
+{
+    unsigned char *raw;
+    TWOFISH_CTX *ctx;
+    size_t len;
+    int secure = (flags & TWOFISH_ALLOC_SECURE) != 0;
+
+#ifdef HAVE_MMAP
+    if ((flags & (TWOFISH_ALLOC_PAGE | TWOFISH_ALLOC_HUGE)) || node >= 0)
+    {
+        size_t ps = page_size();
+        int huge, locked;
+
+        /* the header sits at the end of the first page, the context on the second */
+        len = ps + ROUND_UP(sizeof(TWOFISH_CTX), ps);
+        raw = map_pages(len, 0, node, secure, &huge, &locked);
+        if (raw == NULL)
+            return NULL;
+        ctx = (TWOFISH_CTX *)(raw + ps);
+        HDR(ctx)->raw = raw;
+        HDR(ctx)->map_len = len;
+        HDR(ctx)->secure = 0;
+        twofish_init_ctx(ctx);
+        return ctx;
+    }
+#else
+    (void)node;
+#endif
+
+    if (secure)
+    {
+        /* slab chunks of this size are cache-line aligned */
+        raw = secure_alloc(TWOFISH_CACHELINE + sizeof(TWOFISH_CTX));
+        if (raw == NULL)
+            return NULL;
+        ctx = (TWOFISH_CTX *)(raw + TWOFISH_CACHELINE);
+        HDR(ctx)->raw = raw;
+        HDR(ctx)->map_len = 0;
+        HDR(ctx)->secure = 1;
+        return ctx;
+    }
+
+    len = TWOFISH_CACHELINE + sizeof(TWOFISH_CTX);
+    raw = malloc(len + TWOFISH_CACHELINE - 1);
+    if (raw == NULL)
+        return NULL;
+    ctx = (TWOFISH_CTX *)ROUND_UP((size_t)raw + TWOFISH_CACHELINE, TWOFISH_CACHELINE);
+    HDR(ctx)->raw = raw;
+    HDR(ctx)->map_len = 0;
+    HDR(ctx)->secure = 0;
+    twofish_init_ctx(ctx);
+    return ctx;
+}
+
+void twofish_ctx_release(TWOFISH_CTX *ctx)
+{
+    alloc_hdr hdr;
+
+    if (ctx == NULL)
+        return;
+    twofish_free_ctx(ctx);
+    hdr = *HDR(ctx);
+    if (hdr.secure)
+    {
+        secure_free(hdr.raw);
+        return;
+    }
+#ifdef HAVE_MMAP
+    if (hdr.map_len)
+    {
+        munlock(hdr.raw, hdr.map_len);
+        munmap(hdr.raw, hdr.map_len);
+        return;
+    }
+#endif
+    free(hdr.raw);
+}
+
+size_t twofish_alloc_lock_failures(void)
+{
+#ifdef HAVE_MMAP
+    return __atomic_load_n(&lock_failures, __ATOMIC_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+int twofish_keyring_init(TWOFISH_KEYRING *ring, size_t count, int flags, int node)
+{
+    size_t len;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->stride = ROUND_UP(sizeof(TWOFISH_CTX), TWOFISH_CACHELINE);
+    ring->count = count;
+    ring->flags = flags;
+    ring->node = node;
+    if (count == 0)
+        return 0;
+    if (count > ((size_t)-1 - TWOFISH_HUGE_PAGE) / ring->stride)
+        return -1;
+    len = count * ring->stride;
+
+#ifdef HAVE_MMAP
+    /* secure keyrings are always mapped, so the whole array can be locked */
+    if ((flags & (TWOFISH_ALLOC_PAGE | TWOFISH_ALLOC_HUGE | TWOFISH_ALLOC_SECURE)) || node >= 0)
+    {
+        int want_huge = (flags & TWOFISH_ALLOC_HUGE) != 0;
+
+        len = ROUND_UP(len, want_huge ? TWOFISH_HUGE_PAGE : page_size());
+        ring->base = map_pages(len, want_huge, node, (flags & TWOFISH_ALLOC_SECURE) != 0, &ring->huge,
+                               &ring->locked);
+        if (ring->base == NULL)
+            return -1;
+        ring->bytes = len;
+        return 0;
+    }
+#endif
+
+    /* heap fallback: keep the raw pointer in the cache line before the array */
+    {
+        unsigned char *raw = calloc(1, len + 2 * TWOFISH_CACHELINE);
+        if (raw == NULL)
+            return -1;
+        ring->base = (unsigned char *)ROUND_UP((size_t)raw + TWOFISH_CACHELINE, TWOFISH_CACHELINE);
+        ((void **)ring->base)[-1] = raw;
+    }
+    ring->bytes = 0;
+    return 0;
+}
+
+void twofish_keyring_free(TWOFISH_KEYRING *ring)
+{
+    size_t i;
+
+    if (ring->base == NULL)
+        return;
+    for (i = 0; i < ring->count; i++)
+        twofish_free_ctx(twofish_keyring_ctx(ring, i));
+#ifdef HAVE_MMAP
+    if (ring->bytes)
+        munmap(ring->base, ring->bytes);
+    else
+#endif
+        free(((void **)ring->base)[-1]);
+    ring->base = NULL;
+    ring->count = 0;
+}
+
+/* subkeys expanded per pass of twofish_keyring_derive */
+#define DERIVE_CHUNK 256
+
+int twofish_keyring_derive(TWOFISH_KEYRING *ring, size_t start, const unsigned char prk[32],
+                           const unsigned char *const *infos, const size_t *info_lens,
+                           size_t n, int key_bytes)
+{
+    unsigned char *keys;
+    size_t done, i, m;
+
+    if (key_bytes != 16 && key_bytes != 24 && key_bytes != 32)
+        return -1;
+    if (start > ring->count || n > ring->count - start)
+        return -1;
+
+    keys = secure_alloc(DERIVE_CHUNK * (size_t)key_bytes);
+    if (keys == NULL)
+        return -1;
+    for (done = 0; done < n; done += m)
+    {
+        m = n - done < DERIVE_CHUNK ? n - done : DERIVE_CHUNK;
+        hkdf_sha256_expand_batch(prk, infos + done, info_lens + done, m, keys, key_bytes);
+        for (i = 0; i < m; i++)
+            twofish_set_key(twofish_keyring_ctx(ring, start + done + i),
+                            keys + i * key_bytes, key_bytes * 8);
+    }
+    secure_free(keys);
+    return 0;
+}
+
+int twofish_replicate(TWOFISH_REPLICATED *rep, const TWOFISH_CTX *src)
+{
+    int node;
+
+    memset(rep, 0, sizeof(*rep));
+    rep->nodes = twofish_numa_nodes();
+    for (node = 0; node < rep->nodes; node++)
+    {
+        /* a single node gets a plain aligned copy, no binding needed */
+        rep->replica[node] = twofish_ctx_alloc(TWOFISH_ALLOC_PAGE | TWOFISH_ALLOC_SECURE,
+                                               rep->nodes > 1 ? node : -1);
+        if (rep->replica[node] == NULL)
+        {
+            twofish_replicate_free(rep);
+            return -1;
+        }
+        memcpy(rep->replica[node], src, sizeof(TWOFISH_CTX));
+    }
+    return 0;
+}
+
+TWOFISH_CTX *twofish_replica_local(TWOFISH_REPLICATED *rep)
+{
+    int node;
+
+    if (rep->nodes <= 1)
+        return rep->replica[0];
+    node = twofish_current_node();
+    if (node >= rep->nodes || rep->replica[node] == NULL)
+        node = 0;
+    return rep->replica[node];
+}
+
+void twofish_replicate_free(TWOFISH_REPLICATED *rep)
+{
+    int node;
+
+    for (node = 0; node < rep->nodes; node++)
+    {
+        twofish_ctx_release(rep->replica[node]);
+        rep->replica[node] = NULL;
+    }
+    rep->nodes = 0;
+}
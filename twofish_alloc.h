@@ -0,0 +1,79 @@
+#ifndef TWOFISH_ALLOC_H
+#define TWOFISH_ALLOC_H
+
+#include <stddef.h>
+#include "twofish.h"
+
+#define TWOFISH_CACHELINE 64
+#define TWOFISH_HUGE_PAGE (2UL * 1024 * 1024)
+#define TWOFISH_MAX_NODES 64
+
+/* Allocation flags */
+#define TWOFISH_ALLOC_DEFAULT 0x0   /* cache-line aligned heap memory */
+#define TWOFISH_ALLOC_PAGE    0x1   /* page aligned, private mapping */
+#define TWOFISH_ALLOC_HUGE    0x2   /* try 2 MiB huge pages, fall back to pages */
+#define TWOFISH_ALLOC_SECURE  0x4   /* locked, not dumped (secure pool for single contexts,
+                                       a locked mapping for keyrings) */
+
+/* Contiguous array of contexts (a keyring) */
+typedef struct {
+    unsigned char *base; /* count contexts, stride bytes apart */
+    size_t stride;       /* sizeof(TWOFISH_CTX) rounded up to a cache line */
+    size_t count;
+    size_t bytes;        /* size of the mapping backing base */
+    int flags;
+    int huge;            /* 1 if backed by huge pages */
+    int locked;          /* 1 if mlock'ed; 0 when TWOFISH_ALLOC_SECURE could not lock it */
+    int node;            /* NUMA node the memory is bound to, -1 if none */
+} TWOFISH_KEYRING;
+
+/* i-th context of a keyring */
+#define twofish_keyring_ctx(ring, i) \
+    ((TWOFISH_CTX *)((ring)->base + (size_t)(i) * (ring)->stride))
+
+/* One read-only copy of a context per NUMA node */
+typedef struct {
+    int nodes;
+    TWOFISH_CTX *replica[TWOFISH_MAX_NODES];
+} TWOFISH_REPLICATED;
+
+/* Number of NUMA nodes on this host (1 if unknown) */
+int twofish_numa_nodes(void);
+
+/* NUMA node of the calling thread (0 if unknown) */
+int twofish_current_node(void);
+
+/* Allocate a context with the given flags; node is -1 for no binding */
+TWOFISH_CTX *twofish_ctx_alloc(int flags, int node);
+
+/* Release a context returned by twofish_ctx_alloc */
+void twofish_ctx_release(TWOFISH_CTX *ctx);
+
+/* Allocate a keyring of count contexts; returns 0 on success */
+int twofish_keyring_init(TWOFISH_KEYRING *ring, size_t count, int flags, int node);
+
+/* Release a keyring */
+void twofish_keyring_free(TWOFISH_KEYRING *ring);
+
+/* Secure context and keyring mappings that could not be mlock'ed */
+size_t twofish_alloc_lock_failures(void);
+
+/*
+   Key contexts start..start+n-1 with HKDF-SHA256 subkeys of key_bytes bytes
+   expanded from prk, subkey i using infos[i] as its context. The subkeys
+   only ever exist in the secure pool. Returns 0 on success.
+*/
+int twofish_keyring_derive(TWOFISH_KEYRING *ring, size_t start, const unsigned char prk[32],
+                           const unsigned char *const *infos, const size_t *info_lens,
+                           size_t n, int key_bytes);
+
+/* Copy a keyed context onto every NUMA node; returns 0 on success */
+int twofish_replicate(TWOFISH_REPLICATED *rep, const TWOFISH_CTX *src);
+
+/* Return the replica local to the calling thread */
+TWOFISH_CTX *twofish_replica_local(TWOFISH_REPLICATED *rep);
+
+/* Release all replicas */
+void twofish_replicate_free(TWOFISH_REPLICATED *rep);
+
+#endif /* TWOFISH_ALLOC_H */
@@ -0,0 +1,316 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "twofish_cache.h"
+#include "twofish_alloc.h"
+#include "secure_pool.h"
+#include "sha256.h"
+
+struct twofish_cache_entry
+{
+    TWOFISH_CTX *ctx;
+    BYTE digest[SHA256_DIGEST_SIZE];   /* keyed hash of the key */
+    size_t refs;                       /* holders, the table counting as one */
+    twofish_cache_entry *next;         /* bucket chain */
+    twofish_cache_entry *newer;        /* LRU list of the shard */
+    twofish_cache_entry *older;
+};
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    twofish_cache_entry **buckets;
+    size_t mask;                       /* buckets - 1 */
+    twofish_cache_entry *newest;
+    twofish_cache_entry *oldest;
+    size_t count;
+    size_t capacity;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} cache_shard;
+
+/* one shard per cache line pair, so neighbouring locks do not share a line */
+typedef union
+{
+    cache_shard s;
+    BYTE pad[2 * TWOFISH_CACHELINE * ((sizeof(cache_shard) + 2 * TWOFISH_CACHELINE - 1) /
+                                      (2 * TWOFISH_CACHELINE))];
+} padded_shard;
+
+static padded_shard shards[TWOFISH_CACHE_MAX_SHARDS];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t nshards;                 /* 0 while disabled */
+static size_t total_capacity;
+static hmac_sha256_ctx *hash_key;      /* HMAC with the per-process secret absorbed */
+
+static void cache_init(void)
+{
+    size_t i;
+
+    for (i = 0; i < TWOFISH_CACHE_MAX_SHARDS; i++)
+        pthread_mutex_init(&shards[i].s.lock, NULL);
+}
+
+static void entry_put(twofish_cache_entry *e)
+{
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        twofish_ctx_release(e->ctx);
+        secure_free(e);
+    }
+}
+
+static void lru_unlink(cache_shard *sh, twofish_cache_entry *e)
+{
+    if (e->newer)
+        e->newer->older = e->older;
+    else
+        sh->newest = e->older;
+    if (e->older)
+        e->older->newer = e->newer;
+    else
+        sh->oldest = e->newer;
+}
+
+static void lru_push(cache_shard *sh, twofish_cache_entry *e)
+{
+    e->newer = NULL;
+    e->older = sh->newest;
+    if (sh->newest)
+        sh->newest->newer = e;
+    else
+        sh->oldest = e;
+    sh->newest = e;
+}
+
+static size_t bucket_of(const cache_shard *sh, const BYTE digest[SHA256_DIGEST_SIZE])
+{
+    uint64_t h;
+
+    memcpy(&h, digest + 8, sizeof(h));
+    return (size_t)h & sh->mask;
+}
+
+/* Take e out of the table and drop the table's reference; shard locked */
+static void shard_remove(cache_shard *sh, twofish_cache_entry *e)
+{
+    twofish_cache_entry **p = &sh->buckets[bucket_of(sh, e->digest)];
+
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    lru_unlink(sh, e);
+    sh->count--;
+    entry_put(e);
+}
+
+static void shard_clear(cache_shard *sh)
+{
+    while (sh->oldest)
+        shard_remove(sh, sh->oldest);
+}
+
+int twofish_cache_configure(size_t capacity, size_t count)
+{
+    twofish_cache_entry **buckets[TWOFISH_CACHE_MAX_SHARDS];
+    size_t i, per_shard, nbuckets = 1;
+    BYTE secret[SHA256_DIGEST_SIZE];
+
+    if (count < 1 || count > TWOFISH_CACHE_MAX_SHARDS)
+        return -1;
+    pthread_once(&cache_once, cache_init);
+    if (capacity && count > capacity)
+        count = capacity;
+    per_shard = capacity ? (capacity + count - 1) / count : 0;
+    while (nbuckets < per_shard)
+        nbuckets <<= 1;
+
+    pthread_mutex_lock(&config_lock);
+    if (capacity && hash_key == NULL)
+    {
+        hash_key = secure_alloc(sizeof(hmac_sha256_ctx));
+        if (hash_key == NULL || getentropy(secret, sizeof(secret)) < 0)
+        {
+            secure_free(hash_key);
+            hash_key = NULL;
+            pthread_mutex_unlock(&config_lock);
+            return -1;
+        }
+        hmac_sha256_init(hash_key, secret, sizeof(secret));
+        secure_zero(secret, sizeof(secret));
+    }
+    for (i = 0; i < (capacity ? count : 0); i++)
+    {
+        buckets[i] = calloc(nbuckets, sizeof(twofish_cache_entry *));
+        if (buckets[i] == NULL)
+        {
+            while (i-- > 0)
+                free(buckets[i]);
+            pthread_mutex_unlock(&config_lock);
+            return -1;
+        }
+    }
+
+    /* lookups pick their shard before locking it, so every shard is reset */
+    for (i = 0; i < TWOFISH_CACHE_MAX_SHARDS; i++)
+    {
+        cache_shard *sh = &shards[i].s;
+
+        pthread_mutex_lock(&sh->lock);
+        shard_clear(sh);
+        free(sh->buckets);
+        sh->buckets = NULL;
+        sh->mask = 0;
+        sh->capacity = 0;
+        sh->hits = sh->misses = sh->evictions = 0;
+        if (capacity && i < count)
+        {
+            sh->buckets = buckets[i];
+            sh->mask = nbuckets - 1;
+            sh->capacity = per_shard;
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+    total_capacity = capacity;
+    __atomic_store_n(&nshards, capacity ? count : 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&config_lock);
+    return 0;
+}
+
+twofish_cache_entry *twofish_cache_acquire(const BYTE *key, int key_bytes)
+{
+    size_t n = __atomic_load_n(&nshards, __ATOMIC_ACQUIRE), b;
+    twofish_cache_entry *e, *fresh;
+    hmac_sha256_ctx h;
+    BYTE digest[SHA256_DIGEST_SIZE], len = (BYTE)key_bytes;
+    cache_shard *sh;
+    uint64_t pick;
+
+    if (n == 0)
+        return NULL;
+    h = *hash_key;
+    hmac_sha256_update(&h, &len, 1);
+    hmac_sha256_update(&h, key, (size_t)key_bytes);
+    hmac_sha256_final(&h, digest);
+    secure_zero(&h, sizeof(h));
+    memcpy(&pick, digest, sizeof(pick));
+    sh = &shards[pick % n].s;
+
+    pthread_mutex_lock(&sh->lock);
+    for (e = sh->capacity ? sh->buckets[bucket_of(sh, digest)] : NULL; e; e = e->next)
+        if (memcmp(e->digest, digest, sizeof(digest)) == 0)
+            break;
+    if (e != NULL)
+    {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        lru_unlink(sh, e);
+        lru_push(sh, e);
+        sh->hits++;
+        pthread_mutex_unlock(&sh->lock);
+        return e;
+    }
+    sh->misses++;
+    pthread_mutex_unlock(&sh->lock);
+
+    /* key setup runs unlocked; a racing thread may insert the same key first */
+    fresh = secure_alloc(sizeof(*fresh));
+    if (fresh == NULL)
+        return NULL;
+    fresh->ctx = twofish_ctx_alloc(TWOFISH_ALLOC_SECURE, -1);
+    if (fresh->ctx == NULL)
+    {
+        secure_free(fresh);
+        return NULL;
+    }
+    twofish_set_key(fresh->ctx, (BYTE *)key, key_bytes * 8);
+    memcpy(fresh->digest, digest, sizeof(digest));
+    fresh->refs = 1;
+
+    pthread_mutex_lock(&sh->lock);
+    if (sh->capacity == 0)
+    {
+        /* reconfigured meanwhile: hand out an uncached schedule */
+        pthread_mutex_unlock(&sh->lock);
+        return fresh;
+    }
+    b = bucket_of(sh, digest);
+    for (e = sh->buckets[b]; e; e = e->next)
+        if (memcmp(e->digest, digest, sizeof(digest)) == 0)
+            break;
+    if (e != NULL)
+    {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        lru_unlink(sh, e);
+        lru_push(sh, e);
+        pthread_mutex_unlock(&sh->lock);
+        entry_put(fresh);
+        return e;
+    }
+    while (sh->count >= sh->capacity)
+    {
+        shard_remove(sh, sh->oldest);
+        sh->evictions++;
+    }
+    fresh->refs = 2;
+    fresh->next = sh->buckets[b];
+    sh->buckets[b] = fresh;
+    lru_push(sh, fresh);
+    sh->count++;
+    pthread_mutex_unlock(&sh->lock);
+    return fresh;
+}
+
+TWOFISH_CTX *twofish_cache_ctx(const twofish_cache_entry *entry)
+{
+    return entry->ctx;
+}
+
+void twofish_cache_release(twofish_cache_entry *entry)
+{
+    if (entry != NULL)
+        entry_put(entry);
+}
+
+void twofish_cache_clear(void)
+{
+    size_t i;
+
+    pthread_once(&cache_once, cache_init);
+    for (i = 0; i < TWOFISH_CACHE_MAX_SHARDS; i++)
+    {
+        pthread_mutex_lock(&shards[i].s.lock);
+        shard_clear(&shards[i].s);
+        pthread_mutex_unlock(&shards[i].s.lock);
+    }
+}
+
+void twofish_cache_stats(twofish_cache_stats_t *stats)
+{
+    size_t i;
+
+    pthread_once(&cache_once, cache_init);
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&config_lock);
+    stats->capacity = total_capacity;
+    stats->shards = nshards;
+    for (i = 0; i < nshards; i++)
+    {
+        cache_shard *sh = &shards[i].s;
+
+        pthread_mutex_lock(&sh->lock);
+        stats->entries += sh->count;
+        stats->hits += sh->hits;
+        stats->misses += sh->misses;
+        stats->evictions += sh->evictions;
+        pthread_mutex_unlock(&sh->lock);
+    }
+    pthread_mutex_unlock(&config_lock);
+}
@@ -0,0 +1,54 @@
+#ifndef TWOFISH_CACHE_H
+#define TWOFISH_CACHE_H
+
+#include <stddef.h>
+#include "twofish.h"
+
+/*
+   Process-wide cache of Twofish key schedules, off until configured.
+   Entries are found by an HMAC-SHA256 of the key under a per-process
+   secret, so the raw key is never stored, and spread over shards that
+   each have their own lock and LRU list. A schedule is shared by every
+   holder of its entry and is read-only; an evicted entry is zeroized
+   once its last holder releases it.
+*/
+
+typedef struct twofish_cache_entry twofish_cache_entry;
+
+#define TWOFISH_CACHE_MAX_SHARDS 64
+
+/* Cache counters, summed over the shards */
+typedef struct {
+    size_t capacity;        /* entries at most, 0 when disabled */
+    size_t shards;
+    size_t entries;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} twofish_cache_stats_t;
+
+/*
+   Hold up to capacity schedules in shards shards (1 to
+   TWOFISH_CACHE_MAX_SHARDS). Drops every cached entry; capacity 0
+   disables the cache. Returns 0, or -1 if the arguments or memory are bad.
+*/
+int twofish_cache_configure(size_t capacity, size_t shards);
+
+/*
+   Return the cached entry for key (key_bytes 16, 24 or 32), keying a new
+   one on a miss; the caller holds a reference until twofish_cache_release.
+   Returns NULL if the cache is disabled or memory runs out.
+*/
+twofish_cache_entry *twofish_cache_acquire(const BYTE *key, int key_bytes);
+
+/* The shared, keyed context of an entry; it must not be modified */
+TWOFISH_CTX *twofish_cache_ctx(const twofish_cache_entry *entry);
+
+void twofish_cache_release(twofish_cache_entry *entry);
+
+/* Evict every entry, keeping the configuration */
+void twofish_cache_clear(void);
+
+void twofish_cache_stats(twofish_cache_stats_t *stats);
+
+#endif /* TWOFISH_CACHE_H */
@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <string.h>
+#include "twofish_cmac.h"
+#include "simd_util.h"
+
+void twofish_cmac_dbl(BYTE block[16])
+{
+    BYTE carry = block[0] >> 7;
+    int i;
+
+    for (i = 0; i < 15; i++)
+        block[i] = (BYTE)((block[i] << 1) | (block[i + 1] >> 7));
+    block[15] = (BYTE)((block[15] << 1) ^ (carry ? 0x87 : 0));
+}
+
+void twofish_cmac_key_init(TWOFISH_CMAC_KEY *key, TWOFISH_CTX *ctx)
+{
+    key->ctx = ctx;
+    memset(key->k1, 0, 16);
+    twofish_encrypt(ctx, key->k1);
+    twofish_cmac_dbl(key->k1);
+    memcpy(key->k2, key->k1, 16);
+    twofish_cmac_dbl(key->k2);
+}
+
+void twofish_cmac_init(TWOFISH_CMAC *cmac, const TWOFISH_CMAC_KEY *key)
+{
+    cmac->key = key;
+    memset(cmac->mac, 0, 16);
+    cmac->buf_len = 0;
+}
+
+void twofish_cmac_update(TWOFISH_CMAC *cmac, const BYTE *data, size_t len)
+{
+    size_t n;
+
+    while (len)
+    {
+        /* a full buffer is only flushed once more data proves it is not the last block */
+        if (cmac->buf_len == 16)
+        {
+            simd_xor_block(cmac->mac, cmac->mac, cmac->buf);
+            twofish_encrypt(cmac->key->ctx, cmac->mac);
+            cmac->buf_len = 0;
+        }
+        n = 16 - cmac->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(cmac->buf + cmac->buf_len, data, n);
+        cmac->buf_len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void twofish_cmac_final(TWOFISH_CMAC *cmac, BYTE tag[16])
+{
+    if (cmac->buf_len == 16)
+    {
+        simd_xor_block(cmac->mac, cmac->mac, cmac->key->k1);
+    }
+    else
+    {
+        cmac->buf[cmac->buf_len] = 0x80;
+        memset(cmac->buf + cmac->buf_len + 1, 0, 15 - cmac->buf_len);
+        simd_xor_block(cmac->mac, cmac->mac, cmac->key->k2);
+    }
+    simd_xor_block(cmac->mac, cmac->mac, cmac->buf);
+    twofish_encrypt(cmac->key->ctx, cmac->mac);
+    memcpy(tag, cmac->mac, 16);
+    memset(cmac->mac, 0, 16);
+    memset(cmac->buf, 0, 16);
+}
+
+void twofish_cmac(const TWOFISH_CMAC_KEY *key, const BYTE *data, size_t len, BYTE tag[16])
+{
+    TWOFISH_CMAC cmac;
+
+    twofish_cmac_init(&cmac, key);
+    twofish_cmac_update(&cmac, data, len);
+    twofish_cmac_final(&cmac, tag);
+}
+
+/* Messages scheduled together by twofish_cmac_batch */
+#define WINDOW 256
+
+/* One message in flight in twofish_cmac_batch */
+typedef struct {
+    size_t msg;      /* index into msgs */
+    size_t block;    /* next block to absorb */
+    size_t blocks;   /* blocks in the message, at least one */
+} cmac_lane;
+
+/* the block message m contributes at step b, final-block processing included */
+static void cmac_block(const TWOFISH_CMAC_KEY *key, const BYTE *msg, size_t len,
+                       const BYTE *xorend, size_t b, size_t blocks, BYTE out[16])
+{
+    size_t off = 16 * b, n = len - off < 16 ? len - off : 16, i;
+
+    if (len < off)
+        n = 0;
+    memcpy(out, msg + off, n);
+    if (xorend && len >= 16)
+    {
+        /* bytes of this block that fall in the last 16 of the message */
+        for (i = 0; i < n; i++)
+            if (off + i >= len - 16)
+                out[i] ^= xorend[off + i - (len - 16)];
+    }
+    if (b + 1 < blocks)
+        return;
+    if (n == 16)
+    {
+        simd_xor_block(out, out, key->k1);
+    }
+    else
+    {
+        out[n] = 0x80;
+        memset(out + n + 1, 0, 15 - n);
+        simd_xor_block(out, out, key->k2);
+    }
+}
+
+static size_t cmac_blocks(size_t len)
+{
+    return len ? (len + 15) / 16 : 1;
+}
+
+/* length classes for the scheduling order; longer messages share the top class */
+#define CLASSES 64
+
+/*
+   Queue msgs[base..base+m) longest first, so the short ones fill the lanes
+   at the end. A counting sort: comparison sorting costs as much as the
+   cipher for one-block messages.
+*/
+static void cmac_schedule(const size_t *lens, size_t base, size_t m, cmac_lane *queue)
+{
+    size_t count[CLASSES + 1], i, c;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < m; i++)
+    {
+        c = cmac_blocks(lens[base + i]);
+        count[CLASSES - (c < CLASSES ? c : CLASSES)]++;
+    }
+    for (c = 0, i = 0; c <= CLASSES; c++)
+    {
+        size_t k = count[c];
+        count[c] = i;
+        i += k;
+    }
+    for (i = 0; i < m; i++)
+    {
+        cmac_lane *q;
+
+        c = cmac_blocks(lens[base + i]);
+        q = &queue[count[CLASSES - (c < CLASSES ? c : CLASSES)]++];
+        q->msg = base + i;
+        q->block = 0;
+        q->blocks = c;
+    }
+}
+
+void twofish_cmac_batch(const TWOFISH_CMAC_KEY *key, const BYTE *const *msgs, const size_t *lens,
+                        size_t n, const BYTE *xorend, BYTE *tags)
+{
+    cmac_lane lane[TWOFISH_CMAC_LANES], queue[WINDOW];
+    BYTE state[TWOFISH_CMAC_LANES][16], blk[16];
+    size_t active = 0, next = 0, queued = 0, base = 0, i, off, len;
+    const BYTE *p;
+
+    for (;;)
+    {
+        /* schedule the next window once the current one is handed out */
+        if (next == queued && base < n)
+        {
+            queued = n - base < WINDOW ? n - base : WINDOW;
+            cmac_schedule(lens, base, queued, queue);
+            base += queued;
+            next = 0;
+        }
+
+        /* refill idle lanes from the queue */
+        while (active < TWOFISH_CMAC_LANES && next < queued)
+        {
+            lane[active] = queue[next++];
+            memset(state[active], 0, 16);
+            active++;
+        }
+        if (active == 0)
+            break;
+
+        for (i = 0; i < active; i++)
+        {
+            off = 16 * lane[i].block;
+            len = lens[lane[i].msg];
+            p = msgs[lane[i].msg] + off;
+            if (xorend == NULL || off + 32 <= len)
+            {
+                /* whole blocks clear of the tail absorb straight from the message */
+                if (lane[i].block + 1 < lane[i].blocks)
+                {
+                    simd_xor_block(state[i], state[i], p);
+                    continue;
+                }
+                if (len == off + 16)
+                {
+                    simd_xor_block(state[i], state[i], p);
+                    simd_xor_block(state[i], state[i], key->k1);
+                    continue;
+                }
+            }
+            cmac_block(key, msgs[lane[i].msg], len, xorend, lane[i].block, lane[i].blocks, blk);
+            simd_xor_block(state[i], state[i], blk);
+        }
+        twofish_encrypt_blocks(key->ctx, state[0], state[0], active);
+
+        /* retire finished lanes, moving the last active lane into the gap */
+        for (i = 0; i < active; )
+        {
+            if (++lane[i].block < lane[i].blocks)
+            {
+                i++;
+                continue;
+            }
+            memcpy(tags + 16 * lane[i].msg, state[i], 16);
+            active--;
+            if (i < active)
+            {
+                lane[i] = lane[active];
+                memcpy(state[i], state[active], 16);
+            }
+        }
+    }
+    memset(state, 0, sizeof(state));
+    memset(blk, 0, sizeof(blk));
+}
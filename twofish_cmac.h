@@ -0,0 +1,48 @@
+#ifndef TWOFISH_CMAC_H
+#define TWOFISH_CMAC_H
+
+#include <stddef.h>
+#include "twofish.h"
+
+/* Lanes interleaved by twofish_cmac_batch */
+#define TWOFISH_CMAC_LANES 16
+
+/* A keyed context with its CMAC subkeys */
+typedef struct {
+    TWOFISH_CTX *ctx;
+    BYTE k1[16];
+    BYTE k2[16];
+} TWOFISH_CMAC_KEY;
+
+/* Streaming CMAC state; the last full block is held back until final */
+typedef struct {
+    const TWOFISH_CMAC_KEY *key;
+    BYTE mac[16];
+    BYTE buf[16];
+    size_t buf_len;
+} TWOFISH_CMAC;
+
+/* Multiply a block by x in GF(2^128), as for the CMAC subkeys */
+void twofish_cmac_dbl(BYTE block[16]);
+
+/* Derive the subkeys of an already keyed context */
+void twofish_cmac_key_init(TWOFISH_CMAC_KEY *key, TWOFISH_CTX *ctx);
+
+void twofish_cmac_init(TWOFISH_CMAC *cmac, const TWOFISH_CMAC_KEY *key);
+void twofish_cmac_update(TWOFISH_CMAC *cmac, const BYTE *data, size_t len);
+void twofish_cmac_final(TWOFISH_CMAC *cmac, BYTE tag[16]);
+void twofish_cmac(const TWOFISH_CMAC_KEY *key, const BYTE *data, size_t len, BYTE tag[16]);
+
+/*
+   Tag n independent messages into tags (16 bytes each). Up to
+   TWOFISH_CMAC_LANES chains run through the multi-block kernel together; a
+   lane is refilled as soon as its message ends, and messages are started
+   longest first (within windows of 256) so the lanes stay full to the end.
+   Lengths may differ freely. If xorend is
+   not NULL it is XORed into the last 16 bytes of every message of at least
+   16 bytes first (the S2V final step).
+*/
+void twofish_cmac_batch(const TWOFISH_CMAC_KEY *key, const BYTE *const *msgs, const size_t *lens,
+                        size_t n, const BYTE *xorend, BYTE *tags);
+
+#endif /* TWOFISH_CMAC_H */
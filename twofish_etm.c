@@ -0,0 +1,69 @@
+#include <string.h>
+#include "twofish_etm.h"
+#include "twofish_modes.h"
+#include "secure_pool.h"
+#include "simd_util.h"
+
+/* CBC blocks per chunk: 1 KiB, sixteen SHA-256 blocks */
+#define CHUNK 64
+
+size_t twofish_cbc_hmac_encrypt(TWOFISH_CTX *ctx, const hmac_sha256_ctx *key, const BYTE iv[16],
+                                const BYTE *in, size_t len, BYTE *out, BYTE tag[TWOFISH_ETM_TAG])
+{
+    hmac_sha256_ctx mac = *key;
+    BYTE chain[16], last[16];
+    size_t full = len / 16, done = 0, n;
+
+    memcpy(chain, iv, 16);
+    hmac_sha256_update(&mac, iv, 16);
+    while (done < full)
+    {
+        n = full - done < CHUNK ? full - done : CHUNK;
+        twofish_cbc_encrypt(ctx, chain, in + 16 * done, out + 16 * done, n);
+        hmac_sha256_update(&mac, out + 16 * done, 16 * n);
+        done += n;
+    }
+
+    memcpy(last, in + 16 * full, len % 16);
+    twofish_pad(last, len % 16);
+    twofish_cbc_encrypt(ctx, chain, last, out + 16 * full, 1);
+    hmac_sha256_update(&mac, out + 16 * full, 16);
+    hmac_sha256_final(&mac, tag);
+
+    secure_zero(last, sizeof(last));
+    secure_zero(&mac, sizeof(mac));
+    return 16 * (full + 1);
+}
+
+int twofish_cbc_hmac_decrypt(TWOFISH_CTX *ctx, const hmac_sha256_ctx *key, const BYTE iv[16],
+                             const BYTE *in, size_t len, BYTE *out, size_t *out_len,
+                             const BYTE tag[TWOFISH_ETM_TAG])
+{
+    hmac_sha256_ctx mac = *key;
+    BYTE chain[16], expected[TWOFISH_ETM_TAG];
+    size_t blocks = len / 16, done = 0, n;
+
+    if (len == 0 || len % 16)
+        return -1;
+
+    memcpy(chain, iv, 16);
+    hmac_sha256_update(&mac, iv, 16);
+    while (done < blocks)
+    {
+        /* MAC the ciphertext before the chunk is decrypted over it */
+        n = blocks - done < CHUNK ? blocks - done : CHUNK;
+        hmac_sha256_update(&mac, in + 16 * done, 16 * n);
+        twofish_cbc_decrypt(ctx, chain, in + 16 * done, out + 16 * done, n);
+        done += n;
+    }
+    hmac_sha256_final(&mac, expected);
+    secure_zero(&mac, sizeof(mac));
+
+    if (!simd_equal(expected, tag, TWOFISH_ETM_TAG))
+    {
+        secure_zero(out, len);
+        return -1;
+    }
+    *out_len = twofish_unpad(out, len);
+    return 0;
+}
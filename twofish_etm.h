@@ -0,0 +1,38 @@
+#ifndef TWOFISH_ETM_H
+#define TWOFISH_ETM_H
+
+#include <stddef.h>
+#include "twofish.h"
+#include "sha256.h"
+
+/*
+   CBC encrypt-then-MAC: PKCS#7-padded Twofish-CBC, authenticated with
+   HMAC-SHA256 over iv || ciphertext. The ciphertext is the same as plain
+   CBC, so the tag can travel next to an existing envelope.
+
+   Both directions run in chunks of a kilobyte: each chunk is encrypted (or
+   MACed) and then immediately MACed (or decrypted) while it is still in L1,
+   so the data is only brought in from memory once.
+*/
+
+#define TWOFISH_ETM_TAG SHA256_DIGEST_SIZE
+
+/*
+   Encrypt len bytes of in into out, which needs room for len / 16 * 16 + 16
+   bytes; returns the ciphertext length. key is an HMAC state from
+   hmac_sha256_init and is not modified.
+*/
+size_t twofish_cbc_hmac_encrypt(TWOFISH_CTX *ctx, const hmac_sha256_ctx *key, const BYTE iv[16],
+                                const BYTE *in, size_t len, BYTE *out, BYTE tag[TWOFISH_ETM_TAG]);
+
+/*
+   Verify tag and decrypt len bytes of in into out (len bytes of room); in
+   and out may be the same buffer. Returns 0 and the unpadded length in
+   *out_len, or -1 if len is not a non-zero multiple of 16 or the tag does
+   not match, in which case out is cleared.
+*/
+int twofish_cbc_hmac_decrypt(TWOFISH_CTX *ctx, const hmac_sha256_ctx *key, const BYTE iv[16],
+                             const BYTE *in, size_t len, BYTE *out, size_t *out_len,
+                             const BYTE tag[TWOFISH_ETM_TAG]);
+
+#endif /* TWOFISH_ETM_H */
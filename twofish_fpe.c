@@ -0,0 +1,341 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "twofish_fpe.h"
+#include "twofish_alloc.h"
+#include "secure_pool.h"
+#include "simd_util.h"
+
+/* values run through the rounds together */
+#define GROUP 64
+
+/* longest value for any radix: 63 bits per half in base 2 */
+#define MAX_NUMERALS 128
+
+typedef unsigned __int128 u128;
+
+/* What the rounds need for one value length under one tweak */
+typedef struct
+{
+    size_t u, v;            /* numerals in the first and second half */
+    uint64_t mu, mv;        /* radix^u, radix^v */
+    size_t b, d;            /* FF1: bytes of NUM(B) and of the round output used */
+    BYTE y0[16];            /* FF1: CBC-MAC of P and Q up to its last block */
+    BYTE last[16];          /* FF1: the last block of Q, round and half left blank */
+    BYTE tl[4], tr[4];      /* FF3-1: the tweak halves */
+} shape;
+
+TWOFISH_FPE *twofish_fpe_new(int mode, const BYTE *key, size_t key_len, unsigned radix)
+{
+    TWOFISH_FPE *fpe;
+    BYTE k[32];
+    uint64_t p;
+    size_t i;
+
+    if ((mode != TWOFISH_FF1 && mode != TWOFISH_FF3_1) || radix < 2 || radix > 256
+        || (key_len != 16 && key_len != 24 && key_len != 32))
+        return NULL;
+    fpe = calloc(1, sizeof(TWOFISH_FPE));
+    if (fpe == NULL)
+        return NULL;
+    fpe->ctx = twofish_ctx_alloc(TWOFISH_ALLOC_SECURE, -1);
+    if (fpe->ctx == NULL)
+    {
+        free(fpe);
+        return NULL;
+    }
+
+    /* FF3-1 runs the cipher under the key with its bytes reversed */
+    for (i = 0; i < key_len; i++)
+        k[i] = mode == TWOFISH_FF3_1 ? key[key_len - 1 - i] : key[i];
+    twofish_set_key(fpe->ctx, k, (int)key_len * 8);
+    secure_zero(k, sizeof(k));
+
+    fpe->mode = mode;
+    fpe->radix = radix;
+    for (p = 1; p <= UINT64_MAX / radix; p *= radix)
+        fpe->maxlen += 2;
+    fpe->minlen = 2;
+    for (p = (uint64_t)radix * radix; p < 1000000; p *= radix)
+        fpe->minlen++;
+    return fpe;
+}
+
+void twofish_fpe_free(TWOFISH_FPE *fpe)
+{
+    if (fpe == NULL)
+        return;
+    twofish_ctx_release(fpe->ctx);
+    free(fpe);
+}
+
+static uint64_t power(unsigned radix, size_t m)
+{
+    uint64_t p = 1;
+
+    while (m--)
+        p *= radix;
+    return p;
+}
+
+/* Per-length set-up: the half sizes, and for FF1 the part of the PRF shared by every round */
+static void shape_init(const TWOFISH_FPE *fpe, const BYTE *tweak, size_t t, size_t n, shape *s)
+{
+    size_t qlen, pos, i, j;
+    uint64_t top;
+
+    if (fpe->mode == TWOFISH_FF3_1)
+    {
+        s->u = (n + 1) / 2;
+        s->v = n - s->u;
+        s->mu = power(fpe->radix, s->u);
+        s->mv = power(fpe->radix, s->v);
+        memcpy(s->tl, tweak, 3);
+        s->tl[3] = tweak[3] & 0xf0;
+        memcpy(s->tr, tweak + 4, 3);
+        s->tr[3] = (BYTE)(tweak[3] << 4);
+        return;
+    }
+
+    s->u = n / 2;
+    s->v = n - s->u;
+    s->mu = power(fpe->radix, s->u);
+    s->mv = power(fpe->radix, s->v);
+
+    /* b = ceil(ceil(v log2 radix) / 8): the bytes of radix^v - 1 */
+    s->b = 0;
+    for (top = s->mv - 1; top; top >>= 8)
+        s->b++;
+    s->d = 4 * ((s->b + 3) / 4) + 4;
+
+    /* P */
+    s->y0[0] = 1;
+    s->y0[1] = 2;
+    s->y0[2] = 1;
+    s->y0[3] = (BYTE)(fpe->radix >> 16);
+    s->y0[4] = (BYTE)(fpe->radix >> 8);
+    s->y0[5] = (BYTE)fpe->radix;
+    s->y0[6] = 10;
+    s->y0[7] = (BYTE)s->u;
+    for (i = 0; i < 4; i++)
+    {
+        s->y0[8 + i] = (BYTE)(n >> (24 - 8 * i));
+        s->y0[12 + i] = (BYTE)(t >> (24 - 8 * i));
+    }
+    twofish_encrypt(fpe->ctx, s->y0);
+
+    /* Q = T || 0^pad || [i] || [NUM(B)]^b; all but its last block is the same every round */
+    qlen = (t + s->b + 1 + 15) / 16 * 16;
+    for (i = 0; i + 16 < qlen; i += 16)
+    {
+        for (j = 0; j < 16; j++)
+            s->y0[j] ^= i + j < t ? tweak[i + j] : 0;
+        twofish_encrypt(fpe->ctx, s->y0);
+    }
+    for (j = 0; j < 16; j++)
+    {
+        pos = qlen - 16 + j;
+        s->last[j] = pos < t ? tweak[pos] : 0;
+    }
+}
+
+/* The round input of a value whose other half is x */
+static void round_block(const TWOFISH_FPE *fpe, const shape *s, unsigned round, uint64_t x, BYTE blk[16])
+{
+    size_t j;
+
+    if (fpe->mode == TWOFISH_FF3_1)
+    {
+        /* REVB(W ^ [i]^4 || [NUM(REV(B))]^12) */
+        const BYTE *w = round & 1 ? s->tl : s->tr;
+
+        for (j = 0; j < 8; j++)
+            blk[j] = (BYTE)(x >> (8 * j));
+        memset(blk + 8, 0, 4);
+        blk[12] = w[3] ^ (BYTE)round;
+        blk[13] = w[2];
+        blk[14] = w[1];
+        blk[15] = w[0];
+        return;
+    }
+
+    memcpy(blk, s->last, 16);
+    blk[15 - s->b] = (BYTE)round;
+    for (j = 0; j < s->b; j++)
+        blk[15 - j] = (BYTE)(x >> (8 * j));
+    simd_xor_block(blk, blk, s->y0);
+}
+
+/* y mod radix^m from an encrypted round block */
+static uint64_t round_value(const TWOFISH_FPE *fpe, const shape *s, const BYTE blk[16], uint64_t mod)
+{
+    u128 y = 0;
+    size_t j;
+
+    if (fpe->mode == TWOFISH_FF3_1)
+    {
+        /* NUM(REVB(block)) */
+        for (j = 16; j--; )
+            y = (y << 8) | blk[j];
+    }
+    else
+    {
+        for (j = 0; j < s->d; j++)
+            y = (y << 8) | blk[j];
+    }
+    return (uint64_t)(y % mod);
+}
+
+/* Run the Feistel rounds over m values, held as their halves a[] and b[] */
+static void feistel(const TWOFISH_FPE *fpe, const shape *s, uint64_t *a, uint64_t *b, size_t m, int decrypt)
+{
+    BYTE blk[GROUP * 16];
+    unsigned rounds = fpe->mode == TWOFISH_FF1 ? 10 : 8, r, i;
+    uint64_t mod, y;
+    u128 c;
+    size_t j;
+
+    for (r = 0; r < rounds; r++)
+    {
+        i = decrypt ? rounds - 1 - r : r;
+        mod = i & 1 ? s->mv : s->mu;
+        for (j = 0; j < m; j++)
+            round_block(fpe, s, i, decrypt ? a[j] : b[j], blk + 16 * j);
+        twofish_encrypt_blocks(fpe->ctx, blk, blk, m);
+        for (j = 0; j < m; j++)
+        {
+            y = round_value(fpe, s, blk + 16 * j, mod);
+            if (!decrypt)
+            {
+                c = (u128)a[j] + y;
+                a[j] = b[j];
+                b[j] = (uint64_t)(c >= mod ? c - mod : c);
+            }
+            else
+            {
+                c = b[j] >= y ? b[j] - y : (u128)b[j] + mod - y;
+                b[j] = a[j];
+                a[j] = (uint64_t)c;
+            }
+        }
+    }
+    secure_zero(blk, sizeof(blk));
+}
+
+/* A half as a number: most significant numeral first for FF1, last for FF3-1 */
+static uint64_t load_half(const TWOFISH_FPE *fpe, const BYTE *x, size_t m)
+{
+    uint64_t acc = 0;
+    size_t j;
+
+    for (j = 0; j < m; j++)
+        acc = acc * fpe->radix + x[fpe->mode == TWOFISH_FF1 ? j : m - 1 - j];
+    return acc;
+}
+
+static void store_half(const TWOFISH_FPE *fpe, BYTE *x, size_t m, uint64_t c)
+{
+    size_t j;
+
+    for (j = 0; j < m; j++)
+    {
+        x[fpe->mode == TWOFISH_FF1 ? m - 1 - j : j] = (BYTE)(c % fpe->radix);
+        c /= fpe->radix;
+    }
+}
+
+static int check(const TWOFISH_FPE *fpe, size_t tweak_len, BYTE *const *x, const size_t *lens, size_t count)
+{
+    size_t i, j;
+
+    if (fpe->mode == TWOFISH_FF3_1 ? tweak_len != TWOFISH_FF3_TWEAK : tweak_len > 0xffffffffu)
+        return -1;
+    for (i = 0; i < count; i++)
+    {
+        if (lens[i] < fpe->minlen || lens[i] > fpe->maxlen)
+            return -1;
+        for (j = 0; j < lens[i]; j++)
+            if (x[i][j] >= fpe->radix)
+                return -1;
+    }
+    return 0;
+}
+
+static int fpe_crypt(const TWOFISH_FPE *fpe, const BYTE *tweak, size_t tweak_len,
+                     BYTE *const *x, const size_t *lens, size_t count, int decrypt)
+{
+    size_t start[MAX_NUMERALS + 2], one = 0, *order = &one;
+    uint64_t a[GROUP], b[GROUP];
+    size_t g, i, j, m, n, end;
+    shape s;
+
+    if (check(fpe, tweak_len, x, lens, count) != 0)
+        return -1;
+
+    /* order the values by length, so each run of equal lengths shares a shape */
+    if (count > 1)
+    {
+        order = malloc(count * sizeof(size_t));
+        if (order == NULL)
+            return -1;
+        memset(start, 0, sizeof(start));
+        for (i = 0; i < count; i++)
+            start[lens[i] + 1]++;
+        for (n = 1; n <= MAX_NUMERALS + 1; n++)
+            start[n] += start[n - 1];
+        for (i = 0; i < count; i++)
+            order[start[lens[i]]++] = i;
+    }
+
+    for (g = 0; g < count; g = end)
+    {
+        n = lens[order[g]];
+        for (end = g + 1; end < count && lens[order[end]] == n; end++)
+            ;
+        shape_init(fpe, tweak, tweak_len, n, &s);
+        for (i = g; i < end; i += m)
+        {
+            m = end - i < GROUP ? end - i : GROUP;
+            for (j = 0; j < m; j++)
+            {
+                a[j] = load_half(fpe, x[order[i + j]], s.u);
+                b[j] = load_half(fpe, x[order[i + j]] + s.u, s.v);
+            }
+            feistel(fpe, &s, a, b, m, decrypt);
+            for (j = 0; j < m; j++)
+            {
+                store_half(fpe, x[order[i + j]], s.u, a[j]);
+                store_half(fpe, x[order[i + j]] + s.u, s.v, b[j]);
+            }
+        }
+    }
+
+    secure_zero(a, sizeof(a));
+    secure_zero(b, sizeof(b));
+    secure_zero(&s, sizeof(s));
+    if (order != &one)
+        free(order);
+    return 0;
+}
+
+int twofish_fpe_encrypt(const TWOFISH_FPE *fpe, const BYTE *tweak, size_t tweak_len, BYTE *x, size_t n)
+{
+    return fpe_crypt(fpe, tweak, tweak_len, &x, &n, 1, 0);
+}
+
+int twofish_fpe_decrypt(const TWOFISH_FPE *fpe, const BYTE *tweak, size_t tweak_len, BYTE *x, size_t n)
+{
+    return fpe_crypt(fpe, tweak, tweak_len, &x, &n, 1, 1);
+}
+
+int twofish_fpe_encrypt_batch(const TWOFISH_FPE *fpe, const BYTE *tweak, size_t tweak_len,
+                              BYTE *const *x, const size_t *lens, size_t count)
+{
+    return fpe_crypt(fpe, tweak, tweak_len, x, lens, count, 0);
+}
+
+int twofish_fpe_decrypt_batch(const TWOFISH_FPE *fpe, const BYTE *tweak, size_t tweak_len,
+                              BYTE *const *x, const size_t *lens, size_t count)
+{
+    return fpe_crypt(fpe, tweak, tweak_len, x, lens, count, 1);
+}
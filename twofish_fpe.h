@@ -0,0 +1,62 @@
+#ifndef TWOFISH_FPE_H
+#define TWOFISH_FPE_H
+
+#include <stddef.h>
+#include "twofish.h"
+
+/*
+   Format-preserving encryption: the FF1 and FF3-1 Feistel modes of NIST
+   SP 800-38G Rev. 1 with Twofish in place of AES. A value is a string of
+   numerals, each below the radix, and encrypts to a string of the same
+   length and radix (a card number to another card number).
+
+   Each Feistel round costs one block encryption per value. The batch
+   calls run the same round of many values through the multi-block kernel
+   at once, so a column of values costs little more than its blocks.
+
+   Both halves of a value are kept as 64-bit integers, which bounds the
+   length at twice the number of numerals that fit in 64 bits (38 decimal
+   digits, 24 base-36 characters).
+*/
+
+#define TWOFISH_FF1   0
+#define TWOFISH_FF3_1 1
+
+/* FF3-1 tweaks are exactly 56 bits */
+#define TWOFISH_FF3_TWEAK 7
+
+typedef struct {
+    TWOFISH_CTX *ctx;       /* for FF3-1, keyed with the byte-reversed key */
+    int mode;
+    unsigned radix;         /* 2 to 256 */
+    size_t minlen;          /* radix^minlen >= 1000000, as the standard requires */
+    size_t maxlen;
+} TWOFISH_FPE;
+
+/*
+   Key an FF1 or FF3-1 instance (key_len 16, 24 or 32) for the given radix;
+   NULL if out of memory or an argument is bad.
+*/
+TWOFISH_FPE *twofish_fpe_new(int mode, const BYTE *key, size_t key_len, unsigned radix);
+void twofish_fpe_free(TWOFISH_FPE *fpe);
+
+/*
+   Encrypt or decrypt the n numerals of x in place under a tweak (any
+   length for FF1, TWOFISH_FF3_TWEAK bytes for FF3-1). Returns 0, or -1 if
+   n, the tweak length or a numeral is out of range, leaving x untouched.
+*/
+int twofish_fpe_encrypt(const TWOFISH_FPE *fpe, const BYTE *tweak, size_t tweak_len, BYTE *x, size_t n);
+int twofish_fpe_decrypt(const TWOFISH_FPE *fpe, const BYTE *tweak, size_t tweak_len, BYTE *x, size_t n);
+
+/*
+   The same for count values x[i] of lens[i] numerals sharing one tweak.
+   Values of equal length go through the rounds together; lengths may be
+   mixed freely. Returns 0, or -1 if any value or the tweak is out of
+   range or memory runs out, in which case none is changed.
+*/
+int twofish_fpe_encrypt_batch(const TWOFISH_FPE *fpe, const BYTE *tweak, size_t tweak_len,
+                              BYTE *const *x, const size_t *lens, size_t count);
+int twofish_fpe_decrypt_batch(const TWOFISH_FPE *fpe, const BYTE *tweak, size_t tweak_len,
+                              BYTE *const *x, const size_t *lens, size_t count);
+
+#endif /* TWOFISH_FPE_H */
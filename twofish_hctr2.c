@@ -0,0 +1,436 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "twofish_hctr2.h"
+#include "twofish_alloc.h"
+#include "secure_pool.h"
+#include "simd_util.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/* values handled per group in the batch paths */
+#define GROUP 64
+
+/* XCTR blocks pooled per kernel call */
+#define POOL_BLOCKS 64
+
+/* POLYVAL (RFC 8452): GF(2^128) with x^128 + x^127 + x^126 + x^121 + 1, little-endian */
+
+static uint64_t load64_le(const BYTE *p)
+{
+    uint64_t x;
+
+    memcpy(&x, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+static void store64_le(BYTE *p, uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(p, &x, 8);
+}
+
+/* x = w * x^-128 for the 256-bit product w, two Montgomery steps of 64 bits */
+static void reduce(uint64_t w[4], uint64_t x[2])
+{
+    uint64_t m;
+
+    m = w[0];
+    w[1] ^= (m << 57) ^ (m << 62) ^ (m << 63);
+    w[2] ^= m ^ (m >> 7) ^ (m >> 2) ^ (m >> 1);
+    m = w[1];
+    w[2] ^= (m << 57) ^ (m << 62) ^ (m << 63);
+    w[3] ^= m ^ (m >> 7) ^ (m >> 2) ^ (m >> 1);
+    x[0] = w[2];
+    x[1] = w[3];
+}
+
+/* Carry-less 64x64 multiply; the time taken does not depend on the operands */
+static void clmul64(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi)
+{
+    uint64_t l = 0, h = 0, mask;
+    int i;
+
+    for (i = 0; i < 64; i++)
+    {
+        mask = 0 - ((b >> i) & 1);
+        l ^= (a << i) & mask;
+        if (i)
+            h ^= (a >> (64 - i)) & mask;
+    }
+    *lo = l;
+    *hi = h;
+}
+
+/* x = x . h, the POLYVAL product x * h * x^-128 */
+static void mul_scalar(uint64_t x[2], const uint64_t h[2])
+{
+    uint64_t w[4], l, m;
+
+    clmul64(x[0], h[0], &w[0], &w[1]);
+    clmul64(x[1], h[1], &w[2], &w[3]);
+    clmul64(x[0], h[1], &l, &m);
+    w[1] ^= l;
+    w[2] ^= m;
+    clmul64(x[1], h[0], &l, &m);
+    w[1] ^= l;
+    w[2] ^= m;
+    reduce(w, x);
+}
+
+static void polyval_scalar(uint64_t x[2], const uint64_t hp[4][2], const BYTE *data, size_t nblocks)
+{
+    while (nblocks--)
+    {
+        x[0] ^= load64_le(data);
+        x[1] ^= load64_le(data + 8);
+        data += 16;
+        mul_scalar(x, hp[0]);
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* lo:mid:hi ^= the unreduced product a * b */
+__attribute__((target("pclmul,sse2")))
+static inline void mul_acc(__m128i a, __m128i b, __m128i *lo, __m128i *mid, __m128i *hi)
+{
+    *lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+    *hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+    *mid = _mm_xor_si128(*mid, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x01),
+                                             _mm_clmulepi64_si128(a, b, 0x10)));
+}
+
+/* Four blocks per reduction: S' = (S ^ X1) h^4 ^ X2 h^3 ^ X3 h^2 ^ X4 h */
+__attribute__((target("pclmul,sse2")))
+static void polyval_clmul(uint64_t x[2], const uint64_t hp[4][2], const BYTE *data, size_t nblocks)
+{
+    __m128i h1 = _mm_loadu_si128((const __m128i *)hp[0]);
+    __m128i h2 = _mm_loadu_si128((const __m128i *)hp[1]);
+    __m128i h3 = _mm_loadu_si128((const __m128i *)hp[2]);
+    __m128i h4 = _mm_loadu_si128((const __m128i *)hp[3]);
+    __m128i s, lo, mid, hi;
+    uint64_t w[4];
+
+    while (nblocks)
+    {
+        s = _mm_set_epi64x((long long)x[1], (long long)x[0]);
+        lo = mid = hi = _mm_setzero_si128();
+        if (nblocks >= 4)
+        {
+            mul_acc(_mm_xor_si128(s, _mm_loadu_si128((const __m128i *)data)), h4, &lo, &mid, &hi);
+            mul_acc(_mm_loadu_si128((const __m128i *)(data + 16)), h3, &lo, &mid, &hi);
+            mul_acc(_mm_loadu_si128((const __m128i *)(data + 32)), h2, &lo, &mid, &hi);
+            mul_acc(_mm_loadu_si128((const __m128i *)(data + 48)), h1, &lo, &mid, &hi);
+            data += 64;
+            nblocks -= 4;
+        }
+        else
+        {
+            mul_acc(_mm_xor_si128(s, _mm_loadu_si128((const __m128i *)data)), h1, &lo, &mid, &hi);
+            data += 16;
+            nblocks--;
+        }
+        lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+        hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+        _mm_storeu_si128((__m128i *)w, lo);
+        _mm_storeu_si128((__m128i *)(w + 2), hi);
+        reduce(w, x);
+    }
+}
+#endif
+
+/* backend selection, resolved on first use */
+enum { BACKEND_UNKNOWN, BACKEND_SCALAR, BACKEND_PCLMUL };
+static int backend = BACKEND_UNKNOWN;
+
+static int get_backend(void)
+{
+    int b = __atomic_load_n(&backend, __ATOMIC_RELAXED);
+
+    if (b != BACKEND_UNKNOWN)
+        return b;
+
+    b = BACKEND_SCALAR;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2"))
+        b = BACKEND_PCLMUL;
+#endif
+    __atomic_store_n(&backend, b, __ATOMIC_RELAXED);
+    return b;
+}
+
+const char *twofish_hctr2_backend(void)
+{
+    return get_backend() == BACKEND_PCLMUL ? "pclmul" : "scalar";
+}
+
+static void polyval_blocks(uint64_t x[2], const uint64_t hp[4][2], const BYTE *data, size_t nblocks)
+{
+#ifdef HAVE_X86_SIMD
+    if (get_backend() == BACKEND_PCLMUL)
+    {
+        polyval_clmul(x, hp, data, nblocks);
+        return;
+    }
+#endif
+    polyval_scalar(x, hp, data, nblocks);
+}
+
+/* POLYVAL of len bytes, the last block zero-padded, and of a 0x01 byte first when marked */
+static void polyval_tail(uint64_t x[2], const uint64_t hp[4][2], const BYTE *data, size_t len, int mark)
+{
+    BYTE last[16];
+    size_t full = len / 16;
+
+    polyval_blocks(x, hp, data, full);
+    len -= full * 16;
+    if (len == 0 && !mark)
+        return;
+    memset(last, 0, 16);
+    memcpy(last, data + full * 16, len);
+    if (mark)
+        last[len] = 1;
+    polyval_blocks(x, hp, last, 1);
+}
+
+/* HCTR2 */
+
+TWOFISH_HCTR2 *twofish_hctr2_new(const BYTE *key, size_t key_len)
+{
+    TWOFISH_HCTR2 *hctr2;
+    BYTE k[32];
+    int i;
+
+    if (key_len != 16 && key_len != 24 && key_len != 32)
+        return NULL;
+    hctr2 = secure_alloc(sizeof(TWOFISH_HCTR2));
+    if (hctr2 == NULL)
+        return NULL;
+    hctr2->ctx = twofish_ctx_alloc(TWOFISH_ALLOC_SECURE, -1);
+    if (hctr2->ctx == NULL)
+    {
+        secure_free(hctr2);
+        return NULL;
+    }
+    memcpy(k, key, key_len);
+    twofish_set_key(hctr2->ctx, k, (int)key_len * 8);
+
+    memset(k, 0, 16);
+    twofish_encrypt(hctr2->ctx, k);
+    hctr2->hp[0][0] = load64_le(k);
+    hctr2->hp[0][1] = load64_le(k + 8);
+    for (i = 1; i < 4; i++)
+    {
+        memcpy(hctr2->hp[i], hctr2->hp[i - 1], sizeof(hctr2->hp[i]));
+        mul_scalar(hctr2->hp[i], hctr2->hp[0]);
+    }
+    secure_zero(k, sizeof(k));
+    memset(hctr2->l, 0, 16);
+    hctr2->l[0] = 1;
+    twofish_encrypt(hctr2->ctx, hctr2->l);
+    return hctr2;
+}
+
+void twofish_hctr2_free(TWOFISH_HCTR2 *hctr2)
+{
+    if (hctr2 == NULL)
+        return;
+    twofish_ctx_release(hctr2->ctx);
+    secure_free(hctr2);
+}
+
+/*
+   Hash state after bin(2|T| + 2) || pad(T), or bin(2|T| + 3) || pad(T)
+   for messages whose tail is not a whole number of blocks
+*/
+static void tweak_state(const uint64_t hp[4][2], const BYTE *tweak, size_t tweak_len, int partial, uint64_t x[2])
+{
+    BYTE len[16];
+
+    memset(len, 0, 16);
+    store64_le(len, (uint64_t)tweak_len * 16 + (partial ? 3 : 2));
+    x[0] = x[1] = 0;
+    polyval_blocks(x, hp, len, 1);
+    polyval_tail(x, hp, tweak, tweak_len, 0);
+}
+
+/* H(T, tail) from a tweak state, into out */
+static void hash_tail(const uint64_t hp[4][2], const uint64_t state[2], const BYTE *tail, size_t len, BYTE out[16])
+{
+    uint64_t x[2];
+
+    x[0] = state[0];
+    x[1] = state[1];
+    polyval_tail(x, hp, tail, len, len % 16 != 0);
+    store64_le(out, x[0]);
+    store64_le(out + 8, x[1]);
+}
+
+/* XCTR blocks of several values encrypted together */
+typedef struct {
+    TWOFISH_CTX *ctx;
+    size_t count;
+    BYTE ks[POOL_BLOCKS * 16];
+    const BYTE *src[POOL_BLOCKS];
+    BYTE *dst[POOL_BLOCKS];
+    size_t len[POOL_BLOCKS];
+} xctr_pool;
+
+static void pool_flush(xctr_pool *pool)
+{
+    size_t i, j, n;
+
+    twofish_encrypt_blocks(pool->ctx, pool->ks, pool->ks, pool->count);
+    for (i = 0; i < pool->count; i = j)
+    {
+        /* the blocks of one long tail are adjacent: one xor covers them */
+        n = pool->len[i];
+        for (j = i + 1; j < pool->count && pool->len[j - 1] == 16 && pool->src[j] == pool->src[i] + n
+             && pool->dst[j] == pool->dst[i] + n; j++)
+            n += pool->len[j];
+        simd_xor(pool->dst[i], pool->src[i], pool->ks + 16 * i, n);
+    }
+    pool->count = 0;
+}
+
+/* XCTR: block i of the keystream is E(S ^ bin(i)), counting from 1 */
+static void pool_add(xctr_pool *pool, const BYTE s[16], const BYTE *in, BYTE *out, size_t len)
+{
+    uint64_t i = 1;
+    BYTE *q;
+    size_t n;
+
+    while (len)
+    {
+        if (pool->count == POOL_BLOCKS)
+            pool_flush(pool);
+        n = len < 16 ? len : 16;
+        q = pool->ks + 16 * pool->count;
+        memcpy(q, s, 16);
+        store64_le(q, load64_le(s) ^ i++);
+        pool->src[pool->count] = in;
+        pool->dst[pool->count] = out;
+        pool->len[pool->count++] = n;
+        in += n;
+        out += n;
+        len -= n;
+    }
+}
+
+static int hctr2_crypt(const TWOFISH_HCTR2 *hctr2, const BYTE *const *tweaks, const size_t *tweak_lens,
+                       const BYTE *const *in, BYTE *const *out, const size_t *lens, size_t n, int decrypt)
+{
+    xctr_pool pool;
+    BYTE mid[GROUP * 16], first[GROUP * 16], hh[16], s[16];
+    uint64_t state[2][2];
+    const BYTE *cached = NULL;
+    size_t cached_len = 0, g, i, m, tail;
+    int have[2] = {0, 0}, partial;
+
+    for (i = 0; i < n; i++)
+        if (lens[i] < TWOFISH_HCTR2_MIN)
+            return -1;
+
+    pool.ctx = hctr2->ctx;
+    pool.count = 0;
+
+    for (g = 0; g < n; g += m)
+    {
+        m = n - g < GROUP ? n - g : GROUP;
+
+        /* first hash, folded into the first block; then the block cipher over the group */
+        for (i = 0; i < m; i++)
+        {
+            tail = lens[g + i] - 16;
+            partial = tail % 16 != 0;
+            if (tweaks[g + i] != cached || tweak_lens[g + i] != cached_len)
+            {
+                cached = tweaks[g + i];
+                cached_len = tweak_lens[g + i];
+                have[0] = have[1] = 0;
+            }
+            if (!have[partial])
+            {
+                tweak_state(hctr2->hp, cached, cached_len, partial, state[partial]);
+                have[partial] = 1;
+            }
+            hash_tail(hctr2->hp, state[partial], in[g + i] + 16, tail, hh);
+            simd_xor_block(first + 16 * i, in[g + i], hh);
+        }
+        if (decrypt)
+            twofish_decrypt_blocks(hctr2->ctx, first, mid, m);
+        else
+            twofish_encrypt_blocks(hctr2->ctx, first, mid, m);
+
+        /* XCTR over the tails, keyed by S = MM ^ UU ^ L */
+        for (i = 0; i < m; i++)
+        {
+            simd_xor_block(s, first + 16 * i, mid + 16 * i);
+            simd_xor_block(s, s, hctr2->l);
+            pool_add(&pool, s, in[g + i] + 16, out[g + i] + 16, lens[g + i] - 16);
+        }
+        if (pool.count)
+            pool_flush(&pool);
+
+        /* second hash, over the new tail */
+        for (i = 0; i < m; i++)
+        {
+            tail = lens[g + i] - 16;
+            partial = tail % 16 != 0;
+            if (tweaks[g + i] != cached || tweak_lens[g + i] != cached_len)
+            {
+                cached = tweaks[g + i];
+                cached_len = tweak_lens[g + i];
+                have[0] = have[1] = 0;
+            }
+            if (!have[partial])
+            {
+                tweak_state(hctr2->hp, cached, cached_len, partial, state[partial]);
+                have[partial] = 1;
+            }
+            hash_tail(hctr2->hp, state[partial], out[g + i] + 16, tail, hh);
+            simd_xor_block(out[g + i], mid + 16 * i, hh);
+        }
+    }
+
+    secure_zero(pool.ks, sizeof(pool.ks));
+    secure_zero(mid, sizeof(mid));
+    secure_zero(first, sizeof(first));
+    secure_zero(s, sizeof(s));
+    return 0;
+}
+
+int twofish_hctr2_encrypt(const TWOFISH_HCTR2 *hctr2, const BYTE *tweak, size_t tweak_len,
+                          const BYTE *in, BYTE *out, size_t len)
+{
+    return hctr2_crypt(hctr2, &tweak, &tweak_len, &in, &out, &len, 1, 0);
+}
+
+int twofish_hctr2_decrypt(const TWOFISH_HCTR2 *hctr2, const BYTE *tweak, size_t tweak_len,
+                          const BYTE *in, BYTE *out, size_t len)
+{
+    return hctr2_crypt(hctr2, &tweak, &tweak_len, &in, &out, &len, 1, 1);
+}
+
+int twofish_hctr2_encrypt_batch(const TWOFISH_HCTR2 *hctr2, const BYTE *const *tweaks,
+                                const size_t *tweak_lens, const BYTE *const *in, BYTE *const *out,
+                                const size_t *lens, size_t n)
+{
+    return hctr2_crypt(hctr2, tweaks, tweak_lens, in, out, lens, n, 0);
+}
+
+int twofish_hctr2_decrypt_batch(const TWOFISH_HCTR2 *hctr2, const BYTE *const *tweaks,
+                                const size_t *tweak_lens, const BYTE *const *in, BYTE *const *out,
+                                const size_t *lens, size_t n)
+{
+    return hctr2_crypt(hctr2, tweaks, tweak_lens, in, out, lens, n, 1);
+}
@@ -0,0 +1,62 @@
+#ifndef TWOFISH_HCTR2_H
+#define TWOFISH_HCTR2_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "twofish.h"
+
+/*
+   Length-preserving tweakable wide-block encryption: HCTR2 (Crowley,
+   Huckleberry and Biggers) with Twofish as the block cipher. The whole
+   message is one block of the cipher, so changing any input bit changes
+   every output bit, and the ciphertext is exactly as long as the
+   plaintext. Messages must be at least 16 bytes.
+
+   HCTR2 is a hash-encrypt-hash construction. A POLYVAL hash keyed with
+   E(0) covers the tweak and the tail of the message and is folded into the
+   first block. That block goes through the cipher, and the result keys
+   XCTR over the tail. The carry-less multiplies use PCLMULQDQ when the CPU
+   has it.
+*/
+
+#define TWOFISH_HCTR2_MIN 16
+
+typedef struct {
+    TWOFISH_CTX *ctx;
+    uint64_t hp[4][2];      /* POLYVAL key E(bin(0)) and its powers up to h^4, little-endian halves */
+    BYTE l[16];             /* E(bin(1)) */
+} TWOFISH_HCTR2;
+
+/* Key an instance (key_len 16, 24 or 32); NULL if out of memory or bad length */
+TWOFISH_HCTR2 *twofish_hctr2_new(const BYTE *key, size_t key_len);
+void twofish_hctr2_free(TWOFISH_HCTR2 *hctr2);
+
+/*
+   Encrypt or decrypt len bytes of in into out under a tweak of any length.
+   in and out may be the same buffer. Returns 0, or -1 if len is below
+   TWOFISH_HCTR2_MIN.
+*/
+int twofish_hctr2_encrypt(const TWOFISH_HCTR2 *hctr2, const BYTE *tweak, size_t tweak_len,
+                          const BYTE *in, BYTE *out, size_t len);
+int twofish_hctr2_decrypt(const TWOFISH_HCTR2 *hctr2, const BYTE *tweak, size_t tweak_len,
+                          const BYTE *in, BYTE *out, size_t len);
+
+/*
+   The same for n values in[i] of lens[i] bytes, each under tweaks[i] of
+   tweak_lens[i] bytes. Values that share a tweak pointer with the one
+   before them reuse its hash. The middle block encryptions of a group run
+   as one multi-block call, and the XCTR blocks of all values are pooled.
+   Returns 0, or -1 if a value is too short, in which case none is
+   processed.
+*/
+int twofish_hctr2_encrypt_batch(const TWOFISH_HCTR2 *hctr2, const BYTE *const *tweaks,
+                                const size_t *tweak_lens, const BYTE *const *in, BYTE *const *out,
+                                const size_t *lens, size_t n);
+int twofish_hctr2_decrypt_batch(const TWOFISH_HCTR2 *hctr2, const BYTE *const *tweaks,
+                                const size_t *tweak_lens, const BYTE *const *in, BYTE *const *out,
+                                const size_t *lens, size_t n);
+
+/* "pclmul" or "scalar": how the POLYVAL multiplies are done */
+const char *twofish_hctr2_backend(void);
+
+#endif /* TWOFISH_HCTR2_H */
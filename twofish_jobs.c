@@ -0,0 +1,176 @@
+#include <string.h>
+#include "twofish_jobs.h"
+#include "twofish_modes.h"
+#include "simd_util.h"
+
+/*
+   One batch runner per operation, so the engine's (run_batch, group) key
+   separates operations and group separates keys. A batch merges the blocks
+   of all its jobs into multi-block calls under their one key: small ECB and
+   CBC-decrypt jobs are gathered into a shared buffer, and CBC encryption,
+   serial within a job, advances all jobs one block per step.
+*/
+
+#define GATHER 64   /* blocks per merged call */
+#define DIRECT 8    /* jobs this long fill the kernel's lanes on their own */
+
+typedef void (*blocks_fn)(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out, size_t nblocks);
+
+/*
+   Copy the input of whole jobs of fewer than DIRECT blocks, from
+   jobs[*next] on, into buf until it is full. Moves *next past them and
+   returns the blocks copied.
+*/
+static size_t gather(workpool_job **jobs, size_t n, size_t *next, BYTE *buf)
+{
+    size_t used = 0;
+
+    while (*next < n)
+    {
+        twofish_job *job = (twofish_job *)jobs[*next];
+
+        if (job->nblocks >= DIRECT || used + job->nblocks > GATHER)
+            break;
+        memcpy(buf + 16 * used, job->in, 16 * job->nblocks);
+        used += job->nblocks;
+        (*next)++;
+    }
+    return used;
+}
+
+/* large jobs (and lone ones) go straight to direct, the rest through crypt gathered */
+static void run_ecb(workpool_job **jobs, size_t n, blocks_fn crypt, blocks_fn direct)
+{
+    BYTE buf[GATHER * 16];
+    TWOFISH_CTX *ctx = ((twofish_job *)jobs[0])->ctx;
+    size_t i = 0, start, used;
+
+    while (i < n)
+    {
+        twofish_job *job = (twofish_job *)jobs[i];
+
+        if (job->nblocks >= DIRECT || n == 1)
+        {
+            direct(ctx, job->in, job->out, job->nblocks);
+            i++;
+            continue;
+        }
+        start = i;
+        used = gather(jobs, n, &i, buf);
+        crypt(ctx, buf, buf, used);
+        for (used = 0; start < i; start++)
+        {
+            job = (twofish_job *)jobs[start];
+            memcpy(job->out, buf + 16 * used, 16 * job->nblocks);
+            used += job->nblocks;
+        }
+    }
+}
+
+static void run_ecb_encrypt(workpool_job **jobs, size_t n)
+{
+    run_ecb(jobs, n, twofish_encrypt_blocks, twofish_ecb_encrypt);
+}
+
+static void run_ecb_decrypt(workpool_job **jobs, size_t n)
+{
+    run_ecb(jobs, n, twofish_decrypt_blocks, twofish_ecb_decrypt);
+}
+
+/* every job advances one block per step, the blocks of a step in one call */
+static void run_cbc_encrypt(workpool_job **jobs, size_t n)
+{
+    BYTE buf[GATHER * 16];
+    twofish_job *lane[GATHER];
+    TWOFISH_CTX *ctx = ((twofish_job *)jobs[0])->ctx;
+    size_t base, m, step, live, i;
+
+    if (n == 1)
+    {
+        twofish_job *job = (twofish_job *)jobs[0];
+        twofish_cbc_encrypt(ctx, job->iv, job->in, job->out, job->nblocks);
+        return;
+    }
+    for (base = 0; base < n; base += m)
+    {
+        m = n - base < GATHER ? n - base : GATHER;
+        for (step = 0;; step++)
+        {
+            live = 0;
+            for (i = 0; i < m; i++)
+            {
+                twofish_job *job = (twofish_job *)jobs[base + i];
+                if (step < job->nblocks)
+                {
+                    simd_xor_block(buf + 16 * live, job->in + 16 * step, job->iv);
+                    lane[live++] = job;
+                }
+            }
+            if (live == 0)
+                break;
+            twofish_encrypt_blocks(ctx, buf, buf, live);
+            for (i = 0; i < live; i++)
+            {
+                memcpy(lane[i]->out + 16 * step, buf + 16 * i, 16);
+                memcpy(lane[i]->iv, buf + 16 * i, 16);
+            }
+        }
+    }
+}
+
+static void run_cbc_decrypt(workpool_job **jobs, size_t n)
+{
+    BYTE saved[GATHER * 16], buf[GATHER * 16];
+    TWOFISH_CTX *ctx = ((twofish_job *)jobs[0])->ctx;
+    size_t i = 0, start, used;
+
+    while (i < n)
+    {
+        twofish_job *job = (twofish_job *)jobs[i];
+
+        if (job->nblocks >= DIRECT || n == 1)
+        {
+            twofish_cbc_decrypt(ctx, job->iv, job->in, job->out, job->nblocks);
+            i++;
+            continue;
+        }
+        start = i;
+        used = gather(jobs, n, &i, saved);
+        twofish_decrypt_blocks(ctx, saved, buf, used);
+        for (used = 0; start < i; start++)
+        {
+            job = (twofish_job *)jobs[start];
+            if (job->nblocks == 0)
+                continue;
+            simd_xor_block(job->out, buf + 16 * used, job->iv);
+            simd_xor(job->out + 16, buf + 16 * (used + 1), saved + 16 * used, 16 * (job->nblocks - 1));
+            memcpy(job->iv, saved + 16 * (used + job->nblocks - 1), 16);
+            used += job->nblocks;
+        }
+    }
+}
+
+static void run_single(workpool_job *job)
+{
+    job->run_batch(&job, 1);
+}
+
+void twofish_job_init(twofish_job *job, int op, TWOFISH_CTX *ctx, const BYTE iv[16],
+                      const BYTE *in, BYTE *out, size_t nblocks)
+{
+    static void (*const runners[4])(workpool_job **, size_t) = {
+        run_ecb_encrypt, run_ecb_decrypt, run_cbc_encrypt, run_cbc_decrypt
+    };
+
+    memset(job, 0, sizeof(*job));
+    job->base.run = run_single;
+    job->base.run_batch = runners[op & 3];
+    job->base.group = ctx;
+    job->ctx = ctx;
+    job->op = op;
+    if (iv)
+        memcpy(job->iv, iv, 16);
+    job->in = in;
+    job->out = out;
+    job->nblocks = nblocks;
+}
@@ -0,0 +1,33 @@
+#ifndef TWOFISH_JOBS_H
+#define TWOFISH_JOBS_H
+
+#include <stddef.h>
+#include "twofish.h"
+#include "workpool.h"
+
+/* Operations */
+#define TWOFISH_JOB_ECB_ENCRYPT 0
+#define TWOFISH_JOB_ECB_DECRYPT 1
+#define TWOFISH_JOB_CBC_ENCRYPT 2
+#define TWOFISH_JOB_CBC_DECRYPT 3
+
+/*
+   A Twofish job for the workpool engine. Jobs with the same operation and
+   context are run as one batch. Set the completion fields of base (complete
+   or cq) after twofish_job_init if the pool's completion list is not wanted.
+*/
+typedef struct {
+    workpool_job base;      /* first, so a delivered workpool_job * converts back */
+    TWOFISH_CTX *ctx;
+    int op;
+    BYTE iv[16];            /* CBC: updated to the last ciphertext block */
+    const BYTE *in;
+    BYTE *out;              /* may equal in */
+    size_t nblocks;
+} twofish_job;
+
+/* Prepare a job; iv is only read for the CBC operations and may be NULL otherwise */
+void twofish_job_init(twofish_job *job, int op, TWOFISH_CTX *ctx, const BYTE iv[16],
+                      const BYTE *in, BYTE *out, size_t nblocks);
+
+#endif /* TWOFISH_JOBS_H */
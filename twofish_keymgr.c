@@ -0,0 +1,327 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "twofish_keymgr.h"
+#include "twofish_alloc.h"
+#include "secure_pool.h"
+
+#define NONE ((size_t)-1)
+
+typedef struct
+{
+    TWOFISH_COMPACT ck;         /* ck.k is 0 for a free id */
+    int32_t slab;               /* expanded context, -1 if cold */
+} key_entry;
+
+struct twofish_keymgr
+{
+    pthread_mutex_t lock;
+    key_entry *keys;            /* in the secure pool */
+    size_t nkeys;               /* ids handed out so far */
+    size_t key_cap;
+    size_t *free_ids;           /* removed ids, reused first; room for key_cap */
+    size_t nfree;
+    size_t live;
+
+    TWOFISH_KEYRING pool;       /* the slabs */
+    long *owner;                /* key id of each slab, -1 if unused */
+    unsigned *pins;
+    size_t *newer;              /* LRU list over the slabs in use */
+    size_t *older;
+    size_t newest;
+    size_t oldest;
+    size_t used;                /* slabs handed out at least once */
+    size_t resident;
+    size_t partial_blocks;
+
+    size_t hits;
+    size_t expansions;
+    size_t evictions;
+    size_t partial;
+};
+
+static void lru_unlink(twofish_keymgr *m, size_t s)
+{
+    if (m->newer[s] != NONE)
+        m->older[m->newer[s]] = m->older[s];
+    else
+        m->newest = m->older[s];
+    if (m->older[s] != NONE)
+        m->newer[m->older[s]] = m->newer[s];
+    else
+        m->oldest = m->newer[s];
+}
+
+static void lru_push(twofish_keymgr *m, size_t s)
+{
+    m->newer[s] = NONE;
+    m->older[s] = m->newest;
+    if (m->newest != NONE)
+        m->newer[m->newest] = s;
+    else
+        m->oldest = s;
+    m->newest = s;
+}
+
+static key_entry *lookup(twofish_keymgr *m, long id)
+{
+    if (id < 0 || (size_t)id >= m->nkeys || m->keys[id].ck.k == 0)
+        return NULL;
+    return &m->keys[id];
+}
+
+twofish_keymgr *twofish_keymgr_new(size_t slabs, int flags, size_t partial_blocks)
+{
+    twofish_keymgr *m;
+
+    if (slabs == 0 || slabs > INT32_MAX)
+        return NULL;
+    m = calloc(1, sizeof(*m));
+    if (m == NULL)
+        return NULL;
+    if (twofish_keyring_init(&m->pool, slabs, flags, -1) != 0)
+    {
+        free(m);
+        return NULL;
+    }
+    m->owner = malloc(slabs * sizeof(long));
+    m->pins = calloc(slabs, sizeof(unsigned));
+    m->newer = malloc(slabs * sizeof(size_t));
+    m->older = malloc(slabs * sizeof(size_t));
+    if (m->owner == NULL || m->pins == NULL || m->newer == NULL || m->older == NULL)
+    {
+        twofish_keymgr_free(m);
+        return NULL;
+    }
+    memset(m->owner, 0xff, slabs * sizeof(long));
+    m->newest = m->oldest = NONE;
+    m->partial_blocks = partial_blocks;
+    pthread_mutex_init(&m->lock, NULL);
+    return m;
+}
+
+void twofish_keymgr_free(twofish_keymgr *m)
+{
+    if (m == NULL)
+        return;
+    twofish_keyring_free(&m->pool);     /* zeroizes every slab */
+    secure_free(m->keys);
+    free(m->free_ids);
+    free(m->owner);
+    free(m->pins);
+    free(m->newer);
+    free(m->older);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+long twofish_keymgr_add(twofish_keymgr *m, const BYTE *key, int key_bytes)
+{
+    TWOFISH_COMPACT ck;
+    key_entry *grown;
+    size_t *ids, id, cap;
+
+    if (key_bytes != 16 && key_bytes != 24 && key_bytes != 32)
+        return -1;
+    twofish_compact_key(&ck, (BYTE *)key, key_bytes * 8);
+
+    pthread_mutex_lock(&m->lock);
+    if (m->nfree)
+    {
+        id = m->free_ids[--m->nfree];
+    }
+    else
+    {
+        if (m->nkeys == m->key_cap)
+        {
+            cap = m->key_cap ? m->key_cap * 2 : 64;
+            ids = realloc(m->free_ids, cap * sizeof(size_t));
+            if (ids != NULL)
+                m->free_ids = ids;
+            grown = ids ? secure_realloc(m->keys, cap * sizeof(key_entry)) : NULL;
+            if (grown == NULL)
+            {
+                pthread_mutex_unlock(&m->lock);
+                secure_zero(&ck, sizeof(ck));
+                return -1;
+            }
+            m->keys = grown;
+            m->key_cap = cap;
+        }
+        id = m->nkeys++;
+    }
+    m->keys[id].ck = ck;
+    m->keys[id].slab = -1;
+    m->live++;
+    pthread_mutex_unlock(&m->lock);
+    secure_zero(&ck, sizeof(ck));
+    return (long)id;
+}
+
+int twofish_keymgr_remove(twofish_keymgr *m, long id)
+{
+    key_entry *e;
+    size_t s;
+
+    pthread_mutex_lock(&m->lock);
+    e = lookup(m, id);
+    if (e == NULL || (e->slab >= 0 && m->pins[e->slab]))
+    {
+        pthread_mutex_unlock(&m->lock);
+        errno = e == NULL ? EINVAL : EBUSY;
+        return -1;
+    }
+    if (e->slab >= 0)
+    {
+        /* the slab goes back to the cold end, wiped */
+        s = (size_t)e->slab;
+        twofish_free_ctx(twofish_keyring_ctx(&m->pool, s));
+        m->owner[s] = -1;
+        lru_unlink(m, s);
+        m->newer[s] = NONE;
+        m->older[s] = m->oldest;
+        if (m->oldest != NONE)
+            m->newer[m->oldest] = s;
+        else
+            m->newest = s;
+        m->oldest = s;
+        m->resident--;
+    }
+    secure_zero(e, sizeof(*e));
+    m->free_ids[m->nfree++] = (size_t)id;
+    m->live--;
+    pthread_mutex_unlock(&m->lock);
+    return 0;
+}
+
+/* Expanded context of e, pinned; lock held */
+static TWOFISH_CTX *pin_slab(twofish_keymgr *m, long id, key_entry *e)
+{
+    TWOFISH_CTX *ctx;
+    size_t s;
+
+    if (e->slab >= 0)
+    {
+        s = (size_t)e->slab;
+        m->hits++;
+        lru_unlink(m, s);
+    }
+    else
+    {
+        if (m->used < m->pool.count)
+        {
+            s = m->used++;
+        }
+        else
+        {
+            /* least recently used slab nobody is working with */
+            for (s = m->oldest; s != NONE && m->pins[s]; s = m->newer[s])
+                ;
+            if (s == NONE)
+            {
+                errno = EBUSY;
+                return NULL;
+            }
+            lru_unlink(m, s);
+            if (m->owner[s] >= 0)
+            {
+                m->keys[m->owner[s]].slab = -1;
+                m->resident--;
+                m->evictions++;
+            }
+        }
+        ctx = twofish_keyring_ctx(&m->pool, s);
+        twofish_expand_key(&e->ck, ctx);
+        m->owner[s] = id;
+        e->slab = (int32_t)s;
+        m->resident++;
+        m->expansions++;
+    }
+    lru_push(m, s);
+    m->pins[s]++;
+    return twofish_keyring_ctx(&m->pool, s);
+}
+
+TWOFISH_CTX *twofish_keymgr_acquire(twofish_keymgr *m, long id)
+{
+    TWOFISH_CTX *ctx = NULL;
+    key_entry *e;
+
+    pthread_mutex_lock(&m->lock);
+    e = lookup(m, id);
+    if (e == NULL)
+        errno = EINVAL;
+    else
+        ctx = pin_slab(m, id, e);
+    pthread_mutex_unlock(&m->lock);
+    return ctx;
+}
+
+void twofish_keymgr_release(twofish_keymgr *m, long id)
+{
+    key_entry *e;
+
+    pthread_mutex_lock(&m->lock);
+    e = lookup(m, id);
+    if (e != NULL && e->slab >= 0 && m->pins[e->slab])
+        m->pins[e->slab]--;
+    pthread_mutex_unlock(&m->lock);
+}
+
+int twofish_keymgr_crypt(twofish_keymgr *m, long id, const BYTE *in, BYTE *out,
+                         size_t nblocks, int decrypt)
+{
+    TWOFISH_COMPACT ck;
+    TWOFISH_CTX *ctx;
+    key_entry *e;
+
+    pthread_mutex_lock(&m->lock);
+    e = lookup(m, id);
+    if (e == NULL)
+    {
+        pthread_mutex_unlock(&m->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    if (e->slab < 0 && nblocks <= m->partial_blocks)
+    {
+        /* too little work to pay for a full key setup */
+        ck = e->ck;
+        m->partial += nblocks;
+        pthread_mutex_unlock(&m->lock);
+        if (decrypt)
+            twofish_decrypt_compact_blocks(&ck, in, out, nblocks);
+        else
+            twofish_encrypt_compact_blocks(&ck, in, out, nblocks);
+        secure_zero(&ck, sizeof(ck));
+        return 0;
+    }
+    ctx = pin_slab(m, id, e);
+    pthread_mutex_unlock(&m->lock);
+    if (ctx == NULL)
+        return -1;
+
+    if (decrypt)
+        twofish_decrypt_blocks(ctx, in, out, nblocks);
+    else
+        twofish_encrypt_blocks(ctx, in, out, nblocks);
+    twofish_keymgr_release(m, id);
+    return 0;
+}
+
+void twofish_keymgr_stats(twofish_keymgr *m, twofish_keymgr_stats_t *stats)
+{
+    pthread_mutex_lock(&m->lock);
+    stats->keys = m->live;
+    stats->slabs = m->pool.count;
+    stats->resident = m->resident;
+    stats->hits = m->hits;
+    stats->expansions = m->expansions;
+    stats->evictions = m->evictions;
+    stats->partial = m->partial;
+    stats->huge = m->pool.huge;
+    stats->locked = m->pool.locked;
+    pthread_mutex_unlock(&m->lock);
+}
@@ -0,0 +1,66 @@
+#ifndef TWOFISH_KEYMGR_H
+#define TWOFISH_KEYMGR_H
+
+#include <stddef.h>
+#include "twofish.h"
+
+/*
+   Two-tier key store for large key populations. Every key is kept in
+   compact form (round keys and S-box key words, under 200 bytes, in the
+   secure pool); only the working set is expanded, into a fixed pool of
+   full contexts ("slabs") recycled in LRU order. A request for a cold key
+   either expands it into the least recently used slab or, when it covers
+   only a few blocks, is served through the partially keyed path without
+   touching the slabs at all. Memory stays bounded by the slab count.
+*/
+
+typedef struct twofish_keymgr twofish_keymgr;
+
+/* Manager counters */
+typedef struct {
+    size_t keys;            /* keys stored */
+    size_t slabs;           /* expanded contexts at most */
+    size_t resident;        /* keys expanded right now */
+    size_t hits;            /* requests served by a resident slab */
+    size_t expansions;      /* slabs keyed on a miss */
+    size_t evictions;       /* resident keys pushed out */
+    size_t partial;         /* blocks run through the partially keyed path */
+    int huge;               /* slabs are on huge pages */
+    int locked;             /* slabs are mlock'ed */
+} twofish_keymgr_stats_t;
+
+/*
+   Create a manager with slabs expanded contexts, allocated with the
+   TWOFISH_ALLOC_* flags. Requests of at most partial_blocks blocks for a
+   cold key take the partially keyed path. Returns NULL on failure.
+*/
+twofish_keymgr *twofish_keymgr_new(size_t slabs, int flags, size_t partial_blocks);
+
+void twofish_keymgr_free(twofish_keymgr *m);
+
+/* Store a key (key_bytes 16, 24 or 32); returns its id, or -1 on failure */
+long twofish_keymgr_add(twofish_keymgr *m, const BYTE *key, int key_bytes);
+
+/* Forget a key and zeroize its forms; returns 0, or -1 if id is unknown */
+int twofish_keymgr_remove(twofish_keymgr *m, long id);
+
+/*
+   Return the expanded context of a key, expanding it if needed, and pin
+   it until twofish_keymgr_release. Returns NULL with errno EINVAL for an
+   unknown id, or EBUSY if every slab is pinned.
+*/
+TWOFISH_CTX *twofish_keymgr_acquire(twofish_keymgr *m, long id);
+
+void twofish_keymgr_release(twofish_keymgr *m, long id);
+
+/*
+   Encrypt (or decrypt) nblocks independent blocks with a key, choosing
+   between the resident slab, the partially keyed path and a fresh
+   expansion. in and out may be the same. Returns 0, or -1 with errno set.
+*/
+int twofish_keymgr_crypt(twofish_keymgr *m, long id, const BYTE *in, BYTE *out,
+                         size_t nblocks, int decrypt);
+
+void twofish_keymgr_stats(twofish_keymgr *m, twofish_keymgr_stats_t *stats);
+
+#endif /* TWOFISH_KEYMGR_H */
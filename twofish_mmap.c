@@ -0,0 +1,396 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "twofish_mmap.h"
+#include "twofish_modes.h"
+#include "secure_pool.h"
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#if defined(SYS_userfaultfd) && defined(UFFDIO_COPY) && defined(UFFD_FEATURE_THREAD_ID)
+#define HAVE_USERFAULTFD 1
+#endif
+#endif
+
+/* fault messages read at once */
+#define MSG_BATCH 16
+
+struct twofish_mmap
+{
+    TWOFISH_CTX *ctx;
+    int fd;
+    unsigned long long offset;  /* of the ciphertext in fd */
+    size_t length;
+    BYTE ctr[16];               /* counter of the first block */
+    BYTE *base;
+    size_t map_len;             /* length rounded up to whole pages, at least one */
+    size_t page;
+    int lazy;
+#ifdef HAVE_USERFAULTFD
+    int uffd;
+    int stop_fd;
+    pthread_t thread;
+    size_t window;              /* pages decrypted per fault at most */
+    BYTE *bounce;               /* window pages, decrypted before being installed */
+    uint64_t *present;          /* one bit per page installed and not evicted */
+#endif
+    size_t faults;
+    size_t pages;
+    size_t errors;
+};
+
+/* Read and decrypt [pos, pos + len) of the plaintext into out, zero past the end */
+static int decrypt_range(twofish_mmap *m, size_t pos, size_t len, BYTE *out)
+{
+    size_t valid = pos < m->length ? m->length - pos : 0, done = 0;
+    BYTE ctr[16];
+    ssize_t n = 0;
+
+    if (valid > len)
+        valid = len;
+    while (done < valid)
+    {
+        n = pread(m->fd, out + done, valid - done, (off_t)(m->offset + pos + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;          /* a short file reads as zeros */
+        done += (size_t)n;
+    }
+    memset(out + done, 0, len - done);
+
+    memcpy(ctr, m->ctr, 16);
+    twofish_ctr_add(ctr, pos / 16);
+    twofish_ctr_crypt(m->ctx, ctr, out, out, valid);
+    return n < 0 ? -1 : 0;
+}
+
+#ifdef HAVE_USERFAULTFD
+static int page_present(twofish_mmap *m, size_t i)
+{
+    return (__atomic_load_n(&m->present[i / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1;
+}
+
+static void mark_present(twofish_mmap *m, size_t first, size_t count, int present)
+{
+    size_t i;
+
+    for (i = first; i < first + count; i++)
+    {
+        if (present)
+            __atomic_fetch_or(&m->present[i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_and(&m->present[i / 64], ~(1ULL << (i % 64)), __ATOMIC_RELAXED);
+    }
+}
+
+/* Copy count decrypted pages into the view, skipping any that are already there */
+static void install_pages(twofish_mmap *m, size_t first, size_t count)
+{
+    size_t pos = 0, len = count * m->page;
+    struct uffdio_copy copy;
+    struct uffdio_range wake;
+    int retries = 0;
+
+    while (pos < len)
+    {
+        copy.dst = (uintptr_t)(m->base + first * m->page + pos);
+        copy.src = (uintptr_t)(m->bounce + pos);
+        copy.len = len - pos;
+        copy.mode = 0;
+        copy.copy = 0;
+        if (ioctl(m->uffd, UFFDIO_COPY, &copy) == 0)
+            break;
+        if (copy.copy > 0)
+            pos += (size_t)copy.copy;
+        if (errno == EEXIST)
+            pos += m->page;
+        else if (errno != EAGAIN || ++retries > 8)
+            break;
+    }
+
+    /* the faulting page may have been installed by an earlier window */
+    wake.start = (uintptr_t)(m->base + first * m->page);
+    wake.len = m->page;
+    ioctl(m->uffd, UFFDIO_WAKE, &wake);
+
+#ifdef MADV_FREE
+    /* clean and reclaimable without swap; a reclaimed page faults again */
+    madvise(m->base + first * m->page, len, MADV_FREE);
+#endif
+    mark_present(m, first, count, 1);
+}
+
+/*
+   A page that cannot be read is not installed: the faulting thread gets
+   SIGBUS, as for an I/O error under a file mapping, and is woken to take
+   it. If it handles the signal and touches the page again, the read is
+   retried.
+*/
+static void fail_fault(twofish_mmap *m, uintptr_t addr, pid_t tid)
+{
+    struct uffdio_range wake;
+
+    __atomic_fetch_add(&m->errors, 1, __ATOMIC_RELAXED);
+    secure_zero(m->bounce, m->window * m->page);
+    syscall(SYS_tgkill, getpid(), tid, SIGBUS);
+    wake.start = addr & ~(uintptr_t)(m->page - 1);
+    wake.len = m->page;
+    ioctl(m->uffd, UFFDIO_WAKE, &wake);
+}
+
+static void serve_fault(twofish_mmap *m, uintptr_t addr, pid_t tid)
+{
+    size_t first = (addr - (uintptr_t)m->base) / m->page, total = m->map_len / m->page, count = 1;
+
+    /* prefetch up to the window, stopping at pages decrypted earlier */
+    while (count < m->window && first + count < total && !page_present(m, first + count))
+        count++;
+
+    if (decrypt_range(m, first * m->page, count * m->page, m->bounce) < 0)
+    {
+        fail_fault(m, addr, tid);
+        return;
+    }
+
+    /* counted first: installing wakes the faulting thread */
+    __atomic_fetch_add(&m->faults, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->pages, count, __ATOMIC_RELAXED);
+    install_pages(m, first, count);
+}
+
+static void *fault_thread(void *arg)
+{
+    twofish_mmap *m = arg;
+    struct uffd_msg msgs[MSG_BATCH];
+    struct pollfd fds[2];
+    ssize_t n;
+    size_t i;
+
+    fds[0].fd = m->uffd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m->stop_fd;
+    fds[1].events = POLLIN;
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        n = read(m->uffd, msgs, sizeof(msgs));
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < (size_t)n / sizeof(msgs[0]); i++)
+            if (msgs[i].event == UFFD_EVENT_PAGEFAULT)
+                serve_fault(m, (uintptr_t)msgs[i].arg.pagefault.address,
+                            (pid_t)msgs[i].arg.pagefault.feat.ptid);
+    }
+    return NULL;
+}
+
+/*
+   Register the view with a userfaultfd. Faults raised inside the kernel
+   (a write(2) from the view, for instance) must be served too, so a
+   descriptor limited to user-mode faults does not do; without a full one
+   the caller decrypts up front. Faults must also name their thread, so
+   that a read error can be raised in it.
+*/
+static int start_lazy(twofish_mmap *m, size_t readahead)
+{
+    struct uffdio_api api;
+    struct uffdio_register reg;
+    size_t pages = m->map_len / m->page;
+
+    m->uffd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (m->uffd < 0)
+        return -1;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_THREAD_ID;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (uintptr_t)m->base;
+    reg.range.len = m->map_len;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(m->uffd, UFFDIO_API, &api) < 0 || ioctl(m->uffd, UFFDIO_REGISTER, &reg) < 0)
+        goto fail;
+
+    m->window = 1 + (readahead + m->page - 1) / m->page;
+    m->bounce = mmap(NULL, m->window * m->page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m->bounce == MAP_FAILED)
+    {
+        m->bounce = NULL;
+        goto fail;
+    }
+    m->present = calloc((pages + 63) / 64, sizeof(uint64_t));
+    m->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (m->present == NULL || m->stop_fd < 0)
+        goto fail;
+    if (pthread_create(&m->thread, NULL, fault_thread, m) != 0)
+        goto fail;
+
+#ifdef MADV_DONTFORK
+    /* a child would not be registered and would read zeros */
+    madvise(m->base, m->map_len, MADV_DONTFORK);
+#endif
+    m->lazy = 1;
+    return 0;
+
+fail:
+    if (m->stop_fd >= 0)
+        close(m->stop_fd);
+    m->stop_fd = -1;
+    free(m->present);
+    m->present = NULL;
+    if (m->bounce != NULL)
+        munmap(m->bounce, m->window * m->page);
+    m->bounce = NULL;
+    close(m->uffd);
+    m->uffd = -1;
+    return -1;
+}
+#endif /* HAVE_USERFAULTFD */
+
+twofish_mmap *twofish_mmap_open(TWOFISH_CTX *ctx, int fd, unsigned long long offset, size_t length,
+                                const BYTE ctr[16], size_t readahead)
+{
+    twofish_mmap *m = calloc(1, sizeof(*m));
+    int err;
+
+    if (m == NULL)
+        return NULL;
+    m->ctx = ctx;
+    m->offset = offset;
+    m->length = length;
+    memcpy(m->ctr, ctr, 16);
+    m->page = (size_t)sysconf(_SC_PAGESIZE);
+    m->map_len = length ? (length + m->page - 1) / m->page * m->page : m->page;
+#ifdef HAVE_USERFAULTFD
+    m->uffd = -1;
+    m->stop_fd = -1;
+#endif
+
+    m->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (m->fd < 0)
+    {
+        free(m);
+        return NULL;
+    }
+    m->base = mmap(NULL, m->map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m->base == MAP_FAILED)
+        goto fail;
+#ifdef MADV_DONTDUMP
+    madvise(m->base, m->map_len, MADV_DONTDUMP);
+#endif
+
+#ifdef HAVE_USERFAULTFD
+    if (start_lazy(m, readahead) == 0)
+        return m;
+#else
+    (void)readahead;
+#endif
+
+    /* no fault handling: decrypt everything now */
+    if (mprotect(m->base, m->map_len, PROT_READ | PROT_WRITE) < 0 ||
+        decrypt_range(m, 0, m->map_len, m->base) < 0 ||
+        mprotect(m->base, m->map_len, PROT_READ) < 0)
+        goto fail;
+    m->pages = m->map_len / m->page;
+    return m;
+
+fail:
+    err = errno;
+    if (m->base != MAP_FAILED)
+        munmap(m->base, m->map_len);
+    close(m->fd);
+    free(m);
+    errno = err;
+    return NULL;
+}
+
+const BYTE *twofish_mmap_data(const twofish_mmap *m)
+{
+    return m->base;
+}
+
+size_t twofish_mmap_length(const twofish_mmap *m)
+{
+    return m->length;
+}
+
+void twofish_mmap_evict(twofish_mmap *m, size_t offset, size_t len)
+{
+#ifdef HAVE_USERFAULTFD
+    size_t first, last;
+
+    if (!m->lazy || offset >= m->map_len)
+        return;
+    if (len > m->map_len - offset)
+        len = m->map_len - offset;
+    first = (offset + m->page - 1) / m->page;
+    last = (offset + len) / m->page;
+    if (offset + len == m->map_len)
+        last = m->map_len / m->page;    /* the tail of the last page is padding */
+    if (last <= first)
+        return;
+    mark_present(m, first, last - first, 0);
+    madvise(m->base + first * m->page, (last - first) * m->page, MADV_DONTNEED);
+#else
+    (void)m;
+    (void)offset;
+    (void)len;
+#endif
+}
+
+void twofish_mmap_stats(const twofish_mmap *m, twofish_mmap_stats_t *stats)
+{
+    stats->faults = __atomic_load_n(&m->faults, __ATOMIC_RELAXED);
+    stats->pages = __atomic_load_n(&m->pages, __ATOMIC_RELAXED);
+    stats->errors = __atomic_load_n(&m->errors, __ATOMIC_RELAXED);
+    stats->lazy = m->lazy;
+}
+
+void twofish_mmap_close(twofish_mmap *m)
+{
+    if (m == NULL)
+        return;
+#ifdef HAVE_USERFAULTFD
+    if (m->lazy)
+    {
+        uint64_t one = 1;
+
+        while (write(m->stop_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+            ;
+        pthread_join(m->thread, NULL);
+        close(m->stop_fd);
+        close(m->uffd);
+        secure_zero(m->bounce, m->window * m->page);
+        munmap(m->bounce, m->window * m->page);
+        free(m->present);
+    }
+#endif
+    munmap(m->base, m->map_len);
+    close(m->fd);
+    free(m);
+}
@@ -0,0 +1,54 @@
+#ifndef TWOFISH_MMAP_H
+#define TWOFISH_MMAP_H
+
+#include <stddef.h>
+#include "twofish.h"
+
+/*
+   Read-only memory view of a file region encrypted with CTR mode.
+
+   Where userfaultfd is available, pages are decrypted when first touched,
+   together with the pages that follow them up to a readahead window, and
+   are then handed to the kernel as lazily freeable: under memory pressure
+   it may drop them instead of swapping, and a dropped page is decrypted
+   again on its next touch. A page whose ciphertext cannot be read raises
+   SIGBUS in the thread touching it, as a file mapping does on an I/O
+   error. Otherwise the whole region is decrypted when the view is opened,
+   and a read error fails the open.
+*/
+
+typedef struct twofish_mmap twofish_mmap;
+
+/* View counters */
+typedef struct {
+    size_t faults;          /* page faults served */
+    size_t pages;           /* pages decrypted, prefetched ones included */
+    size_t errors;          /* faults failed with SIGBUS on a read error */
+    int lazy;               /* pages are decrypted on first touch */
+} twofish_mmap_stats_t;
+
+/*
+   Map length bytes whose ciphertext starts at offset in fd, ctr being the
+   counter of the first block. fd is duplicated; ctx must stay valid until
+   twofish_mmap_close. Returns NULL with errno set on failure.
+*/
+twofish_mmap *twofish_mmap_open(TWOFISH_CTX *ctx, int fd, unsigned long long offset, size_t length,
+                                const BYTE ctr[16], size_t readahead);
+
+/* Start of the plaintext; valid until twofish_mmap_close */
+const BYTE *twofish_mmap_data(const twofish_mmap *m);
+
+size_t twofish_mmap_length(const twofish_mmap *m);
+
+/*
+   Drop the decrypted pages lying entirely inside [offset, offset + len);
+   they are decrypted again when touched. Does nothing unless the view is lazy.
+*/
+void twofish_mmap_evict(twofish_mmap *m, size_t offset, size_t len);
+
+void twofish_mmap_stats(const twofish_mmap *m, twofish_mmap_stats_t *stats);
+
+/* Stop serving faults and unmap the view */
+void twofish_mmap_close(twofish_mmap *m);
+
+#endif /* TWOFISH_MMAP_H */
@@ -0,0 +1,428 @@
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "twofish_modes.h"
+#include "simd_util.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_STREAM_STORES 1
+#endif
+
+/* blocks handled per pass of the multi-block kernel */
+#define CHUNK 64
+
+/*
+   Large-buffer strategy. Tiling is off until the application turns it on:
+   on the hosts measured so far it did not beat the plain loop. Writers
+   hold bulk_lock; the tile size is filled from L2 once, on first use.
+*/
+static twofish_bulk_config bulk = {0, 0, 0, 1};
+static pthread_mutex_t bulk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t bulk_once = PTHREAD_ONCE_INIT;
+
+static void bulk_init(void)
+{
+    long l2 = -1;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    /* a tile plus the next one being prefetched stay well inside L2 */
+    bulk.tile = l2 > 0 ? (size_t)l2 / 4 : 256 * 1024;
+    if (bulk.tile < 64 * 1024)
+        bulk.tile = 64 * 1024;
+    if (bulk.tile > 1024 * 1024)
+        bulk.tile = 1024 * 1024;
+}
+
+void twofish_bulk_get_config(twofish_bulk_config *cfg)
+{
+    pthread_once(&bulk_once, bulk_init);
+    pthread_mutex_lock(&bulk_lock);
+    *cfg = bulk;
+    pthread_mutex_unlock(&bulk_lock);
+}
+
+void twofish_bulk_set_config(const twofish_bulk_config *cfg)
+{
+    pthread_once(&bulk_once, bulk_init);
+    pthread_mutex_lock(&bulk_lock);
+    bulk.tile = cfg->tile < CHUNK * 16 ? CHUNK * 16 : cfg->tile / (CHUNK * 16) * (CHUNK * 16);
+    bulk.nt_stores = cfg->nt_stores;
+    bulk.warm_tables = cfg->warm_tables;
+    /* read without the lock by use_tiles on every call */
+    __atomic_store_n(&bulk.threshold, cfg->threshold, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&bulk_lock);
+}
+
+/* Bring every line of the key tables back into L1 */
+static void warm_tables(const TWOFISH_CTX *ctx)
+{
+    const BYTE *p = (const BYTE *)ctx;
+    size_t i;
+
+    for (i = 0; i < sizeof(TWOFISH_CTX); i += 64)
+        __builtin_prefetch(p + i, 0, 3);
+}
+
+/* Ask for [p, p + len) ahead of time, into L2 rather than L1 */
+static void prefetch_range(const BYTE *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i += 64)
+        __builtin_prefetch(p + i, 0, 2);
+}
+
+/* Copy a finished chunk to the output, around the cache when asked to */
+static void store_chunk(BYTE *out, const BYTE *buf, size_t len, int nt)
+{
+#ifdef HAVE_STREAM_STORES
+    size_t i;
+
+    if (nt && ((size_t)out & 15) == 0)
+    {
+        for (i = 0; i + 16 <= len; i += 16)
+            _mm_stream_si128((__m128i *)(out + i), _mm_load_si128((const __m128i *)(buf + i)));
+        memcpy(out + i, buf + i, len - i);
+        return;
+    }
+#else
+    (void)nt;
+#endif
+    memcpy(out, buf, len);
+}
+
+static void store_fence(int nt)
+{
+#ifdef HAVE_STREAM_STORES
+    if (nt)
+        _mm_sfence();
+#else
+    (void)nt;
+#endif
+}
+
+/*
+   Tile loop shared by the bulk modes. Each chunk of a tile is handed to fn
+   while the matching chunk of the next tile is prefetched, so the next
+   tile is in L2 by the time it starts; fn leaves its result in buf.
+*/
+typedef void (*chunk_fn)(TWOFISH_CTX *ctx, const BYTE *in, BYTE *buf, size_t len, void *arg);
+
+static void tiled(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out, size_t len, chunk_fn fn, void *arg)
+{
+    twofish_bulk_config snap, *cfg = &snap;
+    BYTE buf[CHUNK * 16] __attribute__((aligned(16)));
+    size_t tile, pos, end, n;
+
+    /* one copy per call, so a concurrent set never mixes two configs */
+    twofish_bulk_get_config(&snap);
+
+    for (tile = 0; tile < len; tile += cfg->tile)
+    {
+        end = len - tile < cfg->tile ? len : tile + cfg->tile;
+        if (cfg->warm_tables)
+            warm_tables(ctx);
+        for (pos = tile; pos < end; pos += n)
+        {
+            n = end - pos < sizeof(buf) ? end - pos : sizeof(buf);
+            if (pos + cfg->tile < len)
+                prefetch_range(in + pos + cfg->tile,
+                               len - pos - cfg->tile < n ? len - pos - cfg->tile : n);
+            fn(ctx, in + pos, buf, n, arg);
+            store_chunk(out + pos, buf, n, cfg->nt_stores);
+        }
+    }
+    store_fence(cfg->nt_stores);
+}
+
+static int use_tiles(size_t len)
+{
+    size_t threshold = __atomic_load_n(&bulk.threshold, __ATOMIC_RELAXED);
+
+    return threshold && len >= threshold;
+}
+
+static void ecb_encrypt_chunk(TWOFISH_CTX *ctx, const BYTE *in, BYTE *buf, size_t len, void *arg)
+{
+    (void)arg;
+    twofish_encrypt_blocks(ctx, in, buf, len / 16);
+}
+
+static void ecb_decrypt_chunk(TWOFISH_CTX *ctx, const BYTE *in, BYTE *buf, size_t len, void *arg)
+{
+    (void)arg;
+    twofish_decrypt_blocks(ctx, in, buf, len / 16);
+}
+
+void twofish_ecb_encrypt(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out, size_t nblocks)
+{
+    if (use_tiles(16 * nblocks))
+        tiled(ctx, in, out, 16 * nblocks, ecb_encrypt_chunk, NULL);
+    else
+        twofish_encrypt_blocks(ctx, in, out, nblocks);
+}
+
+void twofish_ecb_decrypt(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out, size_t nblocks)
+{
+    if (use_tiles(16 * nblocks))
+        tiled(ctx, in, out, 16 * nblocks, ecb_decrypt_chunk, NULL);
+    else
+        twofish_decrypt_blocks(ctx, in, out, nblocks);
+}
+
+void twofish_cbc_encrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t nblocks)
+{
+    const BYTE *prev = iv;
+    size_t i;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        simd_xor_block(out + 16 * i, in + 16 * i, prev);
+        twofish_encrypt(ctx, out + 16 * i);
+        prev = out + 16 * i;
+    }
+    if (nblocks)
+        memmove(iv, prev, 16);
+}
+
+static void cbc_decrypt_chunk(TWOFISH_CTX *ctx, const BYTE *in, BYTE *buf, size_t len, void *arg)
+{
+    BYTE *iv = arg;
+    size_t n = len / 16;
+
+    /* in is still intact here: the chunk is stored only afterwards */
+    twofish_decrypt_blocks(ctx, in, buf, n);
+    simd_xor_block(buf, buf, iv);
+    simd_xor(buf + 16, buf + 16, in, 16 * (n - 1));
+    memcpy(iv, in + 16 * (n - 1), 16);
+}
+
+void twofish_cbc_decrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t nblocks)
+{
+    BYTE saved[CHUNK * 16];
+    size_t n;
+
+    if (use_tiles(16 * nblocks))
+    {
+        tiled(ctx, in, out, 16 * nblocks, cbc_decrypt_chunk, iv);
+        return;
+    }
+
+    /* every block decrypts independently; the chaining is a XOR afterwards */
+    while (nblocks)
+    {
+        n = nblocks < CHUNK ? nblocks : CHUNK;
+        memcpy(saved, in, 16 * n);
+        twofish_decrypt_blocks(ctx, saved, out, n);
+        simd_xor_block(out, out, iv);
+        simd_xor(out + 16, out + 16, saved, 16 * (n - 1));
+        memcpy(iv, saved + 16 * (n - 1), 16);
+        in += 16 * n;
+        out += 16 * n;
+        nblocks -= n;
+    }
+}
+
+void twofish_cfb128_encrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t len)
+{
+    BYTE ks[16];
+    size_t n;
+
+    while (len)
+    {
+        n = len < 16 ? len : 16;
+        memcpy(ks, iv, 16);
+        twofish_encrypt(ctx, ks);
+        simd_xor(out, in, ks, n);
+        if (n == 16)
+            memcpy(iv, out, 16);
+        in += n;
+        out += n;
+        len -= n;
+    }
+}
+
+void twofish_cfb128_decrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t len)
+{
+    BYTE ks[CHUNK * 16], next[16];
+    size_t segs, bytes;
+
+    /* the register of each segment is the previous ciphertext block, all known up front */
+    while (len)
+    {
+        segs = (len + 15) / 16;
+        if (segs > CHUNK)
+            segs = CHUNK;
+        bytes = segs * 16 < len ? segs * 16 : len;
+
+        memcpy(ks, iv, 16);
+        memcpy(ks + 16, in, 16 * (segs - 1));
+        if (bytes == segs * 16)
+            memcpy(next, in + 16 * (segs - 1), 16);
+        twofish_encrypt_blocks(ctx, ks, ks, segs);
+        simd_xor(out, in, ks, bytes);
+        if (bytes == segs * 16)
+            memcpy(iv, next, 16);
+
+        in += bytes;
+        out += bytes;
+        len -= bytes;
+    }
+}
+
+void twofish_cfb8_encrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t len)
+{
+    BYTE ks[16];
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        memcpy(ks, iv, 16);
+        twofish_encrypt(ctx, ks);
+        memmove(iv, iv + 1, 15);
+        out[i] = in[i] ^ ks[0];
+        iv[15] = out[i];
+    }
+}
+
+void twofish_cfb8_decrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t len)
+{
+    BYTE window[16 + CHUNK], regs[CHUNK * 16];
+    size_t n, i;
+
+    /* byte i's register is the 16 ciphertext bytes before it, so a chunk encrypts at once */
+    while (len)
+    {
+        n = len < CHUNK ? len : CHUNK;
+        memcpy(window, iv, 16);
+        memcpy(window + 16, in, n);
+        for (i = 0; i < n; i++)
+            memcpy(regs + 16 * i, window + i, 16);
+        twofish_encrypt_blocks(ctx, regs, regs, n);
+        for (i = 0; i < n; i++)
+            out[i] = window[16 + i] ^ regs[16 * i];
+        memcpy(iv, window + n, 16);
+        in += n;
+        out += n;
+        len -= n;
+    }
+}
+
+void twofish_ofb_crypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t len)
+{
+    BYTE ks[CHUNK * 16];
+    size_t segs, bytes, i;
+
+    /* the keystream chain is serial: run it a chunk ahead, then XOR the chunk in one sweep */
+    while (len)
+    {
+        segs = (len + 15) / 16;
+        if (segs > CHUNK)
+            segs = CHUNK;
+        bytes = segs * 16 < len ? segs * 16 : len;
+
+        memcpy(ks, iv, 16);
+        twofish_encrypt(ctx, ks);
+        for (i = 1; i < segs; i++)
+        {
+            memcpy(ks + 16 * i, ks + 16 * (i - 1), 16);
+            twofish_encrypt(ctx, ks + 16 * i);
+        }
+        memcpy(iv, ks + 16 * (segs - 1), 16);
+        simd_xor(out, in, ks, bytes);
+
+        in += bytes;
+        out += bytes;
+        len -= bytes;
+    }
+}
+
+void twofish_ctr_increment(BYTE ctr[16])
+{
+    int i;
+
+    for (i = 15; i >= 0; i--)
+        if (++ctr[i])
+            break;
+}
+
+void twofish_ctr_add(BYTE ctr[16], unsigned long long n)
+{
+    unsigned int sum;
+    int i;
+
+    for (i = 15; i >= 0 && n; i--)
+    {
+        sum = ctr[i] + (unsigned int)(n & 0xff);
+        ctr[i] = (BYTE)sum;
+        n = (n >> 8) + (sum >> 8);
+    }
+}
+
+static void ctr_chunk(TWOFISH_CTX *ctx, const BYTE *in, BYTE *buf, size_t len, void *arg)
+{
+    BYTE *ctr = arg;
+    size_t segs = (len + 15) / 16;
+
+    simd_ctr_blocks(buf, ctr, segs);
+    twofish_encrypt_blocks(ctx, buf, buf, segs);
+    simd_xor(buf, in, buf, len);
+}
+
+void twofish_ctr_crypt(TWOFISH_CTX *ctx, BYTE ctr[16], const BYTE *in, BYTE *out, size_t len)
+{
+    BYTE ks[CHUNK * 16];
+    size_t segs, bytes;
+
+    if (use_tiles(len))
+    {
+        tiled(ctx, in, out, len, ctr_chunk, ctr);
+        return;
+    }
+
+    while (len)
+    {
+        segs = (len + 15) / 16;
+        if (segs > CHUNK)
+            segs = CHUNK;
+        bytes = segs * 16 < len ? segs * 16 : len;
+
+        simd_ctr_blocks(ks, ctr, segs);
+        twofish_encrypt_blocks(ctx, ks, ks, segs);
+        simd_xor(out, in, ks, bytes);
+
+        in += bytes;
+        out += bytes;
+        len -= bytes;
+    }
+}
+
+size_t twofish_pad(BYTE *buf, size_t len)
+{
+    BYTE pad = (BYTE)(16 - len % 16);
+
+    memset(buf + len, pad, pad);
+    return len + pad;
+}
+
+size_t twofish_unpad(const BYTE *buf, size_t len)
+{
+    BYTE pad;
+    size_t i;
+
+    if (len >= 16)
+        return len - simd_pkcs7_pad_len(buf + len - 16);
+    if (len == 0)
+        return 0;
+    /* same rule for short buffers, as Twofish.decrypt in pangfish.py had it */
+    pad = buf[len - 1];
+    if (pad == 0 || pad > 16)
+        return len;
+    for (i = len > pad ? len - pad : 0; i < len; i++)
+        if (buf[i] != pad)
+            return len;
+    return len > pad ? len - pad : 0;
+}
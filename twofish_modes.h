@@ -0,0 +1,73 @@
+#ifndef TWOFISH_MODES_H
+#define TWOFISH_MODES_H
+
+#include <stddef.h>
+#include "twofish.h"
+
+/*
+   Large-buffer strategy of ECB, CBC decryption and CTR. From threshold
+   bytes on, a buffer is processed in tiles: every chunk of a tile is
+   worked on in an L1-resident buffer while the same chunk of the next
+   tile is prefetched into L2, the key tables are touched again at the
+   start of each tile, and the output is written with non-temporal stores
+   so that streaming it does not push the tables out of the cache. Tiling
+   is off by default (threshold 0, no NT stores) until a benchmark on the
+   host shows it pays; tiles default to a quarter of L2. The config may be
+   changed while other threads are encrypting.
+*/
+typedef struct {
+    size_t threshold;       /* bytes from which buffers are tiled, 0 for never */
+    size_t tile;            /* bytes per tile, a multiple of 1 KiB */
+    int nt_stores;          /* write the output around the cache */
+    int warm_tables;        /* touch the key tables before every tile */
+} twofish_bulk_config;
+
+void twofish_bulk_get_config(twofish_bulk_config *cfg);
+void twofish_bulk_set_config(const twofish_bulk_config *cfg);
+
+/* ECB over nblocks 16-byte blocks; in and out may be the same buffer */
+void twofish_ecb_encrypt(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out, size_t nblocks);
+void twofish_ecb_decrypt(TWOFISH_CTX *ctx, const BYTE *in, BYTE *out, size_t nblocks);
+
+/*
+   CBC over nblocks 16-byte blocks; in and out may be the same buffer.
+   iv is updated to the last ciphertext block so calls can be chained.
+*/
+void twofish_cbc_encrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t nblocks);
+void twofish_cbc_decrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t nblocks);
+
+/*
+   CFB with 128-bit and 8-bit segments, and OFB, over len bytes; in and out
+   may be the same buffer. iv is updated so that a following call continues
+   the stream, provided len was a multiple of the segment size. CFB
+   decryption runs through the multi-block kernel, since every register is
+   known from the ciphertext.
+*/
+void twofish_cfb128_encrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t len);
+void twofish_cfb128_decrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t len);
+void twofish_cfb8_encrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t len);
+void twofish_cfb8_decrypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t len);
+
+/* OFB is its own inverse */
+void twofish_ofb_crypt(TWOFISH_CTX *ctx, BYTE iv[16], const BYTE *in, BYTE *out, size_t len);
+
+/*
+   CTR over len bytes with a 128-bit big-endian counter, keystream from the
+   multi-block kernel; in and out may be the same buffer. ctr is advanced by
+   one per block used, a trailing partial block included.
+*/
+void twofish_ctr_crypt(TWOFISH_CTX *ctx, BYTE ctr[16], const BYTE *in, BYTE *out, size_t len);
+
+/* Add one to a big-endian 128-bit counter */
+void twofish_ctr_increment(BYTE ctr[16]);
+
+/* Add n to a big-endian 128-bit counter, to seek n blocks into a CTR stream */
+void twofish_ctr_add(BYTE ctr[16], unsigned long long n);
+
+/* Append PKCS#7 padding after len bytes of buf; returns the padded length */
+size_t twofish_pad(BYTE *buf, size_t len);
+
+/* Length of buf without its padding, or len itself if the padding is not valid */
+size_t twofish_unpad(const BYTE *buf, size_t len);
+
+#endif /* TWOFISH_MODES_H */
@@ -0,0 +1,566 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "twofish_ring.h"
+#include "twofish_alloc.h"
+#include "twofish_cmac.h"
+#include "twofish_modes.h"
+#include "secure_pool.h"
+#include "simd_util.h"
+#include "sha256.h"
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(SYS_futex) && defined(MFD_CLOEXEC)
+#define HAVE_RING 1
+#endif
+#endif
+
+#define RING_MAGIC   0x50465247u   /* "PFRG" */
+#define RING_VERSION 1
+#define RING_HEADER  256            /* shared header ahead of the slots */
+
+/* bytes encrypted and tagged per step, so the MAC reads them from cache */
+#define RING_CHUNK   4096
+
+/* polls of the peer's index before sleeping */
+#define SPIN_LIMIT   256
+
+/* Shared header; the indices of each end sit on their own cache line */
+struct ring_shared
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    BYTE salt[16];              /* HKDF salt, fresh for every ring */
+    BYTE pad0[32];
+
+    uint64_t head;              /* messages published by the producer */
+    uint32_t producer_waiting;  /* futex: the producer sleeps on a full ring */
+    BYTE pad1[52];
+
+    uint64_t tail;              /* messages released by the consumer */
+    uint32_t consumer_waiting;  /* futex: the consumer sleeps on an empty ring */
+    BYTE pad2[52];
+};
+
+struct twofish_ring
+{
+    struct ring_shared *sh;
+    BYTE *slots;
+    size_t map_len;
+    size_t nslots;
+    size_t slot_size;
+    int fd;
+    TWOFISH_CTX *enc;
+    TWOFISH_CMAC_KEY *mac;      /* in the secure pool, like the contexts */
+    uint64_t head;              /* producer: messages committed */
+    uint64_t tail;              /* consumer: messages received */
+    int held;                   /* consumer: a received slot is not released yet */
+    size_t held_len;            /* consumer: payload bytes of that slot to wipe */
+    size_t sent;
+    size_t received;
+    size_t failures;
+    size_t waits;
+    size_t wakeups;
+};
+
+#ifdef HAVE_RING
+
+static void cpu_relax(void)
+{
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void count(size_t *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void store_be(BYTE *p, uint64_t v, int n)
+{
+    while (n-- > 0)
+    {
+        p[n] = (BYTE)v;
+        v >>= 8;
+    }
+}
+
+static BYTE *slot_at(const twofish_ring *r, uint64_t index)
+{
+    return r->slots + (size_t)(index & (r->nslots - 1)) * r->slot_size;
+}
+
+/* Counter and MAC prefix of message seq: the sequence number is the nonce */
+static void message_nonce(uint64_t seq, size_t len, BYTE ctr[16], BYTE prefix[16])
+{
+    memset(ctr, 0, 16);
+    store_be(ctr, seq, 8);
+    memset(prefix, 0, 16);
+    store_be(prefix, seq, 8);
+    store_be(prefix + 8, len, 4);
+}
+
+static int derive_keys(twofish_ring *r, const BYTE *key, size_t key_len, const BYTE salt[16])
+{
+    BYTE prk[SHA256_DIGEST_SIZE], okm[64];
+    TWOFISH_CTX *mac_ctx;
+
+    r->enc = twofish_ctx_alloc(TWOFISH_ALLOC_SECURE, -1);
+    mac_ctx = twofish_ctx_alloc(TWOFISH_ALLOC_SECURE, -1);
+    r->mac = secure_alloc(sizeof(TWOFISH_CMAC_KEY));
+    if (r->enc == NULL || mac_ctx == NULL || r->mac == NULL)
+    {
+        twofish_ctx_release(mac_ctx);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    hkdf_sha256_extract(salt, 16, key, key_len, prk);
+    hkdf_sha256_expand(prk, "pangfish shared memory ring", 27, okm, sizeof(okm));
+    twofish_set_key(r->enc, okm, 256);
+    twofish_set_key(mac_ctx, okm + 32, 256);
+    twofish_cmac_key_init(r->mac, mac_ctx);
+    secure_zero(prk, sizeof(prk));
+    secure_zero(okm, sizeof(okm));
+    return 0;
+}
+
+static twofish_ring *map_ring(int fd, size_t map_len)
+{
+    twofish_ring *r = calloc(1, sizeof(*r));
+    void *base;
+
+    if (r == NULL)
+        return NULL;
+    base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        free(r);
+        return NULL;
+    }
+#ifdef MADV_DONTDUMP
+    madvise(base, map_len, MADV_DONTDUMP);
+#endif
+    r->sh = base;
+    r->slots = (BYTE *)base + RING_HEADER;
+    r->map_len = map_len;
+    r->fd = fd;
+    return r;
+}
+
+static void fail_ring(twofish_ring *r)
+{
+    int err = errno;
+
+    twofish_ring_close(r);
+    errno = err;
+}
+
+static long futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+    /* not FUTEX_PRIVATE_FLAG: the word is shared between processes */
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/*
+   Wait while *index still equals value. The waiting flag is raised before
+   the last check, and the peer reads it after moving the index, so one of
+   the two always sees the other.
+*/
+static int ring_wait(twofish_ring *r, uint64_t *index, uint64_t value, uint32_t *waiting,
+                     long long timeout_ns)
+{
+    struct timespec now, deadline, left;
+    int i;
+
+    for (i = 0; i < SPIN_LIMIT; i++)
+    {
+        if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != value)
+            return 0;
+        if (timeout_ns == 0)
+            break;
+        cpu_relax();
+    }
+
+    if (timeout_ns == 0)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (timeout_ns > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (time_t)(timeout_ns / 1000000000);
+        deadline.tv_nsec += (long)(timeout_ns % 1000000000);
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    for (;;)
+    {
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(index, __ATOMIC_SEQ_CST) != value)
+            break;
+        if (timeout_ns >= 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = deadline.tv_sec - now.tv_sec;
+            left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (left.tv_nsec < 0)
+            {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000;
+            }
+            if (left.tv_sec < 0)
+            {
+                __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+        count(&r->waits);
+        futex(waiting, FUTEX_WAIT, 1, timeout_ns >= 0 ? &left : NULL);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Wake the peer if it sleeps; the exchange makes it one wake per sleep */
+static void ring_wake(twofish_ring *r, uint32_t *waiting)
+{
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST))
+    {
+        count(&r->wakeups);
+        futex(waiting, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+twofish_ring *twofish_ring_create(const BYTE *key, size_t key_len, size_t slots, size_t slot_size)
+{
+    twofish_ring *r;
+    size_t map_len;
+    int fd;
+
+    if (slots < 2 || (slots & (slots - 1)) || slots > UINT32_MAX || slot_size % 64 ||
+        slot_size <= TWOFISH_RING_SLOT_HEADER || slot_size > UINT32_MAX ||
+        slots > (SIZE_MAX - RING_HEADER) / slot_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    map_len = RING_HEADER + slots * slot_size;
+
+    fd = memfd_create("pangfish-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, (off_t)map_len) < 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    /* a peer that shrank the file would crash this end with SIGBUS */
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+    r = map_ring(fd, map_len);
+    if (r == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    r->nslots = slots;
+    r->slot_size = slot_size;
+    if (getentropy(r->sh->salt, sizeof(r->sh->salt)) < 0 || derive_keys(r, key, key_len, r->sh->salt) < 0)
+    {
+        fail_ring(r);
+        return NULL;
+    }
+    r->sh->slots = (uint32_t)slots;
+    r->sh->slot_size = (uint32_t)slot_size;
+    r->sh->version = RING_VERSION;
+    __atomic_store_n(&r->sh->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return r;
+}
+
+twofish_ring *twofish_ring_attach(const BYTE *key, size_t key_len, int fd)
+{
+    twofish_ring *r;
+    struct stat st;
+    struct ring_shared sh;
+    int dup_fd;
+
+    if (fstat(fd, &st) < 0)
+        return NULL;
+    if (st.st_size < RING_HEADER ||
+        pread(fd, &sh, sizeof(sh), 0) != (ssize_t)sizeof(sh) ||
+        sh.magic != RING_MAGIC || sh.version != RING_VERSION ||
+        sh.slots < 2 || (sh.slots & (sh.slots - 1)) || sh.slot_size % 64 ||
+        sh.slot_size <= TWOFISH_RING_SLOT_HEADER ||
+        (unsigned long long)st.st_size != RING_HEADER + (unsigned long long)sh.slots * sh.slot_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dup_fd < 0)
+        return NULL;
+    r = map_ring(dup_fd, (size_t)st.st_size);
+    if (r == NULL)
+    {
+        close(dup_fd);
+        return NULL;
+    }
+    /* the geometry is taken from the checked copy, not the live header */
+    r->nslots = sh.slots;
+    r->slot_size = sh.slot_size;
+    if (derive_keys(r, key, key_len, sh.salt) < 0)
+    {
+        fail_ring(r);
+        return NULL;
+    }
+    r->head = __atomic_load_n(&r->sh->head, __ATOMIC_ACQUIRE);
+    r->tail = __atomic_load_n(&r->sh->tail, __ATOMIC_ACQUIRE);
+    return r;
+}
+
+BYTE *twofish_ring_reserve(twofish_ring *r, long long timeout_ns)
+{
+    if (r->head - __atomic_load_n(&r->sh->tail, __ATOMIC_ACQUIRE) >= r->nslots)
+    {
+        /* the consumer cannot free anything it has not seen */
+        twofish_ring_publish(r);
+        if (ring_wait(r, &r->sh->tail, r->head - r->nslots, &r->sh->producer_waiting, timeout_ns) < 0)
+            return NULL;
+    }
+    return slot_at(r, r->head) + TWOFISH_RING_SLOT_HEADER;
+}
+
+void twofish_ring_commit(twofish_ring *r, const BYTE *src, size_t len)
+{
+    BYTE *slot = slot_at(r, r->head), *out = slot + TWOFISH_RING_SLOT_HEADER;
+    BYTE ctr[16], prefix[16];
+    TWOFISH_CMAC cmac;
+    size_t pos, n;
+
+    message_nonce(r->head, len, ctr, prefix);
+    twofish_cmac_init(&cmac, r->mac);
+    twofish_cmac_update(&cmac, prefix, 16);
+    for (pos = 0; pos < len; pos += n)
+    {
+        n = len - pos < RING_CHUNK ? len - pos : RING_CHUNK;
+        twofish_ctr_crypt(r->enc, ctr, src + pos, out + pos, n);
+        twofish_cmac_update(&cmac, out + pos, n);
+    }
+    twofish_cmac_final(&cmac, slot + 16);
+    memcpy(slot, prefix, 16);
+    r->head++;
+    count(&r->sent);
+}
+
+void twofish_ring_publish(twofish_ring *r)
+{
+    if (__atomic_load_n(&r->sh->head, __ATOMIC_RELAXED) == r->head)
+        return;
+    __atomic_store_n(&r->sh->head, r->head, __ATOMIC_SEQ_CST);
+    ring_wake(r, &r->sh->consumer_waiting);
+}
+
+int twofish_ring_send(twofish_ring *r, const BYTE *data, size_t len, long long timeout_ns)
+{
+    if (len > twofish_ring_capacity(r))
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (twofish_ring_reserve(r, timeout_ns) == NULL)
+        return -1;
+    twofish_ring_commit(r, data, len);
+    twofish_ring_publish(r);
+    return 0;
+}
+
+const BYTE *twofish_ring_recv(twofish_ring *r, size_t *len, long long timeout_ns)
+{
+    BYTE *slot, *data, ctr[16], prefix[16], header[16], tag[16], expect[16];
+    TWOFISH_CMAC cmac;
+    size_t pos, n, length;
+
+    twofish_ring_release(r);
+    if (ring_wait(r, &r->sh->head, r->tail, &r->sh->consumer_waiting, timeout_ns) < 0)
+        return NULL;
+    slot = slot_at(r, r->tail);
+    data = slot + TWOFISH_RING_SLOT_HEADER;
+    r->held = 1;
+
+    /* read the header once; the producer side may still be scribbled on */
+    memcpy(header, slot, 16);
+    memcpy(tag, slot + 16, 16);
+    length = ((size_t)header[8] << 24) | ((size_t)header[9] << 16) | ((size_t)header[10] << 8) | header[11];
+    if (length > twofish_ring_capacity(r))
+        length = twofish_ring_capacity(r);
+    message_nonce(r->tail, length, ctr, prefix);
+    r->tail++;
+    r->held_len = length;
+
+    twofish_cmac_init(&cmac, r->mac);
+    twofish_cmac_update(&cmac, prefix, 16);
+    for (pos = 0; pos < length; pos += n)
+    {
+        n = length - pos < RING_CHUNK ? length - pos : RING_CHUNK;
+        twofish_cmac_update(&cmac, data + pos, n);
+        twofish_ctr_crypt(r->enc, ctr, data + pos, data + pos, n);
+    }
+    twofish_cmac_final(&cmac, expect);
+
+    /* the prefix carries the expected sequence number, so a replayed or moved slot fails too */
+    if (!(simd_equal(header, prefix, 16) & simd_equal(tag, expect, 16)))
+    {
+        secure_zero(data, length);
+        count(&r->failures);
+        errno = EBADMSG;
+        return NULL;
+    }
+    count(&r->received);
+    *len = length;
+    return data;
+}
+
+void twofish_ring_release(twofish_ring *r)
+{
+    uint64_t head;
+
+    if (!r->held)
+        return;
+    r->held = 0;
+    /* the plaintext must not outlive the message in memory the peer can map */
+    secure_zero(slot_at(r, r->tail - 1) + TWOFISH_RING_SLOT_HEADER, r->held_len);
+    __atomic_store_n(&r->sh->tail, r->tail, __ATOMIC_SEQ_CST);
+
+    /* batch the producer's wakeups: wait until half the ring is free */
+    head = __atomic_load_n(&r->sh->head, __ATOMIC_ACQUIRE);
+    if (head - r->tail <= r->nslots / 2)
+        ring_wake(r, &r->sh->producer_waiting);
+}
+
+#else /* !HAVE_RING */
+
+twofish_ring *twofish_ring_create(const BYTE *key, size_t key_len, size_t slots, size_t slot_size)
+{
+    (void)key;
+    (void)key_len;
+    (void)slots;
+    (void)slot_size;
+    errno = ENOSYS;
+    return NULL;
+}
+
+twofish_ring *twofish_ring_attach(const BYTE *key, size_t key_len, int fd)
+{
+    (void)key;
+    (void)key_len;
+    (void)fd;
+    errno = ENOSYS;
+    return NULL;
+}
+
+BYTE *twofish_ring_reserve(twofish_ring *r, long long timeout_ns)
+{
+    (void)r;
+    (void)timeout_ns;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void twofish_ring_commit(twofish_ring *r, const BYTE *src, size_t len)
+{
+    (void)r;
+    (void)src;
+    (void)len;
+}
+
+void twofish_ring_publish(twofish_ring *r)
+{
+    (void)r;
+}
+
+int twofish_ring_send(twofish_ring *r, const BYTE *data, size_t len, long long timeout_ns)
+{
+    (void)r;
+    (void)data;
+    (void)len;
+    (void)timeout_ns;
+    errno = ENOSYS;
+    return -1;
+}
+
+const BYTE *twofish_ring_recv(twofish_ring *r, size_t *len, long long timeout_ns)
+{
+    (void)r;
+    (void)len;
+    (void)timeout_ns;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void twofish_ring_release(twofish_ring *r)
+{
+    (void)r;
+}
+
+#endif /* HAVE_RING */
+
+int twofish_ring_fd(const twofish_ring *r)
+{
+    return r->fd;
+}
+
+size_t twofish_ring_slots(const twofish_ring *r)
+{
+    return r->nslots;
+}
+
+size_t twofish_ring_capacity(const twofish_ring *r)
+{
+    return r->slot_size - TWOFISH_RING_SLOT_HEADER;
+}
+
+void twofish_ring_stats(const twofish_ring *r, twofish_ring_stats_t *stats)
+{
+    stats->sent = __atomic_load_n(&r->sent, __ATOMIC_RELAXED);
+    stats->received = __atomic_load_n(&r->received, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&r->failures, __ATOMIC_RELAXED);
+    stats->waits = __atomic_load_n(&r->waits, __ATOMIC_RELAXED);
+    stats->wakeups = __atomic_load_n(&r->wakeups, __ATOMIC_RELAXED);
+}
+
+void twofish_ring_close(twofish_ring *r)
+{
+    if (r == NULL)
+        return;
+    if (r->mac != NULL)
+    {
+        twofish_ctx_release(r->mac->ctx);
+        secure_free(r->mac);
+    }
+    twofish_ctx_release(r->enc);
+    if (r->sh != NULL)
+        munmap(r->sh, r->map_len);
+    close(r->fd);
+    free(r);
+}
@@ -0,0 +1,93 @@
+#ifndef TWOFISH_RING_H
+#define TWOFISH_RING_H
+
+#include <stddef.h>
+#include "twofish.h"
+
+/*
+   Encrypted single-producer, single-consumer ring in shared memory, for
+   passing messages between processes on one host. The ring lives in a
+   memfd that the peer attaches to (inherited over fork, or sent over a
+   Unix socket); both ends derive the same keys from a shared secret and
+   a salt stored in the ring.
+
+   The producer encrypts straight into its slot and the consumer decrypts
+   in place, so a message is written once and read once; the consumer
+   wipes the plaintext from the slot when it releases it. Messages are
+   Twofish-CTR under a counter built from their sequence number, with a
+   CMAC over sequence, length and ciphertext computed in the same pass.
+   Neither end makes a system call unless it has to sleep on a futex: an
+   end only wakes its peer when the peer is actually asleep, and a
+   sleeping producer is only woken once half the ring is free.
+
+   The memfd must only be shared with the peer: whoever can map it can
+   also rewrite a slot after it has been authenticated.
+*/
+
+typedef struct twofish_ring twofish_ring;
+
+/* Bytes at the start of each slot ahead of the payload */
+#define TWOFISH_RING_SLOT_HEADER 32
+
+/* Counters of this end */
+typedef struct {
+    size_t sent;            /* messages committed */
+    size_t received;        /* messages opened */
+    size_t failures;        /* messages that failed to authenticate */
+    size_t waits;           /* futex sleeps */
+    size_t wakeups;         /* futex wakes of the peer */
+} twofish_ring_stats_t;
+
+/*
+   Create a ring of slots (a power of two, at least 2) slots of slot_size
+   bytes each, header included; slot_size must be a multiple of 64.
+   Returns NULL with errno set on failure (ENOSYS off Linux).
+*/
+twofish_ring *twofish_ring_create(const BYTE *key, size_t key_len, size_t slots, size_t slot_size);
+
+/* Attach to the ring in fd, which is duplicated. Returns NULL with errno set on failure */
+twofish_ring *twofish_ring_attach(const BYTE *key, size_t key_len, int fd);
+
+int twofish_ring_fd(const twofish_ring *r);
+size_t twofish_ring_slots(const twofish_ring *r);
+
+/* Largest payload of one message */
+size_t twofish_ring_capacity(const twofish_ring *r);
+
+/*
+   Producer: wait for a free slot and return its payload area, which holds
+   twofish_ring_capacity bytes. Messages committed but not published are
+   published before sleeping. timeout_ns < 0 waits forever; returns NULL
+   with errno ETIMEDOUT when the wait times out.
+*/
+BYTE *twofish_ring_reserve(twofish_ring *r, long long timeout_ns);
+
+/*
+   Encrypt len bytes of src into the reserved slot and queue it for
+   publishing. src may be the payload area itself, or any other buffer.
+*/
+void twofish_ring_commit(twofish_ring *r, const BYTE *src, size_t len);
+
+/* Make committed messages visible to the consumer, waking it if it sleeps */
+void twofish_ring_publish(twofish_ring *r);
+
+/* Reserve, commit and publish one message; returns 0, or -1 with errno set */
+int twofish_ring_send(twofish_ring *r, const BYTE *data, size_t len, long long timeout_ns);
+
+/*
+   Consumer: wait for the next message and decrypt it in place. Returns its
+   plaintext, valid until twofish_ring_release, and its length in *len.
+   Returns NULL with errno ETIMEDOUT on timeout, or EBADMSG if the message
+   failed to authenticate; the slot is then zeroed but must still be released.
+*/
+const BYTE *twofish_ring_recv(twofish_ring *r, size_t *len, long long timeout_ns);
+
+/* Zero the plaintext of the last message received and give its slot back to the producer */
+void twofish_ring_release(twofish_ring *r);
+
+void twofish_ring_stats(const twofish_ring *r, twofish_ring_stats_t *stats);
+
+/* Unmap the ring and close this end's descriptor */
+void twofish_ring_close(twofish_ring *r);
+
+#endif /* TWOFISH_RING_H */
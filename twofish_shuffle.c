@@ -0,0 +1,342 @@
+#include <string.h>
+#include "twofish_shuffle.h"
+#include "secure_pool.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/* backend selection, resolved on first use */
+enum { BACKEND_UNKNOWN, BACKEND_SCALAR, BACKEND_AVX2 };
+static int backend = BACKEND_UNKNOWN;
+
+static int get_backend(void)
+{
+    int b = __atomic_load_n(&backend, __ATOMIC_RELAXED);
+
+    if (b != BACKEND_UNKNOWN)
+        return b;
+
+    b = BACKEND_SCALAR;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        b = BACKEND_AVX2;
+#endif
+    __atomic_store_n(&backend, b, __ATOMIC_RELAXED);
+    return b;
+}
+
+const char *twofish_shuffle_backend(void)
+{
+    return get_backend() == BACKEND_AVX2 ? "avx2" : "scalar";
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* the t0..t3 nibble permutations of q0 and q1 */
+static const BYTE qt[2][4][16] = {
+    {{0x8, 0x1, 0x7, 0xD, 0x6, 0xF, 0x3, 0x2, 0x0, 0xB, 0x5, 0x9, 0xE, 0xC, 0xA, 0x4},
+     {0xE, 0xC, 0xB, 0x8, 0x1, 0x2, 0x3, 0x5, 0xF, 0x4, 0xA, 0x6, 0x7, 0x0, 0x9, 0xD},
+     {0xB, 0xA, 0x5, 0xE, 0x6, 0xD, 0x9, 0x0, 0xC, 0x8, 0xF, 0x3, 0x2, 0x4, 0x7, 0x1},
+     {0xD, 0x7, 0xF, 0x4, 0x1, 0x2, 0x6, 0xE, 0x9, 0xB, 0x3, 0x0, 0x8, 0x5, 0xC, 0xA}},
+    {{0x2, 0x8, 0xB, 0xD, 0xF, 0x7, 0x6, 0xE, 0x3, 0x1, 0x9, 0x4, 0x0, 0xA, 0xC, 0x5},
+     {0x1, 0xE, 0x2, 0xB, 0x4, 0xC, 0x3, 0x7, 0x6, 0xD, 0xA, 0x5, 0xF, 0x9, 0x0, 0x8},
+     {0x4, 0xC, 0x7, 0x5, 0x1, 0x6, 0x9, 0xA, 0x0, 0xE, 0xD, 0x8, 0x2, 0xB, 0x3, 0xF},
+     {0xB, 0x9, 0x5, 0x1, 0xC, 0x3, 0xD, 0xE, 0x6, 0x4, 0x7, 0xF, 0x2, 0x0, 0x8, 0xA}}
+};
+
+/* ROR4(b, 1), and a ^ (8a mod 16): the nibble mixing between the t stages */
+static const BYTE ror4[16] = {
+    0x0, 0x8, 0x1, 0x9, 0x2, 0xA, 0x3, 0xB, 0x4, 0xC, 0x5, 0xD, 0x6, 0xE, 0x7, 0xF
+};
+static const BYTE mix8[16] = {
+    0x0, 0x9, 0x2, 0xB, 0x4, 0xD, 0x6, 0xF, 0x8, 0x1, 0xA, 0x3, 0xC, 0x5, 0xE, 0x7
+};
+
+/* products with 0xEF and 0x5B in GF(2^8) mod 0x169, by low and high nibble */
+static const BYTE mul[4][16] = {
+    {0x00, 0xef, 0xb7, 0x58, 0x07, 0xe8, 0xb0, 0x5f, 0x0e, 0xe1, 0xb9, 0x56, 0x09, 0xe6, 0xbe, 0x51},
+    {0x00, 0x1c, 0x38, 0x24, 0x70, 0x6c, 0x48, 0x54, 0xe0, 0xfc, 0xd8, 0xc4, 0x90, 0x8c, 0xa8, 0xb4},
+    {0x00, 0x5b, 0xb6, 0xed, 0x05, 0x5e, 0xb3, 0xe8, 0x0a, 0x51, 0xbc, 0xe7, 0x0f, 0x54, 0xb9, 0xe2},
+    {0x00, 0x14, 0x28, 0x3c, 0x50, 0x44, 0x78, 0x6c, 0xa0, 0xb4, 0x88, 0x9c, 0xf0, 0xe4, 0xd8, 0xcc}
+};
+
+/*
+   Where each MDS term lands within a word: y, two spreads of EF*y and one
+   of 5B*y (the last 5B term, byte 3 to byte 0, is a shift). 0x80 is zero.
+*/
+static const BYTE route[4][16] = {
+    {0x00, 0x03, 0x02, 0x01, 0x04, 0x07, 0x06, 0x05, 0x08, 0x0b, 0x0a, 0x09, 0x0c, 0x0f, 0x0e, 0x0d},
+    {0x01, 0x01, 0x00, 0x00, 0x05, 0x05, 0x04, 0x04, 0x09, 0x09, 0x08, 0x08, 0x0d, 0x0d, 0x0c, 0x0c},
+    {0x80, 0x02, 0x03, 0x02, 0x80, 0x06, 0x07, 0x06, 0x80, 0x0a, 0x0b, 0x0a, 0x80, 0x0e, 0x0f, 0x0e},
+    {0x02, 0x00, 0x01, 0x03, 0x06, 0x04, 0x05, 0x07, 0x0a, 0x08, 0x09, 0x0b, 0x0e, 0x0c, 0x0d, 0x0f}
+};
+
+/*
+   Bytes of a word that take q1 rather than q0 at each stage of h, from the
+   outermost in: the k = 4 and k = 3 stages, then the three of every key.
+*/
+enum { STAGE_K4, STAGE_K3, STAGE_A, STAGE_B, STAGE_C };
+static const u32 stage_q1[5] = { 0xFF0000FF, 0x0000FFFF, 0xFF00FF00, 0xFFFF0000, 0x00FF00FF };
+
+typedef struct
+{
+    __m256i t[2][4];        /* t3 pre-shifted into the high nibble */
+    __m256i ror4, mix8, nib;
+    __m256i mul[4], route[4];
+    __m256i sel[5];
+    __m256i l[4];           /* the S-box key words, broadcast */
+    int k;
+} consts;
+
+__attribute__((target("avx2")))
+static __m256i bcast(const BYTE t[16])
+{
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t));
+}
+
+__attribute__((target("avx2")))
+static void consts_init(consts *c, const u32 L[4], int k)
+{
+    int q, i;
+
+    for (q = 0; q < 2; q++)
+    {
+        for (i = 0; i < 4; i++)
+            c->t[q][i] = bcast(qt[q][i]);
+        c->t[q][3] = _mm256_slli_epi16(c->t[q][3], 4);
+    }
+    c->ror4 = bcast(ror4);
+    c->mix8 = bcast(mix8);
+    c->nib = _mm256_set1_epi8(0x0F);
+    for (i = 0; i < 4; i++)
+    {
+        c->mul[i] = bcast(mul[i]);
+        c->route[i] = bcast(route[i]);
+    }
+    for (i = 0; i < 5; i++)
+        c->sel[i] = _mm256_set1_epi32((int)stage_q1[i]);
+    for (i = 0; i < 4; i++)
+        c->l[i] = _mm256_set1_epi32(i < k ? (int)L[i] : 0);
+    c->k = k;
+}
+
+/* one of q0, q1 from the nibbles after the first mixing */
+__attribute__((target("avx2")))
+static inline __m256i q_half(const consts *c, int q, __m256i a, __m256i b)
+{
+    __m256i a2 = _mm256_shuffle_epi8(c->t[q][0], a);
+    __m256i b2 = _mm256_shuffle_epi8(c->t[q][1], b);
+
+    a = _mm256_xor_si256(a2, b2);
+    b = _mm256_xor_si256(_mm256_shuffle_epi8(c->mix8, a2), _mm256_shuffle_epi8(c->ror4, b2));
+    return _mm256_or_si256(_mm256_shuffle_epi8(c->t[q][2], a), _mm256_shuffle_epi8(c->t[q][3], b));
+}
+
+/* q0 or q1 on every byte, per the stage's byte mask */
+__attribute__((target("avx2")))
+static inline __m256i q_stage(const consts *c, __m256i x, int stage)
+{
+    __m256i a = _mm256_and_si256(_mm256_srli_epi16(x, 4), c->nib);
+    __m256i b = _mm256_and_si256(x, c->nib);
+    __m256i a1 = _mm256_xor_si256(a, b);
+    __m256i b1 = _mm256_xor_si256(_mm256_shuffle_epi8(c->mix8, a), _mm256_shuffle_epi8(c->ror4, b));
+
+    return _mm256_blendv_epi8(q_half(c, 0, a1, b1), q_half(c, 1, a1, b1), c->sel[stage]);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mds(const consts *c, __m256i y)
+{
+    __m256i lo = _mm256_and_si256(y, c->nib);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(y, 4), c->nib);
+    __m256i ef = _mm256_xor_si256(_mm256_shuffle_epi8(c->mul[0], lo), _mm256_shuffle_epi8(c->mul[1], hi));
+    __m256i fb = _mm256_xor_si256(_mm256_shuffle_epi8(c->mul[2], lo), _mm256_shuffle_epi8(c->mul[3], hi));
+    __m256i z;
+
+    z = _mm256_xor_si256(_mm256_shuffle_epi8(y, c->route[0]), _mm256_shuffle_epi8(ef, c->route[1]));
+    z = _mm256_xor_si256(z, _mm256_shuffle_epi8(ef, c->route[2]));
+    z = _mm256_xor_si256(z, _mm256_shuffle_epi8(fb, c->route[3]));
+    return _mm256_xor_si256(z, _mm256_srli_epi32(fb, 24));
+}
+
+/* the q stages of h on eight words */
+__attribute__((target("avx2")))
+static inline __m256i h_q(const consts *c, __m256i x)
+{
+    switch (c->k)
+    {
+    case 4:
+        x = _mm256_xor_si256(q_stage(c, x, STAGE_K4), c->l[3]);
+        /* fall through */
+    case 3:
+        x = _mm256_xor_si256(q_stage(c, x, STAGE_K3), c->l[2]);
+        /* fall through */
+    default:
+        x = _mm256_xor_si256(q_stage(c, x, STAGE_A), c->l[1]);
+        x = _mm256_xor_si256(q_stage(c, x, STAGE_B), c->l[0]);
+        return q_stage(c, x, STAGE_C);
+    }
+}
+
+#define VROL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+#define VADD(a, b) _mm256_add_epi32((a), (b))
+#define VKEY(ck, i) _mm256_set1_epi32((int)(ck)->K[i])
+
+__attribute__((target("avx2")))
+static size_t h_avx2(const u32 L[4], int k, int mds_on, const u32 *x, u32 *z, size_t n)
+{
+    consts c;
+    u32 tail[8];
+    __m256i v;
+    size_t i, m;
+
+    consts_init(&c, L, k);
+    for (i = 0; i < n; i += 8)
+    {
+        m = n - i < 8 ? n - i : 8;
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, x + i, m * sizeof(u32));
+        v = h_q(&c, _mm256_loadu_si256((const __m256i *)tail));
+        if (mds_on)
+            v = mds(&c, v);
+        _mm256_storeu_si256((__m256i *)tail, v);
+        memcpy(z + i, tail, m * sizeof(u32));
+    }
+    secure_zero(tail, sizeof(tail));
+    secure_zero(&c, sizeof(c));
+    return n;
+}
+
+/*
+   Eight blocks as four vectors of one word each: a 4x4 transpose within
+   each 128-bit half, and its own inverse.
+*/
+__attribute__((target("avx2")))
+static inline void transpose(__m256i *w0, __m256i *w1, __m256i *w2, __m256i *w3)
+{
+    __m256i t0 = _mm256_unpacklo_epi32(*w0, *w1);
+    __m256i t1 = _mm256_unpackhi_epi32(*w0, *w1);
+    __m256i t2 = _mm256_unpacklo_epi32(*w2, *w3);
+    __m256i t3 = _mm256_unpackhi_epi32(*w2, *w3);
+
+    *w0 = _mm256_unpacklo_epi64(t0, t2);
+    *w1 = _mm256_unpackhi_epi64(t0, t2);
+    *w2 = _mm256_unpacklo_epi64(t1, t3);
+    *w3 = _mm256_unpackhi_epi64(t1, t3);
+}
+
+__attribute__((target("avx2")))
+static void crypt8(const consts *c, const TWOFISH_COMPACT *ck, const BYTE *in, BYTE *out, int decrypt)
+{
+    __m256i r0, r1, r2, r3, t0, t1, s;
+    const u32 *pre = decrypt ? ck->K + 4 : ck->K, *post = decrypt ? ck->K : ck->K + 4;
+    int i, r;
+
+    r0 = _mm256_loadu_si256((const __m256i *)in);
+    r1 = _mm256_loadu_si256((const __m256i *)(in + 32));
+    r2 = _mm256_loadu_si256((const __m256i *)(in + 64));
+    r3 = _mm256_loadu_si256((const __m256i *)(in + 96));
+    transpose(&r0, &r1, &r2, &r3);
+    r0 = _mm256_xor_si256(r0, _mm256_set1_epi32((int)pre[0]));
+    r1 = _mm256_xor_si256(r1, _mm256_set1_epi32((int)pre[1]));
+    r2 = _mm256_xor_si256(r2, _mm256_set1_epi32((int)pre[2]));
+    r3 = _mm256_xor_si256(r3, _mm256_set1_epi32((int)pre[3]));
+
+    for (i = 0; i < 16; i++)
+    {
+        r = decrypt ? 15 - i : i;
+        t0 = mds(c, h_q(c, r0));
+        t1 = mds(c, h_q(c, VROL(r1, 8)));
+        if (!decrypt)
+        {
+            r2 = _mm256_xor_si256(r2, VADD(VADD(t0, t1), VKEY(ck, 2 * r + 8)));
+            r2 = VROL(r2, 31);
+            r3 = _mm256_xor_si256(VROL(r3, 1), VADD(VADD(t0, VADD(t1, t1)), VKEY(ck, 2 * r + 9)));
+        }
+        else
+        {
+            r2 = _mm256_xor_si256(VROL(r2, 1), VADD(VADD(t0, t1), VKEY(ck, 2 * r + 8)));
+            r3 = _mm256_xor_si256(r3, VADD(VADD(t0, VADD(t1, t1)), VKEY(ck, 2 * r + 9)));
+            r3 = VROL(r3, 31);
+        }
+        s = r0; r0 = r2; r2 = s;
+        s = r1; r1 = r3; r3 = s;
+    }
+
+    /* the output words are R2 R3 R0 R1, whitened */
+    s = _mm256_xor_si256(r2, _mm256_set1_epi32((int)post[0]));
+    r2 = _mm256_xor_si256(r0, _mm256_set1_epi32((int)post[2]));
+    r0 = s;
+    s = _mm256_xor_si256(r3, _mm256_set1_epi32((int)post[1]));
+    r3 = _mm256_xor_si256(r1, _mm256_set1_epi32((int)post[3]));
+    r1 = s;
+    transpose(&r0, &r1, &r2, &r3);
+    _mm256_storeu_si256((__m256i *)out, r0);
+    _mm256_storeu_si256((__m256i *)(out + 32), r1);
+    _mm256_storeu_si256((__m256i *)(out + 64), r2);
+    _mm256_storeu_si256((__m256i *)(out + 96), r3);
+}
+
+/*
+   A tail is padded out to eight blocks however short it is, so that no
+   block ever goes through table-based g: that costs a full pass for one
+   block, but keeps every call constant time.
+*/
+__attribute__((target("avx2")))
+static size_t crypt_avx2(const TWOFISH_COMPACT *ck, const BYTE *in, BYTE *out, size_t nblocks, int decrypt)
+{
+    consts c;
+    BYTE tail[128];
+    size_t i, m;
+
+    consts_init(&c, ck->S, ck->k);
+    for (i = 0; i + 8 <= nblocks; i += 8)
+        crypt8(&c, ck, in + 16 * i, out + 16 * i, decrypt);
+    m = nblocks - i;
+    if (m > 0)
+    {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, in + 16 * i, 16 * m);
+        crypt8(&c, ck, tail, tail, decrypt);
+        memcpy(out + 16 * i, tail, 16 * m);
+        secure_zero(tail, sizeof(tail));
+        i = nblocks;
+    }
+    secure_zero(&c, sizeof(c));
+    return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+size_t twofish_shuffle_h(const u32 L[4], int k, int mds, const u32 *x, u32 *z, size_t n)
+{
+#ifdef HAVE_X86_SIMD
+    if (get_backend() == BACKEND_AVX2)
+        return h_avx2(L, k, mds, x, z, n);
+#endif
+    (void)L; (void)k; (void)mds; (void)x; (void)z; (void)n;
+    return 0;
+}
+
+size_t twofish_shuffle_encrypt(const TWOFISH_COMPACT *ck, const BYTE *in, BYTE *out, size_t nblocks)
+{
+#ifdef HAVE_X86_SIMD
+    if (get_backend() == BACKEND_AVX2)
+        return crypt_avx2(ck, in, out, nblocks, 0);
+#endif
+    (void)ck; (void)in; (void)out; (void)nblocks;
+    return 0;
+}
+
+size_t twofish_shuffle_decrypt(const TWOFISH_COMPACT *ck, const BYTE *in, BYTE *out, size_t nblocks)
+{
+#ifdef HAVE_X86_SIMD
+    if (get_backend() == BACKEND_AVX2)
+        return crypt_avx2(ck, in, out, nblocks, 1);
+#endif
+    (void)ck; (void)in; (void)out; (void)nblocks;
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef TWOFISH_SHUFFLE_H
+#define TWOFISH_SHUFFLE_H
+
+#include <stddef.h>
+#include "twofish.h"
+
+/*
+   Twofish's g function without tables. q0 and q1 are built from four
+   4-bit permutations each, so eight words at a time go through them as
+   byte shuffles (vpshufb) on their nibbles, and the MDS multiply is two
+   nibble-table products (by 0xEF and 0x5B) routed into place by more
+   shuffles. Nothing is indexed by key-dependent data, so the time taken
+   does not depend on the key or the data, and a key is usable with no
+   setup beyond its compact form.
+
+   Each call returns 0 when the CPU lacks AVX2, and the caller then falls
+   back to its own code.
+*/
+
+/* "avx2" or "scalar" */
+const char *twofish_shuffle_backend(void);
+
+/*
+   z[i] = h(x[i], L) for n words, with the S-box key words L[0..k-1]; mds 0
+   stops after the q permutations and returns their four output bytes.
+   Returns n, or 0 without touching z.
+*/
+size_t twofish_shuffle_h(const u32 L[4], int k, int mds, const u32 *x, u32 *z, size_t n);
+
+/*
+   Encrypt or decrypt independent blocks straight from a compact key; in
+   and out may be the same. Returns nblocks, padding a short tail to a full
+   pass so that every block is done in constant time, or 0 without AVX2.
+*/
+size_t twofish_shuffle_encrypt(const TWOFISH_COMPACT *ck, const BYTE *in, BYTE *out, size_t nblocks);
+size_t twofish_shuffle_decrypt(const TWOFISH_COMPACT *ck, const BYTE *in, BYTE *out, size_t nblocks);
+
+#endif /* TWOFISH_SHUFFLE_H */
@@ -0,0 +1,326 @@
+#include <string.h>
+#include "twofish_siv.h"
+#include "twofish_modes.h"
+#include "twofish_alloc.h"
+#include "secure_pool.h"
+#include "simd_util.h"
+
+/* plaintext bytes per step of the decryption pipeline (a multiple of 16) */
+#define PIPE_BYTES 4096
+
+/* values handled per group in the batch paths */
+#define GROUP 64
+
+/* CTR blocks pooled per kernel call in the batch paths */
+#define POOL_BLOCKS 64
+
+/* CTR starting block from a synthetic IV: two bits cleared, as in RFC 5297 */
+static void siv_counter(const BYTE v[16], BYTE q[16])
+{
+    memcpy(q, v, 16);
+    q[8] &= 0x7f;
+    q[12] &= 0x7f;
+}
+
+TWOFISH_SIV *twofish_siv_new(const BYTE *key, size_t key_len)
+{
+    TWOFISH_SIV *siv;
+    BYTE half[32];
+    size_t n = key_len / 2;
+
+    if (key_len != 32 && key_len != 48 && key_len != 64)
+        return NULL;
+    siv = secure_alloc(sizeof(TWOFISH_SIV));
+    if (siv == NULL)
+        return NULL;
+    siv->mac_ctx = twofish_ctx_alloc(TWOFISH_ALLOC_SECURE, -1);
+    siv->ctr_ctx = twofish_ctx_alloc(TWOFISH_ALLOC_SECURE, -1);
+    if (siv->mac_ctx == NULL || siv->ctr_ctx == NULL)
+    {
+        twofish_siv_free(siv);
+        return NULL;
+    }
+
+    memcpy(half, key, n);
+    twofish_set_key(siv->mac_ctx, half, (int)n * 8);
+    memcpy(half, key + n, n);
+    twofish_set_key(siv->ctr_ctx, half, (int)n * 8);
+    secure_zero(half, sizeof(half));
+
+    twofish_cmac_key_init(&siv->mac, siv->mac_ctx);
+    memset(half, 0, 16);
+    twofish_cmac(&siv->mac, half, 16, siv->d0);
+    return siv;
+}
+
+void twofish_siv_free(TWOFISH_SIV *siv)
+{
+    if (siv == NULL)
+        return;
+    twofish_ctx_release(siv->mac_ctx);
+    twofish_ctx_release(siv->ctr_ctx);
+    secure_free(siv);
+}
+
+/* S2V over the associated data: the value of D before the final string */
+static void s2v_ad(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                   size_t nad, BYTE d[16])
+{
+    BYTE macs[TWOFISH_CMAC_LANES * 16];
+    size_t i, j, m;
+
+    /* the CMACs of the strings are independent, only the folding into D is serial */
+    memcpy(d, siv->d0, 16);
+    for (i = 0; i < nad; i += m)
+    {
+        m = nad - i < TWOFISH_CMAC_LANES ? nad - i : TWOFISH_CMAC_LANES;
+        twofish_cmac_batch(&siv->mac, ad + i, ad_lens + i, m, NULL, macs);
+        for (j = 0; j < m; j++)
+        {
+            twofish_cmac_dbl(d);
+            simd_xor_block(d, d, macs + 16 * j);
+        }
+    }
+}
+
+/* block T for a final string shorter than 16 bytes, with the CMAC subkey applied */
+static void s2v_short_block(const TWOFISH_SIV *siv, const BYTE d[16], const BYTE *msg,
+                            size_t len, BYTE t[16])
+{
+    BYTE pad[16];
+
+    memcpy(t, d, 16);
+    twofish_cmac_dbl(t);
+    memset(pad, 0, 16);
+    memcpy(pad, msg, len);
+    pad[len] = 0x80;
+    simd_xor_block(t, t, pad);
+    simd_xor_block(t, t, siv->mac.k1);
+}
+
+/* final S2V step for up to GROUP messages sharing D; synthetic IVs go to v */
+static void s2v_group(const TWOFISH_SIV *siv, const BYTE d[16], const BYTE *const *msgs,
+                      const size_t *lens, size_t m, BYTE *v)
+{
+    const BYTE *lmsg[GROUP];
+    size_t llen[GROUP], lidx[GROUP], sidx[GROUP], nl = 0, ns = 0, i;
+    BYTE tags[GROUP * 16], shorts[GROUP * 16];
+
+    for (i = 0; i < m; i++)
+    {
+        if (lens[i] >= 16)
+        {
+            lmsg[nl] = msgs[i];
+            llen[nl] = lens[i];
+            lidx[nl++] = i;
+        }
+        else
+        {
+            /* CMAC of a single full block is one encryption */
+            s2v_short_block(siv, d, msgs[i], lens[i], shorts + 16 * ns);
+            sidx[ns++] = i;
+        }
+    }
+
+    if (nl)
+    {
+        twofish_cmac_batch(&siv->mac, lmsg, llen, nl, d, tags);
+        for (i = 0; i < nl; i++)
+            memcpy(v + 16 * lidx[i], tags + 16 * i, 16);
+    }
+    if (ns)
+    {
+        twofish_encrypt_blocks(siv->mac_ctx, shorts, shorts, ns);
+        for (i = 0; i < ns; i++)
+            memcpy(v + 16 * sidx[i], shorts + 16 * i, 16);
+    }
+}
+
+void twofish_siv_encrypt_detached(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                                  size_t nad, const BYTE *in, size_t len, BYTE *out, BYTE tag[16])
+{
+    BYTE d[16], v[16], q[16];
+
+    s2v_ad(siv, ad, ad_lens, nad, d);
+    s2v_group(siv, d, &in, &len, 1, v);
+
+    /* the IV depends on all of the plaintext, so CTR can only start now */
+    siv_counter(v, q);
+    twofish_ctr_crypt(siv->ctr_ctx, q, in, out, len);
+    memcpy(tag, v, 16);
+}
+
+void twofish_siv_encrypt(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                         size_t nad, const BYTE *in, size_t len, BYTE *out)
+{
+    twofish_siv_encrypt_detached(siv, ad, ad_lens, nad, in, len, out + 16, out);
+}
+
+int twofish_siv_decrypt_detached(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                                 size_t nad, const BYTE tag[16], const BYTE *in, size_t len, BYTE *out)
+{
+    TWOFISH_CMAC cmac;
+    BYTE d[16], v[16], q[16], last[16], expected[16];
+    size_t body, off, n, hi;
+
+    /* the tag may sit in the buffer being decrypted over */
+    memcpy(expected, tag, 16);
+    siv_counter(expected, q);
+    s2v_ad(siv, ad, ad_lens, nad, d);
+
+    if (len < 16)
+    {
+        twofish_ctr_crypt(siv->ctr_ctx, q, in, out, len);
+        s2v_group(siv, d, (const BYTE *const *)&out, &len, 1, v);
+    }
+    else
+    {
+        /* decrypt a chunk, then MAC it while it is still in cache */
+        twofish_cmac_init(&cmac, &siv->mac);
+        body = len - 16;
+        for (off = 0; off < len; off += n)
+        {
+            n = len - off < PIPE_BYTES ? len - off : PIPE_BYTES;
+            twofish_ctr_crypt(siv->ctr_ctx, q, in + off, out + off, n);
+            hi = off + n < body ? off + n : body;
+            if (hi > off)
+                twofish_cmac_update(&cmac, out + off, hi - off);
+        }
+        simd_xor_block(last, out + body, d);
+        twofish_cmac_update(&cmac, last, 16);
+        twofish_cmac_final(&cmac, v);
+        secure_zero(last, sizeof(last));
+    }
+
+    if (!simd_equal(v, expected, 16))
+    {
+        secure_zero(out, len);
+        return -1;
+    }
+    return 0;
+}
+
+int twofish_siv_decrypt(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                        size_t nad, const BYTE *in, size_t len, BYTE *out)
+{
+    if (len < 16)
+        return -1;
+    return twofish_siv_decrypt_detached(siv, ad, ad_lens, nad, in, in + 16, len - 16, out);
+}
+
+/* CTR blocks of several values encrypted together */
+typedef struct {
+    TWOFISH_CTX *ctx;
+    size_t count;
+    BYTE ks[POOL_BLOCKS * 16];
+    const BYTE *src[POOL_BLOCKS];
+    BYTE *dst[POOL_BLOCKS];
+    size_t len[POOL_BLOCKS];
+} ctr_pool;
+
+static void pool_flush(ctr_pool *pool)
+{
+    size_t i;
+
+    twofish_encrypt_blocks(pool->ctx, pool->ks, pool->ks, pool->count);
+    for (i = 0; i < pool->count; i++)
+        simd_xor(pool->dst[i], pool->src[i], pool->ks + 16 * i, pool->len[i]);
+    pool->count = 0;
+}
+
+static void pool_add(ctr_pool *pool, BYTE q[16], const BYTE *in, BYTE *out, size_t len)
+{
+    size_t n;
+
+    while (len)
+    {
+        if (pool->count == POOL_BLOCKS)
+            pool_flush(pool);
+        n = len < 16 ? len : 16;
+        memcpy(pool->ks + 16 * pool->count, q, 16);
+        twofish_ctr_increment(q);
+        pool->src[pool->count] = in;
+        pool->dst[pool->count] = out;
+        pool->len[pool->count++] = n;
+        in += n;
+        out += n;
+        len -= n;
+    }
+}
+
+void twofish_siv_encrypt_batch(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                               size_t nad, const BYTE *const *in, const size_t *lens, size_t n,
+                               BYTE *const *out)
+{
+    ctr_pool pool;
+    BYTE d[16], q[16], v[GROUP * 16];
+    size_t g, i, m;
+
+    s2v_ad(siv, ad, ad_lens, nad, d);
+    pool.ctx = siv->ctr_ctx;
+    pool.count = 0;
+
+    for (g = 0; g < n; g += m)
+    {
+        m = n - g < GROUP ? n - g : GROUP;
+        s2v_group(siv, d, in + g, lens + g, m, v);
+        for (i = 0; i < m; i++)
+        {
+            memcpy(out[g + i], v + 16 * i, 16);
+            siv_counter(v + 16 * i, q);
+            pool_add(&pool, q, in[g + i], out[g + i] + 16, lens[g + i]);
+        }
+    }
+    if (pool.count)
+        pool_flush(&pool);
+    secure_zero(pool.ks, sizeof(pool.ks));
+}
+
+size_t twofish_siv_decrypt_batch(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                                 size_t nad, const BYTE *const *in, const size_t *lens, size_t n,
+                                 BYTE *const *out, int *ok)
+{
+    ctr_pool pool;
+    const BYTE *pt[GROUP];
+    size_t ptlen[GROUP], idx[GROUP], g, i, m, k, failed = 0;
+    BYTE d[16], q[16], v[GROUP * 16];
+
+    s2v_ad(siv, ad, ad_lens, nad, d);
+    pool.ctx = siv->ctr_ctx;
+    pool.count = 0;
+
+    for (g = 0; g < n; g += m)
+    {
+        m = n - g < GROUP ? n - g : GROUP;
+        k = 0;
+        for (i = g; i < g + m; i++)
+        {
+            if (lens[i] < 16)
+            {
+                ok[i] = 0;
+                failed++;
+                continue;
+            }
+            siv_counter(in[i], q);
+            pool_add(&pool, q, in[i] + 16, out[i], lens[i] - 16);
+            pt[k] = out[i];
+            ptlen[k] = lens[i] - 16;
+            idx[k++] = i;
+        }
+        if (pool.count)
+            pool_flush(&pool);
+
+        s2v_group(siv, d, pt, ptlen, k, v);
+        for (i = 0; i < k; i++)
+        {
+            ok[idx[i]] = simd_equal(v + 16 * i, in[idx[i]], 16);
+            if (!ok[idx[i]])
+            {
+                secure_zero(out[idx[i]], ptlen[i]);
+                failed++;
+            }
+        }
+    }
+    secure_zero(pool.ks, sizeof(pool.ks));
+    return failed;
+}
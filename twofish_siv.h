@@ -0,0 +1,77 @@
+#ifndef TWOFISH_SIV_H
+#define TWOFISH_SIV_H
+
+#include <stddef.h>
+#include "twofish.h"
+#include "twofish_cmac.h"
+
+/*
+   Deterministic authenticated encryption: the SIV construction of RFC 5297
+   over Twofish. S2V (CMAC under the first half of the key) turns the
+   associated data and the plaintext into a synthetic IV, which is both the
+   tag and the CTR starting point under the second half of the key. Equal
+   inputs give equal outputs, so ciphertexts can be deduplicated.
+
+   A sealed value is V || C: the 16-byte synthetic IV, then a ciphertext as
+   long as the plaintext.
+*/
+
+#define TWOFISH_SIV_TAG 16
+
+typedef struct {
+    TWOFISH_CTX *mac_ctx;
+    TWOFISH_CTX *ctr_ctx;
+    TWOFISH_CMAC_KEY mac;   /* subkeys of mac_ctx */
+    BYTE d0[16];            /* S2V starting value CMAC(zero block), fixed per key */
+} TWOFISH_SIV;
+
+/* Key a SIV instance from 32, 48 or 64 bytes; NULL if out of memory or bad length */
+TWOFISH_SIV *twofish_siv_new(const BYTE *key, size_t key_len);
+void twofish_siv_free(TWOFISH_SIV *siv);
+
+/*
+   Seal len bytes of in into out (len + 16 bytes) under the nad associated
+   data strings ad[i] of ad_lens[i] bytes.
+*/
+void twofish_siv_encrypt(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                         size_t nad, const BYTE *in, size_t len, BYTE *out);
+
+/*
+   Open len bytes (V || C) of in into out (len - 16 bytes). The keystream
+   and the MAC run chunk by chunk, so the plaintext is authenticated while
+   it is still in cache. Returns 0, or -1 if the value is too short or does
+   not authenticate, in which case out is cleared.
+*/
+int twofish_siv_decrypt(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                        size_t nad, const BYTE *in, size_t len, BYTE *out);
+
+/*
+   The same with the tag kept apart from the ciphertext, for callers that
+   lay out records themselves. in and out may be the same buffer; the
+   plaintext or ciphertext is len bytes either way.
+*/
+void twofish_siv_encrypt_detached(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                                  size_t nad, const BYTE *in, size_t len, BYTE *out, BYTE tag[16]);
+int twofish_siv_decrypt_detached(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                                 size_t nad, const BYTE tag[16], const BYTE *in, size_t len, BYTE *out);
+
+/*
+   Seal n values sharing the same associated data; out[i] receives
+   lens[i] + 16 bytes. The associated data is absorbed once, the final S2V
+   CMACs run interleaved, and the CTR blocks of all values are pooled
+   through the multi-block kernel.
+*/
+void twofish_siv_encrypt_batch(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                               size_t nad, const BYTE *const *in, const size_t *lens, size_t n,
+                               BYTE *const *out);
+
+/*
+   Open n sealed values (lens[i] includes the 16-byte tag); out[i] receives
+   lens[i] - 16 bytes. Returns the number of values that failed, each of
+   which has ok[i] set to 0 and its output cleared.
+*/
+size_t twofish_siv_decrypt_batch(const TWOFISH_SIV *siv, const BYTE *const *ad, const size_t *ad_lens,
+                                 size_t nad, const BYTE *const *in, const size_t *lens, size_t n,
+                                 BYTE *const *out, int *ok);
+
+#endif /* TWOFISH_SIV_H */
@@ -1,16 +1,76 @@
 #include <Python.h>
 #include <string.h>
+#include <structmember.h>
 #include "twofish.h"
+#include "twofish_alloc.h"
+#include "twofish_cache.h"
+#include "twofish_keymgr.h"
+#include "secure_pool.h"
+#include "sha256.h"
+#include "base64.h"
+#include "simd_util.h"
+#include "envelope.h"
+#include "twofish_modes.h"
+#include "twofish_jobs.h"
+#include "twofish_cmac.h"
+#include "twofish_etm.h"
+#include "twofish_siv.h"
+#include "twofish_fpe.h"
+#include "twofish_hctr2.h"
+#include "twofish_shuffle.h"
+#include "twofish_mmap.h"
+#include "twofish_ring.h"
+#include "workpool.h"
+#include "dispatcher.h"
 
 typedef struct {
     PyObject_HEAD
-    TWOFISH_CTX ctx;
+    TWOFISH_CTX *ctx;            /* in the secure pool, outside the object */
+    TWOFISH_REPLICATED *rep;     /* per-node copies, NULL unless replicated */
+    twofish_cache_entry *cached; /* owner of ctx when it comes from the key cache */
+    TWOFISH_ADAPTIVE *adaptive;  /* owner of ctx while keyed adaptively */
 } TwofishObject;
 
+/* blocks an adaptive context runs partially keyed unless told otherwise */
+#define DEFAULT_PROMOTE_AFTER 8
+
+/* context to use from the calling thread */
+#define ACTIVE_CTX(self) ((self)->rep ? twofish_replica_local((self)->rep) : (self)->ctx)
+
+/* context for bulk work; an adaptive one is promoted here, with the GIL held */
+static TWOFISH_CTX *
+Twofish_bulk_ctx(TwofishObject *self)
+{
+    if (self->adaptive)
+        twofish_adaptive_full(self->adaptive);
+    return ACTIVE_CTX(self);
+}
+
+/* all-zero schedule of objects not keyed yet; never written */
+static TWOFISH_CTX unkeyed_ctx;
+
+static void
+Twofish_drop_ctx(TwofishObject *self)
+{
+    if (self->cached)
+        twofish_cache_release(self->cached);
+    else if (self->adaptive)
+        secure_free(self->adaptive);
+    else if (self->ctx != &unkeyed_ctx)
+        twofish_ctx_release(self->ctx);
+    self->cached = NULL;
+    self->adaptive = NULL;
+    self->ctx = &unkeyed_ctx;
+}
+
 static void
 Twofish_dealloc(TwofishObject *self)
 {
-    twofish_free_ctx(&self->ctx);
+    if (self->rep) {
+        twofish_replicate_free(self->rep);
+        PyMem_Free(self->rep);
+    }
+    Twofish_drop_ctx(self);
     Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -20,7 +80,11 @@ Twofish_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     TwofishObject *self;
     self = (TwofishObject *)type->tp_alloc(type, 0);
     if (self != NULL) {
-        twofish_init_ctx(&self->ctx);
+        /* the context is allocated, or taken from the key cache, when keyed */
+        self->ctx = &unkeyed_ctx;
+        self->rep = NULL;
+        self->cached = NULL;
+        self->adaptive = NULL;
     }
     return (PyObject *)self;
 }
@@ -30,11 +94,26 @@ Twofish_init(TwofishObject *self, PyObject *args, PyObject *kwds)
 {
     PyObject *key_obj = NULL;
     Py_buffer key;
+    twofish_cache_entry *entry;
+    TWOFISH_ADAPTIVE *ad;
+    TWOFISH_CTX *ctx;
+    int numa_replicate = 0;
+    Py_ssize_t promote_after = DEFAULT_PROMOTE_AFTER;
     
-    static char *kwlist[] = {"key", NULL};
+    static char *kwlist[] = {"key", "numa_replicate", "promote_after", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &key_obj))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|pn", kwlist, &key_obj, &numa_replicate,
+                                     &promote_after))
         return -1;
+    if (promote_after < 0) {
+        PyErr_SetString(PyExc_ValueError, "promote_after must be >= 0");
+        return -1;
+    }
+    /* MappedFile, queued jobs and GIL-free calls may still use the schedule */
+    if (self->ctx != &unkeyed_ctx) {
+        PyErr_SetString(PyExc_RuntimeError, "Twofish object is already keyed");
+        return -1;
+    }
     
     if (PyObject_GetBuffer(key_obj, &key, PyBUF_SIMPLE) < 0)
         return -1;
@@ -45,9 +124,50 @@ Twofish_init(TwofishObject *self, PyObject *args, PyObject *kwds)
         return -1;
     }
     
-    twofish_set_key(&self->ctx, key.buf, key.len * 8);
+    /* a hot key shares the cached schedule instead of being set up again */
+    entry = twofish_cache_acquire(key.buf, (int)key.len);
+    if (entry != NULL) {
+        self->cached = entry;
+        self->ctx = twofish_cache_ctx(entry);
+    }
+    else if (promote_after > 0 && !numa_replicate) {
+        /* partially keyed until bulk work or promote_after blocks call for the full tables */
+        ad = secure_alloc(sizeof(TWOFISH_ADAPTIVE));
+        if (ad == NULL) {
+            PyBuffer_Release(&key);
+            PyErr_NoMemory();
+            return -1;
+        }
+        twofish_adaptive_set_key(ad, key.buf, key.len * 8, (size_t)promote_after);
+        self->adaptive = ad;
+        self->ctx = &ad->full;
+    }
+    else {
+        ctx = twofish_ctx_alloc(TWOFISH_ALLOC_SECURE, -1);
+        if (ctx == NULL) {
+            PyBuffer_Release(&key);
+            PyErr_NoMemory();
+            return -1;
+        }
+        twofish_set_key(ctx, key.buf, key.len * 8);
+        self->ctx = ctx;
+    }
     PyBuffer_Release(&key);
     
+    if (numa_replicate) {
+        self->rep = PyMem_Malloc(sizeof(TWOFISH_REPLICATED));
+        if (self->rep == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (twofish_replicate(self->rep, self->ctx) != 0) {
+            PyMem_Free(self->rep);
+            self->rep = NULL;
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    
     return 0;
 }
 
@@ -75,7 +195,10 @@ Twofish_encrypt(TwofishObject *self, PyObject *args)
     
     buffer = PyBytes_AS_STRING(result);
     memcpy(buffer, data.buf, data.len);
-    twofish_encrypt(&self->ctx, (BYTE*)buffer);
+    if (self->adaptive)
+        twofish_adaptive_encrypt(self->adaptive, (BYTE*)buffer);
+    else
+        twofish_encrypt(ACTIVE_CTX(self), (BYTE*)buffer);
     
     PyBuffer_Release(&data);
     return result;
@@ -105,17 +228,594 @@ Twofish_decrypt(TwofishObject *self, PyObject *args)
     
     buffer = PyBytes_AS_STRING(result);
     memcpy(buffer, data.buf, data.len);
-    twofish_decrypt(&self->ctx, (BYTE*)buffer);
+    if (self->adaptive)
+        twofish_adaptive_decrypt(self->adaptive, (BYTE*)buffer);
+    else
+        twofish_decrypt(ACTIVE_CTX(self), (BYTE*)buffer);
+    
+    PyBuffer_Release(&data);
+    return result;
+}
+
+/* ECB and CBC over whole buffers, with optional PKCS#7 padding */
+
+#define BLOCK_ECB_ENCRYPT 0
+#define BLOCK_ECB_DECRYPT 1
+#define BLOCK_CBC_ENCRYPT 2
+#define BLOCK_CBC_DECRYPT 3
+
+static PyObject *
+Twofish_block_mode(TwofishObject *self, PyObject *args, int op)
+{
+    Py_buffer data, iv = {NULL};
+    PyObject *result;
+    TWOFISH_CTX *ctx;
+    int cbc = op == BLOCK_CBC_ENCRYPT || op == BLOCK_CBC_DECRYPT;
+    int decrypt = op == BLOCK_ECB_DECRYPT || op == BLOCK_CBC_DECRYPT;
+    int padding = 0;
+    BYTE reg[16], *out;
+    size_t n, out_len;
+    
+    if (!(cbc ? PyArg_ParseTuple(args, "y*y*|p", &data, &iv, &padding)
+              : PyArg_ParseTuple(args, "y*|p", &data, &padding)))
+        return NULL;
+    
+    if (cbc && iv.len != 16) {
+        PyErr_SetString(PyExc_ValueError, "IV must be 16 bytes for CBC mode");
+        goto error;
+    }
+    if ((decrypt || !padding) && data.len % 16 != 0) {
+        PyErr_SetString(PyExc_ValueError, "Data length must be a multiple of 16 bytes");
+        goto error;
+    }
+    if (cbc)
+        memcpy(reg, iv.buf, 16);
+    
+    n = (size_t)data.len;
+    out_len = !decrypt && padding ? n / 16 * 16 + 16 : n;
+    result = PyBytes_FromStringAndSize(NULL, out_len);
+    if (result == NULL)
+        goto error;
+    out = (BYTE *)PyBytes_AS_STRING(result);
+    
+    ctx = Twofish_bulk_ctx(self);
+    Py_BEGIN_ALLOW_THREADS
+    if (!decrypt && padding) {
+        memcpy(out, data.buf, n);
+        twofish_pad(out, n);
+    }
+    else if (!decrypt)
+        memcpy(out, data.buf, n);
+    if (op == BLOCK_ECB_ENCRYPT)
+        twofish_ecb_encrypt(ctx, out, out, out_len / 16);
+    else if (op == BLOCK_CBC_ENCRYPT)
+        twofish_cbc_encrypt(ctx, reg, out, out, out_len / 16);
+    else if (op == BLOCK_ECB_DECRYPT)
+        twofish_ecb_decrypt(ctx, data.buf, out, n / 16);
+    else
+        twofish_cbc_decrypt(ctx, reg, data.buf, out, n / 16);
+    if (decrypt && padding)
+        out_len = twofish_unpad(out, n);
+    Py_END_ALLOW_THREADS
+    
+    PyBuffer_Release(&data);
+    if (iv.buf != NULL)
+        PyBuffer_Release(&iv);
+    if (out_len < n && _PyBytes_Resize(&result, out_len) < 0)
+        return NULL;
+    return result;
+    
+error:
+    PyBuffer_Release(&data);
+    if (iv.buf != NULL)
+        PyBuffer_Release(&iv);
+    return NULL;
+}
+
+static PyObject *
+Twofish_ecb_encrypt(TwofishObject *self, PyObject *args)
+{
+    return Twofish_block_mode(self, args, BLOCK_ECB_ENCRYPT);
+}
+
+static PyObject *
+Twofish_ecb_decrypt(TwofishObject *self, PyObject *args)
+{
+    return Twofish_block_mode(self, args, BLOCK_ECB_DECRYPT);
+}
+
+static PyObject *
+Twofish_cbc_encrypt(TwofishObject *self, PyObject *args)
+{
+    return Twofish_block_mode(self, args, BLOCK_CBC_ENCRYPT);
+}
+
+static PyObject *
+Twofish_cbc_decrypt(TwofishObject *self, PyObject *args)
+{
+    return Twofish_block_mode(self, args, BLOCK_CBC_DECRYPT);
+}
+
+/* Asynchronous CBC seal/open on the worker pool */
+
+enum { JOB_SEAL, JOB_OPEN };
+
+typedef struct {
+    workpool_job base;
+    int op;
+    PyObject *owner;        /* Twofish object, kept alive until reaped */
+    PyObject *future;       /* handed back by reap() */
+    Py_buffer in;
+    PyObject *out;          /* bytes filled in by the worker */
+    Py_ssize_t out_len;     /* length of out once unpadded */
+    BYTE iv[16];
+    twofish_job cbc;        /* the CBC pass over out, set up by CryptJob_start */
+} CryptJob;
+
+static workpool *pool = NULL;
+
+/* start the pool on first use; the GIL serialises this */
+static workpool *
+get_pool(void)
+{
+    if (pool == NULL) {
+        pool = workpool_create(0);
+        if (pool == NULL)
+            PyErr_SetString(PyExc_RuntimeError, "Could not start the worker pool");
+    }
+    return pool;
+}
+
+/*
+   The jobs run without the GIL and touch only themselves and the owner's
+   context. A seal copies and pads its input into out, then encrypts it
+   there; an open decrypts straight into out and unpads.
+*/
+static void
+CryptJob_start(CryptJob *job)
+{
+    TWOFISH_CTX *ctx = ACTIVE_CTX((TwofishObject *)job->owner);
+    BYTE *out = (BYTE *)PyBytes_AS_STRING(job->out);
+    const BYTE *in = job->in.buf;
+    size_t n;
+    
+    if (job->op == JOB_SEAL) {
+        memcpy(out, job->iv, 16);
+        memcpy(out + 16, in, job->in.len);
+        n = twofish_pad(out + 16, job->in.len);
+        twofish_job_init(&job->cbc, TWOFISH_JOB_CBC_ENCRYPT, ctx, job->iv, out + 16, out + 16, n / 16);
+        job->out_len = 16 + n;
+    }
+    else {
+        n = job->in.len - 16;
+        twofish_job_init(&job->cbc, TWOFISH_JOB_CBC_DECRYPT, ctx, in, in + 16, out, n / 16);
+        job->out_len = n;
+    }
+}
+
+static void
+CryptJob_finish(CryptJob *job)
+{
+    if (job->op == JOB_OPEN)
+        job->out_len = twofish_unpad(job->cbc.out, (size_t)job->out_len);
+}
+
+static void
+run_crypt_job(workpool_job *base)
+{
+    CryptJob *job = (CryptJob *)base;
+    workpool_job *cbc = &job->cbc.base;
+    
+    CryptJob_start(job);
+    cbc->run_batch(&cbc, 1);
+    CryptJob_finish(job);
+}
+
+/*
+   A batch (all seals or all opens under one context) becomes one batch of
+   CBC jobs, so the blocks of every message go through the multi-block
+   kernel together.
+*/
+static void
+run_crypt_batch(workpool_job **jobs, size_t n, int open)
+{
+    workpool_job *cbc[DISPATCHER_MAX_LANES];
+    size_t base, m, i;
+    
+    for (base = 0; base < n; base += m) {
+        m = n - base < DISPATCHER_MAX_LANES ? n - base : DISPATCHER_MAX_LANES;
+        for (i = 0; i < m; i++) {
+            CryptJob *job = (CryptJob *)jobs[base + i];
+            CryptJob_start(job);
+            cbc[i] = &job->cbc.base;
+        }
+        cbc[0]->run_batch(cbc, m);
+        for (i = 0; open && i < m; i++)
+            CryptJob_finish((CryptJob *)jobs[base + i]);
+    }
+}
+
+/* distinct batch functions keep seals and opens in separate batches */
+static void
+run_seal_batch(workpool_job **jobs, size_t n)
+{
+    run_crypt_batch(jobs, n, 0);
+}
+
+static void
+run_open_batch(workpool_job **jobs, size_t n)
+{
+    run_crypt_batch(jobs, n, 1);
+}
+
+/*
+   Parse (data, iv[, future]) for a seal or (data[, future]) for an open into
+   job and allocate its output. future is NULL for the synchronous methods.
+   On failure the job holds nothing.
+*/
+static int
+CryptJob_parse(CryptJob *job, TwofishObject *self, PyObject *args, int op, PyObject **future)
+{
+    Py_buffer iv;
+    
+    if (op == JOB_SEAL) {
+        if (!(future ? PyArg_ParseTuple(args, "y*y*O", &job->in, &iv, future)
+                     : PyArg_ParseTuple(args, "y*y*", &job->in, &iv)))
+            return -1;
+        if (iv.len != 16) {
+            PyErr_SetString(PyExc_ValueError, "IV must be 16 bytes for CBC mode");
+            PyBuffer_Release(&iv);
+            PyBuffer_Release(&job->in);
+            return -1;
+        }
+        memcpy(job->iv, iv.buf, 16);
+        PyBuffer_Release(&iv);
+        job->out = PyBytes_FromStringAndSize(NULL, 16 + (job->in.len / 16 + 1) * 16);
+    }
+    else {
+        if (!(future ? PyArg_ParseTuple(args, "y*O", &job->in, future)
+                     : PyArg_ParseTuple(args, "y*", &job->in)))
+            return -1;
+        if (job->in.len < 16 || job->in.len % 16 != 0) {
+            PyErr_SetString(PyExc_ValueError, "Encrypted data length must be a non-zero multiple of 16 bytes");
+            PyBuffer_Release(&job->in);
+            return -1;
+        }
+        job->out = PyBytes_FromStringAndSize(NULL, job->in.len - 16);
+    }
+    if (job->out == NULL) {
+        PyBuffer_Release(&job->in);
+        return -1;
+    }
+    
+    /* workers read the context without the GIL, so it must be complete now */
+    Twofish_bulk_ctx(self);
+    job->base.run = run_crypt_job;
+    job->base.run_batch = op == JOB_SEAL ? run_seal_batch : run_open_batch;
+    job->base.group = self->ctx;
+    job->op = op;
+    job->owner = (PyObject *)self;      /* borrowed until the caller takes a reference */
+    return 0;
+}
+
+/* hand back a finished job's output, trimmed to its final length */
+static PyObject *
+CryptJob_result(CryptJob *job)
+{
+    PyObject *out = job->out;
+    
+    job->out = NULL;
+    if (job->out_len < PyBytes_GET_SIZE(out))
+        _PyBytes_Resize(&out, job->out_len);
+    return out;
+}
+
+static PyObject *
+Twofish_submit(TwofishObject *self, PyObject *args, int op)
+{
+    PyObject *future;
+    CryptJob *job;
+    workpool *wp;
+    
+    if ((wp = get_pool()) == NULL)
+        return NULL;
+    job = PyMem_Calloc(1, sizeof(CryptJob));
+    if (job == NULL)
+        return PyErr_NoMemory();
+    if (CryptJob_parse(job, self, args, op, &future) < 0) {
+        PyMem_Free(job);
+        return NULL;
+    }
+    
+    Py_INCREF(self);
+    Py_INCREF(future);
+    job->future = future;
+    
+    if (workpool_submit(wp, &job->base) != 0) {
+        /* not queued, so nothing else refers to the job */
+        PyErr_SetString(PyExc_RuntimeError, "Worker pool is shut down");
+        PyBuffer_Release(&job->in);
+        Py_DECREF(job->out);
+        Py_DECREF(job->owner);
+        Py_DECREF(job->future);
+        PyMem_Free(job);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Twofish_submit_seal(TwofishObject *self, PyObject *args)
+{
+    return Twofish_submit(self, args, JOB_SEAL);
+}
+
+static PyObject *
+Twofish_submit_open(TwofishObject *self, PyObject *args)
+{
+    return Twofish_submit(self, args, JOB_OPEN);
+}
+
+/* CFB, OFB and CTR over whole buffers; no padding, the output is as long as the input */
+
+#define STREAM_CFB_ENCRYPT 0
+#define STREAM_CFB_DECRYPT 1
+#define STREAM_OFB         2
+#define STREAM_CTR         3
+
+static PyObject *
+Twofish_stream(TwofishObject *self, PyObject *args, int op)
+{
+    Py_buffer data, iv;
+    PyObject *result;
+    TWOFISH_CTX *ctx;
+    BYTE reg[16], *out;
+    int segment_bits = 128;
+    
+    if (op == STREAM_OFB || op == STREAM_CTR) {
+        if (!PyArg_ParseTuple(args, "y*y*", &data, &iv))
+            return NULL;
+    }
+    else if (!PyArg_ParseTuple(args, "y*y*|i", &data, &iv, &segment_bits))
+        return NULL;
+    
+    if (iv.len != 16 || (segment_bits != 8 && segment_bits != 128)) {
+        PyErr_SetString(PyExc_ValueError, iv.len != 16 ? "IV must be 16 bytes"
+                                                       : "segment_bits must be 8 or 128");
+        PyBuffer_Release(&data);
+        PyBuffer_Release(&iv);
+        return NULL;
+    }
+    memcpy(reg, iv.buf, 16);
+    PyBuffer_Release(&iv);
+    
+    result = PyBytes_FromStringAndSize(NULL, data.len);
+    if (result == NULL) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    out = (BYTE *)PyBytes_AS_STRING(result);
+    
+    ctx = Twofish_bulk_ctx(self);
+    Py_BEGIN_ALLOW_THREADS
+    if (op == STREAM_OFB)
+        twofish_ofb_crypt(ctx, reg, data.buf, out, data.len);
+    else if (op == STREAM_CTR)
+        twofish_ctr_crypt(ctx, reg, data.buf, out, data.len);
+    else if (op == STREAM_CFB_ENCRYPT && segment_bits == 8)
+        twofish_cfb8_encrypt(ctx, reg, data.buf, out, data.len);
+    else if (op == STREAM_CFB_ENCRYPT)
+        twofish_cfb128_encrypt(ctx, reg, data.buf, out, data.len);
+    else if (segment_bits == 8)
+        twofish_cfb8_decrypt(ctx, reg, data.buf, out, data.len);
+    else
+        twofish_cfb128_decrypt(ctx, reg, data.buf, out, data.len);
+    Py_END_ALLOW_THREADS
+    
+    PyBuffer_Release(&data);
+    return result;
+}
+
+static PyObject *
+Twofish_cfb_encrypt(TwofishObject *self, PyObject *args)
+{
+    return Twofish_stream(self, args, STREAM_CFB_ENCRYPT);
+}
+
+static PyObject *
+Twofish_cfb_decrypt(TwofishObject *self, PyObject *args)
+{
+    return Twofish_stream(self, args, STREAM_CFB_DECRYPT);
+}
+
+static PyObject *
+Twofish_ofb(TwofishObject *self, PyObject *args)
+{
+    return Twofish_stream(self, args, STREAM_OFB);
+}
+
+static PyObject *
+Twofish_ctr(TwofishObject *self, PyObject *args)
+{
+    return Twofish_stream(self, args, STREAM_CTR);
+}
+
+/* CBC encrypt-then-MAC with HMAC-SHA256 over iv || ciphertext */
+
+static PyObject *
+Twofish_cbc_hmac_encrypt(TwofishObject *self, PyObject *args)
+{
+    Py_buffer data, iv, mac_key;
+    PyObject *ct, *tag;
+    TWOFISH_CTX *ctx;
+    hmac_sha256_ctx mac;
+    
+    if (!PyArg_ParseTuple(args, "y*y*y*", &data, &iv, &mac_key))
+        return NULL;
+    
+    if (iv.len != 16) {
+        PyErr_SetString(PyExc_ValueError, "IV must be 16 bytes");
+        ct = tag = NULL;
+        goto done;
+    }
+    
+    ct = PyBytes_FromStringAndSize(NULL, data.len / 16 * 16 + 16);
+    tag = PyBytes_FromStringAndSize(NULL, TWOFISH_ETM_TAG);
+    if (ct == NULL || tag == NULL)
+        goto done;
+    
+    /* promote only once the call is known to go ahead */
+    ctx = Twofish_bulk_ctx(self);
+    hmac_sha256_init(&mac, mac_key.buf, mac_key.len);
+    Py_BEGIN_ALLOW_THREADS
+    twofish_cbc_hmac_encrypt(ctx, &mac, iv.buf, data.buf, data.len,
+                             (BYTE *)PyBytes_AS_STRING(ct), (BYTE *)PyBytes_AS_STRING(tag));
+    Py_END_ALLOW_THREADS
+    secure_zero(&mac, sizeof(mac));
+    
+done:
+    PyBuffer_Release(&data);
+    PyBuffer_Release(&iv);
+    PyBuffer_Release(&mac_key);
+    if (ct == NULL || tag == NULL) {
+        Py_XDECREF(ct);
+        Py_XDECREF(tag);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", ct, tag);
+}
+
+static PyObject *
+Twofish_cbc_hmac_decrypt(TwofishObject *self, PyObject *args)
+{
+    Py_buffer data, iv, tag, mac_key;
+    PyObject *result = NULL;
+    TWOFISH_CTX *ctx;
+    hmac_sha256_ctx mac;
+    size_t out_len = 0;
+    int rc;
+    
+    if (!PyArg_ParseTuple(args, "y*y*y*y*", &data, &iv, &tag, &mac_key))
+        return NULL;
+    
+    if (iv.len != 16 || tag.len != TWOFISH_ETM_TAG) {
+        PyErr_SetString(PyExc_ValueError, iv.len != 16 ? "IV must be 16 bytes" : "Tag must be 32 bytes");
+        goto done;
+    }
+    if (data.len == 0 || data.len % 16 != 0) {
+        PyErr_SetString(PyExc_ValueError, "Encrypted data length must be a non-zero multiple of 16 bytes");
+        goto done;
+    }
     
+    result = PyBytes_FromStringAndSize(NULL, data.len);
+    if (result == NULL)
+        goto done;
+    
+    /* promote only once the call is known to go ahead */
+    ctx = Twofish_bulk_ctx(self);
+    hmac_sha256_init(&mac, mac_key.buf, mac_key.len);
+    Py_BEGIN_ALLOW_THREADS
+    rc = twofish_cbc_hmac_decrypt(ctx, &mac, iv.buf, data.buf, data.len,
+                                  (BYTE *)PyBytes_AS_STRING(result), &out_len, tag.buf);
+    Py_END_ALLOW_THREADS
+    secure_zero(&mac, sizeof(mac));
+    
+    if (rc != 0) {
+        Py_CLEAR(result);
+        PyErr_SetString(PyExc_ValueError, "MAC check failed");
+    }
+    else if ((Py_ssize_t)out_len < data.len) {
+        _PyBytes_Resize(&result, out_len);
+    }
+    
+done:
     PyBuffer_Release(&data);
+    PyBuffer_Release(&iv);
+    PyBuffer_Release(&tag);
+    PyBuffer_Release(&mac_key);
     return result;
 }
 
+/* Micro-batched synchronous seal/open through the dispatcher */
+
+static dispatcher *batcher = NULL;
+
+static dispatcher *
+get_batcher(void)
+{
+    if (batcher == NULL) {
+        batcher = dispatcher_create(20000, 8);
+        if (batcher == NULL)
+            PyErr_NoMemory();
+    }
+    return batcher;
+}
+
+static PyObject *
+Twofish_batched(TwofishObject *self, PyObject *args, int op)
+{
+    CryptJob job;
+    dispatcher *d;
+    
+    if ((d = get_batcher()) == NULL)
+        return NULL;
+    memset(&job, 0, sizeof(job));
+    if (CryptJob_parse(&job, self, args, op, NULL) < 0)
+        return NULL;
+    
+    Py_BEGIN_ALLOW_THREADS
+    dispatcher_run(d, &job.base);
+    Py_END_ALLOW_THREADS
+    
+    PyBuffer_Release(&job.in);
+    return CryptJob_result(&job);
+}
+
+static PyObject *
+Twofish_seal_batched(TwofishObject *self, PyObject *args)
+{
+    return Twofish_batched(self, args, JOB_SEAL);
+}
+
+static PyObject *
+Twofish_open_batched(TwofishObject *self, PyObject *args)
+{
+    return Twofish_batched(self, args, JOB_OPEN);
+}
+
 static PyMethodDef Twofish_methods[] = {
     {"encrypt", (PyCFunction)Twofish_encrypt, METH_VARARGS,
      "Encrypt a 16-byte block with Twofish"},
     {"decrypt", (PyCFunction)Twofish_decrypt, METH_VARARGS,
      "Decrypt a 16-byte block with Twofish"},
+    {"ecb_encrypt", (PyCFunction)Twofish_ecb_encrypt, METH_VARARGS,
+     "ECB encryption (data, padding=False); with padding, PKCS#7 padding is added first"},
+    {"ecb_decrypt", (PyCFunction)Twofish_ecb_decrypt, METH_VARARGS,
+     "ECB decryption (data, padding=False); with padding, valid PKCS#7 padding is removed"},
+    {"cbc_encrypt", (PyCFunction)Twofish_cbc_encrypt, METH_VARARGS,
+     "CBC encryption (data, iv, padding=False); the IV is not included in the result"},
+    {"cbc_decrypt", (PyCFunction)Twofish_cbc_decrypt, METH_VARARGS,
+     "CBC decryption (data, iv, padding=False); data excludes the IV"},
+    {"cfb_encrypt", (PyCFunction)Twofish_cfb_encrypt, METH_VARARGS,
+     "CFB encryption (data, iv, segment_bits=128); segment_bits is 8 or 128"},
+    {"cfb_decrypt", (PyCFunction)Twofish_cfb_decrypt, METH_VARARGS,
+     "CFB decryption (data, iv, segment_bits=128); segment_bits is 8 or 128"},
+    {"ofb", (PyCFunction)Twofish_ofb, METH_VARARGS,
+     "OFB encryption or decryption (data, iv)"},
+    {"ctr", (PyCFunction)Twofish_ctr, METH_VARARGS,
+     "CTR encryption or decryption with a 128-bit big-endian counter (data, counter)"},
+    {"cbc_hmac_encrypt", (PyCFunction)Twofish_cbc_hmac_encrypt, METH_VARARGS,
+     "Padded CBC encryption then HMAC-SHA256 of iv || ciphertext (data, iv, mac_key); returns (ciphertext, tag)"},
+    {"cbc_hmac_decrypt", (PyCFunction)Twofish_cbc_hmac_decrypt, METH_VARARGS,
+     "Verify the tag and decrypt (data, iv, tag, mac_key); raises ValueError on a bad tag"},
+    {"submit_seal", (PyCFunction)Twofish_submit_seal, METH_VARARGS,
+     "Queue a padded CBC encryption (data, iv, future); the result is IV || ciphertext"},
+    {"submit_open", (PyCFunction)Twofish_submit_open, METH_VARARGS,
+     "Queue a CBC decryption of IV || ciphertext (data, future)"},
+    {"seal_batched", (PyCFunction)Twofish_seal_batched, METH_VARARGS,
+     "Padded CBC encryption (data, iv), batched with concurrent callers"},
+    {"open_batched", (PyCFunction)Twofish_open_batched, METH_VARARGS,
+     "CBC decryption of IV || ciphertext, batched with concurrent callers"},
     {NULL}  /* Sentinel */
 };
 
@@ -132,33 +832,3272 @@ static PyTypeObject TwofishType = {
     .tp_methods = Twofish_methods,
 };
 
-static PyMethodDef module_methods[] = {
-    {NULL}  /* Sentinel */
-};
+/* HKDF helpers shared by Keyring.derive and the module functions */
 
-static struct PyModuleDef pangfishmodule = {
-    PyModuleDef_HEAD_INIT,
-    "_twofish",
-    "Pangfish encryption module",
-    -1,
-    module_methods
-};
+/* buffers of a sequence of bytes-like objects (HKDF infos, SIV values and associated data) */
+typedef struct {
+    Py_ssize_t count;
+    Py_buffer *views;
+    const unsigned char **ptrs;
+    size_t *lens;
+} InfoList;
 
-PyMODINIT_FUNC
-PyInit__twofish(void)
+static void
+InfoList_release(InfoList *list)
 {
-    PyObject *m;
+    Py_ssize_t i;
     
-    if (PyType_Ready(&TwofishType) < 0)
-        return NULL;
-
-    m = PyModule_Create(&pangfishmodule);
-    if (m == NULL)
-        return NULL;
+    for (i = 0; i < list->count; i++)
+        PyBuffer_Release(&list->views[i]);
+    PyMem_Free(list->views);
+    PyMem_Free(list->ptrs);
+    PyMem_Free(list->lens);
+    memset(list, 0, sizeof(*list));
+}
 
-    Py_INCREF(&TwofishType);
-    if (PyModule_AddObject(m, "Twofish", (PyObject *)&TwofishType) < 0) {
-        Py_DECREF(&TwofishType);
+static int
+InfoList_fill(InfoList *list, PyObject *infos, const char *errmsg)
+{
+    PyObject *seq;
+    Py_ssize_t n, i;
+    
+    memset(list, 0, sizeof(*list));
+    seq = PySequence_Fast(infos, errmsg);
+    if (seq == NULL)
+        return -1;
+    
+    n = PySequence_Fast_GET_SIZE(seq);
+    list->views = PyMem_New(Py_buffer, n ? n : 1);
+    list->ptrs = PyMem_New(const unsigned char *, n ? n : 1);
+    list->lens = PyMem_New(size_t, n ? n : 1);
+    if (list->views == NULL || list->ptrs == NULL || list->lens == NULL) {
+        InfoList_release(list);
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    
+    for (i = 0; i < n; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        
+        if (PyUnicode_Check(item))
+            item = PyUnicode_AsUTF8String(item);
+        else
+            Py_INCREF(item);
+        if (item == NULL || PyObject_GetBuffer(item, &list->views[i], PyBUF_SIMPLE) < 0) {
+            Py_XDECREF(item);
+            InfoList_release(list);
+            Py_DECREF(seq);
+            return -1;
+        }
+        Py_DECREF(item);   /* the buffer keeps its exporter alive */
+        list->ptrs[i] = list->views[i].buf;
+        list->lens[i] = (size_t)list->views[i].len;
+        list->count = i + 1;
+    }
+    
+    Py_DECREF(seq);
+    list->count = n;
+    return 0;
+}
+
+/* HKDF-Extract from a key and an optional salt */
+static int
+hkdf_prk(PyObject *ikm_obj, PyObject *salt_obj, unsigned char prk[SHA256_DIGEST_SIZE])
+{
+    Py_buffer ikm, salt;
+    
+    if (PyObject_GetBuffer(ikm_obj, &ikm, PyBUF_SIMPLE) < 0)
+        return -1;
+    if (salt_obj == NULL || salt_obj == Py_None) {
+        hkdf_sha256_extract(NULL, 0, ikm.buf, ikm.len, prk);
+    }
+    else {
+        if (PyObject_GetBuffer(salt_obj, &salt, PyBUF_SIMPLE) < 0) {
+            PyBuffer_Release(&ikm);
+            return -1;
+        }
+        hkdf_sha256_extract(salt.buf, salt.len, ikm.buf, ikm.len, prk);
+        PyBuffer_Release(&salt);
+    }
+    PyBuffer_Release(&ikm);
+    return 0;
+}
+
+/* Keyring: a contiguous array of contexts for many keys */
+
+typedef struct {
+    PyObject_HEAD
+    TWOFISH_KEYRING ring;
+} KeyringObject;
+
+static void
+Keyring_dealloc(KeyringObject *self)
+{
+    twofish_keyring_free(&self->ring);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+Keyring_init(KeyringObject *self, PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t count;
+    int huge_pages = 0;
+    int node = -1;
+    int flags = TWOFISH_ALLOC_SECURE;
+    
+    static char *kwlist[] = {"count", "huge_pages", "node", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|pi", kwlist, &count, &huge_pages, &node))
+        return -1;
+    if (self->ring.base != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Keyring is already allocated");
+        return -1;
+    }
+    
+    if (count < 0) {
+        PyErr_SetString(PyExc_ValueError, "Keyring size must not be negative");
+        return -1;
+    }
+    if (node >= twofish_numa_nodes()) {
+        PyErr_SetString(PyExc_ValueError, "NUMA node out of range");
+        return -1;
+    }
+    
+    if (huge_pages)
+        flags |= TWOFISH_ALLOC_HUGE;
+    
+    twofish_keyring_free(&self->ring);
+    if (twofish_keyring_init(&self->ring, (size_t)count, flags, node) != 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* look up a slot, raising IndexError when out of range */
+static TWOFISH_CTX *
+Keyring_slot(KeyringObject *self, Py_ssize_t index)
+{
+    if (index < 0 || (size_t)index >= self->ring.count) {
+        PyErr_SetString(PyExc_IndexError, "Keyring index out of range");
+        return NULL;
+    }
+    return twofish_keyring_ctx(&self->ring, index);
+}
+
+static PyObject *
+Keyring_set_key(KeyringObject *self, PyObject *args)
+{
+    Py_ssize_t index;
+    Py_buffer key;
+    TWOFISH_CTX *ctx;
+    
+    if (!PyArg_ParseTuple(args, "ny*", &index, &key))
+        return NULL;
+    
+    ctx = Keyring_slot(self, index);
+    if (ctx == NULL) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    
+    if (key.len != 16 && key.len != 24 && key.len != 32) {
+        PyErr_SetString(PyExc_ValueError, "Key size must be 16, 24, or 32 bytes (128, 192, or 256 bits)");
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    
+    twofish_set_key(ctx, key.buf, key.len * 8);
+    PyBuffer_Release(&key);
+    
+    Py_RETURN_NONE;
+}
+
+/* shared body of Keyring.encrypt and Keyring.decrypt */
+static PyObject *
+Keyring_crypt(KeyringObject *self, PyObject *args, int encrypt)
+{
+    Py_ssize_t index;
+    Py_buffer data;
+    PyObject *result;
+    TWOFISH_CTX *ctx;
+    char *buffer;
+    
+    if (!PyArg_ParseTuple(args, "ny*", &index, &data))
+        return NULL;
+    
+    ctx = Keyring_slot(self, index);
+    if (ctx == NULL) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    
+    if (data.len != 16) {
+        PyErr_SetString(PyExc_ValueError, "Data must be 16 bytes long");
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    
+    result = PyBytes_FromStringAndSize(NULL, data.len);
+    if (result == NULL) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    
+    buffer = PyBytes_AS_STRING(result);
+    memcpy(buffer, data.buf, data.len);
+    if (encrypt)
+        twofish_encrypt(ctx, (BYTE*)buffer);
+    else
+        twofish_decrypt(ctx, (BYTE*)buffer);
+    
+    PyBuffer_Release(&data);
+    return result;
+}
+
+static PyObject *
+Keyring_encrypt(KeyringObject *self, PyObject *args)
+{
+    return Keyring_crypt(self, args, 1);
+}
+
+static PyObject *
+Keyring_decrypt(KeyringObject *self, PyObject *args)
+{
+    return Keyring_crypt(self, args, 0);
+}
+
+static PyObject *
+Keyring_derive(KeyringObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *master, *infos, *salt = NULL;
+    Py_ssize_t start = 0;
+    int key_size = 32;
+    unsigned char prk[SHA256_DIGEST_SIZE];
+    InfoList list;
+    int rc;
+    
+    static char *kwlist[] = {"master", "infos", "salt", "key_size", "start", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|Oin", kwlist,
+                                     &master, &infos, &salt, &key_size, &start))
+        return NULL;
+    
+    if (key_size != 16 && key_size != 24 && key_size != 32) {
+        PyErr_SetString(PyExc_ValueError, "Key size must be 16, 24, or 32 bytes (128, 192, or 256 bits)");
+        return NULL;
+    }
+    if (InfoList_fill(&list, infos, "infos must be a sequence of bytes") < 0)
+        return NULL;
+    if (start < 0 || (size_t)start > self->ring.count
+        || (size_t)list.count > self->ring.count - (size_t)start) {
+        PyErr_SetString(PyExc_IndexError, "Keyring index out of range");
+        InfoList_release(&list);
+        return NULL;
+    }
+    if (hkdf_prk(master, salt, prk) < 0) {
+        InfoList_release(&list);
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    rc = twofish_keyring_derive(&self->ring, (size_t)start, prk, list.ptrs, list.lens,
+                                (size_t)list.count, key_size);
+    Py_END_ALLOW_THREADS
+    secure_zero(prk, sizeof(prk));
+    InfoList_release(&list);
+    
+    if (rc != 0)
+        return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+Keyring_length(KeyringObject *self)
+{
+    return (Py_ssize_t)self->ring.count;
+}
+
+static PyObject *
+Keyring_get_huge_pages(KeyringObject *self, void *closure)
+{
+    return PyBool_FromLong(self->ring.huge);
+}
+
+static PyObject *
+Keyring_get_locked(KeyringObject *self, void *closure)
+{
+    return PyBool_FromLong(self->ring.locked);
+}
+
+static PyMethodDef Keyring_methods[] = {
+    {"set_key", (PyCFunction)Keyring_set_key, METH_VARARGS,
+     "Set the key of the context at an index"},
+    {"encrypt", (PyCFunction)Keyring_encrypt, METH_VARARGS,
+     "Encrypt a 16-byte block with the key at an index"},
+    {"decrypt", (PyCFunction)Keyring_decrypt, METH_VARARGS,
+     "Decrypt a 16-byte block with the key at an index"},
+    {"derive", (PyCFunction)Keyring_derive, METH_VARARGS | METH_KEYWORDS,
+     "Key consecutive contexts with HKDF-SHA256 subkeys of a master key, one per info"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef Keyring_members[] = {
+    {"node", T_INT, offsetof(KeyringObject, ring.node), READONLY,
+     "NUMA node the keyring is bound to, or -1"},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef Keyring_getset[] = {
+    {"huge_pages", (getter)Keyring_get_huge_pages, NULL,
+     "True if the keyring is backed by 2 MiB huge pages", NULL},
+    {"locked", (getter)Keyring_get_locked, NULL,
+     "True if the keyring is mlock'ed; False if locking failed, e.g. over RLIMIT_MEMLOCK", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods Keyring_as_sequence = {
+    .sq_length = (lenfunc)Keyring_length,
+};
+
+static PyTypeObject KeyringType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "Keyring",
+    .tp_doc = "Array of Twofish contexts in aligned, optionally huge-page memory",
+    .tp_basicsize = sizeof(KeyringObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Keyring_init,
+    .tp_dealloc = (destructor)Keyring_dealloc,
+    .tp_methods = Keyring_methods,
+    .tp_members = Keyring_members,
+    .tp_getset = Keyring_getset,
+    .tp_as_sequence = &Keyring_as_sequence,
+};
+
+/* KeyManager: compact keys with an LRU pool of expanded contexts */
+
+typedef struct {
+    PyObject_HEAD
+    twofish_keymgr *mgr;
+} KeyManagerObject;
+
+static void
+KeyManager_dealloc(KeyManagerObject *self)
+{
+    twofish_keymgr_free(self->mgr);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+KeyManager_init(KeyManagerObject *self, PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t slabs = 1024, partial_blocks = 4;
+    int huge_pages = 0;
+    twofish_keymgr *mgr;
+    
+    static char *kwlist[] = {"slabs", "huge_pages", "partial_blocks", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|npn", kwlist, &slabs, &huge_pages, &partial_blocks))
+        return -1;
+    if (self->mgr != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "KeyManager is already initialized");
+        return -1;
+    }
+    
+    if (slabs < 1 || slabs > 0x7fffffffL || partial_blocks < 0) {
+        PyErr_SetString(PyExc_ValueError, "slabs must be between 1 and 2**31 - 1 and partial_blocks >= 0");
+        return -1;
+    }
+    
+    mgr = twofish_keymgr_new((size_t)slabs, TWOFISH_ALLOC_SECURE | (huge_pages ? TWOFISH_ALLOC_HUGE : 0),
+                             (size_t)partial_blocks);
+    if (mgr == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    twofish_keymgr_free(self->mgr);
+    self->mgr = mgr;
+    return 0;
+}
+
+static int
+KeyManager_check(KeyManagerObject *self)
+{
+    if (self->mgr == NULL) {
+        PyErr_SetString(PyExc_ValueError, "KeyManager is not initialized");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+KeyManager_add(KeyManagerObject *self, PyObject *args)
+{
+    Py_buffer key;
+    long id;
+    
+    if (!PyArg_ParseTuple(args, "y*", &key))
+        return NULL;
+    if (KeyManager_check(self) < 0) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    
+    if (key.len != 16 && key.len != 24 && key.len != 32) {
+        PyErr_SetString(PyExc_ValueError, "Key size must be 16, 24, or 32 bytes (128, 192, or 256 bits)");
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    
+    id = twofish_keymgr_add(self->mgr, key.buf, (int)key.len);
+    PyBuffer_Release(&key);
+    if (id < 0)
+        return PyErr_NoMemory();
+    return PyLong_FromLong(id);
+}
+
+static PyObject *
+KeyManager_remove(KeyManagerObject *self, PyObject *args)
+{
+    long id;
+    
+    if (!PyArg_ParseTuple(args, "l", &id))
+        return NULL;
+    if (KeyManager_check(self) < 0)
+        return NULL;
+    
+    if (twofish_keymgr_remove(self->mgr, id) < 0) {
+        if (errno == EINVAL)
+            PyErr_SetString(PyExc_KeyError, "unknown key id");
+        else
+            PyErr_SetString(PyExc_RuntimeError, "key is in use");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* shared body of KeyManager.encrypt and KeyManager.decrypt */
+static PyObject *
+KeyManager_crypt(KeyManagerObject *self, PyObject *args, int decrypt)
+{
+    Py_buffer data;
+    PyObject *result;
+    long id;
+    int rc;
+    
+    if (!PyArg_ParseTuple(args, "ly*", &id, &data))
+        return NULL;
+    if (KeyManager_check(self) < 0) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    
+    if (data.len % 16 != 0) {
+        PyErr_SetString(PyExc_ValueError, "Data length must be a multiple of 16 bytes");
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    
+    result = PyBytes_FromStringAndSize(NULL, data.len);
+    if (result == NULL) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    rc = twofish_keymgr_crypt(self->mgr, id, data.buf, (BYTE *)PyBytes_AS_STRING(result),
+                              (size_t)data.len / 16, decrypt);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&data);
+    
+    if (rc < 0) {
+        Py_DECREF(result);
+        if (errno == EINVAL)
+            PyErr_SetString(PyExc_KeyError, "unknown key id");
+        else
+            PyErr_SetString(PyExc_RuntimeError, "every slab is in use");
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+KeyManager_encrypt(KeyManagerObject *self, PyObject *args)
+{
+    return KeyManager_crypt(self, args, 0);
+}
+
+static PyObject *
+KeyManager_decrypt(KeyManagerObject *self, PyObject *args)
+{
+    return KeyManager_crypt(self, args, 1);
+}
+
+static PyObject *
+KeyManager_stats(KeyManagerObject *self, PyObject *Py_UNUSED(ignored))
+{
+    twofish_keymgr_stats_t stats;
+    
+    if (KeyManager_check(self) < 0)
+        return NULL;
+    twofish_keymgr_stats(self->mgr, &stats);
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:O,s:O}",
+                         "keys", (Py_ssize_t)stats.keys,
+                         "slabs", (Py_ssize_t)stats.slabs,
+                         "resident", (Py_ssize_t)stats.resident,
+                         "hits", (Py_ssize_t)stats.hits,
+                         "expansions", (Py_ssize_t)stats.expansions,
+                         "evictions", (Py_ssize_t)stats.evictions,
+                         "partial_blocks", (Py_ssize_t)stats.partial,
+                         "huge_pages", stats.huge ? Py_True : Py_False,
+                         "locked", stats.locked ? Py_True : Py_False);
+}
+
+static Py_ssize_t
+KeyManager_length(KeyManagerObject *self)
+{
+    twofish_keymgr_stats_t stats;
+    
+    if (KeyManager_check(self) < 0)
+        return -1;
+    twofish_keymgr_stats(self->mgr, &stats);
+    return (Py_ssize_t)stats.keys;
+}
+
+static PyMethodDef KeyManager_methods[] = {
+    {"add", (PyCFunction)KeyManager_add, METH_VARARGS,
+     "Store a key in compact form; returns its id"},
+    {"remove", (PyCFunction)KeyManager_remove, METH_VARARGS,
+     "Forget the key with an id and wipe its schedule"},
+    {"encrypt", (PyCFunction)KeyManager_encrypt, METH_VARARGS,
+     "Encrypt whole 16-byte blocks with the key of an id (id, data)"},
+    {"decrypt", (PyCFunction)KeyManager_decrypt, METH_VARARGS,
+     "Decrypt whole 16-byte blocks with the key of an id (id, data)"},
+    {"stats", (PyCFunction)KeyManager_stats, METH_NOARGS,
+     "Keys stored, slabs resident, hits, expansions, evictions and blocks run partially keyed"},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods KeyManager_as_sequence = {
+    .sq_length = (lenfunc)KeyManager_length,
+};
+
+static PyTypeObject KeyManagerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "KeyManager",
+    .tp_doc = "Compact key store that keeps only the working set fully expanded",
+    .tp_basicsize = sizeof(KeyManagerObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)KeyManager_init,
+    .tp_dealloc = (destructor)KeyManager_dealloc,
+    .tp_methods = KeyManager_methods,
+    .tp_as_sequence = &KeyManager_as_sequence,
+};
+
+/* CMAC: a keyed context with its subkeys, derived once per key */
+
+typedef struct {
+    PyObject_HEAD
+    TWOFISH_CMAC_KEY *key;       /* in the secure pool, like its context */
+} CMACObject;
+
+static void
+CMAC_free_key(CMACObject *self)
+{
+    if (self->key) {
+        twofish_ctx_release(self->key->ctx);
+        secure_free(self->key);
+        self->key = NULL;
+    }
+}
+
+static void
+CMAC_dealloc(CMACObject *self)
+{
+    CMAC_free_key(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+CMAC_init(CMACObject *self, PyObject *args, PyObject *kwds)
+{
+    Py_buffer key;
+    TWOFISH_CTX *ctx;
+    
+    static char *kwlist[] = {"key", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*", kwlist, &key))
+        return -1;
+    if (self->key != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "CMAC is already keyed");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    
+    if (key.len != 16 && key.len != 24 && key.len != 32) {
+        PyErr_SetString(PyExc_ValueError, "Key size must be 16, 24, or 32 bytes (128, 192, or 256 bits)");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    
+    CMAC_free_key(self);
+    self->key = secure_alloc(sizeof(TWOFISH_CMAC_KEY));
+    ctx = twofish_ctx_alloc(TWOFISH_ALLOC_SECURE, -1);
+    if (self->key == NULL || ctx == NULL) {
+        secure_free(self->key);
+        self->key = NULL;
+        twofish_ctx_release(ctx);
+        PyBuffer_Release(&key);
+        PyErr_NoMemory();
+        return -1;
+    }
+    
+    twofish_set_key(ctx, key.buf, key.len * 8);
+    twofish_cmac_key_init(self->key, ctx);
+    PyBuffer_Release(&key);
+    return 0;
+}
+
+static PyObject *
+CMAC_tag(CMACObject *self, PyObject *args)
+{
+    Py_buffer data;
+    PyObject *result;
+    
+    if (!PyArg_ParseTuple(args, "y*", &data))
+        return NULL;
+    
+    result = PyBytes_FromStringAndSize(NULL, 16);
+    if (result == NULL) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    twofish_cmac(self->key, data.buf, data.len, (BYTE *)PyBytes_AS_STRING(result));
+    Py_END_ALLOW_THREADS
+    
+    PyBuffer_Release(&data);
+    return result;
+}
+
+static PyObject *
+CMAC_verify(CMACObject *self, PyObject *args)
+{
+    Py_buffer data, tag;
+    BYTE expected[16];
+    int ok;
+    
+    if (!PyArg_ParseTuple(args, "y*y*", &data, &tag))
+        return NULL;
+    
+    Py_BEGIN_ALLOW_THREADS
+    twofish_cmac(self->key, data.buf, data.len, expected);
+    Py_END_ALLOW_THREADS
+    
+    ok = tag.len == 16 && simd_equal(expected, tag.buf, 16);
+    PyBuffer_Release(&data);
+    PyBuffer_Release(&tag);
+    return PyBool_FromLong(ok);
+}
+
+/* tags of a sequence of messages, computed in interleaved lanes */
+static BYTE *
+CMAC_batch(CMACObject *self, InfoList *msgs)
+{
+    BYTE *tags = PyMem_Malloc(16 * (msgs->count ? msgs->count : 1));
+    
+    if (tags == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    twofish_cmac_batch(self->key, msgs->ptrs, msgs->lens, msgs->count, NULL, tags);
+    Py_END_ALLOW_THREADS
+    return tags;
+}
+
+static PyObject *
+CMAC_tag_batch(CMACObject *self, PyObject *args)
+{
+    PyObject *msgs_obj, *result = NULL, *item;
+    InfoList msgs;
+    BYTE *tags;
+    Py_ssize_t i;
+    
+    if (!PyArg_ParseTuple(args, "O", &msgs_obj))
+        return NULL;
+    if (InfoList_fill(&msgs, msgs_obj, "messages must be a sequence of bytes") < 0)
+        return NULL;
+    
+    tags = CMAC_batch(self, &msgs);
+    if (tags != NULL)
+        result = PyList_New(msgs.count);
+    for (i = 0; result != NULL && i < msgs.count; i++) {
+        item = PyBytes_FromStringAndSize((char *)tags + 16 * i, 16);
+        if (item == NULL)
+            Py_CLEAR(result);
+        else
+            PyList_SET_ITEM(result, i, item);
+    }
+    
+    PyMem_Free(tags);
+    InfoList_release(&msgs);
+    return result;
+}
+
+static PyObject *
+CMAC_verify_batch(CMACObject *self, PyObject *args)
+{
+    PyObject *msgs_obj, *tags_obj, *result = NULL;
+    InfoList msgs, given;
+    BYTE *tags;
+    Py_ssize_t i;
+    
+    if (!PyArg_ParseTuple(args, "OO", &msgs_obj, &tags_obj))
+        return NULL;
+    if (InfoList_fill(&msgs, msgs_obj, "messages must be a sequence of bytes") < 0)
+        return NULL;
+    if (InfoList_fill(&given, tags_obj, "tags must be a sequence of bytes") < 0) {
+        InfoList_release(&msgs);
+        return NULL;
+    }
+    if (given.count != msgs.count) {
+        PyErr_SetString(PyExc_ValueError, "messages and tags must have the same length");
+        goto done;
+    }
+    
+    tags = CMAC_batch(self, &msgs);
+    if (tags == NULL)
+        goto done;
+    result = PyList_New(msgs.count);
+    for (i = 0; result != NULL && i < msgs.count; i++) {
+        PyObject *ok = given.lens[i] == 16 && simd_equal(tags + 16 * i, given.ptrs[i], 16) ? Py_True : Py_False;
+        
+        Py_INCREF(ok);
+        PyList_SET_ITEM(result, i, ok);
+    }
+    PyMem_Free(tags);
+    
+done:
+    InfoList_release(&msgs);
+    InfoList_release(&given);
+    return result;
+}
+
+static PyMethodDef CMAC_methods[] = {
+    {"tag", (PyCFunction)CMAC_tag, METH_VARARGS,
+     "16-byte CMAC tag of a message"},
+    {"verify", (PyCFunction)CMAC_verify, METH_VARARGS,
+     "True if tag is the CMAC of the message (message, tag), compared in constant time"},
+    {"tag_batch", (PyCFunction)CMAC_tag_batch, METH_VARARGS,
+     "Tags of a sequence of messages, computed in interleaved lanes"},
+    {"verify_batch", (PyCFunction)CMAC_verify_batch, METH_VARARGS,
+     "One bool per (message, tag) pair of two sequences"},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject CMACType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "CMAC",
+    .tp_doc = "Twofish-CMAC message authentication with the subkeys derived once",
+    .tp_basicsize = sizeof(CMACObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)CMAC_init,
+    .tp_dealloc = (destructor)CMAC_dealloc,
+    .tp_methods = CMAC_methods,
+};
+
+/* SIV: deterministic authenticated encryption with two Twofish keys */
+
+typedef struct {
+    PyObject_HEAD
+    TWOFISH_SIV *siv;            /* in the secure pool */
+} SIVObject;
+
+static void
+SIV_dealloc(SIVObject *self)
+{
+    twofish_siv_free(self->siv);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+SIV_init(SIVObject *self, PyObject *args, PyObject *kwds)
+{
+    Py_buffer key;
+    
+    static char *kwlist[] = {"key", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*", kwlist, &key))
+        return -1;
+    if (self->siv != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "SIV is already keyed");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    
+    if (key.len != 32 && key.len != 48 && key.len != 64) {
+        PyErr_SetString(PyExc_ValueError, "SIV key size must be 32, 48, or 64 bytes (two Twofish keys)");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    
+    twofish_siv_free(self->siv);
+    self->siv = twofish_siv_new(key.buf, key.len);
+    PyBuffer_Release(&key);
+    if (self->siv == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+/* shared body of SIV.seal and SIV.open */
+static PyObject *
+SIV_crypt(SIVObject *self, PyObject *args, PyObject *kwds, int encrypt)
+{
+    Py_buffer data;
+    PyObject *ad_obj = NULL, *result;
+    InfoList ad = {0};
+    Py_ssize_t out_len;
+    BYTE *out;
+    int rc = 0;
+    
+    static char *kwlist[] = {"data", "ad", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|O", kwlist, &data, &ad_obj))
+        return NULL;
+    
+    if (ad_obj && InfoList_fill(&ad, ad_obj, "ad must be a sequence of bytes") < 0) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    if (!encrypt && data.len < TWOFISH_SIV_TAG) {
+        PyErr_SetString(PyExc_ValueError, "SIV value must be at least 16 bytes");
+        PyBuffer_Release(&data);
+        InfoList_release(&ad);
+        return NULL;
+    }
+    
+    out_len = encrypt ? data.len + TWOFISH_SIV_TAG : data.len - TWOFISH_SIV_TAG;
+    result = PyBytes_FromStringAndSize(NULL, out_len);
+    if (result == NULL) {
+        PyBuffer_Release(&data);
+        InfoList_release(&ad);
+        return NULL;
+    }
+    out = (BYTE *)PyBytes_AS_STRING(result);
+    
+    Py_BEGIN_ALLOW_THREADS
+    if (encrypt)
+        twofish_siv_encrypt(self->siv, ad.ptrs, ad.lens, ad.count, data.buf, data.len, out);
+    else
+        rc = twofish_siv_decrypt(self->siv, ad.ptrs, ad.lens, ad.count, data.buf, data.len, out);
+    Py_END_ALLOW_THREADS
+    
+    PyBuffer_Release(&data);
+    InfoList_release(&ad);
+    if (rc != 0) {
+        Py_DECREF(result);
+        PyErr_SetString(PyExc_ValueError, "SIV authentication failed");
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+SIV_seal(SIVObject *self, PyObject *args, PyObject *kwds)
+{
+    return SIV_crypt(self, args, kwds, 1);
+}
+
+static PyObject *
+SIV_open(SIVObject *self, PyObject *args, PyObject *kwds)
+{
+    return SIV_crypt(self, args, kwds, 0);
+}
+
+/* shared body of SIV.seal_batch and SIV.open_batch */
+static PyObject *
+SIV_crypt_batch(SIVObject *self, PyObject *args, PyObject *kwds, int encrypt)
+{
+    PyObject *values_obj, *ad_obj = NULL, *result = NULL;
+    InfoList values, ad = {0};
+    BYTE **outs = NULL;
+    int *ok = NULL;
+    size_t failed = 0;
+    Py_ssize_t i, out_len;
+    
+    static char *kwlist[] = {"values", "ad", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &values_obj, &ad_obj))
+        return NULL;
+    
+    if (InfoList_fill(&values, values_obj, "values must be a sequence of bytes") < 0)
+        return NULL;
+    if (ad_obj && InfoList_fill(&ad, ad_obj, "ad must be a sequence of bytes") < 0)
+        goto done;
+    
+    for (i = 0; !encrypt && i < values.count; i++) {
+        if (values.lens[i] < TWOFISH_SIV_TAG) {
+            PyErr_Format(PyExc_ValueError, "SIV value %zd is shorter than 16 bytes", i);
+            goto done;
+        }
+    }
+    
+    outs = PyMem_New(BYTE *, values.count ? values.count : 1);
+    ok = PyMem_New(int, values.count ? values.count : 1);
+    result = PyList_New(values.count);
+    if (outs == NULL || ok == NULL || result == NULL) {
+        if (result == NULL)
+            goto done;
+        PyErr_NoMemory();
+        Py_CLEAR(result);
+        goto done;
+    }
+    for (i = 0; i < values.count; i++) {
+        PyObject *item;
+        
+        out_len = encrypt ? (Py_ssize_t)values.lens[i] + TWOFISH_SIV_TAG
+                          : (Py_ssize_t)values.lens[i] - TWOFISH_SIV_TAG;
+        item = PyBytes_FromStringAndSize(NULL, out_len);
+        if (item == NULL) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        outs[i] = (BYTE *)PyBytes_AS_STRING(item);
+        PyList_SET_ITEM(result, i, item);
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    if (encrypt)
+        twofish_siv_encrypt_batch(self->siv, ad.ptrs, ad.lens, ad.count, values.ptrs, values.lens,
+                                  values.count, outs);
+    else
+        failed = twofish_siv_decrypt_batch(self->siv, ad.ptrs, ad.lens, ad.count, values.ptrs,
+                                           values.lens, values.count, outs, ok);
+    Py_END_ALLOW_THREADS
+    
+    if (failed) {
+        for (i = 0; ok[i]; i++)
+            ;
+        PyErr_Format(PyExc_ValueError, "SIV authentication failed for value %zd", i);
+        Py_CLEAR(result);
+    }
+    
+done:
+    PyMem_Free(outs);
+    PyMem_Free(ok);
+    InfoList_release(&values);
+    InfoList_release(&ad);
+    return result;
+}
+
+static PyObject *
+SIV_seal_batch(SIVObject *self, PyObject *args, PyObject *kwds)
+{
+    return SIV_crypt_batch(self, args, kwds, 1);
+}
+
+static PyObject *
+SIV_open_batch(SIVObject *self, PyObject *args, PyObject *kwds)
+{
+    return SIV_crypt_batch(self, args, kwds, 0);
+}
+
+/* SIV.seal_into and SIV.open_into: caller buffers, tag kept apart */
+static PyObject *
+SIV_crypt_into(SIVObject *self, PyObject *args, PyObject *kwds, int encrypt)
+{
+    Py_buffer data, tag = {0}, out;
+    PyObject *ad_obj = NULL, *result = NULL;
+    InfoList ad = {0};
+    BYTE v[TWOFISH_SIV_TAG];
+    int rc = 0;
+    
+    static char *seal_kwlist[] = {"data", "out", "ad", NULL};
+    static char *open_kwlist[] = {"data", "tag", "out", "ad", NULL};
+
+    if (encrypt) {
+        if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*w*|O", seal_kwlist, &data, &out, &ad_obj))
+            return NULL;
+    }
+    else if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*y*w*|O", open_kwlist, &data, &tag, &out, &ad_obj))
+        return NULL;
+    
+    if (!encrypt && tag.len != TWOFISH_SIV_TAG) {
+        PyErr_SetString(PyExc_ValueError, "SIV tag must be 16 bytes");
+        goto done;
+    }
+    if (out.len < data.len) {
+        PyErr_SetString(PyExc_ValueError, "output buffer is shorter than the data");
+        goto done;
+    }
+    if (ad_obj && InfoList_fill(&ad, ad_obj, "ad must be a sequence of bytes") < 0)
+        goto done;
+    if (!encrypt)
+        memcpy(v, tag.buf, TWOFISH_SIV_TAG);
+    
+    Py_BEGIN_ALLOW_THREADS
+    if (encrypt)
+        twofish_siv_encrypt_detached(self->siv, ad.ptrs, ad.lens, ad.count, data.buf, data.len, out.buf, v);
+    else
+        rc = twofish_siv_decrypt_detached(self->siv, ad.ptrs, ad.lens, ad.count, v, data.buf, data.len,
+                                          out.buf);
+    Py_END_ALLOW_THREADS
+    
+    if (rc != 0)
+        PyErr_SetString(PyExc_ValueError, "SIV authentication failed");
+    else if (encrypt)
+        result = PyBytes_FromStringAndSize((char *)v, TWOFISH_SIV_TAG);
+    else
+        result = PyLong_FromSsize_t(data.len);
+    
+done:
+    PyBuffer_Release(&data);
+    PyBuffer_Release(&tag);
+    PyBuffer_Release(&out);
+    InfoList_release(&ad);
+    return result;
+}
+
+static PyObject *
+SIV_seal_into(SIVObject *self, PyObject *args, PyObject *kwds)
+{
+    return SIV_crypt_into(self, args, kwds, 1);
+}
+
+static PyObject *
+SIV_open_into(SIVObject *self, PyObject *args, PyObject *kwds)
+{
+    return SIV_crypt_into(self, args, kwds, 0);
+}
+
+static PyMethodDef SIV_methods[] = {
+    {"seal", (PyCFunction)SIV_seal, METH_VARARGS | METH_KEYWORDS,
+     "Deterministically encrypt data (data, ad=()); the result is tag || ciphertext"},
+    {"open", (PyCFunction)SIV_open, METH_VARARGS | METH_KEYWORDS,
+     "Verify and decrypt the output of seal (data, ad=()); raises ValueError on a bad tag"},
+    {"seal_batch", (PyCFunction)SIV_seal_batch, METH_VARARGS | METH_KEYWORDS,
+     "Seal a sequence of values sharing the same associated data (values, ad=())"},
+    {"open_batch", (PyCFunction)SIV_open_batch, METH_VARARGS | METH_KEYWORDS,
+     "Open a sequence of sealed values (values, ad=()); raises ValueError if any fails"},
+    {"seal_into", (PyCFunction)SIV_seal_into, METH_VARARGS | METH_KEYWORDS,
+     "Seal data into the writable buffer out (data, out, ad=()), which may be data itself; returns the tag"},
+    {"open_into", (PyCFunction)SIV_open_into, METH_VARARGS | METH_KEYWORDS,
+     "Open a ciphertext with its tag into out (data, tag, out, ad=()), in place if out is data; returns the length"},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject SIVType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "SIV",
+    .tp_doc = "Twofish-SIV deterministic authenticated encryption",
+    .tp_basicsize = sizeof(SIVObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)SIV_init,
+    .tp_dealloc = (destructor)SIV_dealloc,
+    .tp_methods = SIV_methods,
+};
+
+/* FPE: FF1 and FF3-1 format-preserving encryption of strings over an alphabet */
+
+#define FPE_DEFAULT_ALPHABET "0123456789abcdefghijklmnopqrstuvwxyz"
+
+/* longest value of any radix, see twofish_fpe.h */
+#define FPE_MAX_LEN 128
+
+typedef struct {
+    PyObject_HEAD
+    TWOFISH_FPE *fpe;
+    PyObject *mode;              /* "ff1" or "ff3-1" */
+    PyObject *alphabet;          /* the characters of numerals 0 to radix - 1 */
+    Py_ssize_t radix;
+    Py_ssize_t minlen;
+    Py_ssize_t maxlen;
+    BYTE numeral[256];           /* numeral of each character, 0xff outside the alphabet */
+    char chars[256];             /* character of each numeral */
+} FPEObject;
+
+static void
+FPE_dealloc(FPEObject *self)
+{
+    twofish_fpe_free(self->fpe);
+    Py_XDECREF(self->mode);
+    Py_XDECREF(self->alphabet);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+FPE_init(FPEObject *self, PyObject *args, PyObject *kwds)
+{
+    Py_buffer key;
+    const char *mode = "ff1", *chars;
+    PyObject *radix_obj = Py_None, *alphabet = Py_None, *mode_obj;
+    TWOFISH_FPE *fpe;
+    Py_ssize_t radix = 10, len, i;
+    int m;
+    
+    static char *kwlist[] = {"key", "mode", "radix", "alphabet", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|sOO", kwlist, &key, &mode, &radix_obj, &alphabet))
+        return -1;
+    if (self->fpe != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "FPE is already keyed");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    
+    if (key.len != 16 && key.len != 24 && key.len != 32) {
+        PyErr_SetString(PyExc_ValueError, "Key size must be 16, 24, or 32 bytes");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    if (strcmp(mode, "ff1") == 0)
+        m = TWOFISH_FF1;
+    else if (strcmp(mode, "ff3-1") == 0)
+        m = TWOFISH_FF3_1;
+    else {
+        PyErr_SetString(PyExc_ValueError, "FPE mode must be 'ff1' or 'ff3-1'");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    if (radix_obj != Py_None) {
+        radix = PyLong_AsSsize_t(radix_obj);
+        if (radix == -1 && PyErr_Occurred()) {
+            PyBuffer_Release(&key);
+            return -1;
+        }
+    }
+    
+    if (alphabet == Py_None) {
+        if (radix < 2 || radix > 36) {
+            PyErr_SetString(PyExc_ValueError, "radix must be between 2 and 36 without an alphabet");
+            PyBuffer_Release(&key);
+            return -1;
+        }
+        alphabet = PyUnicode_FromStringAndSize(FPE_DEFAULT_ALPHABET, radix);
+        if (alphabet == NULL) {
+            PyBuffer_Release(&key);
+            return -1;
+        }
+    }
+    else if (!PyUnicode_Check(alphabet)) {
+        PyErr_SetString(PyExc_TypeError, "alphabet must be a str");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    else {
+        if (radix_obj == Py_None)
+            radix = PyUnicode_GET_LENGTH(alphabet);
+        Py_INCREF(alphabet);
+    }
+    
+    chars = PyUnicode_AsUTF8AndSize(alphabet, &len);
+    if (chars == NULL || !PyUnicode_IS_ASCII(alphabet) || len < 2 || len != radix) {
+        if (chars != NULL)
+            PyErr_SetString(PyExc_ValueError, "alphabet must be radix ASCII characters, at least 2");
+        Py_DECREF(alphabet);
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    memset(self->numeral, 0xff, sizeof(self->numeral));
+    for (i = 0; i < len; i++) {
+        BYTE c = (BYTE)chars[i];
+        
+        if (c == 0 || self->numeral[c] != 0xff) {
+            PyErr_SetString(PyExc_ValueError, "alphabet characters must be distinct and not NUL");
+            Py_DECREF(alphabet);
+            PyBuffer_Release(&key);
+            return -1;
+        }
+        self->numeral[c] = (BYTE)i;
+        self->chars[i] = (char)c;
+    }
+    
+    fpe = twofish_fpe_new(m, key.buf, key.len, (unsigned)radix);
+    PyBuffer_Release(&key);
+    mode_obj = PyUnicode_FromString(m == TWOFISH_FF1 ? "ff1" : "ff3-1");
+    if (fpe == NULL || mode_obj == NULL) {
+        twofish_fpe_free(fpe);
+        Py_XDECREF(mode_obj);
+        Py_DECREF(alphabet);
+        if (!PyErr_Occurred())
+            PyErr_NoMemory();
+        return -1;
+    }
+    
+    twofish_fpe_free(self->fpe);
+    self->fpe = fpe;
+    Py_XSETREF(self->mode, mode_obj);
+    Py_XSETREF(self->alphabet, alphabet);
+    self->radix = radix;
+    self->minlen = (Py_ssize_t)fpe->minlen;
+    self->maxlen = (Py_ssize_t)fpe->maxlen;
+    return 0;
+}
+
+static int
+FPE_check_tweak(FPEObject *self, const Py_buffer *tweak)
+{
+    if (self->fpe->mode == TWOFISH_FF3_1 && tweak->len != TWOFISH_FF3_TWEAK) {
+        PyErr_SetString(PyExc_ValueError, "FF3-1 tweak must be 7 bytes");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+   Map the n characters of s to numerals in x (which may be s) and check
+   the length; index names the value in errors, -1 for a lone value.
+*/
+static int
+FPE_numerals(FPEObject *self, const char *s, Py_ssize_t n, BYTE *x, Py_ssize_t index)
+{
+    Py_ssize_t i;
+    
+    for (i = 0; i < n; i++) {
+        x[i] = self->numeral[(BYTE)s[i]];
+        if (x[i] == 0xff) {
+            if (index < 0)
+                PyErr_SetString(PyExc_ValueError, "value has a character outside the alphabet");
+            else
+                PyErr_Format(PyExc_ValueError, "value %zd has a character outside the alphabet", index);
+            return -1;
+        }
+    }
+    if (n < self->minlen || n > self->maxlen) {
+        if (index < 0)
+            PyErr_Format(PyExc_ValueError, "value length must be between %zd and %zd",
+                         self->minlen, self->maxlen);
+        else
+            PyErr_Format(PyExc_ValueError, "value %zd: length must be between %zd and %zd",
+                         index, self->minlen, self->maxlen);
+        return -1;
+    }
+    return 0;
+}
+
+/* A str of the characters of n numerals */
+static PyObject *
+FPE_str(FPEObject *self, const BYTE *x, Py_ssize_t n)
+{
+    PyObject *s;
+    Py_UCS1 *out;
+    Py_ssize_t i;
+    
+    s = PyUnicode_New(n, 127);
+    if (s == NULL)
+        return NULL;
+    out = PyUnicode_1BYTE_DATA(s);
+    for (i = 0; i < n; i++)
+        out[i] = (Py_UCS1)self->chars[x[i]];
+    return s;
+}
+
+/* shared body of FPE.encrypt and FPE.decrypt */
+static PyObject *
+FPE_crypt(FPEObject *self, PyObject *args, PyObject *kwds, int decrypt)
+{
+    PyObject *value, *result = NULL;
+    Py_buffer tweak = {0};
+    BYTE x[FPE_MAX_LEN];
+    const char *s;
+    Py_ssize_t n;
+    
+    static char *kwlist[] = {"value", "tweak", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "U|y*", kwlist, &value, &tweak))
+        return NULL;
+    
+    if (FPE_check_tweak(self, &tweak) < 0)
+        goto done;
+    s = PyUnicode_AsUTF8AndSize(value, &n);
+    if (s == NULL || FPE_numerals(self, s, n, x, -1) < 0)
+        goto done;
+    
+    if (decrypt)
+        twofish_fpe_decrypt(self->fpe, tweak.buf, tweak.len, x, n);
+    else
+        twofish_fpe_encrypt(self->fpe, tweak.buf, tweak.len, x, n);
+    result = FPE_str(self, x, n);
+    secure_zero(x, sizeof(x));
+    
+done:
+    PyBuffer_Release(&tweak);
+    return result;
+}
+
+static PyObject *
+FPE_encrypt(FPEObject *self, PyObject *args, PyObject *kwds)
+{
+    return FPE_crypt(self, args, kwds, 0);
+}
+
+static PyObject *
+FPE_decrypt(FPEObject *self, PyObject *args, PyObject *kwds)
+{
+    return FPE_crypt(self, args, kwds, 1);
+}
+
+/* shared body of FPE.encrypt_batch and FPE.decrypt_batch */
+static PyObject *
+FPE_crypt_batch(FPEObject *self, PyObject *args, PyObject *kwds, int decrypt)
+{
+    PyObject *values_obj, *seq = NULL, *result = NULL;
+    Py_buffer tweak = {0};
+    BYTE *buf = NULL, **ptrs = NULL;
+    size_t *lens = NULL, total = 0;
+    Py_ssize_t count = 0, i, n;
+    const char *s;
+    int rc;
+    
+    static char *kwlist[] = {"values", "tweak", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|y*", kwlist, &values_obj, &tweak))
+        return NULL;
+    
+    if (FPE_check_tweak(self, &tweak) < 0)
+        goto done;
+    seq = PySequence_Fast(values_obj, "values must be a sequence of str");
+    if (seq == NULL)
+        goto done;
+    count = PySequence_Fast_GET_SIZE(seq);
+    
+    /* every value's numerals go into one buffer */
+    for (i = 0; i < count; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        
+        if (!PyUnicode_Check(item)) {
+            PyErr_Format(PyExc_TypeError, "value %zd is not a str", i);
+            goto done;
+        }
+        if (PyUnicode_AsUTF8AndSize(item, &n) == NULL)
+            goto done;
+        total += (size_t)n;
+    }
+    buf = PyMem_Malloc(total ? total : 1);
+    ptrs = PyMem_New(BYTE *, count ? count : 1);
+    lens = PyMem_New(size_t, count ? count : 1);
+    if (buf == NULL || ptrs == NULL || lens == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    total = 0;
+    for (i = 0; i < count; i++) {
+        s = PyUnicode_AsUTF8AndSize(PySequence_Fast_GET_ITEM(seq, i), &n);
+        ptrs[i] = buf + total;
+        lens[i] = (size_t)n;
+        total += (size_t)n;
+        if (FPE_numerals(self, s, n, ptrs[i], i) < 0)
+            goto done;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    if (decrypt)
+        rc = twofish_fpe_decrypt_batch(self->fpe, tweak.buf, tweak.len, ptrs, lens, count);
+    else
+        rc = twofish_fpe_encrypt_batch(self->fpe, tweak.buf, tweak.len, ptrs, lens, count);
+    Py_END_ALLOW_THREADS
+    if (rc != 0) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    
+    result = PyList_New(count);
+    for (i = 0; result != NULL && i < count; i++) {
+        PyObject *item = FPE_str(self, ptrs[i], (Py_ssize_t)lens[i]);
+        
+        if (item == NULL)
+            Py_CLEAR(result);
+        else
+            PyList_SET_ITEM(result, i, item);
+    }
+    
+done:
+    if (buf != NULL)
+        secure_zero(buf, total);
+    PyMem_Free(buf);
+    PyMem_Free(ptrs);
+    PyMem_Free(lens);
+    Py_XDECREF(seq);
+    PyBuffer_Release(&tweak);
+    return result;
+}
+
+static PyObject *
+FPE_encrypt_batch(FPEObject *self, PyObject *args, PyObject *kwds)
+{
+    return FPE_crypt_batch(self, args, kwds, 0);
+}
+
+static PyObject *
+FPE_decrypt_batch(FPEObject *self, PyObject *args, PyObject *kwds)
+{
+    return FPE_crypt_batch(self, args, kwds, 1);
+}
+
+/*
+   Shared body of FPE.encrypt_column and FPE.decrypt_column: values laid
+   out in fixed-width, NUL-padded slots, as in a numpy bytes array.
+*/
+static PyObject *
+FPE_crypt_column(FPEObject *self, PyObject *args, PyObject *kwds, int decrypt)
+{
+    Py_buffer data, tweak = {0};
+    PyObject *result = NULL;
+    BYTE *out, *item, **ptrs = NULL;
+    size_t *lens = NULL, j;
+    Py_ssize_t width, count = 0, i;
+    int rc;
+    
+    static char *kwlist[] = {"data", "width", "tweak", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*n|y*", kwlist, &data, &width, &tweak))
+        return NULL;
+    
+    if (width <= 0 || data.len % width != 0) {
+        PyErr_SetString(PyExc_ValueError, "data length must be a multiple of width");
+        goto done;
+    }
+    if (FPE_check_tweak(self, &tweak) < 0)
+        goto done;
+    count = data.len / width;
+    ptrs = PyMem_New(BYTE *, count ? count : 1);
+    lens = PyMem_New(size_t, count ? count : 1);
+    if (ptrs == NULL || lens == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    result = PyBytes_FromStringAndSize(data.buf, data.len);
+    if (result == NULL)
+        goto done;
+    out = (BYTE *)PyBytes_AS_STRING(result);
+    
+    /* the numerals replace the characters in place; the padding stays */
+    for (i = 0; i < count; i++) {
+        item = out + i * width;
+        ptrs[i] = item;
+        lens[i] = (size_t)width;
+        for (j = 0; j < (size_t)width; j++) {
+            if (item[j] == 0) {
+                lens[i] = j;
+                break;
+            }
+        }
+        if (FPE_numerals(self, (const char *)item, (Py_ssize_t)lens[i], item, i) < 0) {
+            secure_zero(out, (size_t)data.len);
+            Py_CLEAR(result);
+            goto done;
+        }
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    if (decrypt)
+        rc = twofish_fpe_decrypt_batch(self->fpe, tweak.buf, tweak.len, ptrs, lens, count);
+    else
+        rc = twofish_fpe_encrypt_batch(self->fpe, tweak.buf, tweak.len, ptrs, lens, count);
+    if (rc == 0) {
+        for (i = 0; i < count; i++)
+            for (j = 0; j < lens[i]; j++)
+                ptrs[i][j] = (BYTE)self->chars[ptrs[i][j]];
+    }
+    Py_END_ALLOW_THREADS
+    if (rc != 0) {
+        secure_zero(out, (size_t)data.len);
+        Py_CLEAR(result);
+        PyErr_NoMemory();
+    }
+    
+done:
+    PyMem_Free(ptrs);
+    PyMem_Free(lens);
+    PyBuffer_Release(&data);
+    PyBuffer_Release(&tweak);
+    return result;
+}
+
+static PyObject *
+FPE_encrypt_column(FPEObject *self, PyObject *args, PyObject *kwds)
+{
+    return FPE_crypt_column(self, args, kwds, 0);
+}
+
+static PyObject *
+FPE_decrypt_column(FPEObject *self, PyObject *args, PyObject *kwds)
+{
+    return FPE_crypt_column(self, args, kwds, 1);
+}
+
+static PyMethodDef FPE_methods[] = {
+    {"encrypt", (PyCFunction)FPE_encrypt, METH_VARARGS | METH_KEYWORDS,
+     "Encrypt a str over the alphabet to one of the same length (value, tweak=b'')"},
+    {"decrypt", (PyCFunction)FPE_decrypt, METH_VARARGS | METH_KEYWORDS,
+     "Decrypt the output of encrypt (value, tweak=b'')"},
+    {"encrypt_batch", (PyCFunction)FPE_encrypt_batch, METH_VARARGS | METH_KEYWORDS,
+     "Encrypt a sequence of str sharing one tweak (values, tweak=b''); returns a list"},
+    {"decrypt_batch", (PyCFunction)FPE_decrypt_batch, METH_VARARGS | METH_KEYWORDS,
+     "Decrypt a sequence of str sharing one tweak (values, tweak=b''); returns a list"},
+    {"encrypt_column", (PyCFunction)FPE_encrypt_column, METH_VARARGS | METH_KEYWORDS,
+     "Encrypt NUL-padded values in slots of width bytes (data, width, tweak=b''); returns bytes"},
+    {"decrypt_column", (PyCFunction)FPE_decrypt_column, METH_VARARGS | METH_KEYWORDS,
+     "Decrypt NUL-padded values in slots of width bytes (data, width, tweak=b''); returns bytes"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef FPE_members[] = {
+    {"mode", T_OBJECT, offsetof(FPEObject, mode), READONLY, "'ff1' or 'ff3-1'"},
+    {"alphabet", T_OBJECT, offsetof(FPEObject, alphabet), READONLY, "Characters of the numerals, in order"},
+    {"radix", T_PYSSIZET, offsetof(FPEObject, radix), READONLY, "Number of characters in the alphabet"},
+    {"minlen", T_PYSSIZET, offsetof(FPEObject, minlen), READONLY, "Shortest value accepted"},
+    {"maxlen", T_PYSSIZET, offsetof(FPEObject, maxlen), READONLY, "Longest value accepted"},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject FPEType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "FPE",
+    .tp_doc = "FF1 and FF3-1 format-preserving encryption over Twofish",
+    .tp_basicsize = sizeof(FPEObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)FPE_init,
+    .tp_dealloc = (destructor)FPE_dealloc,
+    .tp_methods = FPE_methods,
+    .tp_members = FPE_members,
+};
+
+/* HCTR2: length-preserving wide-block encryption */
+
+typedef struct {
+    PyObject_HEAD
+    TWOFISH_HCTR2 *hctr2;        /* in the secure pool */
+} HCTR2Object;
+
+static void
+HCTR2_dealloc(HCTR2Object *self)
+{
+    twofish_hctr2_free(self->hctr2);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+HCTR2_init(HCTR2Object *self, PyObject *args, PyObject *kwds)
+{
+    Py_buffer key;
+    
+    static char *kwlist[] = {"key", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*", kwlist, &key))
+        return -1;
+    if (self->hctr2 != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "HCTR2 is already keyed");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    
+    if (key.len != 16 && key.len != 24 && key.len != 32) {
+        PyErr_SetString(PyExc_ValueError, "Key size must be 16, 24, or 32 bytes");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    
+    twofish_hctr2_free(self->hctr2);
+    self->hctr2 = twofish_hctr2_new(key.buf, key.len);
+    PyBuffer_Release(&key);
+    if (self->hctr2 == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+/* shared body of HCTR2.encrypt and HCTR2.decrypt */
+static PyObject *
+HCTR2_crypt(HCTR2Object *self, PyObject *args, PyObject *kwds, int decrypt)
+{
+    Py_buffer data, tweak = {0};
+    PyObject *result;
+    BYTE *out;
+    
+    static char *kwlist[] = {"data", "tweak", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|y*", kwlist, &data, &tweak))
+        return NULL;
+    
+    if (data.len < TWOFISH_HCTR2_MIN) {
+        PyErr_SetString(PyExc_ValueError, "HCTR2 data must be at least 16 bytes");
+        PyBuffer_Release(&data);
+        PyBuffer_Release(&tweak);
+        return NULL;
+    }
+    result = PyBytes_FromStringAndSize(NULL, data.len);
+    if (result == NULL) {
+        PyBuffer_Release(&data);
+        PyBuffer_Release(&tweak);
+        return NULL;
+    }
+    out = (BYTE *)PyBytes_AS_STRING(result);
+    
+    Py_BEGIN_ALLOW_THREADS
+    if (decrypt)
+        twofish_hctr2_decrypt(self->hctr2, tweak.buf, tweak.len, data.buf, out, data.len);
+    else
+        twofish_hctr2_encrypt(self->hctr2, tweak.buf, tweak.len, data.buf, out, data.len);
+    Py_END_ALLOW_THREADS
+    
+    PyBuffer_Release(&data);
+    PyBuffer_Release(&tweak);
+    return result;
+}
+
+static PyObject *
+HCTR2_encrypt(HCTR2Object *self, PyObject *args, PyObject *kwds)
+{
+    return HCTR2_crypt(self, args, kwds, 0);
+}
+
+static PyObject *
+HCTR2_decrypt(HCTR2Object *self, PyObject *args, PyObject *kwds)
+{
+    return HCTR2_crypt(self, args, kwds, 1);
+}
+
+/* shared body of HCTR2.encrypt_batch and HCTR2.decrypt_batch */
+static PyObject *
+HCTR2_crypt_batch(HCTR2Object *self, PyObject *args, PyObject *kwds, int decrypt)
+{
+    PyObject *values_obj, *tweak_obj = NULL, *result = NULL;
+    InfoList values, tweaks = {0};
+    Py_buffer shared = {0};
+    const BYTE **tweak_ptrs = NULL;
+    size_t *tweak_lens = NULL;
+    BYTE **outs = NULL;
+    Py_ssize_t i;
+    
+    static char *kwlist[] = {"values", "tweak", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &values_obj, &tweak_obj))
+        return NULL;
+    
+    if (InfoList_fill(&values, values_obj, "values must be a sequence of bytes") < 0)
+        return NULL;
+    for (i = 0; i < values.count; i++) {
+        if (values.lens[i] < TWOFISH_HCTR2_MIN) {
+            PyErr_Format(PyExc_ValueError, "HCTR2 value %zd is shorter than 16 bytes", i);
+            goto done;
+        }
+    }
+    
+    /* one tweak for every value, or a sequence of them */
+    if (tweak_obj == NULL || PyObject_CheckBuffer(tweak_obj)) {
+        if (tweak_obj != NULL && PyObject_GetBuffer(tweak_obj, &shared, PyBUF_SIMPLE) < 0)
+            goto done;
+        tweak_ptrs = PyMem_New(const BYTE *, values.count ? values.count : 1);
+        tweak_lens = PyMem_New(size_t, values.count ? values.count : 1);
+        if (tweak_ptrs == NULL || tweak_lens == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        for (i = 0; i < values.count; i++) {
+            tweak_ptrs[i] = shared.buf;
+            tweak_lens[i] = (size_t)shared.len;
+        }
+    }
+    else {
+        if (InfoList_fill(&tweaks, tweak_obj, "tweak must be bytes or a sequence of bytes") < 0)
+            goto done;
+        if (tweaks.count != values.count) {
+            PyErr_SetString(PyExc_ValueError, "tweak sequence must have one tweak per value");
+            goto done;
+        }
+    }
+    
+    outs = PyMem_New(BYTE *, values.count ? values.count : 1);
+    result = PyList_New(values.count);
+    if (outs == NULL || result == NULL) {
+        if (result == NULL)
+            goto done;
+        PyErr_NoMemory();
+        Py_CLEAR(result);
+        goto done;
+    }
+    for (i = 0; i < values.count; i++) {
+        PyObject *item = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)values.lens[i]);
+        
+        if (item == NULL) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        outs[i] = (BYTE *)PyBytes_AS_STRING(item);
+        PyList_SET_ITEM(result, i, item);
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    if (decrypt)
+        twofish_hctr2_decrypt_batch(self->hctr2, tweak_ptrs ? tweak_ptrs : tweaks.ptrs,
+                                    tweak_lens ? tweak_lens : tweaks.lens, values.ptrs, outs,
+                                    values.lens, values.count);
+    else
+        twofish_hctr2_encrypt_batch(self->hctr2, tweak_ptrs ? tweak_ptrs : tweaks.ptrs,
+                                    tweak_lens ? tweak_lens : tweaks.lens, values.ptrs, outs,
+                                    values.lens, values.count);
+    Py_END_ALLOW_THREADS
+    
+done:
+    PyMem_Free(outs);
+    PyMem_Free(tweak_ptrs);
+    PyMem_Free(tweak_lens);
+    PyBuffer_Release(&shared);
+    InfoList_release(&values);
+    InfoList_release(&tweaks);
+    return result;
+}
+
+static PyObject *
+HCTR2_encrypt_batch(HCTR2Object *self, PyObject *args, PyObject *kwds)
+{
+    return HCTR2_crypt_batch(self, args, kwds, 0);
+}
+
+static PyObject *
+HCTR2_decrypt_batch(HCTR2Object *self, PyObject *args, PyObject *kwds)
+{
+    return HCTR2_crypt_batch(self, args, kwds, 1);
+}
+
+static PyMethodDef HCTR2_methods[] = {
+    {"encrypt", (PyCFunction)HCTR2_encrypt, METH_VARARGS | METH_KEYWORDS,
+     "Encrypt data of 16 bytes or more to the same length (data, tweak=b'')"},
+    {"decrypt", (PyCFunction)HCTR2_decrypt, METH_VARARGS | METH_KEYWORDS,
+     "Decrypt the output of encrypt (data, tweak=b'')"},
+    {"encrypt_batch", (PyCFunction)HCTR2_encrypt_batch, METH_VARARGS | METH_KEYWORDS,
+     "Encrypt a sequence of values (values, tweak=b''); tweak is shared or one per value"},
+    {"decrypt_batch", (PyCFunction)HCTR2_decrypt_batch, METH_VARARGS | METH_KEYWORDS,
+     "Decrypt a sequence of values (values, tweak=b''); tweak is shared or one per value"},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject HCTR2Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "HCTR2",
+    .tp_doc = "HCTR2 length-preserving tweakable wide-block encryption over Twofish",
+    .tp_basicsize = sizeof(HCTR2Object),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)HCTR2_init,
+    .tp_dealloc = (destructor)HCTR2_dealloc,
+    .tp_methods = HCTR2_methods,
+};
+
+/* Read-only view of a CTR-encrypted file region, decrypted as pages are touched */
+
+typedef struct {
+    PyObject_HEAD
+    twofish_mmap *map;
+    PyObject *cipher;           /* Twofish object whose context decrypts the pages */
+    Py_ssize_t exports;         /* buffers handed out */
+} MappedFileObject;
+
+static void
+MappedFile_dealloc(MappedFileObject *self)
+{
+    twofish_mmap_close(self->map);
+    Py_XDECREF(self->cipher);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+MappedFile_init(MappedFileObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *cipher;
+    Py_buffer ctr;
+    unsigned long long offset, length;
+    Py_ssize_t readahead = 65536;
+    twofish_mmap *map;
+    TWOFISH_CTX *ctx;
+    int fd;
+    
+    static char *kwlist[] = {"cipher", "fd", "offset", "length", "counter", "readahead", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!iKKy*|n", kwlist, &TwofishType, &cipher,
+                                     &fd, &offset, &length, &ctr, &readahead))
+        return -1;
+    
+    if (ctr.len != 16 || readahead < 0 || length > PY_SSIZE_T_MAX) {
+        PyErr_SetString(PyExc_ValueError, ctr.len != 16 ? "counter must be 16 bytes"
+                        : readahead < 0 ? "readahead must be >= 0" : "length does not fit in memory");
+        PyBuffer_Release(&ctr);
+        return -1;
+    }
+    if (self->map != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "MappedFile is already open");
+        PyBuffer_Release(&ctr);
+        return -1;
+    }
+    
+    /* promotion writes the cipher object, so it happens with the GIL held;
+       without userfaultfd this decrypts the whole region */
+    ctx = Twofish_bulk_ctx((TwofishObject *)cipher);
+    Py_BEGIN_ALLOW_THREADS
+    map = twofish_mmap_open(ctx, fd, offset, (size_t)length, ctr.buf, (size_t)readahead);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&ctr);
+    if (map == NULL) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    
+    self->map = map;
+    Py_INCREF(cipher);
+    self->cipher = cipher;
+    return 0;
+}
+
+static int
+MappedFile_check(MappedFileObject *self)
+{
+    if (self->map == NULL) {
+        PyErr_SetString(PyExc_ValueError, "MappedFile is closed");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+MappedFile_getbuffer(MappedFileObject *self, Py_buffer *view, int flags)
+{
+    if (MappedFile_check(self) < 0) {
+        view->obj = NULL;
+        return -1;
+    }
+    if (PyBuffer_FillInfo(view, (PyObject *)self, (void *)twofish_mmap_data(self->map),
+                          (Py_ssize_t)twofish_mmap_length(self->map), 1, flags) < 0)
+        return -1;
+    self->exports++;
+    return 0;
+}
+
+static void
+MappedFile_releasebuffer(MappedFileObject *self, Py_buffer *view)
+{
+    self->exports--;
+}
+
+static Py_ssize_t
+MappedFile_length(MappedFileObject *self)
+{
+    if (MappedFile_check(self) < 0)
+        return -1;
+    return (Py_ssize_t)twofish_mmap_length(self->map);
+}
+
+static PyObject *
+MappedFile_close(MappedFileObject *self, PyObject *Py_UNUSED(ignored))
+{
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError, "cannot close MappedFile: exported buffers exist");
+        return NULL;
+    }
+    twofish_mmap_close(self->map);
+    self->map = NULL;
+    Py_CLEAR(self->cipher);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+MappedFile_evict(MappedFileObject *self, PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t offset = 0, length = PY_SSIZE_T_MAX;
+    
+    static char *kwlist[] = {"offset", "length", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nn", kwlist, &offset, &length))
+        return NULL;
+    if (MappedFile_check(self) < 0)
+        return NULL;
+    if (offset < 0 || length < 0) {
+        PyErr_SetString(PyExc_ValueError, "offset and length must be >= 0");
+        return NULL;
+    }
+    twofish_mmap_evict(self->map, (size_t)offset, (size_t)length);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+MappedFile_stats(MappedFileObject *self, PyObject *Py_UNUSED(ignored))
+{
+    twofish_mmap_stats_t stats;
+    
+    if (MappedFile_check(self) < 0)
+        return NULL;
+    twofish_mmap_stats(self->map, &stats);
+    return Py_BuildValue("{s:n,s:n,s:n,s:O}",
+                         "faults", (Py_ssize_t)stats.faults,
+                         "pages", (Py_ssize_t)stats.pages,
+                         "errors", (Py_ssize_t)stats.errors,
+                         "lazy", stats.lazy ? Py_True : Py_False);
+}
+
+static PyObject *
+MappedFile_enter(MappedFileObject *self, PyObject *Py_UNUSED(ignored))
+{
+    if (MappedFile_check(self) < 0)
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+MappedFile_exit(MappedFileObject *self, PyObject *args)
+{
+    return MappedFile_close(self, NULL);
+}
+
+static PyObject *
+MappedFile_get_closed(MappedFileObject *self, void *closure)
+{
+    return PyBool_FromLong(self->map == NULL);
+}
+
+static PyMethodDef MappedFile_methods[] = {
+    {"close", (PyCFunction)MappedFile_close, METH_NOARGS,
+     "Unmap the view; fails while buffers exported from it are alive"},
+    {"evict", (PyCFunction)MappedFile_evict, METH_VARARGS | METH_KEYWORDS,
+     "Drop the decrypted pages inside (offset=0, length=None); they are decrypted again on touch"},
+    {"stats", (PyCFunction)MappedFile_stats, METH_NOARGS,
+     "Faults served, pages decrypted, read errors raised as SIGBUS, and whether pages are decrypted lazily"},
+    {"__enter__", (PyCFunction)MappedFile_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)MappedFile_exit, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef MappedFile_getset[] = {
+    {"closed", (getter)MappedFile_get_closed, NULL, "True once the view is unmapped", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods MappedFile_as_sequence = {
+    .sq_length = (lenfunc)MappedFile_length,
+};
+
+static PyBufferProcs MappedFile_as_buffer = {
+    .bf_getbuffer = (getbufferproc)MappedFile_getbuffer,
+    .bf_releasebuffer = (releasebufferproc)MappedFile_releasebuffer,
+};
+
+static PyTypeObject MappedFileType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "MappedFile",
+    .tp_doc = "Read-only buffer over a CTR-encrypted file region, decrypted on first touch",
+    .tp_basicsize = sizeof(MappedFileObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)MappedFile_init,
+    .tp_dealloc = (destructor)MappedFile_dealloc,
+    .tp_methods = MappedFile_methods,
+    .tp_getset = MappedFile_getset,
+    .tp_as_sequence = &MappedFile_as_sequence,
+    .tp_as_buffer = &MappedFile_as_buffer,
+};
+
+/* Ring: encrypted SPSC message ring in shared memory */
+
+typedef struct {
+    PyObject_HEAD
+    twofish_ring *ring;
+    const BYTE *msg;            /* plaintext of the message held by peek() */
+    Py_ssize_t msg_len;
+    Py_ssize_t exports;         /* buffers handed out over the held message */
+    int busy;                   /* calls running without the GIL */
+} RingObject;
+
+static void
+Ring_dealloc(RingObject *self)
+{
+    twofish_ring_close(self->ring);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+Ring_init(RingObject *self, PyObject *args, PyObject *kwds)
+{
+    Py_buffer key;
+    Py_ssize_t slots = 64, slot_size = 65536;
+    twofish_ring *ring;
+    int fd = -1;
+    
+    static char *kwlist[] = {"key", "fd", "slots", "slot_size", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|inn", kwlist, &key, &fd, &slots, &slot_size))
+        return -1;
+    
+    if (key.len < 16) {
+        PyErr_SetString(PyExc_ValueError, "Ring key must be at least 16 bytes");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    if (fd < 0 && (slots < 2 || (slots & (slots - 1)) || slot_size % 64 ||
+                   slot_size <= TWOFISH_RING_SLOT_HEADER || slot_size > 0xffffffffL)) {
+        PyErr_SetString(PyExc_ValueError, "slots must be a power of two >= 2 and slot_size a multiple of 64 above 32");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    if (self->ring != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Ring is already open");
+        PyBuffer_Release(&key);
+        return -1;
+    }
+    
+    if (fd < 0)
+        ring = twofish_ring_create(key.buf, (size_t)key.len, (size_t)slots, (size_t)slot_size);
+    else
+        ring = twofish_ring_attach(key.buf, (size_t)key.len, fd);
+    PyBuffer_Release(&key);
+    if (ring == NULL) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    self->ring = ring;
+    return 0;
+}
+
+static int
+Ring_check(RingObject *self)
+{
+    if (self->ring == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Ring is closed");
+        return -1;
+    }
+    return 0;
+}
+
+/* None waits forever (-1), anything else is seconds */
+static int
+Ring_timeout(PyObject *obj, long long *ns)
+{
+    double seconds;
+    
+    if (obj == NULL || obj == Py_None) {
+        *ns = -1;
+        return 0;
+    }
+    seconds = PyFloat_AsDouble(obj);
+    if (seconds == -1.0 && PyErr_Occurred())
+        return -1;
+    if (seconds < 0) {
+        PyErr_SetString(PyExc_ValueError, "timeout must be >= 0 or None");
+        return -1;
+    }
+    *ns = seconds > 9e9 ? -1 : (long long)(seconds * 1e9);
+    return 0;
+}
+
+/* Give back the message held by peek(); fails while it is exported */
+static int
+Ring_drop(RingObject *self)
+{
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError, "cannot release the message: exported buffers exist");
+        return -1;
+    }
+    if (self->msg != NULL) {
+        self->msg = NULL;
+        self->msg_len = 0;
+        twofish_ring_release(self->ring);
+    }
+    return 0;
+}
+
+static PyObject *
+Ring_send(RingObject *self, PyObject *args, PyObject *kwds)
+{
+    Py_buffer data;
+    PyObject *timeout_obj = NULL;
+    long long timeout;
+    int rc;
+    
+    static char *kwlist[] = {"data", "timeout", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|O", kwlist, &data, &timeout_obj))
+        return NULL;
+    if (Ring_check(self) < 0 || Ring_timeout(timeout_obj, &timeout) < 0) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    if ((size_t)data.len > twofish_ring_capacity(self->ring)) {
+        PyErr_SetString(PyExc_ValueError, "message does not fit in a ring slot");
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    
+    /* encrypted straight from the caller's buffer into the slot */
+    self->busy++;
+    Py_BEGIN_ALLOW_THREADS
+    rc = twofish_ring_send(self->ring, data.buf, (size_t)data.len, timeout);
+    Py_END_ALLOW_THREADS
+    self->busy--;
+    PyBuffer_Release(&data);
+    
+    if (rc < 0) {
+        if (errno == ETIMEDOUT)
+            Py_RETURN_FALSE;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    Py_RETURN_TRUE;
+}
+
+static PyObject *
+Ring_send_batch(RingObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *messages, *timeout_obj = NULL;
+    InfoList list = {0};
+    long long timeout;
+    Py_ssize_t i, sent = 0;
+    size_t capacity;
+    BYTE *slot;
+    int err = 0;
+    
+    static char *kwlist[] = {"messages", "timeout", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &messages, &timeout_obj))
+        return NULL;
+    if (Ring_check(self) < 0 || Ring_timeout(timeout_obj, &timeout) < 0)
+        return NULL;
+    if (InfoList_fill(&list, messages, "messages must be a sequence of bytes") < 0)
+        return NULL;
+    capacity = twofish_ring_capacity(self->ring);
+    for (i = 0; i < list.count; i++) {
+        if (list.lens[i] > capacity) {
+            PyErr_SetString(PyExc_ValueError, "message does not fit in a ring slot");
+            InfoList_release(&list);
+            return NULL;
+        }
+    }
+    
+    /* one publish, and at most one wakeup, for the whole batch */
+    self->busy++;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < list.count; i++) {
+        slot = twofish_ring_reserve(self->ring, timeout);
+        if (slot == NULL) {
+            err = errno;
+            break;
+        }
+        twofish_ring_commit(self->ring, list.ptrs[i], list.lens[i]);
+        sent++;
+    }
+    twofish_ring_publish(self->ring);
+    Py_END_ALLOW_THREADS
+    self->busy--;
+    InfoList_release(&list);
+    
+    if (err && err != ETIMEDOUT) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    return PyLong_FromSsize_t(sent);
+}
+
+/* Wait for the next message and decrypt it in place; NULL with no error set on timeout */
+static const BYTE *
+Ring_next(RingObject *self, long long timeout, size_t *len)
+{
+    const BYTE *msg;
+    int err;
+    
+    if (Ring_drop(self) < 0)
+        return NULL;
+    self->busy++;
+    Py_BEGIN_ALLOW_THREADS
+    msg = twofish_ring_recv(self->ring, len, timeout);
+    err = errno;
+    Py_END_ALLOW_THREADS
+    self->busy--;
+    
+    if (msg == NULL) {
+        if (err == EBADMSG) {
+            twofish_ring_release(self->ring);
+            PyErr_SetString(PyExc_ValueError, "ring message authentication failed");
+        }
+        else if (err != ETIMEDOUT) {
+            errno = err;
+            PyErr_SetFromErrno(PyExc_OSError);
+        }
+    }
+    return msg;
+}
+
+static PyObject *
+Ring_recv(RingObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *timeout_obj = NULL, *result;
+    long long timeout;
+    const BYTE *msg;
+    size_t len;
+    
+    static char *kwlist[] = {"timeout", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout_obj))
+        return NULL;
+    if (Ring_check(self) < 0 || Ring_timeout(timeout_obj, &timeout) < 0)
+        return NULL;
+    
+    msg = Ring_next(self, timeout, &len);
+    if (msg == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    result = PyBytes_FromStringAndSize((const char *)msg, (Py_ssize_t)len);
+    twofish_ring_release(self->ring);
+    return result;
+}
+
+static PyObject *
+Ring_recv_batch(RingObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *timeout_obj = NULL, *result, *item;
+    Py_ssize_t max = 64;
+    long long timeout;
+    const BYTE *msg;
+    size_t len;
+    
+    static char *kwlist[] = {"max", "timeout", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nO", kwlist, &max, &timeout_obj))
+        return NULL;
+    if (Ring_check(self) < 0 || Ring_timeout(timeout_obj, &timeout) < 0)
+        return NULL;
+    if (max < 1) {
+        PyErr_SetString(PyExc_ValueError, "max must be >= 1");
+        return NULL;
+    }
+    
+    result = PyList_New(0);
+    if (result == NULL)
+        return NULL;
+    /* wait for the first message only, then take what is already there */
+    while (PyList_GET_SIZE(result) < max) {
+        msg = Ring_next(self, PyList_GET_SIZE(result) ? 0 : timeout, &len);
+        if (msg == NULL) {
+            if (PyErr_Occurred()) {
+                Py_DECREF(result);
+                return NULL;
+            }
+            break;
+        }
+        item = PyBytes_FromStringAndSize((const char *)msg, (Py_ssize_t)len);
+        twofish_ring_release(self->ring);
+        if (item == NULL || PyList_Append(result, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    return result;
+}
+
+static PyObject *
+Ring_peek(RingObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *timeout_obj = NULL;
+    long long timeout;
+    const BYTE *msg;
+    size_t len;
+    
+    static char *kwlist[] = {"timeout", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout_obj))
+        return NULL;
+    if (Ring_check(self) < 0 || Ring_timeout(timeout_obj, &timeout) < 0)
+        return NULL;
+    
+    msg = Ring_next(self, timeout, &len);
+    if (msg == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    self->msg = msg;
+    self->msg_len = (Py_ssize_t)len;
+    return PyMemoryView_FromObject((PyObject *)self);
+}
+
+static PyObject *
+Ring_release(RingObject *self, PyObject *Py_UNUSED(ignored))
+{
+    if (Ring_check(self) < 0 || Ring_drop(self) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static int
+Ring_getbuffer(RingObject *self, Py_buffer *view, int flags)
+{
+    if (Ring_check(self) < 0 || self->msg == NULL) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_BufferError, "no message is held; call peek() first");
+        view->obj = NULL;
+        return -1;
+    }
+    if (PyBuffer_FillInfo(view, (PyObject *)self, (void *)self->msg, self->msg_len, 1, flags) < 0)
+        return -1;
+    self->exports++;
+    return 0;
+}
+
+static void
+Ring_releasebuffer(RingObject *self, Py_buffer *view)
+{
+    self->exports--;
+}
+
+static PyObject *
+Ring_close(RingObject *self, PyObject *Py_UNUSED(ignored))
+{
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError, "cannot close Ring: exported buffers exist");
+        return NULL;
+    }
+    if (self->busy > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot close Ring: another thread is using it");
+        return NULL;
+    }
+    twofish_ring_close(self->ring);
+    self->ring = NULL;
+    self->msg = NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Ring_stats(RingObject *self, PyObject *Py_UNUSED(ignored))
+{
+    twofish_ring_stats_t stats;
+    
+    if (Ring_check(self) < 0)
+        return NULL;
+    twofish_ring_stats(self->ring, &stats);
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n}",
+                         "sent", (Py_ssize_t)stats.sent,
+                         "received", (Py_ssize_t)stats.received,
+                         "failures", (Py_ssize_t)stats.failures,
+                         "waits", (Py_ssize_t)stats.waits,
+                         "wakeups", (Py_ssize_t)stats.wakeups);
+}
+
+static PyObject *
+Ring_enter(RingObject *self, PyObject *Py_UNUSED(ignored))
+{
+    if (Ring_check(self) < 0)
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+Ring_exit(RingObject *self, PyObject *args)
+{
+    return Ring_close(self, NULL);
+}
+
+static PyObject *
+Ring_get_fd(RingObject *self, void *closure)
+{
+    if (Ring_check(self) < 0)
+        return NULL;
+    return PyLong_FromLong(twofish_ring_fd(self->ring));
+}
+
+static PyObject *
+Ring_get_slots(RingObject *self, void *closure)
+{
+    if (Ring_check(self) < 0)
+        return NULL;
+    return PyLong_FromSize_t(twofish_ring_slots(self->ring));
+}
+
+static PyObject *
+Ring_get_capacity(RingObject *self, void *closure)
+{
+    if (Ring_check(self) < 0)
+        return NULL;
+    return PyLong_FromSize_t(twofish_ring_capacity(self->ring));
+}
+
+static PyObject *
+Ring_get_closed(RingObject *self, void *closure)
+{
+    return PyBool_FromLong(self->ring == NULL);
+}
+
+static PyMethodDef Ring_methods[] = {
+    {"send", (PyCFunction)Ring_send, METH_VARARGS | METH_KEYWORDS,
+     "Encrypt data into the next slot (timeout=None); False if no slot freed up in time"},
+    {"send_batch", (PyCFunction)Ring_send_batch, METH_VARARGS | METH_KEYWORDS,
+     "Send a sequence of messages with a single publish; returns how many were sent"},
+    {"recv", (PyCFunction)Ring_recv, METH_VARARGS | METH_KEYWORDS,
+     "Next message as bytes (timeout=None), or None on timeout"},
+    {"recv_batch", (PyCFunction)Ring_recv_batch, METH_VARARGS | METH_KEYWORDS,
+     "Wait for one message (max=64, timeout=None), then take up to max already waiting"},
+    {"peek", (PyCFunction)Ring_peek, METH_VARARGS | METH_KEYWORDS,
+     "Next message as a read-only memoryview of its slot, held until release()"},
+    {"release", (PyCFunction)Ring_release, METH_NOARGS,
+     "Give the slot of the message held by peek() back to the producer"},
+    {"close", (PyCFunction)Ring_close, METH_NOARGS,
+     "Unmap this end of the ring"},
+    {"stats", (PyCFunction)Ring_stats, METH_NOARGS,
+     "Messages sent, received and rejected, futex sleeps and wakeups of this end"},
+    {"__enter__", (PyCFunction)Ring_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)Ring_exit, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef Ring_getset[] = {
+    {"fd", (getter)Ring_get_fd, NULL, "memfd holding the ring, for the peer to attach to", NULL},
+    {"slots", (getter)Ring_get_slots, NULL, "Number of slots", NULL},
+    {"capacity", (getter)Ring_get_capacity, NULL, "Largest message", NULL},
+    {"closed", (getter)Ring_get_closed, NULL, "True once the ring is unmapped", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyBufferProcs Ring_as_buffer = {
+    .bf_getbuffer = (getbufferproc)Ring_getbuffer,
+    .bf_releasebuffer = (releasebufferproc)Ring_releasebuffer,
+};
+
+static PyTypeObject RingType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "Ring",
+    .tp_doc = "Encrypted single-producer, single-consumer message ring in shared memory",
+    .tp_basicsize = sizeof(RingObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Ring_init,
+    .tp_dealloc = (destructor)Ring_dealloc,
+    .tp_methods = Ring_methods,
+    .tp_getset = Ring_getset,
+    .tp_as_buffer = &Ring_as_buffer,
+};
+
+static PyObject *
+module_numa_nodes(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return PyLong_FromLong(twofish_numa_nodes());
+}
+
+static PyObject *
+module_secure_pool_stats(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    secure_pool_stats_t stats;
+    
+    secure_pool_stats(&stats);
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n}",
+                         "arenas", (Py_ssize_t)stats.arenas,
+                         "reserved", (Py_ssize_t)stats.reserved,
+                         "locked", (Py_ssize_t)stats.locked,
+                         "in_use", (Py_ssize_t)stats.in_use,
+                         "lock_failures", (Py_ssize_t)(stats.lock_failures + twofish_alloc_lock_failures()),
+                         "large_fallbacks", (Py_ssize_t)stats.large_fallbacks);
+}
+
+static PyObject *
+module_key_cache_configure(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t capacity, shards = 16;
+    
+    static char *kwlist[] = {"capacity", "shards", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|n", kwlist, &capacity, &shards))
+        return NULL;
+    if (capacity < 0 || shards < 1 || shards > TWOFISH_CACHE_MAX_SHARDS) {
+        PyErr_Format(PyExc_ValueError, "capacity must be >= 0 and shards between 1 and %d",
+                     TWOFISH_CACHE_MAX_SHARDS);
+        return NULL;
+    }
+    if (twofish_cache_configure((size_t)capacity, (size_t)shards) < 0)
+        return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+module_key_cache_clear(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    twofish_cache_clear();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+module_key_cache_stats(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    twofish_cache_stats_t stats;
+    size_t lookups;
+    
+    twofish_cache_stats(&stats);
+    lookups = stats.hits + stats.misses;
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:d}",
+                         "capacity", (Py_ssize_t)stats.capacity,
+                         "shards", (Py_ssize_t)stats.shards,
+                         "entries", (Py_ssize_t)stats.entries,
+                         "hits", (Py_ssize_t)stats.hits,
+                         "misses", (Py_ssize_t)stats.misses,
+                         "evictions", (Py_ssize_t)stats.evictions,
+                         "hit_rate", lookups ? (double)stats.hits / (double)lookups : 0.0);
+}
+
+static PyObject *
+module_bulk_config(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *threshold = Py_None, *tile = Py_None, *nt_stores = Py_None, *warm_tables = Py_None;
+    twofish_bulk_config cfg;
+    Py_ssize_t n;
+    
+    static char *kwlist[] = {"threshold", "tile", "nt_stores", "warm_tables", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOOO", kwlist,
+                                     &threshold, &tile, &nt_stores, &warm_tables))
+        return NULL;
+    twofish_bulk_get_config(&cfg);
+    if (threshold != Py_None) {
+        n = PyNumber_AsSsize_t(threshold, PyExc_OverflowError);
+        if (n == -1 && PyErr_Occurred())
+            return NULL;
+        if (n < 0) {
+            PyErr_SetString(PyExc_ValueError, "threshold must be >= 0");
+            return NULL;
+        }
+        cfg.threshold = (size_t)n;
+    }
+    if (tile != Py_None) {
+        n = PyNumber_AsSsize_t(tile, PyExc_OverflowError);
+        if (n == -1 && PyErr_Occurred())
+            return NULL;
+        if (n < 1024) {
+            PyErr_SetString(PyExc_ValueError, "tile must be at least 1024 bytes");
+            return NULL;
+        }
+        cfg.tile = (size_t)n;
+    }
+    if (nt_stores != Py_None && (cfg.nt_stores = PyObject_IsTrue(nt_stores)) < 0)
+        return NULL;
+    if (warm_tables != Py_None && (cfg.warm_tables = PyObject_IsTrue(warm_tables)) < 0)
+        return NULL;
+    twofish_bulk_set_config(&cfg);
+    
+    twofish_bulk_get_config(&cfg);
+    return Py_BuildValue("{s:n,s:n,s:O,s:O}",
+                         "threshold", (Py_ssize_t)cfg.threshold,
+                         "tile", (Py_ssize_t)cfg.tile,
+                         "nt_stores", cfg.nt_stores ? Py_True : Py_False,
+                         "warm_tables", cfg.warm_tables ? Py_True : Py_False);
+}
+
+static PyObject *
+module_hkdf_sha256(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *ikm, *salt = NULL;
+    Py_buffer info = {NULL};
+    Py_ssize_t length = 32;
+    unsigned char prk[SHA256_DIGEST_SIZE];
+    PyObject *result;
+    
+    static char *kwlist[] = {"ikm", "info", "length", "salt", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|y*nO", kwlist, &ikm, &info, &length, &salt))
+        return NULL;
+    
+    if (length < 0 || length > 255 * SHA256_DIGEST_SIZE) {
+        PyErr_SetString(PyExc_ValueError, "HKDF output length must be between 0 and 8160 bytes");
+        PyBuffer_Release(&info);
+        return NULL;
+    }
+    if (hkdf_prk(ikm, salt, prk) < 0) {
+        PyBuffer_Release(&info);
+        return NULL;
+    }
+    
+    result = PyBytes_FromStringAndSize(NULL, length);
+    if (result != NULL)
+        hkdf_sha256_expand(prk, info.buf, info.buf ? (size_t)info.len : 0,
+                           (unsigned char *)PyBytes_AS_STRING(result), (size_t)length);
+    secure_zero(prk, sizeof(prk));
+    PyBuffer_Release(&info);
+    return result;
+}
+
+static PyObject *
+module_hkdf_sha256_batch(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *ikm, *infos, *salt = NULL;
+    Py_ssize_t length = 32, i;
+    unsigned char prk[SHA256_DIGEST_SIZE];
+    unsigned char *okm;
+    PyObject *result = NULL;
+    InfoList list;
+    
+    static char *kwlist[] = {"ikm", "infos", "length", "salt", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|nO", kwlist, &ikm, &infos, &length, &salt))
+        return NULL;
+    
+    if (length < 0 || length > 255 * SHA256_DIGEST_SIZE) {
+        PyErr_SetString(PyExc_ValueError, "HKDF output length must be between 0 and 8160 bytes");
+        return NULL;
+    }
+    if (InfoList_fill(&list, infos, "infos must be a sequence of bytes") < 0)
+        return NULL;
+    if (hkdf_prk(ikm, salt, prk) < 0) {
+        InfoList_release(&list);
+        return NULL;
+    }
+    
+    okm = secure_alloc(list.count * length + 1);
+    if (okm == NULL) {
+        secure_zero(prk, sizeof(prk));
+        InfoList_release(&list);
+        return PyErr_NoMemory();
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    hkdf_sha256_expand_batch(prk, list.ptrs, list.lens, (size_t)list.count, okm, (size_t)length);
+    Py_END_ALLOW_THREADS
+    secure_zero(prk, sizeof(prk));
+    
+    result = PyList_New(list.count);
+    for (i = 0; result != NULL && i < list.count; i++) {
+        PyObject *key = PyBytes_FromStringAndSize((char *)okm + i * length, length);
+        if (key == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, key);
+    }
+    
+    secure_free(okm);
+    InfoList_release(&list);
+    return result;
+}
+
+static PyObject *
+module_sha256_backend(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return PyUnicode_FromString(sha256_backend());
+}
+
+static PyObject *
+module_simd_backend(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return PyUnicode_FromString(simd_backend());
+}
+
+static PyObject *
+module_polyval_backend(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return PyUnicode_FromString(twofish_hctr2_backend());
+}
+
+static PyObject *
+module_shuffle_backend(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return PyUnicode_FromString(twofish_shuffle_backend());
+}
+
+static PyObject *
+module_base64_backend(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return PyUnicode_FromString(base64_backend());
+}
+
+static PyObject *
+module_b64encode(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+    PyObject *result;
+    
+    if (!PyArg_ParseTuple(args, "y*", &data))
+        return NULL;
+    
+    result = PyUnicode_New(BASE64_ENCODED_LEN(data.len), 127);
+    if (result != NULL) {
+        Py_BEGIN_ALLOW_THREADS
+        base64_encode(data.buf, (size_t)data.len, (char *)PyUnicode_1BYTE_DATA(result));
+        Py_END_ALLOW_THREADS
+    }
+    PyBuffer_Release(&data);
+    return result;
+}
+
+/* Bytes of len base64 characters, NULL with ValueError if they are not valid */
+static PyObject *
+b64decode_chars(const char *s, Py_ssize_t len)
+{
+    PyObject *result;
+    int rc;
+    
+    result = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)base64_decoded_len(s, (size_t)len));
+    if (result == NULL)
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = base64_decode(s, (size_t)len, (unsigned char *)PyBytes_AS_STRING(result));
+    Py_END_ALLOW_THREADS
+    if (rc < 0) {
+        Py_DECREF(result);
+        PyErr_SetString(PyExc_ValueError, "invalid base64 data");
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+module_b64decode(PyObject *self, PyObject *args)
+{
+    PyObject *obj, *result;
+    Py_buffer data;
+    
+    if (!PyArg_ParseTuple(args, "O", &obj))
+        return NULL;
+    
+    if (PyUnicode_Check(obj)) {
+        if (PyUnicode_READY(obj) < 0)
+            return NULL;
+        if (!PyUnicode_IS_ASCII(obj)) {
+            PyErr_SetString(PyExc_ValueError, "invalid base64 data");
+            return NULL;
+        }
+        return b64decode_chars((const char *)PyUnicode_1BYTE_DATA(obj), PyUnicode_GET_LENGTH(obj));
+    }
+    if (PyObject_GetBuffer(obj, &data, PyBUF_SIMPLE) < 0)
+        return NULL;
+    result = b64decode_chars(data.buf, data.len);
+    PyBuffer_Release(&data);
+    return result;
+}
+
+/* One member of an envelope being written, referenced so the dict may change meanwhile */
+typedef struct {
+    PyObject *key;
+    PyObject *text;             /* str value or str() of an integer, NULL for binary */
+    int escape;                 /* text is a str value */
+    Py_buffer view;             /* binary values, base64-encoded on output */
+} EnvelopeMember;
+
+static void
+EnvelopeMembers_release(EnvelopeMember *members, Py_ssize_t n)
+{
+    Py_ssize_t i;
+    
+    for (i = 0; i < n; i++) {
+        PyBuffer_Release(&members[i].view);
+        Py_XDECREF(members[i].key);
+        Py_XDECREF(members[i].text);
+    }
+    PyMem_Free(members);
+}
+
+/* Characters of an ASCII str as a JSON string, -1 with ValueError if not ASCII */
+static Py_ssize_t
+envelope_ascii_len(PyObject *obj)
+{
+    if (PyUnicode_READY(obj) < 0)
+        return -1;
+    if (!PyUnicode_IS_ASCII(obj)) {
+        PyErr_SetString(PyExc_ValueError, "envelope strings must be ASCII");
+        return -1;
+    }
+    return (Py_ssize_t)envelope_string_len((const char *)PyUnicode_1BYTE_DATA(obj),
+                                           (size_t)PyUnicode_GET_LENGTH(obj));
+}
+
+static char *
+envelope_write_str(char *out, PyObject *obj)
+{
+    return envelope_write_string(out, (const char *)PyUnicode_1BYTE_DATA(obj),
+                                 (size_t)PyUnicode_GET_LENGTH(obj));
+}
+
+static PyObject *
+module_envelope_dumps(PyObject *self, PyObject *args)
+{
+    PyObject *fields, *key, *value, *result = NULL;
+    EnvelopeMember *members;
+    Py_ssize_t n, i, pos = 0, total = 2, len;
+    char *out;
+    
+    if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &fields))
+        return NULL;
+    
+    n = PyDict_GET_SIZE(fields);
+    members = PyMem_Calloc(n ? n : 1, sizeof(EnvelopeMember));
+    if (members == NULL)
+        return PyErr_NoMemory();
+    
+    /* size the output, which is then written exactly once */
+    for (i = 0; i < n && PyDict_Next(fields, &pos, &key, &value); i++) {
+        EnvelopeMember *m = &members[i];
+        
+        if (!PyUnicode_Check(key)) {
+            PyErr_SetString(PyExc_TypeError, "envelope names must be str");
+            goto done;
+        }
+        Py_INCREF(key);
+        m->key = key;
+        if ((len = envelope_ascii_len(key)) < 0)
+            goto done;
+        total += len + 2 + (i ? 2 : 0);
+        
+        if (PyUnicode_Check(value)) {
+            Py_INCREF(value);
+            m->text = value;
+            m->escape = 1;
+            if ((len = envelope_ascii_len(value)) < 0)
+                goto done;
+            total += len;
+        }
+        else if (PyLong_CheckExact(value)) {
+            if ((m->text = PyObject_Str(value)) == NULL)
+                goto done;
+            total += PyUnicode_GET_LENGTH(m->text);
+        }
+        else if (PyObject_CheckBuffer(value)) {
+            if (PyObject_GetBuffer(value, &m->view, PyBUF_SIMPLE) < 0)
+                goto done;
+            total += (Py_ssize_t)BASE64_ENCODED_LEN(m->view.len) + 2;
+        }
+        else {
+            PyErr_Format(PyExc_TypeError, "unsupported envelope value of type %.200s",
+                         Py_TYPE(value)->tp_name);
+            goto done;
+        }
+    }
+    if (i < n) {
+        PyErr_SetString(PyExc_RuntimeError, "dictionary changed size during iteration");
+        goto done;
+    }
+    
+    result = PyUnicode_New(total, 127);
+    if (result == NULL)
+        goto done;
+    out = (char *)PyUnicode_1BYTE_DATA(result);
+    *out++ = '{';
+    for (i = 0; i < n; i++) {
+        EnvelopeMember *m = &members[i];
+        
+        if (i) {
+            *out++ = ',';
+            *out++ = ' ';
+        }
+        out = envelope_write_str(out, m->key);
+        *out++ = ':';
+        *out++ = ' ';
+        if (m->escape) {
+            out = envelope_write_str(out, m->text);
+        }
+        else if (m->text != NULL) {
+            memcpy(out, PyUnicode_1BYTE_DATA(m->text), (size_t)PyUnicode_GET_LENGTH(m->text));
+            out += PyUnicode_GET_LENGTH(m->text);
+        }
+        else {
+            *out++ = '"';
+            Py_BEGIN_ALLOW_THREADS
+            base64_encode(m->view.buf, (size_t)m->view.len, out);
+            Py_END_ALLOW_THREADS
+            out += BASE64_ENCODED_LEN(m->view.len);
+            *out++ = '"';
+        }
+    }
+    *out = '}';
+    
+done:
+    EnvelopeMembers_release(members, n);
+    return result;
+}
+
+/* Members accepted by envelope_loads; larger objects are left to json */
+#define ENVELOPE_MAX_MEMBERS 64
+
+/* str of an escaped JSON string */
+static PyObject *
+envelope_unescaped(const char *s, size_t len)
+{
+    PyObject *result;
+    uint32_t *chars;
+    long n;
+    
+    chars = PyMem_Malloc(len ? len * sizeof(uint32_t) : 1);
+    if (chars == NULL)
+        return PyErr_NoMemory();
+    n = envelope_unescape(s, len, chars);
+    if (n < 0) {
+        PyMem_Free(chars);
+        PyErr_SetString(PyExc_ValueError, "malformed string escape in envelope");
+        return NULL;
+    }
+    result = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, chars, n);
+    PyMem_Free(chars);
+    return result;
+}
+
+static PyObject *
+envelope_member_value(const envelope_member *m, int binary)
+{
+    PyObject *text, *result;
+    
+    if (binary && m->kind != ENVELOPE_STRING) {
+        PyErr_SetString(PyExc_ValueError, "invalid base64 data");
+        return NULL;
+    }
+    switch (m->kind) {
+    case ENVELOPE_STRING:
+        if (binary)
+            return b64decode_chars(m->value, (Py_ssize_t)m->value_len);
+        return PyUnicode_DecodeASCII(m->value, (Py_ssize_t)m->value_len, NULL);
+    case ENVELOPE_ESCAPED:
+        return envelope_unescaped(m->value, m->value_len);
+    default:
+        text = PyUnicode_DecodeASCII(m->value, (Py_ssize_t)m->value_len, NULL);
+        if (text == NULL)
+            return NULL;
+        result = PyLong_FromUnicodeObject(text, 10);
+        Py_DECREF(text);
+        return result;
+    }
+}
+
+static PyObject *
+module_envelope_loads(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *obj, *binary = NULL, *result, *name, *value;
+    envelope_member members[ENVELOPE_MAX_MEMBERS];
+    Py_buffer data;
+    const char *text;
+    Py_ssize_t len;
+    long n, i;
+    int is_binary;
+    
+    static char *kwlist[] = {"text", "binary", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &obj, &binary))
+        return NULL;
+    
+    data.obj = NULL;
+    if (PyUnicode_Check(obj)) {
+        if (PyUnicode_READY(obj) < 0)
+            return NULL;
+        if (!PyUnicode_IS_ASCII(obj)) {
+            PyErr_SetString(PyExc_ValueError, "envelope is not a flat ASCII JSON object");
+            return NULL;
+        }
+        text = (const char *)PyUnicode_1BYTE_DATA(obj);
+        len = PyUnicode_GET_LENGTH(obj);
+    }
+    else {
+        if (PyObject_GetBuffer(obj, &data, PyBUF_SIMPLE) < 0)
+            return NULL;
+        text = data.buf;
+        len = data.len;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    n = envelope_parse(text, (size_t)len, members, ENVELOPE_MAX_MEMBERS);
+    Py_END_ALLOW_THREADS
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError, "envelope is not a flat ASCII JSON object");
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    
+    result = PyDict_New();
+    for (i = 0; result != NULL && i < n; i++) {
+        if (members[i].name_escaped)
+            name = envelope_unescaped(members[i].name, members[i].name_len);
+        else
+            name = PyUnicode_DecodeASCII(members[i].name, (Py_ssize_t)members[i].name_len, NULL);
+        if (name == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        is_binary = binary != NULL ? PySequence_Contains(binary, name) : 0;
+        value = is_binary < 0 ? NULL : envelope_member_value(&members[i], is_binary);
+        if (value == NULL || PyDict_SetItem(result, name, value) < 0)
+            Py_CLEAR(result);
+        Py_DECREF(name);
+        Py_XDECREF(value);
+    }
+    
+    PyBuffer_Release(&data);
+    return result;
+}
+
+static PyObject *
+module_completion_fd(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    workpool *wp = get_pool();
+    
+    if (wp == NULL)
+        return NULL;
+    return PyLong_FromLong(workpool_fd(wp));
+}
+
+static PyObject *
+module_reap(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    workpool_job *base, *next;
+    PyObject *list, *item, *result;
+    
+    list = PyList_New(0);
+    if (list == NULL || pool == NULL)
+        return list;
+    
+    /* every reaped job is released, even if building the list fails */
+    for (base = workpool_reap(pool); base != NULL; base = next) {
+        CryptJob *job = (CryptJob *)base;
+        
+        next = base->next;
+        result = CryptJob_result(job);
+        if (list != NULL && result != NULL) {
+            item = Py_BuildValue("(OOO)", job->future, Py_True, result);
+            if (item == NULL || PyList_Append(list, item) < 0)
+                Py_CLEAR(list);
+            Py_XDECREF(item);
+        }
+        PyBuffer_Release(&job->in);
+        Py_XDECREF(result);
+        Py_DECREF(job->future);
+        Py_DECREF(job->owner);
+        PyMem_Free(job);
+    }
+    return list;
+}
+
+static PyObject *
+module_pool_stats(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    workpool_stats_t stats;
+    workpool *wp = get_pool();
+    
+    if (wp == NULL)
+        return NULL;
+    workpool_stats(wp, &stats);
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:i}",
+                         "submitted", (Py_ssize_t)stats.submitted,
+                         "completed", (Py_ssize_t)stats.completed,
+                         "batches", (Py_ssize_t)stats.batches,
+                         "groups", (Py_ssize_t)stats.groups,
+                         "batch_target", (Py_ssize_t)stats.batch_target,
+                         "largest_batch", (Py_ssize_t)stats.largest_batch,
+                         "threads", stats.threads);
+}
+
+static PyObject *
+module_dispatcher_stats(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    dispatcher_stats_t stats;
+    PyObject *hist;
+    dispatcher *d = get_batcher();
+    int i;
+    
+    if (d == NULL)
+        return NULL;
+    dispatcher_stats(d, &stats);
+    hist = PyList_New(DISPATCHER_HIST);
+    if (hist == NULL)
+        return NULL;
+    for (i = 0; i < DISPATCHER_HIST; i++)
+        PyList_SET_ITEM(hist, i, PyLong_FromSize_t(stats.size_hist[i]));
+    return Py_BuildValue("{s:n,s:n,s:n,s:N,s:d,s:d,s:d,s:d,s:n}",
+                         "jobs", (Py_ssize_t)stats.jobs,
+                         "batches", (Py_ssize_t)stats.batches,
+                         "full_batches", (Py_ssize_t)stats.full_batches,
+                         "batch_size_hist", hist,
+                         "mean_batch", stats.batches ? (double)stats.jobs / stats.batches : 0.0,
+                         "mean_wait_us", stats.batches ? stats.wait_ns_total / 1e3 / stats.batches : 0.0,
+                         "max_wait_us", stats.wait_ns_max / 1e3,
+                         "window_us", stats.window_ns / 1e3,
+                         "lanes", (Py_ssize_t)stats.lanes);
+}
+
+static PyObject *
+module_configure_dispatcher(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    double window_us = 20.0;
+    Py_ssize_t lanes = 8;
+    dispatcher *d = get_batcher();
+    
+    static char *kwlist[] = {"window_us", "lanes", NULL};
+
+    if (d == NULL)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dn", kwlist, &window_us, &lanes))
+        return NULL;
+    if (window_us < 0 || lanes < 1 || lanes > DISPATCHER_MAX_LANES) {
+        PyErr_SetString(PyExc_ValueError, "window_us must be >= 0 and lanes between 1 and 64");
+        return NULL;
+    }
+    dispatcher_configure(d, (unsigned long)(window_us * 1000), (size_t)lanes);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+    {"numa_nodes", (PyCFunction)module_numa_nodes, METH_NOARGS,
+     "Number of NUMA nodes contexts can be replicated to"},
+    {"secure_pool_stats", (PyCFunction)module_secure_pool_stats, METH_NOARGS,
+     "Usage of the locked memory pool holding key schedules; lock_failures also counts secure keyring mappings"},
+    {"key_cache_configure", (PyCFunction)module_key_cache_configure, METH_VARARGS | METH_KEYWORDS,
+     "Share key schedules of up to capacity keys between Twofish objects (shards=16); 0 disables"},
+    {"key_cache_clear", (PyCFunction)module_key_cache_clear, METH_NOARGS,
+     "Evict every cached key schedule"},
+    {"key_cache_stats", (PyCFunction)module_key_cache_stats, METH_NOARGS,
+     "Entries, hits, misses, evictions and hit rate of the key schedule cache"},
+    {"bulk_config", (PyCFunction)module_bulk_config, METH_VARARGS | METH_KEYWORDS,
+     "Large-buffer strategy of the bulk modes: threshold (0 disables), tile, nt_stores, warm_tables"},
+    {"hkdf_sha256", (PyCFunction)module_hkdf_sha256, METH_VARARGS | METH_KEYWORDS,
+     "HKDF-SHA256 (RFC 5869) of a key with an optional info and salt"},
+    {"hkdf_sha256_batch", (PyCFunction)module_hkdf_sha256_batch, METH_VARARGS | METH_KEYWORDS,
+     "List of HKDF-SHA256 subkeys of one key, one per info"},
+    {"simd_backend", (PyCFunction)module_simd_backend, METH_NOARGS,
+     "Byte kernel implementation in use: 'avx512', 'avx2', 'sse2' or 'scalar'"},
+    {"sha256_backend", (PyCFunction)module_sha256_backend, METH_NOARGS,
+     "SHA-256 implementation in use: 'sha-ni', 'avx2-x8' or 'scalar'"},
+    {"polyval_backend", (PyCFunction)module_polyval_backend, METH_NOARGS,
+     "POLYVAL multiply used by HCTR2: 'pclmul' or 'scalar'"},
+    {"shuffle_backend", (PyCFunction)module_shuffle_backend, METH_NOARGS,
+     "Table-free g used by compact keys and key setup: 'avx2' or 'scalar'"},
+    {"b64encode", (PyCFunction)module_b64encode, METH_VARARGS,
+     "Standard padded base64 of bytes, as str"},
+    {"b64decode", (PyCFunction)module_b64decode, METH_VARARGS,
+     "Bytes of strict padded base64 (str or bytes); ValueError if invalid"},
+    {"base64_backend", (PyCFunction)module_base64_backend, METH_NOARGS,
+     "Base64 implementation in use: 'avx2' or 'scalar'"},
+    {"envelope_dumps", (PyCFunction)module_envelope_dumps, METH_VARARGS,
+     "json.dumps of a flat dict of str/int values; bytes values become base64 strings"},
+    {"envelope_loads", (PyCFunction)module_envelope_loads, METH_VARARGS | METH_KEYWORDS,
+     "Dict of a flat JSON object, base64-decoding the members named in binary"},
+    {"completion_fd", (PyCFunction)module_completion_fd, METH_NOARGS,
+     "Descriptor that becomes readable when queued jobs have completed"},
+    {"reap", (PyCFunction)module_reap, METH_NOARGS,
+     "List of (future, ok, result) for every completed job"},
+    {"pool_stats", (PyCFunction)module_pool_stats, METH_NOARGS,
+     "Counters of the worker pool behind the asynchronous methods"},
+    {"dispatcher_stats", (PyCFunction)module_dispatcher_stats, METH_NOARGS,
+     "Batch-size and wait-time metrics of the micro-batching dispatcher"},
+    {"configure_dispatcher", (PyCFunction)module_configure_dispatcher, METH_VARARGS | METH_KEYWORDS,
+     "Set the dispatcher's maximum window (microseconds) and lanes per batch"},
+    {NULL}  /* Sentinel */
+};
+
+static struct PyModuleDef pangfishmodule = {
+    PyModuleDef_HEAD_INIT,
+    "_twofish",
+    "Pangfish encryption module",
+    -1,
+    module_methods
+};
+
+PyMODINIT_FUNC
+PyInit__twofish(void)
+{
+    PyObject *m;
+    
+    if (PyType_Ready(&TwofishType) < 0)
+        return NULL;
+    if (PyType_Ready(&KeyringType) < 0)
+        return NULL;
+    if (PyType_Ready(&KeyManagerType) < 0)
+        return NULL;
+    if (PyType_Ready(&CMACType) < 0)
+        return NULL;
+    if (PyType_Ready(&SIVType) < 0)
+        return NULL;
+    if (PyType_Ready(&FPEType) < 0)
+        return NULL;
+    if (PyType_Ready(&HCTR2Type) < 0)
+        return NULL;
+    if (PyType_Ready(&MappedFileType) < 0)
+        return NULL;
+    if (PyType_Ready(&RingType) < 0)
+        return NULL;
+
+    m = PyModule_Create(&pangfishmodule);
+    if (m == NULL)
+        return NULL;
+
+    Py_INCREF(&TwofishType);
+    if (PyModule_AddObject(m, "Twofish", (PyObject *)&TwofishType) < 0) {
+        Py_DECREF(&TwofishType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&KeyringType);
+    if (PyModule_AddObject(m, "Keyring", (PyObject *)&KeyringType) < 0) {
+        Py_DECREF(&KeyringType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&KeyManagerType);
+    if (PyModule_AddObject(m, "KeyManager", (PyObject *)&KeyManagerType) < 0) {
+        Py_DECREF(&KeyManagerType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&CMACType);
+    if (PyModule_AddObject(m, "CMAC", (PyObject *)&CMACType) < 0) {
+        Py_DECREF(&CMACType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&SIVType);
+    if (PyModule_AddObject(m, "SIV", (PyObject *)&SIVType) < 0) {
+        Py_DECREF(&SIVType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&FPEType);
+    if (PyModule_AddObject(m, "FPE", (PyObject *)&FPEType) < 0) {
+        Py_DECREF(&FPEType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&HCTR2Type);
+    if (PyModule_AddObject(m, "HCTR2", (PyObject *)&HCTR2Type) < 0) {
+        Py_DECREF(&HCTR2Type);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&MappedFileType);
+    if (PyModule_AddObject(m, "MappedFile", (PyObject *)&MappedFileType) < 0) {
+        Py_DECREF(&MappedFileType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&RingType);
+    if (PyModule_AddObject(m, "Ring", (PyObject *)&RingType) < 0) {
+        Py_DECREF(&RingType);
         Py_DECREF(m);
         return NULL;
     }
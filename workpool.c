@@ -0,0 +1,480 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "workpool.h"
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD 1
+#endif
+
+#define MAX_WORKERS 256
+#define RING_SIZE   65536        /* submission slots, a power of two */
+#define BATCH_MAX   64
+#define CACHELINE   64
+
+#define LOAD(p)       __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)   __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define COUNT(p, v)   __atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+
+/*
+   Bounded ring with a sequence number per slot (Vyukov). Any number of
+   threads may push; one thread at a time pops.
+*/
+typedef struct {
+    size_t seq;
+    workpool_job *job;
+} slot;
+
+typedef struct {
+    size_t mask;
+    slot *slots;
+    char pad0[CACHELINE];
+    size_t tail;                    /* next slot to push, shared by producers */
+    char pad1[CACHELINE];
+    size_t head;                    /* next slot to pop, owned by the consumer */
+    char pad2[CACHELINE];
+} ring;
+
+static int ring_init(ring *r, size_t capacity)
+{
+    size_t size = 2, i;
+
+    while (size < capacity)
+        size <<= 1;
+    r->slots = malloc(size * sizeof(slot));
+    if (r->slots == NULL)
+        return -1;
+    for (i = 0; i < size; i++)
+        r->slots[i].seq = i;
+    r->mask = size - 1;
+    r->head = r->tail = 0;
+    return 0;
+}
+
+static int ring_push(ring *r, workpool_job *job)
+{
+    size_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    slot *s;
+
+    for (;;)
+    {
+        intptr_t dif;
+
+        s = &r->slots[pos & r->mask];
+        dif = (intptr_t)LOAD(&s->seq) - (intptr_t)pos;
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+            return -1;              /* full */
+        else
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+    s->job = job;
+    STORE(&s->seq, pos + 1);
+    return 0;
+}
+
+static workpool_job *ring_pop(ring *r)
+{
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    slot *s = &r->slots[head & r->mask];
+    workpool_job *job;
+
+    if (LOAD(&s->seq) != head + 1)
+        return NULL;
+    job = s->job;
+    STORE(&s->seq, head + r->mask + 1);
+    STORE(&r->head, head + 1);
+    return job;
+}
+
+static int ring_empty(ring *r)
+{
+    size_t head = LOAD(&r->head);
+    return LOAD(&r->slots[head & r->mask].seq) != head + 1;
+}
+
+struct workpool_cq {
+    ring r;
+};
+
+struct workpool {
+    ring sub;                       /* submission ring */
+    int drain_token;                /* held by the worker popping from sub */
+    size_t batch_target;
+
+    pthread_mutex_t lock;           /* only for sleeping and waking workers */
+    pthread_cond_t ready;
+    int sleepers;
+    int stopping;
+
+    workpool_job *done;             /* completion list, newest first */
+    int fds[2];                     /* eventfd twice, or a pipe's read and write ends */
+
+    workpool_stats_t stats;
+    pthread_t threads[MAX_WORKERS];
+};
+
+static void notify(workpool *pool)
+{
+#ifdef HAVE_EVENTFD
+    uint64_t one = 1;
+    while (write(pool->fds[1], &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+#else
+    char c = 0;
+    while (write(pool->fds[1], &c, 1) < 0 && errno == EINTR)
+        ;
+#endif
+}
+
+static void drain_fd(workpool *pool)
+{
+    char buf[64];
+
+    while (read(pool->fds[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+static void wake_one(workpool *pool)
+{
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) == 0)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void deliver(workpool *pool, workpool_job *job)
+{
+    workpool_job *old;
+
+    STORE(&job->state, WORKPOOL_DONE);
+    if (job->complete)
+    {
+        job->complete(job, job->complete_arg);
+        return;
+    }
+    if (job->cq)
+    {
+        /* the consumer keeps in-flight jobs within capacity, so this rarely spins */
+        while (ring_push(&job->cq->r, job) != 0)
+            sched_yield();
+        return;
+    }
+
+    /* only the push that finds the list empty wakes the loop */
+    old = __atomic_load_n(&pool->done, __ATOMIC_RELAXED);
+    do {
+        job->next = old;
+    } while (!__atomic_compare_exchange_n(&pool->done, &old, job, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (old == NULL)
+        notify(pool);
+}
+
+size_t workpool_next_group(workpool_job **jobs, size_t n, workpool_job **group)
+{
+    size_t i, j, m = 0;
+
+    for (i = 0; i < n && jobs[i] == NULL; i++)
+        ;
+    if (i == n)
+        return 0;
+    group[m++] = jobs[i];
+    jobs[i] = NULL;
+    if (group[0]->run_batch == NULL)
+        return 1;
+
+    /* the rest of this group, keeping submission order */
+    for (j = i + 1; j < n; j++)
+    {
+        if (jobs[j] && jobs[j]->run_batch == group[0]->run_batch && jobs[j]->group == group[0]->group)
+        {
+            group[m++] = jobs[j];
+            jobs[j] = NULL;
+        }
+    }
+    return m;
+}
+
+void workpool_run_group(workpool_job **group, size_t m)
+{
+    size_t j;
+
+    for (j = 0; j < m; j++)
+        STORE(&group[j]->state, WORKPOOL_RUNNING);
+    if (group[0]->run_batch)
+        group[0]->run_batch(group, m);
+    else
+        group[0]->run(group[0]);
+}
+
+/* run one drained batch, one call per (run_batch, group) */
+static void run_batch(workpool *pool, workpool_job **jobs, size_t n)
+{
+    workpool_job *group[BATCH_MAX];
+    size_t j, m;
+
+    while ((m = workpool_next_group(jobs, n, group)) != 0)
+    {
+        workpool_run_group(group, m);
+        COUNT(&pool->stats.groups, 1);
+        for (j = 0; j < m; j++)
+            deliver(pool, group[j]);
+    }
+}
+
+/* take up to batch_target jobs if no other worker is draining */
+static size_t drain(workpool *pool, workpool_job **jobs)
+{
+    size_t n = 0, target;
+
+    if (__atomic_exchange_n(&pool->drain_token, 1, __ATOMIC_ACQUIRE))
+        return 0;
+    target = pool->batch_target;
+    while (n < target && (jobs[n] = ring_pop(&pool->sub)) != NULL)
+        n++;
+
+    /* grow the batch while the backlog outlasts it, shrink when it runs dry */
+    if (n == target && target < BATCH_MAX && !ring_empty(&pool->sub))
+        target *= 2;
+    else if (n < target / 2 && target > 1)
+        target /= 2;
+    pool->batch_target = target;
+    __atomic_store_n(&pool->stats.batch_target, target, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->drain_token, 0, __ATOMIC_RELEASE);
+
+    if (n)
+    {
+        COUNT(&pool->stats.batches, 1);
+        if (n > __atomic_load_n(&pool->stats.largest_batch, __ATOMIC_RELAXED))
+            __atomic_store_n(&pool->stats.largest_batch, n, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+static void *worker(void *arg)
+{
+    workpool *pool = arg;
+    workpool_job *jobs[BATCH_MAX];
+    size_t n;
+
+    for (;;)
+    {
+        if (LOAD(&pool->stopping))
+            return NULL;
+
+        n = drain(pool, jobs);
+        if (n)
+        {
+            /* more waiting: let another worker drain while this one runs */
+            if (!ring_empty(&pool->sub))
+                wake_one(pool);
+            run_batch(pool, jobs, n);
+            COUNT(&pool->stats.completed, n);
+            continue;
+        }
+        if (!ring_empty(&pool->sub))
+        {
+            sched_yield();          /* another worker holds the drain token */
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ring_empty(&pool->sub) && !pool->stopping)
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static int open_fds(int fds[2])
+{
+#ifdef HAVE_EVENTFD
+    fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return fds[0] < 0 ? -1 : 0;
+#else
+    if (pipe(fds) != 0)
+        return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+static void close_fds(int fds[2])
+{
+    close(fds[0]);
+    if (fds[1] != fds[0])
+        close(fds[1]);
+}
+
+workpool *workpool_create(int threads)
+{
+    workpool *pool;
+    int i;
+
+    if (threads <= 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (int)n : 1;
+    }
+    if (threads > MAX_WORKERS)
+        threads = MAX_WORKERS;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    if (ring_init(&pool->sub, RING_SIZE) != 0)
+    {
+        free(pool);
+        return NULL;
+    }
+    if (open_fds(pool->fds) != 0)
+    {
+        free(pool->sub.slots);
+        free(pool);
+        return NULL;
+    }
+    pool->batch_target = 1;
+    pool->stats.batch_target = 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0)
+            break;
+        pool->stats.threads++;
+    }
+    if (pool->stats.threads == 0)
+    {
+        workpool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void workpool_destroy(workpool *pool)
+{
+    int i;
+
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    STORE(&pool->stopping, 1);
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->stats.threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+    close_fds(pool->fds);
+    free(pool->sub.slots);
+    free(pool);
+}
+
+int workpool_submit(workpool *pool, workpool_job *job)
+{
+    job->next = NULL;
+    job->state = WORKPOOL_QUEUED;
+    while (ring_push(&pool->sub, job) != 0)
+    {
+        if (LOAD(&pool->stopping))
+            return -1;
+        wake_one(pool);
+        sched_yield();
+    }
+    COUNT(&pool->stats.submitted, 1);
+
+    /* pairs with the sleepers increment in worker(): either it sees the job or we see it */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    wake_one(pool);
+    return 0;
+}
+
+int workpool_job_state(const workpool_job *job)
+{
+    return LOAD(&job->state);
+}
+
+int workpool_fd(workpool *pool)
+{
+    return pool->fds[0];
+}
+
+workpool_job *workpool_reap(workpool *pool)
+{
+    workpool_job *list, *ordered = NULL, *next;
+
+    /* clear the descriptor first: a job completing after the exchange re-signals */
+    drain_fd(pool);
+    list = __atomic_exchange_n(&pool->done, NULL, __ATOMIC_ACQUIRE);
+
+    while (list)
+    {
+        next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    return ordered;
+}
+
+void workpool_stats(workpool *pool, workpool_stats_t *stats)
+{
+    stats->submitted = __atomic_load_n(&pool->stats.submitted, __ATOMIC_RELAXED);
+    stats->completed = __atomic_load_n(&pool->stats.completed, __ATOMIC_RELAXED);
+    stats->batches = __atomic_load_n(&pool->stats.batches, __ATOMIC_RELAXED);
+    stats->groups = __atomic_load_n(&pool->stats.groups, __ATOMIC_RELAXED);
+    stats->batch_target = __atomic_load_n(&pool->stats.batch_target, __ATOMIC_RELAXED);
+    stats->largest_batch = __atomic_load_n(&pool->stats.largest_batch, __ATOMIC_RELAXED);
+    stats->threads = pool->stats.threads;
+}
+
+workpool_cq *workpool_cq_create(size_t capacity)
+{
+    workpool_cq *cq = calloc(1, sizeof(*cq));
+
+    if (cq == NULL)
+        return NULL;
+    if (ring_init(&cq->r, capacity ? capacity : 1) != 0)
+    {
+        free(cq);
+        return NULL;
+    }
+    return cq;
+}
+
+void workpool_cq_destroy(workpool_cq *cq)
+{
+    if (cq == NULL)
+        return;
+    free(cq->r.slots);
+    free(cq);
+}
+
+size_t workpool_cq_poll(workpool_cq *cq, workpool_job **jobs, size_t max)
+{
+    size_t n = 0;
+
+    while (n < max && (jobs[n] = ring_pop(&cq->r)) != NULL)
+        n++;
+    return n;
+}
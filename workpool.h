@@ -0,0 +1,96 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <stddef.h>
+
+/*
+   Asynchronous job engine. Producers on any thread push jobs into a
+   lock-free ring; the workers take turns draining it, group compatible jobs
+   (same run_batch and group) and run each group as one batch. The number
+   of jobs taken per drain adapts to the backlog.
+
+   A finished job is delivered in exactly one way:
+     - job->complete, called on the worker thread, if set;
+     - otherwise job->cq, a completion queue read by the producer, if set;
+     - otherwise the pool's completion list, collected with workpool_reap.
+       workpool_fd becomes readable when that list goes from empty to
+       non-empty, so an event loop wakes once per batch rather than per job.
+
+   The job memory belongs to the caller and must stay valid until the job
+   has been delivered.
+*/
+
+typedef struct workpool_job workpool_job;
+typedef struct workpool_cq workpool_cq;
+
+/* Job states, see workpool_job_state */
+#define WORKPOOL_QUEUED  0
+#define WORKPOOL_RUNNING 1
+#define WORKPOOL_DONE    2
+
+struct workpool_job {
+    void (*run)(workpool_job *job);                     /* run a single job */
+    void (*run_batch)(workpool_job **jobs, size_t n);   /* optional: run a group at once */
+    const void *group;          /* jobs batch together when run_batch and group match */
+    void (*complete)(workpool_job *job, void *arg);     /* optional completion callback */
+    void *complete_arg;
+    workpool_cq *cq;            /* optional completion queue */
+    workpool_job *next;         /* owned by the pool while queued */
+    int state;
+};
+
+typedef struct workpool workpool;
+
+/* Pool counters */
+typedef struct {
+    size_t submitted;       /* jobs accepted */
+    size_t completed;       /* jobs delivered */
+    size_t batches;         /* drains of the ring */
+    size_t groups;          /* run_batch calls and single runs */
+    size_t batch_target;    /* jobs the next drain will take at most */
+    size_t largest_batch;
+    int threads;
+} workpool_stats_t;
+
+/* Start a pool of threads workers (one per online CPU if threads <= 0) */
+workpool *workpool_create(int threads);
+
+/* Stop the workers and release the pool; queued jobs are not run */
+void workpool_destroy(workpool *pool);
+
+/* Queue a job; waits while the ring is full. Returns 0, or -1 if the pool is stopping */
+int workpool_submit(workpool *pool, workpool_job *job);
+
+/* WORKPOOL_QUEUED, WORKPOOL_RUNNING or WORKPOOL_DONE */
+int workpool_job_state(const workpool_job *job);
+
+/* Descriptor that is readable while jobs wait on the completion list */
+int workpool_fd(workpool *pool);
+
+/* Take every job on the completion list, oldest first, and rearm the descriptor */
+workpool_job *workpool_reap(workpool *pool);
+
+/*
+   Move the first group of compatible jobs out of jobs[0..n) into group[]
+   (NULLing their entries) and return its size, 0 once jobs[] is empty.
+   group[] must have room for n jobs.
+*/
+size_t workpool_next_group(workpool_job **jobs, size_t n, workpool_job **group);
+
+/* Run a group from workpool_next_group on the calling thread */
+void workpool_run_group(workpool_job **group, size_t m);
+
+/* Snapshot of the pool counters */
+void workpool_stats(workpool *pool, workpool_stats_t *stats);
+
+/*
+   Completion queue for one consumer thread. Workers publish into it without
+   locks; keep at most capacity jobs that use it in flight.
+*/
+workpool_cq *workpool_cq_create(size_t capacity);
+void workpool_cq_destroy(workpool_cq *cq);
+
+/* Move up to max delivered jobs into jobs[]; returns how many */
+size_t workpool_cq_poll(workpool_cq *cq, workpool_job **jobs, size_t max);
+
+#endif /* WORKPOOL_H */